@@ -28,6 +28,10 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 
 #include "EMLocalShapeCostFunction.h"
 #include "EMLocalRegistrationCostFunction.h"
+#include "EMLocalAsyncWriter.h"
+#include "EMLocalInputChannels.h"
+#include "EMLocalTrace.h"
+#include "EMLocalMetrics.h"
 
 // -----------------------------------------------------------
 // Structures needed for MultiThreading 
@@ -71,12 +75,12 @@ public:
   void DetermineLabelMap(short* LabelMap); 
 
 
-   int Initialize(vtkImageEMLocalSegmenter *vtk_filter, T **ProbDataPtrStart,float** initInputVector, short *initROI, float **initw_m, char *initLevelName, 
+   int Initialize(vtkImageEMLocalSegmenter *vtk_filter, T **ProbDataPtrStart,EMLocalInputChannels* initInputChannels, short *initROI, float **initw_m, char *initLevelName, 
                 float initGlobalRegInvRotation[9], float initGlobalRegInvTranslation[3], int initRegistrationType, int DataType);
 
-   EMLocalAlgorithm(vtkImageEMLocalSegmenter *vtk_filter, T **aProbDataPtrStart,float** initInputVector, short *initROI, float **initw_m, char *initLevelName, 
+   EMLocalAlgorithm(vtkImageEMLocalSegmenter *vtk_filter, T **aProbDataPtrStart,EMLocalInputChannels* initInputChannels, short *initROI, float **initw_m, char *initLevelName, 
                  float initGlobalRegInvRotation[9], float initGlobalRegInvTranslation[3], int initRegistrationType, int DataType, int &SuccessFlag) {
-     SuccessFlag = this->Initialize(vtk_filter, aProbDataPtrStart, initInputVector, initROI, initw_m, initLevelName, initGlobalRegInvRotation, initGlobalRegInvTranslation, 
+     SuccessFlag = this->Initialize(vtk_filter, aProbDataPtrStart, initInputChannels, initROI, initw_m, initLevelName, initGlobalRegInvRotation, initGlobalRegInvTranslation, 
                           initRegistrationType, DataType);
    }
    ~EMLocalAlgorithm();
@@ -97,6 +101,9 @@ public:
   int* GetExtent() {return this->Extent;}
   int* GetSegmentationBoundaryMin() {return this->SegmentationBoundaryMin;}
 
+  // Intermediate results are written by a background thread 
+  EMLocalAsyncWriter* GetImageWriter() {return &this->ImageWriter;}
+
   // =============================
   // For Message Protocol
   // So we can also enter streams for functions outside vtk
@@ -111,7 +118,7 @@ private:
   // Initialization Functions 
   // -----------------------------------------------------
 
-  void InitializeEM(vtkImageEMLocalSegmenter* vtk_filter, char* initLevelName, int initRegistrationType, float** initInputVector, short *initROI, 
+  void InitializeEM(vtkImageEMLocalSegmenter* vtk_filter, char* initLevelName, int initRegistrationType, EMLocalInputChannels* initInputChannels, short *initROI, 
               int ROI_Label, float **initw_m);
   int InitializeClass(vtkImageEMLocalSuperClass* initactSupCl, T** ProbDataPtrStart);
   void InitializeHierarchicalParameters();
@@ -154,13 +161,28 @@ private:
                   unsigned char OutputVector);
 
   void E_Step_ExecuteMultiThread();
+  // Slab streaming: drops the pages of the weights of a finished slab - the E-Step keeps the last slice as 
+  // halo of the MRF stencil of the next slab. The other passes over the weights walk through the volume in 
+  // the same order and call ReleaseWeightsOfSlice after each slice.
+  void ReleaseWeightSlab(int SlabIndex, int KeepHaloFlag);
+  void ReleaseWeightsOfSlice(int z) 
+    {
+    if (this->SlabStreaming && (!((z+1) % this->SlabThickness) || (z+1 == this->BoundaryMaxZ))) this->ReleaseWeightSlab(z / this->SlabThickness, 0);
+    }
+  // The registration and shape cost functions still evaluate the whole volume - records how much of the 
+  // weights they brought back into memory  
+  void MeasureStreamedWeights(const char* PassName);
   double NeighberhoodEnergy(float **w_m_input, unsigned char MapVector, int CurrentClass);
 
   // Mstep 
   //  - Bias
+  // The passes over the input channels dispatch once on the storage type of the channels and then run 
+  // the version templated over TIn 
   void  EstimateImageInhomegeneity(float* skern, EMTriVolume& iv_m, EMVolume *r_m);
+  template <class TIn> void EstimateImageInhomegeneity(TIn*, float* skern, EMTriVolume& iv_m, EMVolume *r_m);
   // Have to do &iv_m bc have not programmed copy function
   void IntensityCorrection(int PrintIntermediateFlag, int iter, EMTriVolume &iv_m, EMVolume *r_m, float *cY_M);
+  template <class TIn> void IntensityCorrection(TIn*, int PrintIntermediateFlag, int iter, EMTriVolume &iv_m, EMVolume *r_m, float *cY_M);
   void InitializeLogIntensity(int HeadLevelFlag, EMTriVolume& iv_m, EMVolume *r_m, float *cY_M);
   //  - Registration
   int  EstimateRegistrationParameters(int iter, float &RegistrationCost, float &RegistrationClassSpecificCost);
@@ -214,6 +236,7 @@ private:
   char*  LevelName;  
   int    RegistrationType;
   int    DisableMultiThreading;
+  int    NumberOfThreads;
 
   int SmoothingWidth;
   int SmoothingSigma;
@@ -221,9 +244,15 @@ private:
   ProtocolMessages ErrorMessage;    // Lists all the error messges -> allows them to be displayed in tcl too 
   ProtocolMessages WarningMessage;  // Lists all the error messges -> allows them to be displayed in tcl too 
 
+  // Bias corrected log intensities - owned by the filter and shared by all levels 
   float  *cY_MPtr;
 
   char* PrintDir;
+  EMLocalAsyncWriter ImageWriter;
+
+  // Counters of the segmenter and the record of the current level - NULL if not recorded 
+  EMLocalMetrics       *Metrics;
+  EMLocalMetrics_Level *LevelMetrics;
 
  
   // --------------------------------
@@ -371,7 +400,8 @@ private:
   // Should be defined later in EM-Varaible Section but needed for CostFunctionParameters
   unsigned char *OutputVectorPtr; 
   short *ROIPtr;
-  float **InputVectorPtr;
+  // Log intensities of the input images - read in place from the input of the filter 
+  EMLocalInputChannels *InputChannels;
 
   float   *SuperClassToAtlasRotationMatrix;    
   float   *SuperClassToAtlasTranslationVector; 
@@ -424,6 +454,25 @@ private:
   EMLocalAlgorithm_E_Step_MultiThreaded_Parameters *E_Step_Threader_Parameters;
   EMLocalAlgorithm_E_Step_MultiThreaded_SelfPointer E_Step_Threader_SelfPointer;
   int E_Step_Threader_Number;
+
+  // -----------------------------------------------------------
+  // Slab Streaming 
+  // -----------------------------------------------------------
+  // The E-Step jobs are grouped into z-slabs of SlabThickness slices. Without streaming
+  // there is only one slab covering the whole volume. Job of thread t in slab s 
+  // is E_Step_Threader_Parameters[s*E_Step_Threader_Number + t]
+  // The passes over w_m (E-Step, MF, bias, label map and convergence measures) run slab by slab and release 
+  // each slab once it is done. Not streamed are the registration and shape cost functions, which evaluate the 
+  // whole volume for every Powell step, the atlas priors, which are inputs of the filter, and the weights 
+  // convergence buffers (PrintWeightsConvergence / EMSEGMENT_STOP_WEIGHTS). 
+  int SlabStreaming;
+  int SlabThickness;
+  char* ScratchDir;
+  int E_Step_Threader_NumberOfSlabs;
+  int E_Step_Threader_SlabIndex;
+  // Scratch file of w_m is owned by the filter, the one of w_mCopy by the algorithm
+  EMScratchArray *w_mScratch;
+  EMScratchArray w_mCopyScratch;
 };
 
 #include "EMLocalAlgorithm.txx"
@@ -28,6 +28,7 @@ template <class T> void EMLocalAlgorithm_PrintVector(T* parameters, int Min,  in
 VTK_THREAD_RETURN_TYPE EMLocalAlgorithm_E_Step_Threader_Function(void *arg);
 
 #include "vtkTimeDef.h"
+#include "vtkTimerLog.h"
 #include "EMLocalAlgorithm_Initialization.txx"
 #include "EMLocalAlgorithm_MeanField.txx"
 #include "EMLocalAlgorithm_Miscellaneous.txx"
@@ -43,16 +44,21 @@ template <class T> EMLocalAlgorithm<T>::~EMLocalAlgorithm()
  
   if (this->w_mCopy )
     {
-    for (int i = 0; i < this->NumTotalTypeCLASS; i++)
+    // In slab streaming mode the copy is released together with w_mCopyScratch
+    if (!this->SlabStreaming)
       {
-      delete[] this->w_mCopy[i];
+      for (int i = 0; i < this->NumTotalTypeCLASS; i++)
+        {
+        delete[] this->w_mCopy[i];
+        }
       }
     delete[] this->w_mCopy;
+    this->Metrics->RemoveMemory(EMLOCALMETRICS_WEIGHTS, vtkIdType(this->NumTotalTypeCLASS)*vtkIdType(this->ImageProd)*vtkIdType(sizeof(float)));
     }
 
   if (this->E_Step_Threader_Parameters)
     {
-    for (int i = 0; i < this->E_Step_Threader_Number; i++)
+    for (int i = 0; i < this->E_Step_Threader_Number*this->E_Step_Threader_NumberOfSlabs; i++)
       {
       if (this->E_Step_Threader_Parameters[i].ProbDataJump)
         {
@@ -271,7 +277,6 @@ template <class T> EMLocalAlgorithm<T>::~EMLocalAlgorithm()
   delete[] ProbDataIncZ;
   delete[] ProbDataIncY;
 
-  delete[] this->cY_MPtr;
   delete[] this->OutputVectorPtr;
 }
 
@@ -282,8 +287,10 @@ template <class T> EMLocalAlgorithm<T>::~EMLocalAlgorithm()
 template <class T>  void EMLocalAlgorithm<T>::E_Step_Threader_FunctionStart(int CurrentThread)
 {
   assert(CurrentThread < this->E_Step_Threader_Number);
+  EMLocalTraceScope Trace("E-Step thread", "estep", CurrentThread + 1);
 
-  EMLocalAlgorithm_E_Step_MultiThreaded_Parameters* ThreadedParameters  =  &(this->E_Step_Threader_Parameters[CurrentThread]); 
+  EMLocalAlgorithm_E_Step_MultiThreaded_Parameters* ThreadedParameters  =  
+    &(this->E_Step_Threader_Parameters[this->E_Step_Threader_SlabIndex*this->E_Step_Threader_Number + CurrentThread]); 
 
   this->E_Step_Weight_Calculation_Threaded(ThreadedParameters->VoxelStart, ThreadedParameters->NumberOfVoxels, ThreadedParameters->DataJump, 
                                            ThreadedParameters->PCAMeanShapeJump, ThreadedParameters->PCAEigenVectorsJump, ThreadedParameters->ProbDataJump,
@@ -414,6 +421,7 @@ inline void EMLocalAlgorithm<T>::DefineForRegistrationRotTranSca(int NumParaSets
 template <class T>
 void EMLocalAlgorithm<T>::RegistrationInterface(float &Cost)
 {
+  EMLocalTraceScope Trace("Registration", "registration");
   // Initialize Parameters
   int NumParaPerSet    =  this->RegistrationParameters->GetNumberOfParameterPerSet();
   int NumParaTotal     =  this->RegistrationParameters->GetNumberOfParameterSets()*NumParaPerSet; 
@@ -423,7 +431,8 @@ void EMLocalAlgorithm<T>::RegistrationInterface(float &Cost)
                                                                  this->RegistrationScale[i], &FinalParameters[NumParaPerSet*i],
                                                                  this->RegistrationParameters);
   // this->RegistrationParameters->StartRegistration(FinalParameters,Cost);
-  itkEMLocalOptimization_Registration_Start(this->RegistrationParameters,FinalParameters,Cost);
+  int NumberOfEvaluations = itkEMLocalOptimization_Registration_Start(this->RegistrationParameters,FinalParameters,Cost);
+  if (this->LevelMetrics) this->LevelMetrics->RegistrationCostEvaluations += NumberOfEvaluations;
 
   for (int j = 0; j < this->RegistrationParameters->GetNumberOfParameterSets() ; j++) 
     EMLocalAlgorithm_TransfereRegistrationParameter_ToTranRotSca(&FinalParameters[j* NumParaPerSet],this->RegistrationTranslation[j], 
@@ -581,20 +590,47 @@ inline double EMLocalAlgorithm_ConditionalTissueProbability(const double TissueP
   return TissueProbability  * vtkImageEMGeneral::FastGaussMulti(InvSqrtDetLogCov,cY_M, LogMu,InvLogCov,NumInputImages, VirtualNumInputImages); 
 }
 
+template  <class T> void EMLocalAlgorithm<T>::ReleaseWeightSlab(int SlabIndex, int KeepHaloFlag)
+{
+  // With KeepHaloFlag the last slice of the slab is kept as it is the halo of the MRF stencil of the next slab 
+  int SlabVoxels = this->SlabThickness*this->imgXY;
+  int Start = SlabIndex*SlabVoxels;
+  int End   = (SlabIndex < this->E_Step_Threader_NumberOfSlabs - 1 ? (SlabIndex+1)*SlabVoxels : this->ImageProd);
+  if (KeepHaloFlag)
+    {
+    if (SlabIndex) Start -= this->imgXY;
+    if (SlabIndex < this->E_Step_Threader_NumberOfSlabs - 1) End -= this->imgXY;
+    }
+  if (End <= Start) return;
+
+  for (int i = 0; i < this->NumTotalTypeCLASS; i++)
+    {
+    if (this->w_mScratch) this->w_mScratch->ReleaseRange(size_t(i)*size_t(this->ImageProd) + size_t(Start), size_t(End - Start));
+    if (this->w_mCopy) this->w_mCopyScratch.ReleaseRange(size_t(i)*size_t(this->ImageProd) + size_t(Start), size_t(End - Start));
+    }
+}
+
+template  <class T> void EMLocalAlgorithm<T>::MeasureStreamedWeights(const char* PassName)
+{
+  if (!this->SlabStreaming || !this->w_mScratch) return;
+  vtkIdType Resident = vtkIdType(this->w_mScratch->GetResidentBytes());
+  if (this->w_mCopy) Resident += vtkIdType(this->w_mCopyScratch.GetResidentBytes());
+  std::cerr << "Slab streaming: " << Resident << " bytes of the weights in memory after " << PassName << endl;
+  if (this->LevelMetrics && (Resident > this->LevelMetrics->StreamedWeightsPeakResidentBytes)) 
+    this->LevelMetrics->StreamedWeightsPeakResidentBytes = Resident;
+}
+
 template  <class T> void EMLocalAlgorithm<T>::E_Step_ExecuteMultiThread()
 {
-  if (1) 
-    this->E_Step_Threader->SingleMethodExecute();
-  else
+  EMLocalTraceScope Trace("E-Step weights", "estep");
+  double StartTime = vtkTimerLog::GetUniversalTime();
+  // Without slab streaming there is only one slab
+  for (this->E_Step_Threader_SlabIndex = 0; this->E_Step_Threader_SlabIndex < this->E_Step_Threader_NumberOfSlabs; this->E_Step_Threader_SlabIndex++)
     {
-    std::cerr << "===================================" << endl;
-    std::cerr << "Debug Threading" << endl;
-    for (int i = 0; i < this->E_Step_Threader_Number ; i++ )
-      {
-      std::cerr << "Execute Thread " << i << endl;
-      this->E_Step_Threader_FunctionStart(i);
-      } 
+    this->E_Step_Threader->SingleMethodExecute();
+    if (this->SlabStreaming) this->ReleaseWeightSlab(this->E_Step_Threader_SlabIndex, 1);
     }
+  this->E_Step_Threader_SlabIndex = 0;
 
   int IncompleteModelVoxelCount = 0;
   this->PCA_ROIExactVoxelCount = 0 ;
@@ -607,7 +643,9 @@ template  <class T> void EMLocalAlgorithm<T>::E_Step_ExecuteMultiThread()
   this->PCAMin[0] = this->BoundaryMaxX;  this->PCAMin[1] = this->BoundaryMaxY;   this->PCAMin[2] = this->BoundaryMaxZ;
   for (int i = 0; i <3; i++) this->PCAMax[i] = 0;
 
-  for (int i = 0 ; i < this->E_Step_Threader_Number; i++)
+  // Reduce the statistics of all jobs over all slabs - counts, minima and maxima are exact so the result 
+  // does not depend on how the volume is split between the threads
+  for (int i = 0 ; i < this->E_Step_Threader_Number*this->E_Step_Threader_NumberOfSlabs; i++)
     {
     IncompleteModelVoxelCount    += this->E_Step_Threader_Parameters[i].IncompleteModelVoxelCount; 
     this->PCA_ROIExactVoxelCount += this->E_Step_Threader_Parameters[i].PCA_ROIExactVoxelCount;
@@ -623,6 +661,14 @@ template  <class T> void EMLocalAlgorithm<T>::E_Step_ExecuteMultiThread()
 
     }
   if (IncompleteModelVoxelCount) std::cerr <<"Warning: E-Step counted "<< IncompleteModelVoxelCount <<" voxels not properly captured by the Model !" <<endl;
+
+  if (this->LevelMetrics)
+    {
+    this->LevelMetrics->EStepCount ++;
+    this->LevelMetrics->EStepTime                 += vtkTimerLog::GetUniversalTime() - StartTime;
+    this->LevelMetrics->VoxelClassEvaluations     += double(this->NumROIVoxels)*double(this->NumTotalTypeCLASS);
+    this->LevelMetrics->IncompleteModelVoxelCount  = IncompleteModelVoxelCount;
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -731,6 +777,7 @@ template <class T> void EMLocalAlgorithm<T>::InfoOnPrintFlags()
 
 template  <class T> void EMLocalAlgorithm<T>::Expectation_Step(int iter)
 {
+  EMLocalTraceScope Trace("E-Step", "estep");
   // -----------------------------------------      
   // E-Step without MF 
 
@@ -1336,8 +1383,19 @@ template <class T> void EMLocalAlgorithm<T>::E_Step_Weight_Calculation_Threaded(
 template <class T>
 void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(float *skern, EMTriVolume& iv_m, EMVolume *r_m)
 {
+  switch (this->InputChannels->GetStorageType()) 
+    {
+    EMLocalInputChannels_TemplateMacro(this->EstimateImageInhomegeneity((VTK_TT*) NULL, skern, iv_m, r_m));
+    }
+}
+
+template <class T> template <class TIn>
+void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(TIn*, float *skern, EMTriVolume& iv_m, EMVolume *r_m)
+{
+  EMLocalTraceScope Trace("Bias estimation", "bias");
   int VoxelIndex = 0;
-  float** InputVector = this->InputVectorPtr;
+  EMLocalInputChannels_Iterator<TIn> InputVector(this->InputChannels);
+  float *LogIntensity = new float[NumInputImages];
   unsigned char* OutputVector = this->OutputVectorPtr;
   float temp;
 
@@ -1351,6 +1409,7 @@ void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(float *skern, EMTriVolume&
   // Just use the outcome of the last hierarchical level 
   if (*OutputVector < EMSEGMENT_NOTROI)
     {
+    InputVector.Get(LogIntensity);
     for (int m=0; m<NumInputImages; m++)
       {
       r_m[m](i,k,j) = 0.0;
@@ -1364,7 +1423,7 @@ void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(float *skern, EMTriVolume&
         for (int n=0; n<NumInputImages; n++)
           {
           temp =  *w_m[l] * float(InverseWeightedLogCov[l][m][n]);
-          r_m[m](i,k,j)     += temp * ((*InputVector)[n] - float(LogMu[l][n]));
+          r_m[m](i,k,j)     += temp * (LogIntensity[n] - float(LogMu[l][n]));
           if (n <= m) iv_m(m,n,i,k,j) += temp;
           }
         }
@@ -1379,14 +1438,16 @@ void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(float *skern, EMTriVolume&
       w_m[l] ++;
       }
     }
-  InputVector ++;
+  InputVector.Next();
   OutputVector ++;
   VoxelIndex ++;
   }
   } 
+  this->ReleaseWeightsOfSlice(i);
   } // End of for (z = 0; z < BoundaryMaxZ ; z++) 
 
   delete[] w_m;
+  delete[] LogIntensity;
 
   
   //------------------------------------------------------------
@@ -1402,6 +1463,7 @@ void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(float *skern, EMTriVolume&
   // Kilian: Does not account for parts were *OutputVector |= EMSEGMENT_INCORRECT_MODEL is set 
   // what should we do ? 
   //------------------------------------------------------------
+  EMLocalTraceScope ConvTrace("Convolution", "bias");
   iv_m.Conv(skern,SmoothingWidth);
   for (int i=0; i< this->NumInputImages; i++) r_m[i].Conv(skern,SmoothingWidth); 
 }
@@ -1415,10 +1477,20 @@ void EMLocalAlgorithm<T>::EstimateImageInhomegeneity(float *skern, EMTriVolume&
 
 template <class T> void EMLocalAlgorithm<T>::IntensityCorrection(int printIntermediateFlag, int iter, EMTriVolume &iv_m, EMVolume *r_m, float *cY_M)
 {
+  switch (this->InputChannels->GetStorageType()) 
+    {
+    EMLocalInputChannels_TemplateMacro(this->IntensityCorrection((VTK_TT*) NULL, printIntermediateFlag, iter, iv_m, r_m, cY_M));
+    }
+}
+
+template <class T> template <class TIn> 
+void EMLocalAlgorithm<T>::IntensityCorrection(TIn*, int printIntermediateFlag, int iter, EMTriVolume &iv_m, EMVolume *r_m, float *cY_M)
+{
+  EMLocalTraceScope Trace("Intensity correction", "bias");
   // If needed the bias can also be printed out if ROI != NULL - just have to do slight modifications 
 
   unsigned char* OutputVector = this->OutputVectorPtr;
-  float** InputVector         = this->InputVectorPtr;
+  EMLocalInputChannels_Iterator<TIn> InputVector(this->InputChannels);
 
   double **iv_mat     = new double*[VirtualOveralInputChannelNum];
   double **inv_iv_mat = new double*[VirtualOveralInputChannelNum];
@@ -1493,7 +1565,7 @@ template <class T> void EMLocalAlgorithm<T>::IntensityCorrection(int printInterm
               }
             }
           lindex ++;
-          (*cY_M ++) = fabs((*InputVector)[l] - double(Bias));
+          (*cY_M ++) = fabs(InputVector[l] - double(Bias));
           if (BiasSlice) (*BiasSlice ++) = Bias;
           }
         else
@@ -1507,7 +1579,7 @@ template <class T> void EMLocalAlgorithm<T>::IntensityCorrection(int printInterm
       { 
       for (int l=0; l< NumInputImages; l++)
         {
-        (*cY_M ++) = fabs((*InputVector)[l]);
+        (*cY_M ++) = fabs(InputVector[l]);
         if (BiasSlice) (*BiasSlice ++) = 0.0;
         }
       }
@@ -1517,7 +1589,7 @@ template <class T> void EMLocalAlgorithm<T>::IntensityCorrection(int printInterm
     cY_M       += NumInputImages;
     if (BiasSlice) BiasSlice  += NumInputImages;
     }
-  InputVector++;
+  InputVector.Next();
   }
   }
   // Print Bias Field if necessary  
@@ -1564,16 +1636,26 @@ template <class T> void EMLocalAlgorithm<T>::IntensityCorrection(int printInterm
 // If iter == 1 => Bias has been defined in the previous hierarchical level 
 // cY_M  = fabs(InputVector - b_m) = {b_m ==0} = fabs(InputVector) = InputVector;
 // we assume InputVector >= 0
+template <class TIn> 
+static void EMLocalAlgorithm_CopyLogIntensity(TIn*, const EMLocalInputChannels *InputChannels, int ImageProd, float *cY_M)
+{
+  EMLocalInputChannels_Iterator<TIn> InputVector(InputChannels);
+  int NumInputImages = InputChannels->GetNumberOfChannels();
+  for (int i=0; i< ImageProd; i++)
+    {
+    for (int l=0; l< NumInputImages; l++) (*cY_M ++) = fabs(InputVector[l]);
+    InputVector.Next();
+    }
+}
+
 template <class T> void EMLocalAlgorithm<T>::InitializeLogIntensity(int HeadLevelFlag, EMTriVolume& iv_m, EMVolume *r_m, float *cY_M)
 {
   // Is the top level - bias is not calculated so far
   if (HeadLevelFlag)
     {
-    float** InputVector = this->InputVectorPtr;
-    for (int i=0; i< this->ImageProd; i++)
+    switch (this->InputChannels->GetStorageType()) 
       {
-      for (int l=0; l< this->NumInputImages; l++) (*cY_M ++) = fabs((*InputVector)[l]);
-      InputVector++;
+      EMLocalInputChannels_TemplateMacro(EMLocalAlgorithm_CopyLogIntensity((VTK_TT*) NULL, this->InputChannels, this->ImageProd, cY_M));
       }
     }
   else this->IntensityCorrection(0, 0, iv_m, r_m, cY_M);
@@ -1684,13 +1766,15 @@ int EMLocalAlgorithm<T>::EstimateRegistrationParameters(int iter, float &Registr
 template <class T>
 float EMLocalAlgorithm<T>::EstimateShapeParameters(int iter)
 {
+  EMLocalTraceScope Trace("Shape", "shape");
   float Cost;
 
-  itkEMLocalOptimization_Shape_Start(this->ShapeParameters, this->PCAShapeParameters, this->PCAMax[0], this->PCAMin[0], this->PCAMax[1], this->PCAMin[1], 
+  int NumberOfEvaluations = itkEMLocalOptimization_Shape_Start(this->ShapeParameters, this->PCAShapeParameters, this->PCAMax[0], this->PCAMin[0], this->PCAMax[1], this->PCAMin[1], 
                                      this->PCAMax[2], this->PCAMin[2], this->SegmentationBoundaryMin[0] -1, this->SegmentationBoundaryMin[1] - 1, 
                                      this->SegmentationBoundaryMin[2] -1, this->BoundaryMaxX, this->BoundaryMaxY, this->w_mPtr, this->PCA_ROI_Start, 
                                      ((void**) this->ProbDataPtrStart), this->PCAMeanShapePtrStart, this->PCAMeanShapeIncY, this->PCAMeanShapeIncZ, 
                                      this->PCAEigenVectorsPtrStart, this->PCAEigenVectorsIncY, this->PCAEigenVectorsIncZ, Cost);
+  if (this->LevelMetrics) this->LevelMetrics->ShapeCostEvaluations += NumberOfEvaluations;
 
   // ---------------------------------------------------
   // Print out initializing cost  if needed
@@ -1733,6 +1817,7 @@ template  <class T> void EMLocalAlgorithm<T>::RunAlgorithm(EMTriVolume& iv_m, EM
 
   SegmentLevelSucessfullFlag = 1;
   int iter = 0;
+  if (this->LevelMetrics) this->LevelMetrics->NumberOfClasses = this->NumTotalTypeCLASS;
 
   if (this->PrintFrequency) this->InfoOnPrintFlags(); 
   // cY_M correct log intensity - dimension NumInputImages x ImageProd 
@@ -1795,6 +1880,7 @@ template  <class T> void EMLocalAlgorithm<T>::RunAlgorithm(EMTriVolume& iv_m, EM
         {
         SegmentLevelSucessfullFlag = this->EstimateRegistrationParameters(iter, RegistrationCost, RegistrationClassSpecificCost);
         if (!SegmentLevelSucessfullFlag) break; 
+        this->MeasureStreamedWeights("registration");
         if (this->PrintIntermediateFlag) this->Print_M_StepRegistrationToFile(iter, RegistrationCost, RegistrationClassSpecificCost); 
         }
      
@@ -1802,6 +1888,7 @@ template  <class T> void EMLocalAlgorithm<T>::RunAlgorithm(EMTriVolume& iv_m, EM
       if (PCATotalNumOfShapeParameters && (this->PCAShapeModelType < EMSEGMENT_PCASHAPE_APPLY))
         {
         PCACost = this->EstimateShapeParameters(iter);
+        this->MeasureStreamedWeights("shape estimation");
         if (this->PrintIntermediateFlag) this->Print_M_StepShapeToFile(iter, PCACost);
         // has to do be done  after printing otherwise printing similarity measure is corrupted 
         // as logistic slope is alteres
@@ -1833,6 +1920,8 @@ template  <class T> void EMLocalAlgorithm<T>::RunAlgorithm(EMTriVolume& iv_m, EM
     fprintf(WeightsEMDifferenceFile,"\n%% Maximum Iteration Border: %d \n", NumIter);
     }
 
+  if (this->LevelMetrics) this->LevelMetrics->EMIterations = iter;
+
   delete[] skern;
   std::cerr << "EMLocalAlgorithm::RunAlgorithm: Finished " << endl;
 }
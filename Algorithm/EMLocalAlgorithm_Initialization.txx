@@ -22,13 +22,16 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 
 =========================================================================auto=*/
 
-template  <class T> int EMLocalAlgorithm<T>::Initialize(vtkImageEMLocalSegmenter *vtk_filter, T **initProbDataPtrStart, float** initInputVector, short *initROI, 
+// Defined in EMLocalAlgorithm_Print.txx
+int EMLocalAlgorithm_GEImageWriter(vtkImageData *Volume, char *FileName,int PrintFlag);
+
+template  <class T> int EMLocalAlgorithm<T>::Initialize(vtkImageEMLocalSegmenter *vtk_filter, T **initProbDataPtrStart, EMLocalInputChannels* initInputChannels, short *initROI, 
                               float **initw_mPtr, char *initLevelName, float initGlobalRegInvRotation[9], float initGlobalRegInvTranslation[3], 
                               int initRegistrationType, int DataType)
 {
     int SuccessFlag = 1;
    
-    this->InitializeEM(vtk_filter, initLevelName, initRegistrationType, initInputVector, initROI, vtk_filter->GetActiveSuperClass()->GetLabel(), initw_mPtr); 
+    this->InitializeEM(vtk_filter, initLevelName, initRegistrationType, initInputChannels, initROI, vtk_filter->GetActiveSuperClass()->GetLabel(), initw_mPtr); 
     if (!this->InitializeClass(vtk_filter->GetActiveSuperClass(), initProbDataPtrStart)) SuccessFlag = 0;
     
     this->InitializeHierarchicalParameters();
@@ -44,7 +47,7 @@ template  <class T> int EMLocalAlgorithm<T>::Initialize(vtkImageEMLocalSegmenter
 
 
 template  <class T> void EMLocalAlgorithm<T>::InitializeEM(vtkImageEMLocalSegmenter* vtk_filter, char* initLevelName,int initRegistrationType, 
-                                   float** initInputVector, short *initROI, int ROI_Label, float **initw_mPtr) {
+                                   EMLocalInputChannels* initInputChannels, short *initROI, int ROI_Label, float **initw_mPtr) {
   this->ImageProd                = vtk_filter->GetImageProd();
   this->NumInputImages           = vtk_filter->GetNumInputImages();
   this->SegmentationBoundaryMin  = vtk_filter->GetSegmentationBoundaryMin();
@@ -69,25 +72,34 @@ template  <class T> void EMLocalAlgorithm<T>::InitializeEM(vtkImageEMLocalSegmen
   this->RegistrationInterpolationType = vtk_filter->GetRegistrationInterpolationType();
 
   this->PrintDir                = vtk_filter->GetPrintDir(); 
+  this->Metrics                 = vtk_filter->GetMetrics(); 
+  this->LevelMetrics            = this->Metrics->GetCurrentLevel(); 
   this->LevelName               = initLevelName;
   this->RegistrationType        = initRegistrationType;
   this->DisableMultiThreading   = vtk_filter->GetDisableMultiThreading(); 
+  this->NumberOfThreads         = EMLocalInterface_GetNumberOfThreads(this->DisableMultiThreading, vtk_filter->GetNumberOfThreads());
 
   this->SmoothingWidth          = vtk_filter->GetSmoothingWidth();
   this->SmoothingSigma          = vtk_filter->GetSmoothingSigma();
 
+  this->SlabStreaming           = vtk_filter->GetSlabStreaming();
+  this->ScratchDir              = vtk_filter->GetScratchDir();
+  this->w_mScratch              = (this->SlabStreaming ? vtk_filter->GetWeightScratch() : NULL);
+  this->SlabThickness           = (this->SlabStreaming ? vtk_filter->GetSlabThickness() : this->BoundaryMaxZ);
+  if ((this->SlabThickness < 1) || (this->SlabThickness > this->BoundaryMaxZ)) this->SlabThickness = this->BoundaryMaxZ;
+
 
   // Should be defined later in EM-Varaible Section but needed for CostFunctionParameters
   this->OutputVectorPtr = new unsigned char[ImageProd];
   unsigned char* OutputVector = this->OutputVectorPtr;
   memset(OutputVector, 0, this->ImageProd*sizeof(unsigned char));
 
-  this->cY_MPtr = new float[this->NumInputImages* this->ImageProd]; 
+  this->cY_MPtr = vtk_filter->GetCorrectedIntensity(); 
   memset(this->cY_MPtr, 0, this->NumInputImages * this->ImageProd * sizeof(float));
 
   this->NumROIVoxels                 =  0;
   this->ROIPtr = initROI;
-  this->InputVectorPtr = initInputVector;
+  this->InputChannels = initInputChannels;
 
   if (this->ROIPtr) {
     // 1.) Check what the region of interest is 
@@ -100,6 +112,7 @@ template  <class T> void EMLocalAlgorithm<T>::InitializeEM(vtkImageEMLocalSegmen
   } else {
     NumROIVoxels = ImageProd;
   }
+  if (this->LevelMetrics) this->LevelMetrics->ROIVoxelCount = NumROIVoxels;
 
   // 2.) Check every voxel if it has a defined neighbor or an edge
   for (int i=0; i < ImageProd; i++) {
@@ -471,6 +484,11 @@ template <class T> void EMLocalAlgorithm<T>::InitializePrint() {
   // This variable is set so that we can exclude classed from the incomplete E-Step 
   int QualityFlag = 0;
 
+  // Intermediate results are snapshot and written in the background - at most two volumes 
+  // of the largest type (double) are waiting to be written at any time
+  this->ImageWriter.SetWriteFunction(EMLocalAlgorithm_GEImageWriter);
+  this->ImageWriter.SetMaximumBufferSize(2*vtkIdType(this->RealMaxX)*vtkIdType(this->RealMaxY)*vtkIdType(this->RealMaxZ)*vtkIdType(sizeof(double)));
+
   this->QualityFile  = NULL; 
   this->QualityFlagList = new int[NumClasses];
   memset(this->QualityFlagList,0,sizeof(int)*NumClasses);
@@ -679,7 +697,7 @@ template <class T> int EMLocalAlgorithm<T>::InitializeShape() {
   // -----------------------------------------------------------
 
   // Cannot define it before bc of PCANumberOfEigenModes
-  this->ShapeParameters = new EMLocalShapeCostFunction(&this->HierarchicalParameters,this->PCANumberOfEigenModes, this->DisableMultiThreading); 
+  this->ShapeParameters = new EMLocalShapeCostFunction(&this->HierarchicalParameters,this->PCANumberOfEigenModes, this->NumberOfThreads); 
 
   if (PCATotalNumOfShapeParameters) {
     int PCAFlag    = 0; 
@@ -872,7 +890,7 @@ template <class T> int EMLocalAlgorithm<T>::InitializeRegistration(float initGlo
 
        this->DefineForRegistrationRotTranSca(NumParaSets);
 
-       this->RegistrationParameters->MultiThreadDefine(this->DisableMultiThreading);
+       this->RegistrationParameters->MultiThreadDefine(this->NumberOfThreads);
        this->RegistrationParameters->DefineRegistrationParametersForThreadedCostFunction(SegmentationBoundaryMin[0] -1, SegmentationBoundaryMin[1] -1, SegmentationBoundaryMin[2] -1, SegmentationBoundaryMax[0] -1, SegmentationBoundaryMax[1] -1, SegmentationBoundaryMax[2] -1);
        if (actSupCl->GetPrintFrequency() && 
        (actSupCl->GetPrintRegistrationParameters() || actSupCl->GetPrintRegistrationSimularityMeasure())) {
@@ -970,7 +988,7 @@ template <class T> void EMLocalAlgorithm<T>::InitializeEStepMultiThreader(int Da
   this->E_Step_Threader_SelfPointer.DataType = DataType;
 
   // Initialize Multithreading
-  this->E_Step_Threader_Number = EMLocalInterface_GetDefaultNumberOfThreads(this->DisableMultiThreading);
+  this->E_Step_Threader_Number = this->NumberOfThreads;
 
   // std::cerr << "Threader Number: " << this->E_Step_Threader_Number << std::endl;
 
@@ -978,12 +996,22 @@ template <class T> void EMLocalAlgorithm<T>::InitializeEStepMultiThreader(int Da
   this->E_Step_Threader->SetNumberOfThreads(this->E_Step_Threader_Number);
   this->E_Step_Threader->SetSingleMethod(EMLocalAlgorithm_E_Step_Threader_Function,((void*) &(this->E_Step_Threader_SelfPointer)));
 
-  this->E_Step_Threader_Parameters = new EMLocalAlgorithm_E_Step_MultiThreaded_Parameters[this->E_Step_Threader_Number];
+  // Each slab is split evenly between the threads  
+  this->E_Step_Threader_NumberOfSlabs = (this->BoundaryMaxZ + this->SlabThickness - 1) / this->SlabThickness;
+  this->E_Step_Threader_SlabIndex     = 0;
+  if (this->SlabStreaming) 
+    std::cerr << "Slab streaming: " << this->E_Step_Threader_NumberOfSlabs << " slabs of " << this->SlabThickness << " slices" << endl;
+
+  this->E_Step_Threader_Parameters = new EMLocalAlgorithm_E_Step_MultiThreaded_Parameters[this->E_Step_Threader_Number*this->E_Step_Threader_NumberOfSlabs];
 
-  int JobSize = this->ImageProd / this->E_Step_Threader_Number;
   int VoxelOffset = 0;
   int VoxelLeftOver;
-  for (int i= 0; i < this->E_Step_Threader_Number; i++) 
+  for (int s = 0; s < this->E_Step_Threader_NumberOfSlabs; s++) 
+   {
+   int SlabSize = (s < this->E_Step_Threader_NumberOfSlabs - 1 ? this->SlabThickness*this->imgXY : this->ImageProd - s*this->SlabThickness*this->imgXY);
+   int JobSize  = SlabSize / this->E_Step_Threader_Number;
+
+   for (int i= s*this->E_Step_Threader_Number; i < (s+1)*this->E_Step_Threader_Number; i++) 
     {
     // std::cerr << "Thread " << i <<  std::endl;
     int *VoxelStart = this->E_Step_Threader_Parameters[i].VoxelStart;
@@ -992,8 +1020,8 @@ template <class T> void EMLocalAlgorithm<T>::InitializeEStepMultiThreader(int Da
     VoxelStart[1] = VoxelLeftOver / this->BoundaryMaxX;
     VoxelStart[0] = VoxelLeftOver % this->BoundaryMaxX;
  
-     if (i < this->E_Step_Threader_Number -1) this->E_Step_Threader_Parameters[i].NumberOfVoxels = JobSize;
-     else this->E_Step_Threader_Parameters[i].NumberOfVoxels = JobSize +  this->ImageProd % this->E_Step_Threader_Number;
+     if (i < (s+1)*this->E_Step_Threader_Number -1) this->E_Step_Threader_Parameters[i].NumberOfVoxels = JobSize;
+     else this->E_Step_Threader_Parameters[i].NumberOfVoxels = JobSize +  SlabSize % this->E_Step_Threader_Number;
 
      this->E_Step_Threader_Parameters[i].DataJump = EMLocalInterface_DefineMultiThreadJump(VoxelStart,this->BoundaryMaxX,this->BoundaryMaxY,0,0); 
 
@@ -1030,8 +1058,9 @@ template <class T> void EMLocalAlgorithm<T>::InitializeEStepMultiThreader(int Da
                                                          this->PCAEigenVectorsIncZ[j][k]);
        }
      }
-     VoxelOffset += JobSize;
-  }
+     VoxelOffset += this->E_Step_Threader_Parameters[i].NumberOfVoxels;
+    }
+   }
   // This is actually not necessary for this->E_Step_Threader_Number == 1. 
   // However, we produce very different results using 1 cpu and multi cpu machines. 
   // In the 1 cpu machine the updated weights are getting used in MF calculations 
@@ -1039,7 +1068,13 @@ template <class T> void EMLocalAlgorithm<T>::InitializeEStepMultiThreader(int Da
   if (this->Alpha > 0.0) {
     // We have to create a copy of w_m as MF read and writes to w_m simultaneously 
     this->w_mCopy   = new float*[this->NumTotalTypeCLASS];
-    for (int i = 0; i < this->NumTotalTypeCLASS; i++) this->w_mCopy[i] = new float[this->ImageProd];
+    if (this->SlabStreaming) {
+      float *w_mCopyStart = this->w_mCopyScratch.Allocate(this->ScratchDir, size_t(this->NumTotalTypeCLASS)*size_t(this->ImageProd));
+      for (int i = 0; i < this->NumTotalTypeCLASS; i++) this->w_mCopy[i] = w_mCopyStart + size_t(i)*size_t(this->ImageProd);
+    } else {
+      for (int i = 0; i < this->NumTotalTypeCLASS; i++) this->w_mCopy[i] = new float[this->ImageProd];
+    }
+    this->Metrics->AddMemory(EMLOCALMETRICS_WEIGHTS, vtkIdType(this->NumTotalTypeCLASS)*vtkIdType(this->ImageProd)*vtkIdType(sizeof(float)));
   } else {
     this->w_mCopy = NULL;
   }
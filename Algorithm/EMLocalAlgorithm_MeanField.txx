@@ -55,6 +55,8 @@ template <class T> void EMLocalAlgorithm<T>::RegularizeWeightsWithMeanField(int
 
     this->w_m_inputPtr  = (regiter%2 ? w_mPtr  : w_mCopy);
     this->w_m_outputPtr = (regiter%2 ? w_mCopy : w_mPtr);
+    EMLocalTraceScope Trace("MF sweep", "estep");
+    if (this->LevelMetrics) this->LevelMetrics->MFSweeps ++;
 
     // -----------------------------------------------------------
     // Calculation of MF
@@ -95,7 +97,12 @@ template <class T> void EMLocalAlgorithm<T>::RegularizeWeightsWithMeanField(int
 
   if ((NumRegIter%2 && !MFAStopFlag) || (regiter%2 && MFAStopFlag) ) {
     assert(w_mCopy);
-    for (int j=0; j < this->NumTotalTypeCLASS; j++) memcpy(this->w_mPtr[j],w_mCopy[j],sizeof(float)*this->ImageProd);
+    // Copied slice by slice so that in slab streaming mode the finished slabs can be released 
+    for (int z=0; z < this->BoundaryMaxZ; z++) {
+      int Offset = z*this->imgXY;
+      for (int j=0; j < this->NumTotalTypeCLASS; j++) memcpy(this->w_mPtr[j] + Offset,w_mCopy[j] + Offset,sizeof(float)*this->imgXY);
+      this->ReleaseWeightsOfSlice(z);
+    }
   } 
 }
 
@@ -25,6 +25,7 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 
 template <class T>
 void EMLocalAlgorithm<T>::DetermineLabelMap(short* LabelMap) { 
+  EMLocalTraceScope Trace("Label map", "labelmap");
 #if (0) 
     std::cerr << "EMLocalAlgorithm<T>::DetermineLabelMap LabelMap " << LabelMap << " NumTotalTypeCLASS " << this->NumTotalTypeCLASS << " NumChildClasses  " 
          << this->NumChildClasses << " head " << this->actSupCl << " ROI " << this->ROIPtr << " ImageProd " << this->ImageProd  << " w_m  " << this->w_mPtr << endl;
@@ -64,6 +65,7 @@ void EMLocalAlgorithm<T>::DetermineLabelMap(short* LabelMap) {
       *LabelMap++ = 0;
       for (l=0;l< NumTotalTypeCLASS;l++) w_m[l] ++;
     } 
+    if (this->SlabStreaming && !((idx+1) % this->imgXY)) this->ReleaseWeightsOfSlice((idx+1)/this->imgXY - 1);
   }
 
 
@@ -116,12 +118,20 @@ void EMLocalAlgorithm<T>::DifferenceMeassure(int StopType, int PrintLabelMapConv
     for (int i=0; i<this->NumClasses; i++) memset(CurrentWeights[i],0, sizeof(float)*this->ImageProd);
     WeightsDifferenceAbsolut = 0.0;
     float diff; 
-    int index =0;
-    for (int j = 0 ; j < this->NumClasses; j++) { 
-      for (int k = 0 ; k < this->NumChildClasses[j]; k++) {
-    for (int i = 0 ; i < ImageProd; i++) CurrentWeights[j][i] += w_m[index][i]; 
-    index ++;
+    // Summed slice by slice so that in slab streaming mode the finished slabs can be released 
+    for (int z = 0 ; z < this->BoundaryMaxZ; z++) {
+      int First = z*this->imgXY;
+      int Last  = First + this->imgXY;
+      int index =0;
+      for (int j = 0 ; j < this->NumClasses; j++) { 
+    for (int k = 0 ; k < this->NumChildClasses[j]; k++) {
+      for (int i = First ; i < Last; i++) CurrentWeights[j][i] += w_m[index][i]; 
+      index ++;
+    }
       }
+      this->ReleaseWeightsOfSlice(z);
+    }
+    for (int j = 0 ; j < this->NumClasses; j++) { 
       if (iter > 1) {
     for (int i= 0 ; i < ImageProd; i++) {           
       diff = LastWeights[j][i] - CurrentWeights[j][i];
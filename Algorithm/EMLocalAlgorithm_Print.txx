@@ -235,8 +235,8 @@ static void EMLocalAlgorithm_PrintDataToOutputExtension(EMLocalAlgorithm<T> *sel
 
     EMLocalAlgorithm_TransfereDataToOutputExtension(selfPtr,inputExtension_Vector,OriginalExtension_DataPtr ,outInc,SliceNum);
   } 
-  EMLocalAlgorithm_GEImageWriter(OriginalExtension_Data,FileName,PrintOutputFlag);
-  OriginalExtension_Data->Delete();    
+  // The writer takes over OriginalExtension_Data and writes it while the algorithm continues
+  selfPtr->GetImageWriter()->Write(OriginalExtension_Data,FileName,PrintOutputFlag);
 }
 
 // -----------------------------------------------------------
@@ -373,8 +373,7 @@ template <class T> void EMLocalAlgorithm<T>::Print_E_StepResultsToFile(int iter)
       OriginalExtension_Data->Delete();
       return;
     }
-    EMLocalAlgorithm_GEImageWriter(OriginalExtension_Data,FileName,0);
-    OriginalExtension_Data->Delete();
+    this->ImageWriter.Write(OriginalExtension_Data,FileName,0);
   }
   // -----------------------------------------------------------
   //  Print Quality Measure 
@@ -0,0 +1,139 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+#include "EMLocalAsyncWriter.h"
+#include "vtkImageData.h"
+#include "vtkMutexLock.h"
+#include "vtkConditionVariable.h"
+#include <string.h>
+
+EMLocalAsyncWriter::EMLocalAsyncWriter() {
+  this->WriteFunction     = NULL;
+  this->FirstJob          = this->LastJob = NULL;
+  this->BufferSize        = 0;
+  this->MaximumBufferSize = 0;
+  this->StopFlag          = 0;
+  this->Threader          = NULL;
+  this->ThreadID          = -1;
+  this->Lock              = NULL;
+  this->Condition         = NULL;
+}
+
+EMLocalAsyncWriter::~EMLocalAsyncWriter() {
+  this->Stop();
+}
+
+void EMLocalAsyncWriter::Start() {
+  this->Lock      = vtkMutexLock::New();
+  this->Condition = vtkConditionVariable::New();
+  this->StopFlag  = 0;
+  this->Threader  = vtkMultiThreader::New();
+  this->ThreadID  = this->Threader->SpawnThread(EMLocalAsyncWriter::ThreadFunction, this);
+}
+
+void EMLocalAsyncWriter::Stop() {
+  if (!this->Threader) return;
+
+  this->Lock->Lock();
+  this->StopFlag = 1;
+  this->Condition->Broadcast();
+  this->Lock->Unlock();
+
+  // Writer thread empties the queue before it returns  
+  this->Threader->TerminateThread(this->ThreadID);
+  this->Threader->Delete();
+  this->Threader = NULL;
+  this->ThreadID = -1;
+
+  this->Condition->Delete();
+  this->Condition = NULL;
+  this->Lock->Delete();
+  this->Lock = NULL;
+}
+
+void EMLocalAsyncWriter::WriteJob(EMLocalAsyncWriter_Job *Job) {
+  if (this->WriteFunction) this->WriteFunction(Job->Volume, Job->FileName, Job->PrintFlag);
+  Job->Volume->Delete();
+  delete[] Job->FileName;
+}
+
+void EMLocalAsyncWriter::Write(vtkImageData *Volume, const char *FileName, int PrintFlag) {
+  EMLocalAsyncWriter_Job *Job = new EMLocalAsyncWriter_Job;
+  Job->Volume    = Volume;
+  Job->FileName  = new char[strlen(FileName) + 1];
+  strcpy(Job->FileName, FileName);
+  Job->PrintFlag = PrintFlag;
+  Job->Size      = vtkIdType(Volume->GetActualMemorySize())*1024;
+  Job->Next      = NULL;
+
+  // Without a buffer there is nothing to overlap with 
+  if (this->MaximumBufferSize <= 0) {
+    this->WriteJob(Job);
+    delete Job;
+    return;
+  }
+
+  if (!this->Threader) this->Start();
+
+  this->Lock->Lock();
+  // An image larger than the buffer is accepted once the buffer is empty 
+  while (this->BufferSize && (this->BufferSize + Job->Size > this->MaximumBufferSize)) this->Condition->Wait(this->Lock);
+  if (this->LastJob) this->LastJob->Next = Job;
+  else this->FirstJob = Job;
+  this->LastJob     = Job;
+  this->BufferSize += Job->Size;
+  this->Condition->Broadcast();
+  this->Lock->Unlock();
+}
+
+void EMLocalAsyncWriter::Flush() {
+  if (!this->Threader) return;
+  this->Lock->Lock();
+  while (this->BufferSize) this->Condition->Wait(this->Lock);
+  this->Lock->Unlock();
+}
+
+VTK_THREAD_RETURN_TYPE EMLocalAsyncWriter::ThreadFunction(void *arg) {
+  vtkMultiThreader::ThreadInfo *Info = static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  EMLocalAsyncWriter *self = static_cast<EMLocalAsyncWriter *>(Info->UserData);
+
+  self->Lock->Lock();
+  while (1) {
+    while (!self->FirstJob && !self->StopFlag) self->Condition->Wait(self->Lock);
+    EMLocalAsyncWriter_Job *Job = self->FirstJob;
+    if (!Job) break;
+    self->FirstJob = Job->Next;
+    if (!self->FirstJob) self->LastJob = NULL;
+
+    // The image stays counted in BufferSize until it is written 
+    self->Lock->Unlock();
+    self->WriteJob(Job);
+    self->Lock->Lock();
+
+    self->BufferSize -= Job->Size;
+    delete Job;
+    self->Condition->Broadcast();
+  }
+  self->Lock->Unlock();
+  return VTK_THREAD_RETURN_VALUE;
+}
@@ -0,0 +1,103 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+// Writes the intermediate results of the EM algorithm (weights, label maps, bias slices, ...) 
+// in a background thread so that the next iteration can be computed while the files are written. 
+// Each image handed to Write is a snapshot owned by the writer. The number of bytes waiting to be 
+// written is bounded by MaximumBufferSize (by default two volumes - a double buffer) - if the buffer 
+// is full Write blocks until the writer thread has caught up.
+
+#ifndef _EMLOCALASYNCWRITER_H_INCLUDED
+#define _EMLOCALASYNCWRITER_H_INCLUDED 1
+
+#include "vtkEMSegment.h"
+#include "vtkType.h"
+#include "vtkMultiThreader.h"
+
+class vtkImageData;
+class vtkMutexLock;
+class vtkConditionVariable;
+
+typedef int (*EMLocalAsyncWriter_WriteFunction)(vtkImageData *Volume, char *FileName, int PrintFlag);
+
+typedef struct EMLocalAsyncWriter_Job {
+  vtkImageData *Volume;
+  char         *FileName;
+  int          PrintFlag;
+  vtkIdType    Size;
+  struct EMLocalAsyncWriter_Job *Next;
+} EMLocalAsyncWriter_Job;
+
+class VTK_EMSEGMENT_EXPORT EMLocalAsyncWriter {
+public:
+  EMLocalAsyncWriter();
+  // Flushes all pending images before returning
+  ~EMLocalAsyncWriter();
+
+  // Description:
+  // Function that writes an image to disk - called by the writer thread
+  void SetWriteFunction(EMLocalAsyncWriter_WriteFunction Function) {this->WriteFunction = Function;}
+
+  // Description:
+  // Maximum number of bytes held by images that are not written yet
+  void SetMaximumBufferSize(vtkIdType Size) {this->MaximumBufferSize = Size;}
+  vtkIdType GetMaximumBufferSize() {return this->MaximumBufferSize;}
+
+  // Description:
+  // Hands Volume over to the writer - the caller must not use or delete Volume afterwards.
+  // The writer thread is started with the first image.
+  void Write(vtkImageData *Volume, const char *FileName, int PrintFlag);
+
+  // Description:
+  // Blocks until all images are written 
+  void Flush();
+
+  // Description:
+  // Flushes and terminates the writer thread 
+  void Stop();
+
+protected:
+  void Start();
+  static VTK_THREAD_RETURN_TYPE ThreadFunction(void *arg);
+  void WriteJob(EMLocalAsyncWriter_Job *Job);
+
+  EMLocalAsyncWriter_WriteFunction WriteFunction;
+
+  EMLocalAsyncWriter_Job *FirstJob;
+  EMLocalAsyncWriter_Job *LastJob;
+  // Bytes of images in the queue or currently written 
+  vtkIdType BufferSize;
+  vtkIdType MaximumBufferSize;
+  int StopFlag;
+
+  vtkMultiThreader     *Threader;
+  int                  ThreadID;
+  vtkMutexLock         *Lock;
+  vtkConditionVariable *Condition;
+
+private:
+  EMLocalAsyncWriter(const EMLocalAsyncWriter&);
+  void operator=(const EMLocalAsyncWriter&);
+};
+
+#endif
@@ -0,0 +1,294 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+#include "EMLocalCheckpoint.h"
+#include <string.h>
+#include <iostream>
+
+static const char EMLocalCheckpoint_Magic[8] = {'E','M','L','O','C','C','K','P'};
+
+// All blocks start at multiples of 8 bytes
+inline vtkTypeInt64 EMLocalCheckpoint_Pad(vtkTypeInt64 Size) {
+  return ((Size + 7)/8)*8;
+}
+
+EMLocalCheckpoint::EMLocalCheckpoint() {
+  this->File = NULL;
+  memset(&this->Header, 0, sizeof(EMLocalCheckpoint_FileHeader));
+  memset(&this->CurrentRecord, 0, sizeof(EMLocalCheckpoint_RecordHeader));
+  this->CurrentRecordStart = this->CurrentPosition = 0;
+  this->LevelOffset    = NULL;
+  this->LevelName      = NULL;
+  this->LevelHash      = NULL;
+  this->LevelArraySize = 0;
+}
+
+EMLocalCheckpoint::~EMLocalCheckpoint() {
+  this->Close();
+}
+
+void EMLocalCheckpoint::Close() {
+  if (this->File) fclose(this->File);
+  this->File = NULL;
+  if (this->LevelOffset) delete[] this->LevelOffset;
+  if (this->LevelName)   delete[] this->LevelName;
+  if (this->LevelHash)   delete[] this->LevelHash;
+  this->LevelOffset    = NULL;
+  this->LevelName      = NULL;
+  this->LevelHash      = NULL;
+  this->LevelArraySize = 0;
+  memset(&this->Header, 0, sizeof(EMLocalCheckpoint_FileHeader));
+}
+
+int EMLocalCheckpoint::Seek(vtkTypeInt64 Offset) {
+#ifdef _WIN32
+  if (_fseeki64(this->File, Offset, SEEK_SET)) return 0;
+#else
+  if (fseeko(this->File, off_t(Offset), SEEK_SET)) return 0;
+#endif
+  this->CurrentPosition = Offset;
+  return 1;
+}
+
+int EMLocalCheckpoint::WriteHeader() {
+  if (!this->Seek(0)) return 0;
+  if (fwrite(&this->Header, sizeof(EMLocalCheckpoint_FileHeader), 1, this->File) != 1) return 0;
+  fflush(this->File);
+  this->CurrentPosition = sizeof(EMLocalCheckpoint_FileHeader);
+  return 1;
+}
+
+void EMLocalCheckpoint::AddLevel(vtkTypeInt64 Offset, const char* Name, vtkTypeUInt64 Hash) {
+  if (this->Header.NumberOfLevels >= this->LevelArraySize) {
+    int NewSize = (this->LevelArraySize ? 2*this->LevelArraySize : 16);
+    vtkTypeInt64 *NewOffset = new vtkTypeInt64[NewSize];
+    char (*NewName)[EMLOCALCHECKPOINT_MAX_LEVELNAME] = new char[NewSize][EMLOCALCHECKPOINT_MAX_LEVELNAME];
+    vtkTypeUInt64 *NewHash = new vtkTypeUInt64[NewSize];
+    if (this->LevelArraySize) {
+      memcpy(NewOffset, this->LevelOffset, sizeof(vtkTypeInt64)*this->LevelArraySize);
+      memcpy(NewName, this->LevelName, EMLOCALCHECKPOINT_MAX_LEVELNAME*this->LevelArraySize);
+      memcpy(NewHash, this->LevelHash, sizeof(vtkTypeUInt64)*this->LevelArraySize);
+      delete[] this->LevelOffset;
+      delete[] this->LevelName;
+      delete[] this->LevelHash;
+    }
+    this->LevelOffset    = NewOffset;
+    this->LevelName      = NewName;
+    this->LevelHash      = NewHash;
+    this->LevelArraySize = NewSize;
+  }
+  this->LevelOffset[this->Header.NumberOfLevels] = Offset;
+  strncpy(this->LevelName[this->Header.NumberOfLevels], Name, EMLOCALCHECKPOINT_MAX_LEVELNAME-1);
+  this->LevelName[this->Header.NumberOfLevels][EMLOCALCHECKPOINT_MAX_LEVELNAME-1] = '\0';
+  this->LevelHash[this->Header.NumberOfLevels] = Hash;
+  this->Header.NumberOfLevels ++;
+}
+
+//----------------------------------------------------------------------------
+int EMLocalCheckpoint::Create(const char* FileName, int Dimension[3], int NumInputImages) {
+  this->Close();
+  this->File = fopen(FileName, "w+b");
+  if (!this->File) {
+    std::cerr << "EMLocalCheckpoint::Create: Could not open " << FileName << std::endl;
+    return 0;
+  }
+  memcpy(this->Header.Magic, EMLocalCheckpoint_Magic, 8);
+  this->Header.Version = EMLOCALCHECKPOINT_VERSION;
+  memcpy(this->Header.Dimension, Dimension, sizeof(int)*3);
+  this->Header.NumInputImages = NumInputImages;
+  this->Header.CommittedSize  = sizeof(EMLocalCheckpoint_FileHeader);
+  if (!this->WriteHeader()) {
+    std::cerr << "EMLocalCheckpoint::Create: Could not write header of " << FileName << std::endl;
+    this->Close();
+    return 0;
+  }
+  return 1;
+}
+
+int EMLocalCheckpoint::Open(const char* FileName, int Dimension[3], int NumInputImages) {
+  this->Close();
+  this->File = fopen(FileName, "r+b");
+  if (!this->File) return 0;
+
+  if ((fread(&this->Header, sizeof(EMLocalCheckpoint_FileHeader), 1, this->File) != 1) || memcmp(this->Header.Magic, EMLocalCheckpoint_Magic, 8)
+      || (this->Header.Version != EMLOCALCHECKPOINT_VERSION)) {
+    std::cerr << "EMLocalCheckpoint::Open: " << FileName << " is not a checkpoint file of this version" << std::endl;
+    this->Close();
+    return 0;
+  }
+
+  if (memcmp(this->Header.Dimension, Dimension, sizeof(int)*3) || (this->Header.NumInputImages != NumInputImages)) {
+    std::cerr << "EMLocalCheckpoint::Open: " << FileName << " was written for images of different dimension" << std::endl;
+    this->Close();
+    return 0;
+  }
+
+  // Index completed levels
+  int NumberOfLevels = this->Header.NumberOfLevels;
+  this->Header.NumberOfLevels = 0;
+  vtkTypeInt64 Offset = sizeof(EMLocalCheckpoint_FileHeader);
+  EMLocalCheckpoint_RecordHeader Record;
+  for (int i = 0; i < NumberOfLevels; i++) {
+    if (!this->Seek(Offset) || (fread(&Record, sizeof(EMLocalCheckpoint_RecordHeader), 1, this->File) != 1) || (Record.Type != EMLOCALCHECKPOINT_LEVEL)) {
+      std::cerr << "EMLocalCheckpoint::Open: " << FileName << " is corrupted after " << i << " levels" << std::endl;
+      break;
+    }
+    this->AddLevel(Offset, Record.LevelName, Record.ParameterHash);
+    Offset += Record.RecordSize;
+  }
+  // Anything after the completed levels is overwritten
+  this->Header.CommittedSize = Offset;
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int EMLocalCheckpoint::BeginRecord(const char* LevelName, vtkTypeUInt64 ParameterHash) {
+  if (!this->File) return 0;
+  memset(&this->CurrentRecord, 0, sizeof(EMLocalCheckpoint_RecordHeader));
+  this->CurrentRecord.Type          = EMLOCALCHECKPOINT_LEVEL;
+  this->CurrentRecord.ParameterHash = ParameterHash;
+  strncpy(this->CurrentRecord.LevelName, LevelName, EMLOCALCHECKPOINT_MAX_LEVELNAME-1);
+
+  // Appended after the completed levels
+  this->CurrentRecordStart = this->Header.CommittedSize;
+  if (!this->Seek(this->CurrentRecordStart)) return 0;
+  if (fwrite(&this->CurrentRecord, sizeof(EMLocalCheckpoint_RecordHeader), 1, this->File) != 1) return 0;
+  this->CurrentPosition += sizeof(EMLocalCheckpoint_RecordHeader);
+  return 1;
+}
+
+int EMLocalCheckpoint::WriteBlock(int Tag, const void* Data, int ElementSize, vtkTypeInt64 NumberOfElements) {
+  if (!this->File) return 0;
+  EMLocalCheckpoint_BlockHeader Block;
+  Block.Tag              = Tag;
+  Block.ElementSize      = ElementSize;
+  Block.NumberOfElements = NumberOfElements;
+  if (fwrite(&Block, sizeof(EMLocalCheckpoint_BlockHeader), 1, this->File) != 1) return 0;
+
+  vtkTypeInt64 NumBytes = vtkTypeInt64(ElementSize)*NumberOfElements;
+  if (NumBytes && (fwrite(Data, 1, size_t(NumBytes), this->File) != size_t(NumBytes))) return 0;
+  static const char Zeros[8] = {0,0,0,0,0,0,0,0};
+  vtkTypeInt64 Padding = EMLocalCheckpoint_Pad(NumBytes) - NumBytes;
+  if (Padding && (fwrite(Zeros, 1, size_t(Padding), this->File) != size_t(Padding))) return 0;
+
+  this->CurrentPosition += sizeof(EMLocalCheckpoint_BlockHeader) + NumBytes + Padding;
+  this->CurrentRecord.NumberOfBlocks ++;
+  return 1;
+}
+
+int EMLocalCheckpoint::EndRecord() {
+  if (!this->File) return 0;
+  this->CurrentRecord.RecordSize = this->CurrentPosition - this->CurrentRecordStart;
+  vtkTypeInt64 RecordEnd = this->CurrentPosition;
+
+  // Update record header and make sure the data is on disk before the file header refers to it
+  if (!this->Seek(this->CurrentRecordStart)) return 0;
+  if (fwrite(&this->CurrentRecord, sizeof(EMLocalCheckpoint_RecordHeader), 1, this->File) != 1) return 0;
+  fflush(this->File);
+
+  this->AddLevel(this->CurrentRecordStart, this->CurrentRecord.LevelName, this->CurrentRecord.ParameterHash);
+  this->Header.CommittedSize = RecordEnd;
+  return this->WriteHeader();
+}
+
+//----------------------------------------------------------------------------
+int EMLocalCheckpoint::GetLevelIndex(const char* LevelName, vtkTypeUInt64 ParameterHash) {
+  // The last record wins
+  for (int i = this->Header.NumberOfLevels -1; i >= 0; i--) {
+    if (!strcmp(this->LevelName[i], LevelName) && (this->LevelHash[i] == ParameterHash)) return i;
+  }
+  return -1;
+}
+
+vtkTypeUInt64 EMLocalCheckpoint::HashParameters(vtkTypeUInt64 Hash, const void* Data, size_t NumBytes) {
+  const unsigned char* Ptr = static_cast<const unsigned char*>(Data);
+  for (size_t i = 0; i < NumBytes; i++) {
+    Hash ^= vtkTypeUInt64(Ptr[i]);
+    Hash *= 1099511628211ULL;
+  }
+  return Hash;
+}
+
+vtkTypeUInt64 EMLocalCheckpoint::HashData(vtkTypeUInt64 Hash, const void* Data, size_t NumBytes) {
+  const unsigned char* Ptr = static_cast<const unsigned char*>(Data);
+  size_t NumWords = NumBytes / sizeof(vtkTypeUInt64);
+  for (size_t i = 0; i < NumWords; i++, Ptr += sizeof(vtkTypeUInt64)) {
+    vtkTypeUInt64 Word;
+    memcpy(&Word, Ptr, sizeof(vtkTypeUInt64));
+    Hash ^= Word;
+    Hash *= 1099511628211ULL;
+  }
+  return EMLocalCheckpoint::HashParameters(Hash, Ptr, NumBytes - NumWords*sizeof(vtkTypeUInt64));
+}
+
+int EMLocalCheckpoint::ReadBlock(int LevelIndex, int Tag, void* Data, int ElementSize, vtkTypeInt64 NumberOfElements, int Occurrence) {
+  if (!this->File || (LevelIndex < 0) || (LevelIndex >= this->Header.NumberOfLevels)) return 0;
+
+  EMLocalCheckpoint_RecordHeader Record;
+  vtkTypeInt64 Offset = this->LevelOffset[LevelIndex];
+  if (!this->Seek(Offset) || (fread(&Record, sizeof(EMLocalCheckpoint_RecordHeader), 1, this->File) != 1)) return 0;
+  Offset += sizeof(EMLocalCheckpoint_RecordHeader);
+
+  EMLocalCheckpoint_BlockHeader Block;
+  for (int i = 0; i < Record.NumberOfBlocks; i++) {
+    if (!this->Seek(Offset) || (fread(&Block, sizeof(EMLocalCheckpoint_BlockHeader), 1, this->File) != 1)) return 0;
+    vtkTypeInt64 NumBytes = vtkTypeInt64(Block.ElementSize)*Block.NumberOfElements;
+    if ((Block.Tag == Tag) && !(Occurrence--)) {
+      if ((Block.ElementSize != ElementSize) || (Block.NumberOfElements != NumberOfElements)) {
+        std::cerr << "EMLocalCheckpoint::ReadBlock: Block " << Tag << " of level " << Record.LevelName << " has unexpected size" << std::endl;
+        return 0;
+      }
+      return (fread(Data, 1, size_t(NumBytes), this->File) == size_t(NumBytes));
+    }
+    Offset += sizeof(EMLocalCheckpoint_BlockHeader) + EMLocalCheckpoint_Pad(NumBytes);
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------
+int EMLocalCheckpoint::WriteBias(EMTriVolume &iv_m, EMVolume *r_m, int NumInputImages) {
+  vtkTypeInt64 NumVoxels = vtkTypeInt64(r_m[0].GetMaxX())*r_m[0].GetMaxY()*r_m[0].GetMaxZ();
+  for (int y = 0; y < NumInputImages; y++) {
+    for (int x = 0; x <= y; x++) {
+      if (!this->WriteBlock(EMLOCALCHECKPOINT_BIAS_IV, &iv_m(y,x,0,0,0), sizeof(float), NumVoxels)) return 0;
+    }
+  }
+  for (int i = 0; i < NumInputImages; i++) {
+    if (!this->WriteBlock(EMLOCALCHECKPOINT_BIAS_R, r_m[i].GetData(), sizeof(float), NumVoxels)) return 0;
+  }
+  return 1;
+}
+
+int EMLocalCheckpoint::ReadBias(int LevelIndex, EMTriVolume &iv_m, EMVolume *r_m, int NumInputImages) {
+  vtkTypeInt64 NumVoxels = vtkTypeInt64(r_m[0].GetMaxX())*r_m[0].GetMaxY()*r_m[0].GetMaxZ();
+  int Occurrence = 0;
+  for (int y = 0; y < NumInputImages; y++) {
+    for (int x = 0; x <= y; x++) {
+      if (!this->ReadBlock(LevelIndex, EMLOCALCHECKPOINT_BIAS_IV, &iv_m(y,x,0,0,0), sizeof(float), NumVoxels, Occurrence++)) return 0;
+    }
+  }
+  for (int i = 0; i < NumInputImages; i++) {
+    if (!this->ReadBlock(LevelIndex, EMLOCALCHECKPOINT_BIAS_R, r_m[i].GetData(), sizeof(float), NumVoxels, i)) return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,155 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+// Binary checkpoint file of the hierarchical segmentation
+//
+// Layout (all offsets are multiples of 8 so that the file can be memory mapped):
+//   EMLocalCheckpoint_FileHeader
+//   Record 1 .. NumberOfLevels        - state after each completed level (in order of completion)
+// Each record is a EMLocalCheckpoint_RecordHeader followed by NumberOfBlocks blocks. A record is identified 
+// by the name of the level and a hash of the parameters of the level and its sub-hierarchy, so that a 
+// checkpoint of a different hierarchy is never restored. Levels are only saved once they are completed - 
+// an interrupted level is segmented again when resuming.
+// Each block is a EMLocalCheckpoint_BlockHeader followed by the raw data (native byte order),
+// padded to 8 bytes.
+// The file header is rewritten after every record so that a crash while writing a record
+// never invalidates the records written before.
+
+#ifndef _EMLOCALCHECKPOINT_H_INCLUDED
+#define _EMLOCALCHECKPOINT_H_INCLUDED 1
+
+#include "vtkEMSegment.h"
+#include "vtkType.h"
+#include "vtkDataDef.h"
+#include <stdio.h>
+
+#define EMLOCALCHECKPOINT_VERSION 2
+#define EMLOCALCHECKPOINT_MAX_LEVELNAME 64
+#define EMLOCALCHECKPOINT_HASH_SEED 14695981039346656037ULL
+
+// Record types
+#define EMLOCALCHECKPOINT_LEVEL     1
+
+// Block tags
+#define EMLOCALCHECKPOINT_LABELMAP            1
+#define EMLOCALCHECKPOINT_GLOBAL_REGISTRATION 2
+#define EMLOCALCHECKPOINT_REGISTRATION        3
+#define EMLOCALCHECKPOINT_SHAPE               4
+#define EMLOCALCHECKPOINT_BIAS_IV             5
+#define EMLOCALCHECKPOINT_BIAS_R              6
+
+typedef struct {
+  char        Magic[8];
+  int         Version;
+  int         Dimension[3];
+  int         NumInputImages;
+  int         NumberOfLevels;
+  int         Padding;
+  vtkTypeInt64 CommittedSize;
+} EMLocalCheckpoint_FileHeader;
+
+typedef struct {
+  int           Type;
+  int           NumberOfBlocks;
+  char          LevelName[EMLOCALCHECKPOINT_MAX_LEVELNAME];
+  vtkTypeUInt64 ParameterHash;
+  vtkTypeInt64  RecordSize;
+} EMLocalCheckpoint_RecordHeader;
+
+typedef struct {
+  int          Tag;
+  int          ElementSize;
+  vtkTypeInt64 NumberOfElements;
+} EMLocalCheckpoint_BlockHeader;
+
+class VTK_EMSEGMENT_EXPORT EMLocalCheckpoint {
+public:
+  EMLocalCheckpoint();
+  ~EMLocalCheckpoint();
+
+  // Description:
+  // Creates a new checkpoint file - an existing file is overwritten
+  int Create(const char* FileName, int Dimension[3], int NumInputImages);
+
+  // Description:
+  // Opens an existing checkpoint for resuming. Completed levels can be read back and new records
+  // are appended after them (a partially written record is overwritten).
+  // Returns 0 if the file does not exist or was written for differently sized images
+  int Open(const char* FileName, int Dimension[3], int NumInputImages);
+  void Close();
+  int  IsOpen() {return (this->File != NULL);}
+
+  // Description:
+  // Writing the record of a completed level: BeginRecord, a WriteBlock for each block and EndRecord.
+  // ParameterHash identifies the parameters the level was segmented with (see HashParameters) 
+  int BeginRecord(const char* LevelName, vtkTypeUInt64 ParameterHash);
+  int WriteBlock(int Tag, const void* Data, int ElementSize, vtkTypeInt64 NumberOfElements);
+  int EndRecord();
+
+  // Description:
+  // Index of the last completed record for LevelName with the same ParameterHash - -1 if the level was not completed
+  int GetLevelIndex(const char* LevelName, vtkTypeUInt64 ParameterHash);
+  int GetNumberOfLevels() {return this->Header.NumberOfLevels;}
+
+  // Description:
+  // Reads the block Tag of the completed level LevelIndex into Data - the size has to agree with the one written
+  // If a record contains several blocks with the same tag, Occurrence selects among them
+  int ReadBlock(int LevelIndex, int Tag, void* Data, int ElementSize, vtkTypeInt64 NumberOfElements, int Occurrence = 0);
+
+  // Description:
+  // FNV-1a hash of NumBytes at Data continuing from Hash - start with EMLOCALCHECKPOINT_HASH_SEED 
+  static vtkTypeUInt64 HashParameters(vtkTypeUInt64 Hash, const void* Data, size_t NumBytes);
+
+  // Description:
+  // Same for large blocks such as image data - FNV-1a over 64 bit words, so the result differs from HashParameters 
+  static vtkTypeUInt64 HashData(vtkTypeUInt64 Hash, const void* Data, size_t NumBytes);
+
+  // Description:
+  // Bias state - iv_m (lower triangle) as blocks EMLOCALCHECKPOINT_BIAS_IV and r_m as EMLOCALCHECKPOINT_BIAS_R 
+  int WriteBias(EMTriVolume &iv_m, EMVolume *r_m, int NumInputImages);
+  int ReadBias(int LevelIndex, EMTriVolume &iv_m, EMVolume *r_m, int NumInputImages);
+
+protected:
+  int WriteHeader();
+  int Seek(vtkTypeInt64 Offset);
+
+  FILE* File;
+  EMLocalCheckpoint_FileHeader   Header;
+  EMLocalCheckpoint_RecordHeader CurrentRecord;
+  vtkTypeInt64 CurrentRecordStart;
+  vtkTypeInt64 CurrentPosition;
+
+  // Offset, level name and parameter hash of each completed record
+  vtkTypeInt64  *LevelOffset;
+  char          (*LevelName)[EMLOCALCHECKPOINT_MAX_LEVELNAME];
+  vtkTypeUInt64 *LevelHash;
+  int           LevelArraySize;
+
+  void AddLevel(vtkTypeInt64 Offset, const char* Name, vtkTypeUInt64 Hash);
+
+private:
+  EMLocalCheckpoint(const EMLocalCheckpoint&);
+  void operator=(const EMLocalCheckpoint&);
+};
+
+#endif
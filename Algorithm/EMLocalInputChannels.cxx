@@ -0,0 +1,135 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+#include "EMLocalInputChannels.h"
+#include "vtkImageData.h"
+#include <limits.h>
+#include <string.h>
+
+EMLocalInputChannels::EMLocalInputChannels() {
+  this->NumChannels = 0;
+  this->Dimension[0] = this->Dimension[1] = this->Dimension[2] = 0;
+  this->Channels = NULL;
+}
+
+EMLocalInputChannels::~EMLocalInputChannels() {
+  this->DeleteVariables();
+}
+
+void EMLocalInputChannels::DeleteVariables() {
+  if (this->Channels) {
+    for (int l = 0; l < this->NumChannels; l++) {
+      if (this->Channels[l].LookupTable) delete[] this->Channels[l].LookupTable;
+      if (this->Channels[l].LogBuffer) delete[] this->Channels[l].LogBuffer;
+    }
+    delete[] this->Channels;
+    this->Channels = NULL;
+  }
+  this->NumChannels = 0;
+}
+
+void EMLocalInputChannels::Initialize(int initNumChannels, int initDimension[3]) {
+  this->DeleteVariables();
+  this->NumChannels = initNumChannels;
+  memcpy(this->Dimension, initDimension, sizeof(int)*3);
+  this->Channels = new EMLocalInputChannels_Channel[initNumChannels];
+  memset(this->Channels, 0, sizeof(EMLocalInputChannels_Channel)*initNumChannels);
+}
+
+// Table with the log intensity of each value between Min and Max
+template <class T> 
+static float* EMLocalInputChannels_LookupTable(T *, int Min, int Max) {
+  float *Table = new float[Max - Min + 1];
+  for (int i = Min; i <= Max; i++) Table[i - Min] = EMLocalInputChannels_LogIntensity(T(i));
+  return Table;
+}
+
+// Log intensities of the working region starting at Ptr 
+template <class T> 
+static void EMLocalInputChannels_FillLogBuffer(const T *Ptr, float *Buffer, int Dimension[3], vtkIdType IncY, vtkIdType IncZ) {
+  for (int z = 0; z < Dimension[2]; z++) {
+    for (int y = 0; y < Dimension[1]; y++) {
+      for (int x = 0; x < Dimension[0]; x++) *Buffer++ = EMLocalInputChannels_LogIntensity(*Ptr++);
+      Ptr += IncY;
+    }
+    Ptr += IncZ;
+  }
+}
+
+int EMLocalInputChannels::SetChannel(int Channel, vtkImageData *Image, int Extent[6], int BoundaryMin[3]) {
+  EMLocalInputChannels_Channel *Ch = this->Channels + Channel;
+  if (Ch->LookupTable) delete[] Ch->LookupTable;
+  if (Ch->LogBuffer) delete[] Ch->LogBuffer;
+  memset(Ch, 0, sizeof(EMLocalInputChannels_Channel));
+
+  Ch->ScalarType  = Image->GetScalarType();
+  Ch->StorageType = Ch->ScalarType;
+  switch (Ch->ScalarType) {
+    case VTK_CHAR:           Ch->LookupTable = EMLocalInputChannels_LookupTable((char*) NULL, CHAR_MIN, CHAR_MAX); Ch->LookupTableOffset = CHAR_MIN; break;
+    case VTK_SIGNED_CHAR:    Ch->LookupTable = EMLocalInputChannels_LookupTable((signed char*) NULL, SCHAR_MIN, SCHAR_MAX); Ch->LookupTableOffset = SCHAR_MIN; break;
+    case VTK_UNSIGNED_CHAR:  Ch->LookupTable = EMLocalInputChannels_LookupTable((unsigned char*) NULL, 0, UCHAR_MAX); break;
+    case VTK_SHORT:          Ch->LookupTable = EMLocalInputChannels_LookupTable((short*) NULL, SHRT_MIN, SHRT_MAX); Ch->LookupTableOffset = SHRT_MIN; break;
+    case VTK_UNSIGNED_SHORT: Ch->LookupTable = EMLocalInputChannels_LookupTable((unsigned short*) NULL, 0, USHRT_MAX); break;
+    case VTK_INT: case VTK_UNSIGNED_INT: case VTK_LONG: case VTK_UNSIGNED_LONG: case VTK_FLOAT: case VTK_DOUBLE: 
+#if defined(VTK_TYPE_USE_LONG_LONG)
+    case VTK_LONG_LONG: case VTK_UNSIGNED_LONG_LONG:
+#endif
+#if defined(VTK_TYPE_USE___INT64)
+    case VTK___INT64: case VTK_UNSIGNED___INT64:
+#endif
+      break;
+    default: 
+      return 0;
+  }
+
+  // Increments in number of scalars - we assume the input has one scalar component which is checked in CheckInputImage
+  vtkIdType IncX, IncY, IncZ;
+  Image->GetContinuousIncrements(Extent, IncX, IncY, IncZ);
+
+  vtkIdType ScalarSize   = Image->GetScalarSize();
+  vtkIdType LengthOfXDim = Extent[1] - Extent[0] + 1 + IncY;
+  vtkIdType LengthOfYDim = LengthOfXDim*(Extent[3] - Extent[2] + 1) + IncZ;  
+  vtkIdType Jump         = (BoundaryMin[0] - 1) + (BoundaryMin[1] - 1) * LengthOfXDim + LengthOfYDim *(BoundaryMin[2] - 1);
+  vtkIdType BoundaryDataIncY = LengthOfXDim - this->Dimension[0];
+  vtkIdType BoundaryDataIncZ = LengthOfYDim - this->Dimension[1] *LengthOfXDim;
+
+  const char* Start = static_cast<const char*>(Image->GetScalarPointerForExtent(Extent)) + Jump*ScalarSize;
+
+  if (Ch->LookupTable) {
+    Ch->Start     = Start;
+    Ch->VoxelJump = ScalarSize;
+    Ch->RowJump   = (1 + BoundaryDataIncY)*ScalarSize;
+    Ch->SliceJump = (1 + BoundaryDataIncY + BoundaryDataIncZ)*ScalarSize;
+    return 1;
+  }
+
+  // No lookup table - the log intensities are computed once here instead of at every access 
+  Ch->LogBuffer = new float[vtkIdType(this->Dimension[0])*vtkIdType(this->Dimension[1])*vtkIdType(this->Dimension[2])];
+  switch (Ch->ScalarType) {
+    vtkTemplateMacro(EMLocalInputChannels_FillLogBuffer((const VTK_TT*) Start, Ch->LogBuffer, this->Dimension, BoundaryDataIncY, BoundaryDataIncZ));
+  }
+  Ch->StorageType = VTK_FLOAT;
+  Ch->Start       = (const char*) Ch->LogBuffer;
+  Ch->VoxelJump   = Ch->RowJump = Ch->SliceJump = sizeof(float);
+  return 1;
+}
@@ -0,0 +1,177 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+// Read-only access to the input channels of the segmenter.
+// 8 and 16 bit intensities are not copied into a float buffer - the scalars of the input images are read in place 
+// (any increments of the vtkImageData) and mapped to log(I + 1) by a table lookup when they are accessed. 
+// For all other scalar types log(I + 1) is computed once and kept in a float buffer of the size of the working 
+// region. The images have to stay unchanged while the view is used.
+// The iterator is templated over the storage type of the channels (GetStorageType) so that the type is 
+// resolved once per pass with EMLocalInputChannels_TemplateMacro and not for every access.
+
+#ifndef _EMLOCALINPUTCHANNELS_H_INCLUDED
+#define _EMLOCALINPUTCHANNELS_H_INCLUDED 1
+
+#include "vtkEMSegment.h"
+#include "vtkType.h"
+#include "vtkSetGet.h"
+#include <math.h>
+
+class vtkImageData;
+
+// Log intensity as it was used by the algorithm from the beginning - values <= 0 are mapped to 0 
+template <class T> 
+inline float EMLocalInputChannels_LogIntensity(T Value) {
+  if (double(Value) > 0.0) return log(float(Value) +1);
+  return 0.0;
+}
+
+typedef struct {
+  // First voxel of the working region
+  const char *Start;
+  int        ScalarType;
+  // Scalar type of the data Start points to - VTK_FLOAT if the channel is kept in LogBuffer 
+  int        StorageType;
+  // Defined for scalar types without lookup table - log intensities of the working region  
+  float      *LogBuffer;
+  // Bytes to advance to the next voxel / first voxel of next row / first voxel of next slice 
+  vtkIdType  VoxelJump;
+  vtkIdType  RowJump;
+  vtkIdType  SliceJump;
+  // Defined for 8 and 16 bit scalars - indexed by Value - LookupTableOffset  
+  float      *LookupTable;
+  int        LookupTableOffset;
+} EMLocalInputChannels_Channel;
+
+class VTK_EMSEGMENT_EXPORT EMLocalInputChannels {
+public:
+  EMLocalInputChannels();
+  ~EMLocalInputChannels();
+
+  // Description:
+  // Dimension is the size of the working region (defined by the segmentation boundary)
+  void Initialize(int initNumChannels, int Dimension[3]);
+
+  // Description:
+  // Reads channel Channel from the scalars of Image. Extent is the extent of the image data given to the filter
+  // and BoundaryMin the first voxel of the working region within it (starting with 1). 
+  // Returns 0 if the scalar type is not supported.
+  int SetChannel(int Channel, vtkImageData *Image, int Extent[6], int BoundaryMin[3]);
+
+  int  GetNumberOfChannels() const {return this->NumChannels;}
+  const int* GetDimension() const {return this->Dimension;}
+  const EMLocalInputChannels_Channel* GetChannel(int Channel) const {return this->Channels + Channel;}
+
+  // Description:
+  // Storage type shared by all channels (the inputs of the segmenter all have the same scalar type) - 
+  // selects the EMLocalInputChannels_Iterator of a pass 
+  int GetStorageType() const {return (this->NumChannels ? this->Channels[0].StorageType : VTK_FLOAT);}
+
+protected:
+  void DeleteVariables();
+
+  int NumChannels;
+  int Dimension[3];
+  EMLocalInputChannels_Channel *Channels;
+
+private:
+  EMLocalInputChannels(const EMLocalInputChannels&);
+  void operator=(const EMLocalInputChannels&);
+};
+
+// Log intensity of the voxel at Ptr - the float storage already holds the log intensities  
+template <class TIn> 
+inline float EMLocalInputChannels_GetLogIntensity(const EMLocalInputChannels_Channel *Channel, const TIn *Ptr) {
+  return Channel->LookupTable[int(*Ptr) - Channel->LookupTableOffset];
+}
+
+inline float EMLocalInputChannels_GetLogIntensity(const EMLocalInputChannels_Channel *, const float *Ptr) {
+  return *Ptr;
+}
+
+// Same as vtkTemplateMacro but only for the storage types of EMLocalInputChannels 
+#define EMLocalInputChannels_TemplateMacro(call)                          \
+  case VTK_FLOAT: { typedef float VTK_TT; call; }; break;                 \
+  case VTK_CHAR: { typedef char VTK_TT; call; }; break;                   \
+  case VTK_SIGNED_CHAR: { typedef signed char VTK_TT; call; }; break;     \
+  case VTK_UNSIGNED_CHAR: { typedef unsigned char VTK_TT; call; }; break; \
+  case VTK_SHORT: { typedef short VTK_TT; call; }; break;                 \
+  case VTK_UNSIGNED_SHORT: { typedef unsigned short VTK_TT; call; }; break
+
+// -----------------------------------------------------------
+// Iterates through the working region in the same order as all the other volumes of the algorithm 
+// (x fastest, then y, then z). Replaces the old InputVector - InputVector[l] is channel l of the current voxel 
+// TIn has to be the storage type of the channels 
+// -----------------------------------------------------------
+template <class TIn> 
+class EMLocalInputChannels_Iterator {
+public:
+  EMLocalInputChannels_Iterator(const EMLocalInputChannels *initChannels) {
+    this->Channels    = initChannels;
+    this->NumChannels = initChannels->GetNumberOfChannels();
+    this->Ptr         = new const char*[this->NumChannels];
+    this->Begin();
+  }
+  ~EMLocalInputChannels_Iterator() {delete[] this->Ptr;}
+
+  void Begin() {
+    for (int l = 0; l < this->NumChannels; l++) this->Ptr[l] = this->Channels->GetChannel(l)->Start;
+    this->X = this->Y = 0;
+  }
+
+  // Description:
+  // Log intensity of channel l of the current voxel 
+  float operator[](int l) const {return EMLocalInputChannels_GetLogIntensity(this->Channels->GetChannel(l), (const TIn*) this->Ptr[l]);}
+  // All channels of the current voxel
+  void Get(float *Values) const {for (int l = 0; l < this->NumChannels; l++) Values[l] = (*this)[l];}
+
+  // Description:
+  // Moves to the next voxel of the working region
+  void Next() {
+    const int *Dimension = this->Channels->GetDimension();
+    if (++this->X < Dimension[0]) {
+      for (int l = 0; l < this->NumChannels; l++) this->Ptr[l] += this->Channels->GetChannel(l)->VoxelJump;
+      return;
+    }
+    this->X = 0;
+    if (++this->Y < Dimension[1]) {
+      for (int l = 0; l < this->NumChannels; l++) this->Ptr[l] += this->Channels->GetChannel(l)->RowJump;
+      return;
+    }
+    this->Y = 0;
+    for (int l = 0; l < this->NumChannels; l++) this->Ptr[l] += this->Channels->GetChannel(l)->SliceJump;
+  }
+  void operator++(int) {this->Next();}
+
+protected:
+  const EMLocalInputChannels *Channels;
+  int NumChannels;
+  const char **Ptr;
+  int X, Y;
+
+private:
+  EMLocalInputChannels_Iterator(const EMLocalInputChannels_Iterator&);
+  void operator=(const EMLocalInputChannels_Iterator&);
+};
+
+#endif
@@ -35,6 +35,11 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
  
 #define EMLOCALSEGMENTER_MAX_MULTI_THREAD -1
 
+// Threaded sums (e.g. of the registration and shape cost functions) are accumulated in blocks 
+// of EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE voxels, which are never split between threads. The block 
+// sums are then added pairwise in a fixed order so that the result does not depend on the number of threads.
+#define EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE 4096
+
 //--------------------------------------------------------------------
 // Registration Parameters 
 //--------------------------------------------------------------------
@@ -250,9 +255,36 @@ inline int EMLocalInterface_DefineMultiThreadJump(int *Start, int BoundaryMaxX,
   return Start[0] + Start[1] * LengthOfXDim + LengthOfYDim *Start[2];
 }
 
-inline int EMLocalInterface_GetDefaultNumberOfThreads(int DisableFlag) {
+inline int EMLocalInterface_GetNumberOfReductionBlocks(int NumberOfVoxels) {
+  return (NumberOfVoxels + EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE - 1)/EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE;
+}
+
+// Defines the voxels [JobStart, JobStart + JobNumVoxels) of job Job so that jobs start at block boundaries
+inline void EMLocalInterface_DefineBlockAlignedJob(int NumberOfVoxels, int NumberOfJobs, int Job, int &JobStart, int &JobNumVoxels) {
+  int NumberOfBlocks = EMLocalInterface_GetNumberOfReductionBlocks(NumberOfVoxels);
+  int BlocksPerJob   = NumberOfBlocks / NumberOfJobs;
+  int LeftOver       = NumberOfBlocks % NumberOfJobs;
+  int FirstBlock     = Job * BlocksPerJob + (Job < LeftOver ? Job : LeftOver);
+  int LastBlock      = FirstBlock + BlocksPerJob + (Job < LeftOver ? 1 : 0);
+  JobStart     = FirstBlock * EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE;
+  JobNumVoxels = LastBlock * EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE;
+  if (JobStart > NumberOfVoxels) JobStart = NumberOfVoxels;
+  if (JobNumVoxels > NumberOfVoxels) JobNumVoxels = NumberOfVoxels;
+  JobNumVoxels -= JobStart;
+}
+
+// Pairwise summation - the order only depends on Num 
+inline double EMLocalInterface_PairwiseSum(const double *Values, int Num) {
+  if (Num < 1) return 0.0;
+  if (Num == 1) return Values[0];
+  int Half = Num/2;
+  return EMLocalInterface_PairwiseSum(Values, Half) + EMLocalInterface_PairwiseSum(Values + Half, Num - Half);
+}
+
+// NumberOfThreads < 1 => global default of vtkMultiThreader 
+inline int EMLocalInterface_GetNumberOfThreads(int DisableFlag, int NumberOfThreads) {
   if (DisableFlag) return 1;
-  int result = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int result = (NumberOfThreads > 0 ? NumberOfThreads : vtkMultiThreader::GetGlobalDefaultNumberOfThreads());
   if ((EMLOCALSEGMENTER_MAX_MULTI_THREAD > 0 ) && (result >  EMLOCALSEGMENTER_MAX_MULTI_THREAD)) return EMLOCALSEGMENTER_MAX_MULTI_THREAD;
   return result;
 }
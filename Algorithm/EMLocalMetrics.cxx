@@ -0,0 +1,189 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+#include "EMLocalMetrics.h"
+#include "vtkTimerLog.h"
+#include <stdio.h>
+#include <string.h>
+
+EMLocalMetrics::EMLocalMetrics() {
+  this->Levels         = NULL;
+  this->LevelArraySize = 0;
+  this->Reset();
+}
+
+EMLocalMetrics::~EMLocalMetrics() {
+  delete[] this->Levels;
+}
+
+void EMLocalMetrics::Reset() {
+  this->NumberOfLevels = 0;
+  this->CurrentLevel   = -1;
+  this->LevelStartTime = 0.0;
+  for (int i = 0; i < EMLOCALMETRICS_NUMBER_OF_SUBSYSTEMS; i++) this->CurrentMemory[i] = this->PeakMemory[i] = 0;
+  this->TotalCurrentMemory = this->TotalPeakMemory = 0;
+}
+
+EMLocalMetrics_Level* EMLocalMetrics::BeginLevel(const char* LevelName) {
+  if (this->NumberOfLevels == this->LevelArraySize) {
+    int NewSize = (this->LevelArraySize ? 2*this->LevelArraySize : 16);
+    EMLocalMetrics_Level *NewLevels = new EMLocalMetrics_Level[NewSize];
+    if (this->NumberOfLevels) memcpy(NewLevels, this->Levels, sizeof(EMLocalMetrics_Level)*this->NumberOfLevels);
+    delete[] this->Levels;
+    this->Levels         = NewLevels;
+    this->LevelArraySize = NewSize;
+  }
+  this->CurrentLevel = this->NumberOfLevels++;
+  EMLocalMetrics_Level *Level = &this->Levels[this->CurrentLevel];
+  memset(Level, 0, sizeof(EMLocalMetrics_Level));
+  strncpy(Level->LevelName, LevelName, EMLOCALMETRICS_MAX_LEVELNAME - 1);
+  this->LevelStartTime = vtkTimerLog::GetUniversalTime();
+  return Level;
+}
+
+void EMLocalMetrics::EndLevel() {
+  if (this->CurrentLevel < 0) return;
+  this->Levels[this->CurrentLevel].Time = vtkTimerLog::GetUniversalTime() - this->LevelStartTime;
+  this->CurrentLevel = -1;
+}
+
+int EMLocalMetrics::GetTotalEMIterations() {
+  int Sum = 0;
+  for (int i = 0; i < this->NumberOfLevels; i++) Sum += this->Levels[i].EMIterations;
+  return Sum;
+}
+
+int EMLocalMetrics::GetTotalMFSweeps() {
+  int Sum = 0;
+  for (int i = 0; i < this->NumberOfLevels; i++) Sum += this->Levels[i].MFSweeps;
+  return Sum;
+}
+
+int EMLocalMetrics::GetTotalRegistrationCostEvaluations() {
+  int Sum = 0;
+  for (int i = 0; i < this->NumberOfLevels; i++) Sum += this->Levels[i].RegistrationCostEvaluations;
+  return Sum;
+}
+
+int EMLocalMetrics::GetTotalShapeCostEvaluations() {
+  int Sum = 0;
+  for (int i = 0; i < this->NumberOfLevels; i++) Sum += this->Levels[i].ShapeCostEvaluations;
+  return Sum;
+}
+
+double EMLocalMetrics::GetTotalVoxelClassEvaluations() {
+  double Sum = 0.0;
+  for (int i = 0; i < this->NumberOfLevels; i++) Sum += this->Levels[i].VoxelClassEvaluations;
+  return Sum;
+}
+
+double EMLocalMetrics::GetTotalEStepTime() {
+  double Sum = 0.0;
+  for (int i = 0; i < this->NumberOfLevels; i++) Sum += this->Levels[i].EStepTime;
+  return Sum;
+}
+
+double EMLocalMetrics::GetVoxelClassEvaluationsPerSecond() {
+  double Time = this->GetTotalEStepTime();
+  return (Time > 0.0 ? this->GetTotalVoxelClassEvaluations()/Time : 0.0);
+}
+
+void EMLocalMetrics::AddMemory(int Subsystem, vtkIdType Bytes) {
+  this->CurrentMemory[Subsystem] += Bytes;
+  if (this->CurrentMemory[Subsystem] > this->PeakMemory[Subsystem]) this->PeakMemory[Subsystem] = this->CurrentMemory[Subsystem];
+  this->TotalCurrentMemory += Bytes;
+  if (this->TotalCurrentMemory > this->TotalPeakMemory) this->TotalPeakMemory = this->TotalCurrentMemory;
+}
+
+void EMLocalMetrics::RemoveMemory(int Subsystem, vtkIdType Bytes) {
+  this->CurrentMemory[Subsystem] -= Bytes;
+  this->TotalCurrentMemory       -= Bytes;
+}
+
+const char* EMLocalMetrics::GetSubsystemName(int Subsystem) {
+  switch (Subsystem) {
+    case EMLOCALMETRICS_WEIGHTS:   return "weights";
+    case EMLOCALMETRICS_INTENSITY: return "intensity";
+    case EMLOCALMETRICS_BIAS:      return "bias";
+    case EMLOCALMETRICS_LABELMAP:  return "labelmap";
+  }
+  return "unknown";
+}
+
+int EMLocalMetrics::WriteJSON(const char* FileName) {
+  FILE* File = fopen(FileName, "w");
+  if (!File) {
+    std::cerr << "EMLocalMetrics::WriteJSON: Could not open " << FileName << std::endl;
+    return 0;
+  }
+
+  fprintf(File, "{\n  \"levels\": [\n");
+  for (int i = 0; i < this->NumberOfLevels; i++) {
+    EMLocalMetrics_Level *Level = &this->Levels[i];
+    // Level names only consist of digits and dashes
+    fprintf(File, "    {\"name\": \"%s\", \"restored\": %d, \"classes\": %d, \"roiVoxels\": %lld, \"emIterations\": %d, \"mfSweeps\": %d, "
+            "\"eSteps\": %d, \"voxelClassEvaluations\": %.0f, \"eStepSeconds\": %.6f, \"voxelClassEvaluationsPerSecond\": %.1f, "
+            "\"registrationCostEvaluations\": %d, \"shapeCostEvaluations\": %d, \"incompleteModelVoxelCount\": %d, \"streamedWeightsPeakResidentBytes\": %lld, \"seconds\": %.6f}%s\n", 
+            Level->LevelName, Level->RestoredFlag, Level->NumberOfClasses, (long long) Level->ROIVoxelCount, Level->EMIterations, Level->MFSweeps, 
+            Level->EStepCount, Level->VoxelClassEvaluations, Level->EStepTime, (Level->EStepTime > 0.0 ? Level->VoxelClassEvaluations/Level->EStepTime : 0.0),
+            Level->RegistrationCostEvaluations, Level->ShapeCostEvaluations, Level->IncompleteModelVoxelCount, (long long) Level->StreamedWeightsPeakResidentBytes, Level->Time, 
+            (i + 1 < this->NumberOfLevels ? "," : ""));
+  }
+  fprintf(File, "  ],\n");
+
+  fprintf(File, "  \"totals\": {\"emIterations\": %d, \"mfSweeps\": %d, \"voxelClassEvaluations\": %.0f, \"eStepSeconds\": %.6f, "
+          "\"voxelClassEvaluationsPerSecond\": %.1f, \"registrationCostEvaluations\": %d, \"shapeCostEvaluations\": %d},\n", 
+          this->GetTotalEMIterations(), this->GetTotalMFSweeps(), this->GetTotalVoxelClassEvaluations(), this->GetTotalEStepTime(), 
+          this->GetVoxelClassEvaluationsPerSecond(), this->GetTotalRegistrationCostEvaluations(), this->GetTotalShapeCostEvaluations());
+
+  fprintf(File, "  \"memory\": {");
+  for (int i = 0; i < EMLOCALMETRICS_NUMBER_OF_SUBSYSTEMS; i++) 
+    fprintf(File, "\"%s\": {\"currentBytes\": %lld, \"peakBytes\": %lld}, ", EMLocalMetrics::GetSubsystemName(i), (long long) this->CurrentMemory[i], 
+            (long long) this->PeakMemory[i]);
+  fprintf(File, "\"total\": {\"currentBytes\": %lld, \"peakBytes\": %lld}}\n}\n", (long long) this->TotalCurrentMemory, (long long) this->TotalPeakMemory);
+
+  int Success = !ferror(File);
+  if (fclose(File)) Success = 0;
+  if (!Success) std::cerr << "EMLocalMetrics::WriteJSON: Could not write " << FileName << std::endl;
+  return Success;
+}
+
+void EMLocalMetrics::Print(std::ostream& os) {
+  char Line[256];
+  os << "==================== EM Metrics ====================" << std::endl;
+  sprintf(Line, "%-12s %10s %6s %6s %14s %14s %8s %8s %10s", "Level", "ROI voxels", "EM it", "MF", "Evals/s", "Incomplete", "RegEval", "ShpEval", "Time (s)");
+  os << Line << std::endl;
+  for (int i = 0; i < this->NumberOfLevels; i++) {
+    EMLocalMetrics_Level *Level = &this->Levels[i];
+    sprintf(Line, "%-12.12s %10lld %6d %6d %14.0f %14d %8d %8d %10.3f", Level->LevelName, (long long) Level->ROIVoxelCount, Level->EMIterations, Level->MFSweeps, 
+            (Level->EStepTime > 0.0 ? Level->VoxelClassEvaluations/Level->EStepTime : 0.0), Level->IncompleteModelVoxelCount, 
+            Level->RegistrationCostEvaluations, Level->ShapeCostEvaluations, Level->Time);
+    os << Line << std::endl;
+    if (Level->StreamedWeightsPeakResidentBytes) 
+      os << "  Streamed weights in memory after registration/shape: peak " << Level->StreamedWeightsPeakResidentBytes << " bytes" << std::endl;
+  }
+  for (int i = 0; i < EMLOCALMETRICS_NUMBER_OF_SUBSYSTEMS; i++) 
+    os << "Memory " << EMLocalMetrics::GetSubsystemName(i) << ": peak " << this->PeakMemory[i] << " bytes" << std::endl;
+  os << "Memory total: peak " << this->TotalPeakMemory << " bytes" << std::endl;
+  os << "====================================================" << std::endl;
+}
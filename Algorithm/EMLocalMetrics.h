@@ -0,0 +1,131 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+// Counters collected during a segmentation run
+//
+// For each segmented level of the hierarchy the number of voxels in the region of interest, 
+// EM iterations, MF sweeps, voxel-class evaluations of the E-Step (and the time spent in the E-Step), 
+// Powell cost evaluations of registration and shape and the voxels not captured by the model are recorded. 
+// Memory is accounted per subsystem (current and peak bytes). 
+// The counters can be queried after the run or written as JSON for batch processing.
+
+#ifndef _EMLOCALMETRICS_H_INCLUDED
+#define _EMLOCALMETRICS_H_INCLUDED 1
+
+#include "vtkEMSegment.h"
+#include "vtkType.h"
+#include <iostream>
+
+#define EMLOCALMETRICS_MAX_LEVELNAME 64
+
+// Memory subsystems
+#define EMLOCALMETRICS_WEIGHTS    0
+#define EMLOCALMETRICS_INTENSITY  1
+#define EMLOCALMETRICS_BIAS       2
+#define EMLOCALMETRICS_LABELMAP   3
+#define EMLOCALMETRICS_NUMBER_OF_SUBSYSTEMS 4
+
+typedef struct {
+  char      LevelName[EMLOCALMETRICS_MAX_LEVELNAME];
+  int       NumberOfClasses;
+  vtkIdType ROIVoxelCount;
+  int       EMIterations;
+  int       MFSweeps;
+  int       EStepCount;
+  // Number of ROI voxels times number of classes summed over all E-Steps 
+  double    VoxelClassEvaluations;
+  double    EStepTime;
+  int       RegistrationCostEvaluations;
+  int       ShapeCostEvaluations;
+  // Result of the last E-Step
+  int       IncompleteModelVoxelCount;
+  // Restored from a checkpoint instead of segmented 
+  int       RestoredFlag;
+  // Slab streaming: largest part of the weights found in memory after the passes that are not streamed 
+  // (registration and shape cost functions) 
+  vtkIdType StreamedWeightsPeakResidentBytes;
+  double    Time;
+} EMLocalMetrics_Level;
+
+class VTK_EMSEGMENT_EXPORT EMLocalMetrics {
+public:
+  EMLocalMetrics();
+  ~EMLocalMetrics();
+
+  // Description:
+  // Removes all levels and resets the memory counters 
+  void Reset();
+
+  // Description:
+  // Adds a record for LevelName - it stays the current level until EndLevel is called 
+  EMLocalMetrics_Level* BeginLevel(const char* LevelName);
+  void EndLevel();
+  // NULL outside of BeginLevel/EndLevel 
+  EMLocalMetrics_Level* GetCurrentLevel() {return (this->CurrentLevel > -1 ? &this->Levels[this->CurrentLevel] : NULL);}
+
+  int GetNumberOfLevels() {return this->NumberOfLevels;}
+  EMLocalMetrics_Level* GetLevel(int Index) {return ((Index > -1) && (Index < this->NumberOfLevels) ? &this->Levels[Index] : NULL);}
+
+  // Description:
+  // Sum over all levels 
+  int    GetTotalEMIterations();
+  int    GetTotalMFSweeps();
+  int    GetTotalRegistrationCostEvaluations();
+  int    GetTotalShapeCostEvaluations();
+  double GetTotalVoxelClassEvaluations();
+  double GetTotalEStepTime();
+  double GetVoxelClassEvaluationsPerSecond();
+
+  // Description:
+  // Memory accounting per subsystem - not thread safe, all allocations happen in the main thread
+  void AddMemory(int Subsystem, vtkIdType Bytes);
+  void RemoveMemory(int Subsystem, vtkIdType Bytes);
+  vtkIdType GetCurrentMemory(int Subsystem) {return this->CurrentMemory[Subsystem];}
+  vtkIdType GetPeakMemory(int Subsystem) {return this->PeakMemory[Subsystem];}
+  vtkIdType GetCurrentMemory() {return this->TotalCurrentMemory;}
+  vtkIdType GetPeakMemory() {return this->TotalPeakMemory;}
+  static const char* GetSubsystemName(int Subsystem);
+
+  // Description:
+  // Returns 0 if the file cannot be written
+  int WriteJSON(const char* FileName);
+  void Print(std::ostream& os);
+
+protected:
+  EMLocalMetrics_Level *Levels;
+  int NumberOfLevels;
+  int LevelArraySize;
+  int CurrentLevel;
+  double LevelStartTime;
+
+  vtkIdType CurrentMemory[EMLOCALMETRICS_NUMBER_OF_SUBSYSTEMS];
+  vtkIdType PeakMemory[EMLOCALMETRICS_NUMBER_OF_SUBSYSTEMS];
+  vtkIdType TotalCurrentMemory;
+  vtkIdType TotalPeakMemory;
+
+private:
+  EMLocalMetrics(const EMLocalMetrics&);
+  void operator=(const EMLocalMetrics&);
+};
+
+#endif
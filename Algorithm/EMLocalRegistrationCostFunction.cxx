@@ -128,6 +128,9 @@ void EMLocalRegistrationCostFunction::InitializeParameters() {
 
   this->ParaDepVar->Boundary_OffsetY = -1;
   this->ParaDepVar->Boundary_OffsetZ = -1;
+
+  this->ParaDepVar->BlockResult    = NULL;
+  this->ParaDepVar->NumberOfBlocks = 0;
  
 }
 
@@ -142,6 +145,7 @@ EMLocalRegistrationCostFunction::~EMLocalRegistrationCostFunction() {
     this->ClassInvCovariance_Delete(); 
     this->SpatialCostFunctionOff();
     this->MultiThreadDelete();
+    if (this->ParaDepVar->BlockResult) delete[] this->ParaDepVar->BlockResult;
     delete this->ParaDepVar; 
 }
 
@@ -243,9 +247,13 @@ void EMLocalRegistrationCostFunction::DefineRegistrationParametersForThreadedCos
   int ROI_LengthXY          = ROI_LengthX * ROI_LengthY;
   int ROI_LengthXYZ         = ROI_LengthXY * ROI_LengthZ;
 
-  // Job size with respect to ROI of registration 
-  int ROI_JobSize           = ROI_LengthXYZ/this->NumberOfThreads;
-  vtkNotUsed(int ROI_JobSizeXY         = ROI_JobSize % ROI_LengthXY;);
+  // Jobs start at block boundaries so that the block sums do not depend on the number of threads 
+  int NumberOfBlocks = EMLocalInterface_GetNumberOfReductionBlocks(ROI_LengthXYZ);
+  if (NumberOfBlocks != this->ParaDepVar->NumberOfBlocks) {
+    if (this->ParaDepVar->BlockResult) delete[] this->ParaDepVar->BlockResult;
+    this->ParaDepVar->BlockResult    = new double[NumberOfBlocks];
+    this->ParaDepVar->NumberOfBlocks = NumberOfBlocks;
+  }
 
   // std::cerr << " nlun " <<  " " << ROI_MinX << " " << ROI_MinY << " " << ROI_MinZ << " " << ROI_MaxX << " " << ROI_MaxY << " " << ROI_MaxZ  << endl;
 
@@ -269,7 +277,7 @@ void EMLocalRegistrationCostFunction::DefineRegistrationParametersForThreadedCos
 
   // --------------------------------------------------
   // Thread Specific Paramaters
-  int ROI_VoxelThreadStart = 0;
+  int ROI_VoxelThreadStart;
   int ROI_VoxelThreadStartZ;
   int ROI_VoxelThreadStartY;
   int ROI_VoxelThreadStartX;
@@ -279,8 +287,8 @@ void EMLocalRegistrationCostFunction::DefineRegistrationParametersForThreadedCos
   int Image_VoxelStartXY;
 
   for (int i = 0 ; i < this->NumberOfThreads; i++) {                                    
-    if (i < this->NumberOfThreads-1) this->MultiThreadedParameters[i].ROI_NumVoxels = ROI_JobSize;
-    else { this->MultiThreadedParameters[i].ROI_NumVoxels = ROI_JobSize + (ROI_LengthXYZ - ROI_JobSize * this->NumberOfThreads);}
+    EMLocalInterface_DefineBlockAlignedJob(ROI_LengthXYZ, this->NumberOfThreads, i, ROI_VoxelThreadStart, this->MultiThreadedParameters[i].ROI_NumVoxels);
+    this->MultiThreadedParameters[i].BlockResult = this->ParaDepVar->BlockResult + ROI_VoxelThreadStart / EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE;
 
     // Transform from ROI Corrdinates into Real and Boundary coordinates 
     ROI_VoxelThreadStartXY = ROI_VoxelThreadStart % ROI_LengthXY;
@@ -297,8 +305,6 @@ void EMLocalRegistrationCostFunction::DefineRegistrationParametersForThreadedCos
 
     this->MultiThreadedParameters[i].Boundary_VoxelOffset = Boundary_VoxelOffset + ROI_VoxelThreadStartZ * Boundary_LengthXY + ROI_VoxelThreadStartY * Boundary_LengthX + ROI_VoxelThreadStartX;
     
-    ROI_VoxelThreadStart += ROI_JobSize;
-    
     //RegistrationParameters.MultiThreadedParameters[i].DebugMin[0] =  ROI_MaxX;
     //RegistrationParameters.MultiThreadedParameters[i].DebugMin[1] =  ROI_MaxY;
     //RegistrationParameters.MultiThreadedParameters[i].DebugMin[2] =  ROI_MaxZ;
@@ -347,17 +353,16 @@ VTK_THREAD_RETURN_TYPE EMLocalRegistrationCostFunction_CostFunction_Sum_WeightxP
   assert(CurrentThread < self->GetNumberOfThreads()); 
 
   EMLocalRegistrationCostFunction_MultiThreadedParameters* ThreadedParameters = &(self->GetMultiThreadedParameters()[CurrentThread]);
-  ThreadedParameters->Result = 0.0;
-  self->CostFunction_Sum_WeightxProbability(ThreadedParameters->Real_VoxelStart, ThreadedParameters->Boundary_VoxelOffset, ThreadedParameters->ROI_NumVoxels, ThreadedParameters->Result);
+  self->CostFunction_Sum_WeightxProbability(ThreadedParameters->Real_VoxelStart, ThreadedParameters->Boundary_VoxelOffset, ThreadedParameters->ROI_NumVoxels, ThreadedParameters->BlockResult);
   return VTK_THREAD_RETURN_VALUE;
 }
 
 
 // Define parameters for threaded cost function 
-void EMLocalRegistrationCostFunction::MultiThreadDefine(int DisableFlag) {
+void EMLocalRegistrationCostFunction::MultiThreadDefine(int initNumberOfThreads) {
   this->MultiThreadDelete();
   
-  this->NumberOfThreads = EMLocalInterface_GetDefaultNumberOfThreads(DisableFlag); 
+  this->NumberOfThreads = (initNumberOfThreads > 0 ? initNumberOfThreads : 1); 
  
   //std::cerr << "Registration Debug NumverOf Treads " << NumberOfThreads << endl;
   this->MultiThreadedParameters = new EMLocalRegistrationCostFunction_MultiThreadedParameters[this->NumberOfThreads];
@@ -383,7 +388,7 @@ void EMLocalRegistrationCostFunction::ScaleRotationValues(double *FinalParameter
 // Cost functions for Registration methods 
 //------------------------------------------------------
 
-inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability(int Real_VoxelStart[3], int Boundary_VoxelOffset, int ROI_NumVoxels, double &result) {
+inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability(int Real_VoxelStart[3], int Boundary_VoxelOffset, int ROI_NumVoxels, double *BlockResult) {
   // Assign ProbDataPtr before starting this function
   assert(this->ProbDataPtr); 
 
@@ -427,10 +432,9 @@ inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability
   // -----------------------------------------------------------
   // Initialization of parameters 
 
-  result = 0.0;
-
-  double RowResult   = 0.0;
-  double SliceResult = 0.0;
+  // The job starts at a block boundary (see DefineRegistrationParametersForThreadedCostFunction)
+  double BlockSum  = 0.0;
+  int BlockVoxel   = 0;
 
   double RegistrationEpsilon    = 0.05;
   double LogRegistrationEpsilon = log(RegistrationEpsilon);
@@ -556,7 +560,7 @@ inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability
       VoxelResult = SumOverWeightsAndAlignedProbData - log(SumOverAlignedProbData);
       // Ignore otherwise bc it is just numerical errors 
       if (VoxelResult < -0.0001) {
-        RowResult += VoxelResult;
+        BlockSum += VoxelResult;
         if (SpatialCostFunctionPtr) *SpatialCostFunctionPtr =  -VoxelResult; 
         // if (x == 201 && y == 118 & z == 3) std::cerr << z << " " <<  y << " " << x << " " << SumOverWeightsAndAlignedProbData << " - " << log(SumOverAlignedProbData) << " " << SumOverAlignedProbData << " " << VoxelResult << " ===== " << targetX <<  " " << targetY << " " << targetZ << endl; 
         // It is negative bc we look at minus values later to find minimum even though we really search of positive maximimum
@@ -576,6 +580,12 @@ inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability
     if (ROI_Weight_MAP) ROI_Weight_MAP ++;
     x++;
 
+    if (++BlockVoxel == EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE) {
+      *BlockResult++ = BlockSum;
+      BlockSum   = 0.0;
+      BlockVoxel = 0;
+    }
+
     // Sanity Check - if this assert is triggered than we went over the boundary
     assert(z <= this->ParaDepVar->ROI_MaxZ);
 
@@ -585,9 +595,6 @@ inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability
       if (SpatialCostFunctionPtr) SpatialCostFunctionPtr += this->ParaDepVar->Boundary_OffsetY;
       if (ROI_Weight_MAP) ROI_Weight_MAP += this->ParaDepVar->Boundary_OffsetY;
       for (int i = 0; i < NumTotalTypeCLASS; i++) WeightsCopy[i] += this->ParaDepVar->Boundary_OffsetY;
-      
-      SliceResult += RowResult;
-      RowResult = 0.0;
 
       
       //if (Debug_FlagY) {
@@ -603,8 +610,6 @@ inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability
     if (SpatialCostFunctionPtr) SpatialCostFunctionPtr += this->ParaDepVar->Boundary_OffsetZ;
     if (ROI_Weight_MAP) ROI_Weight_MAP += this->ParaDepVar->Boundary_OffsetZ;
     for (int i = 0; i < NumTotalTypeCLASS; i++) WeightsCopy[i] += this->ParaDepVar->Boundary_OffsetZ;
-        result += SliceResult;
-    SliceResult = 0.0;
 
     //if (Debug_FlagZ) {
     //  if (DebugMin[2] > z)  DebugMin[2] = z;
@@ -617,7 +622,7 @@ inline void EMLocalRegistrationCostFunction::CostFunction_Sum_WeightxProbability
     }  
   } // End of voxel
 
-  result += SliceResult + RowResult;
+  if (BlockVoxel) *BlockResult = BlockSum;
 
   // std::cerr << "ggggggggggggr " << x << " " << y << " " << z << endl;
   // -----------------------------------------------------------
@@ -790,8 +795,7 @@ float EMLocalRegistrationCostFunction::ComputeCostFunction(const double* paramet
   // Call Thread to start cost function
   // std::cerr << "We start now " << endl;
   this->Threader->SingleMethodExecute();
-  double result = 0.0; 
-  for (int i = 0; i < this->NumberOfThreads; i++) result += this->MultiThreadedParameters[i].Result;
+  double result = EMLocalInterface_PairwiseSum(this->ParaDepVar->BlockResult, this->ParaDepVar->NumberOfBlocks);
 
 
   // -----------------------------------------------------------
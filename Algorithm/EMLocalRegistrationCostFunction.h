@@ -47,7 +47,8 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 // Threader Structure
 // --------------------------------------
 typedef struct {
-  double Result;
+  // Sums of the blocks of the job (see EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE) 
+  double *BlockResult;
   int Real_VoxelStart[3];
   int Boundary_VoxelOffset;
   // Job specifc number of Voxels in Image Space (not considering boundaries); 
@@ -83,6 +84,10 @@ typedef struct {
   double MinWeightAtlasCost;
   // MinGaussianCost = G(parameters,ClassInvCovariance)
   double MinGaussianCost;
+
+  // Block sums of the cost function - added up in a fixed order independent of the number of threads
+  double *BlockResult;
+  int     NumberOfBlocks;
 } EMLocalRegistrationCostFunction_IterationSpecificVariables;
 
 
@@ -122,7 +127,7 @@ public:
   void  FinalizeCostFunction(double* Parameters, int NumOfFunctionEvaluations); 
   
   // Is called from threaded function
-  void CostFunction_Sum_WeightxProbability(int Real_VoxelStart[3], int Boundary_VoxelOffset, int ROI_NumVoxels, double &result);
+  void CostFunction_Sum_WeightxProbability(int Real_VoxelStart[3], int Boundary_VoxelOffset, int ROI_NumVoxels, double *BlockResult);
 
   // -----------------------------------------
   // Setting Parameters 
@@ -212,7 +217,7 @@ public:
   void SetBoundary_ROIVector(unsigned char * init) {this->Boundary_ROIVector = init;}
 
   void MultiThreadDelete();
-  void MultiThreadDefine(int DisableFlag); 
+  void MultiThreadDefine(int initNumberOfThreads); 
 
   // -----------------------------
   // Do you want to Keep the result for each voxel 
@@ -28,7 +28,7 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 /* Foreward Defintion */
      template  <class Tin> 
 inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunction *Shape, Tin **ProbDataPtrOrig, int *VoxelStart, int NumberOfVoxels, 
-                                                           int DataJump, int *PCAMeanShapeJump, int **PCAEigenVectorsJump, int *ProbDataJump, float &result);
+                                                           int DataJump, int *PCAMeanShapeJump, int **PCAEigenVectorsJump, int *ProbDataJump, double *BlockResult);
 
 //----------------------------------------------------------------------------------
 // Utility functions
@@ -49,12 +49,11 @@ VTK_THREAD_RETURN_TYPE EMLocalShapeCostFunction_ShapeCostFunctionMultiThreaded_F
   assert(CurrentThread < shape->GetNumOfThreads()); 
   EMLocalShapeCostFunction_MultiThreadedParameters* ThreadedParameters = &(shape->GetMultiThreadedParameters()[CurrentThread]);
   
-  ThreadedParameters->Result = 0.0;
   switch (shape->GetProbDataType())
     {                  
     vtkTemplateMacro(EMLocalShapeCostFunction_CalculateCostFunction(shape, (VTK_TT**) shape->GetProbDataPtr(), ThreadedParameters->VoxelStart, 
                                                                     ThreadedParameters->NumberOfVoxels, ThreadedParameters->DataJump, ThreadedParameters->PCAMeanShapeJump, ThreadedParameters->PCAEigenVectorsJump, 
-                                                                    ThreadedParameters->ProbDataJump, ThreadedParameters->Result)); 
+                                                                    ThreadedParameters->ProbDataJump, ThreadedParameters->BlockResult)); 
     default :
       std::cerr << "Warning: EMLocalShapeCostFunction_ShapeCostFunctionMultiThreaded_Function : unknown data type " << shape->GetProbDataType() << endl;
     }
@@ -69,7 +68,7 @@ VTK_THREAD_RETURN_TYPE EMLocalShapeCostFunction_ShapeCostFunctionMultiThreaded_F
 // Calculat the value of the cost function in dependency of the parameter Shape
 template  <class Tin> 
 inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunction *Shape, Tin **ProbDataPtrOrig, int *VoxelStart, int NumberOfVoxels, 
-                                                           int DataJump, int *PCAMeanShapeJump, int **PCAEigenVectorsJump, int *ProbDataJump, float &result)
+                                                           int DataJump, int *PCAMeanShapeJump, int **PCAEigenVectorsJump, int *ProbDataJump, double *BlockResult)
 {
 
   // std::cerr << "Start vtkImageEMLocalSegmenter_CalculateCostFunction " << endl;
@@ -185,11 +184,10 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
   double SumVoxelDenominator;
   double SumVoxelNumerator; 
 
-  // To reduce Compuational errors ! 
+  // To reduce Compuational errors the penalty is summed up in blocks - the job starts at a block boundary 
   double SumVoxelPenality;
-  double SumRowPenalty = 0.0;
-  double SumSlicePenalty = 0.0;
-  double SumImagePenalty = 0.0;
+  double SumBlockPenalty = 0.0;
+  int    BlockVoxel      = 0;
 
 
   // The Cost function we calculate here is 
@@ -287,7 +285,7 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
         // If smaller than they are just numerical errors => do not consider it 
         if (fabs(SumVoxelPenality) > 0.0001)
           {
-          SumRowPenalty += SumVoxelPenality;
+          SumBlockPenalty += SumVoxelPenality;
           if (SpatialCostFunction)  *SpatialCostFunction  = -SumVoxelPenality;
           // if (SpatialCostFunction)  *SpatialCostFunction  = -SumVoxelPenality + 1.0;
           }
@@ -295,9 +293,15 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
       } // end of if (*ROI) .. 
     // Go to next x value 
     // Debug  
-    // *SpatialCostFunction  = SumRowPenalty; 
+    // *SpatialCostFunction  = SumBlockPenalty; 
 
     VoxelIndex ++;
+    if (++BlockVoxel == EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE)
+      {
+      *BlockResult++  = SumBlockPenalty;
+      SumBlockPenalty = 0.0;
+      BlockVoxel      = 0;
+      }
     x ++;
     ROI++;
     if (SpatialCostFunction) SpatialCostFunction ++;
@@ -336,8 +340,6 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
           } 
         }
       for (int i = 0; i < NumberOfTotalTypeCLASS; i++) weights[i] += weightsIncY;
-      SumSlicePenalty += SumRowPenalty;
-      SumRowPenalty = 0.0;
 
       if (y > ROI_MaxY)
         {
@@ -358,13 +360,10 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
             }
           }
         for (int i = 0; i < NumberOfTotalTypeCLASS; i++) weights[i] += weightsIncZ;
-        // To reduce computational errors 
-        SumImagePenalty  += SumSlicePenalty;
-        SumSlicePenalty = 0.0;
         }
       }
     }
-  SumImagePenalty += SumSlicePenalty + SumRowPenalty; 
+  if (BlockVoxel) *BlockResult = SumBlockPenalty;
 
   // std::cerr <<"============================== finished "<< endl;
   // --------------------------------------
@@ -377,8 +376,6 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
   delete[] PCAEigenVectorsPtr;
   delete[] ProbDataPtr;
   delete[] weights;  
-  // Because we look for the maximum and powel defines the minimum
-  result = float(-1.0 * SumImagePenalty);
 }
 
 
@@ -386,7 +383,7 @@ inline void EMLocalShapeCostFunction_CalculateCostFunction(EMLocalShapeCostFunct
 // Class functions
 //----------------------------------------------------------------------------------
 
-EMLocalShapeCostFunction::EMLocalShapeCostFunction(EMLocal_Hierarchical_Class_Parameters* initEMHierarchyParameters, int  *initPCANumberOfEigenModes, int DisableMultiThreading)
+EMLocalShapeCostFunction::EMLocalShapeCostFunction(EMLocal_Hierarchical_Class_Parameters* initEMHierarchyParameters, int  *initPCANumberOfEigenModes, int initNumberOfThreads)
 {
   this->EMHierarchyParameters  = initEMHierarchyParameters;
   this->NumberOfTotalTypeCLASS = initEMHierarchyParameters->NumTotalTypeCLASS;
@@ -410,16 +407,20 @@ EMLocalShapeCostFunction::EMLocalShapeCostFunction(EMLocal_Hierarchical_Class_Pa
   this->PCANumberOfEigenModes = initPCANumberOfEigenModes;
 
   // Initialize Multi Threading
-  this->NumOfThreads = EMLocalInterface_GetDefaultNumberOfThreads(DisableMultiThreading);
+  this->NumOfThreads = (initNumberOfThreads > 0 ? initNumberOfThreads : 1);
   //std::cerr << "====================================== Debug "<< this->NumOfThreads << endl;
 
   this->Threader = vtkMultiThreader::New();
   this->Threader->SetNumberOfThreads(this->NumOfThreads);
   this->Threader->SetSingleMethod(EMLocalShapeCostFunction_ShapeCostFunctionMultiThreaded_Function, ((void*) this));
 
+  this->BlockResult    = NULL;
+  this->NumberOfBlocks = 0;
+
   this->MultiThreadedParameters = new EMLocalShapeCostFunction_MultiThreadedParameters[this->NumOfThreads];
   for (int i=0; i < this->NumOfThreads; i++)
     {
+    this->MultiThreadedParameters[i].BlockResult = NULL;
     this->MultiThreadedParameters[i].ProbDataJump       = new int[NumTotalTypeCLASS];
     this->MultiThreadedParameters[i].PCAMeanShapeJump   = new int[NumTotalTypeCLASS];
     this->MultiThreadedParameters[i].PCAEigenVectorsJump = new int*[NumTotalTypeCLASS]; 
@@ -530,6 +531,10 @@ EMLocalShapeCostFunction::~EMLocalShapeCostFunction()  {
     this->MultiThreadedParameters =NULL;
     }
 
+  if (this->BlockResult) delete[] this->BlockResult;
+  this->BlockResult    = NULL;
+  this->NumberOfBlocks = 0;
+
   if (this->weights)
     {
     delete[] this->weights; 
@@ -658,11 +663,8 @@ float EMLocalShapeCostFunction::ComputeCostFunction(const double *initPCAPara) c
   // Start Execution
   this->Threader->SingleMethodExecute();
 
-  float result = 0.0;  
-  for (int i = 0; i < this->NumOfThreads; i++)
-    {
-    result += this->MultiThreadedParameters[i].Result;
-    }
+  // Because we look for the maximum and powel defines the minimum
+  float result = float(-1.0 * EMLocalInterface_PairwiseSum(this->BlockResult, this->NumberOfBlocks));
   // --------------------------------------
   // Calculate Gaussian Term
   // --------------------------------------
@@ -814,22 +816,27 @@ void EMLocalShapeCostFunction::InitializeCostFunction(int PCAMaxX, int PCAMinX,
   EMLocalShapeCostFunction_MultiThreadedParameters *aMultiThreadedParameters = this->MultiThreadedParameters;  
   int ROI_LengthXY       = this->ROI_LengthX * this->ROI_LengthY;
   int ROI_LengthXYZ      = ROI_LengthXY * this->ROI_LengthZ;
-  int JobSize     = ROI_LengthXYZ/this->NumOfThreads;
-  // std::cerr << "Jobsize " << JobSize << " " << ROI_LengthXYZ << endl;
-  int VoxelOffset = 0;
+  // Jobs start at block boundaries so that the block sums do not depend on the number of threads 
+  int NumberOfBlocks = EMLocalInterface_GetNumberOfReductionBlocks(ROI_LengthXYZ);
+  if (NumberOfBlocks != this->NumberOfBlocks)
+    {
+    if (this->BlockResult) delete[] this->BlockResult;
+    this->BlockResult    = new double[NumberOfBlocks];
+    this->NumberOfBlocks = NumberOfBlocks;
+    }
+  int VoxelOffset;
   int VoxelLeftOver;
   for (int i= 0; i < this->NumOfThreads; i++)
     {
     // std::cerr << "Thread " << i <<  endl;
     int *VoxelStart = aMultiThreadedParameters[i].VoxelStart;
+    EMLocalInterface_DefineBlockAlignedJob(ROI_LengthXYZ, this->NumOfThreads, i, VoxelOffset, aMultiThreadedParameters[i].NumberOfVoxels);
+    aMultiThreadedParameters[i].BlockResult = this->BlockResult + VoxelOffset / EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE;
     VoxelStart[2] = VoxelOffset/ROI_LengthXY;
     VoxelLeftOver = VoxelOffset % ROI_LengthXY;
     VoxelStart[1] = VoxelLeftOver / this->ROI_LengthX;
     VoxelStart[0] = VoxelLeftOver % this->ROI_LengthX;
  
-    if (i < this->NumOfThreads -1) aMultiThreadedParameters[i].NumberOfVoxels = JobSize;
-    else aMultiThreadedParameters[i].NumberOfVoxels = JobSize +  ROI_LengthXYZ%this->NumOfThreads;
- 
     aMultiThreadedParameters[i].DataJump = EMLocalInterface_DefineMultiThreadJump(VoxelStart,this->ROI_LengthX, this->ROI_LengthY, this->DataIncY, this->DataIncZ);
     // std::cerr << "DataJump " <<  aMultiThreadedParameters[i].DataJump << endl;
     // std::cerr << "Jump " << aMultiThreadedParameters[i].DataJump <<  " " << ROI_LengthX << " " <<  ROI_LengthY << " " <<  this->DataIncY << " " << this->DataIncZ << " " << VoxelOffset << endl; 
@@ -879,8 +886,6 @@ void EMLocalShapeCostFunction::InitializeCostFunction(int PCAMaxX, int PCAMinX,
     VoxelStart[2] += this->ROI_MinZ;
     VoxelStart[1] += this->ROI_MinY;
     VoxelStart[0] += this->ROI_MinX;
-
-    VoxelOffset += JobSize;
     }
 }
 
@@ -31,7 +31,8 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 
 //BTX
 typedef struct {
-  float Result;
+  // Sums of the blocks of the job (see EMLOCALSEGMENTER_REDUCTION_BLOCK_SIZE) 
+  double *BlockResult;
   int VoxelStart[3];
   int DataJump;
   int *PCAMeanShapeJump;
@@ -69,7 +70,7 @@ public:
 
 
   // Initialize values
-  EMLocalShapeCostFunction(EMLocal_Hierarchical_Class_Parameters* initEMHierarchyParameters, int  *initPCANumberOfEigenModes, int DisableMultiThreading);
+  EMLocalShapeCostFunction(EMLocal_Hierarchical_Class_Parameters* initEMHierarchyParameters, int  *initPCANumberOfEigenModes, int initNumberOfThreads);
   ~EMLocalShapeCostFunction();
 
   // ------------------------
@@ -190,6 +191,10 @@ private:
   int NumOfThreads;
   vtkMultiThreader *Threader; 
 
+  // Block sums of the cost function - added up in a fixed order independent of the number of threads
+  double *BlockResult;
+  int NumberOfBlocks;
+
   int ROI_MaxZ;
   int ROI_MaxY; 
   int ROI_MaxX; 
@@ -0,0 +1,234 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+#include "EMLocalTrace.h"
+#include "vtkTimerLog.h"
+#include "vtkMutexLock.h"
+#include "vtkType.h"
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+static EMLocalTrace* EMLocalTrace_Active = NULL;
+
+void EMLocalTrace::SetActive(EMLocalTrace* Trace) {
+  EMLocalTrace_Active = Trace;
+}
+
+EMLocalTrace* EMLocalTrace::GetActive() {
+  return EMLocalTrace_Active;
+}
+
+EMLocalTrace::EMLocalTrace() {
+  this->Events         = NULL;
+  this->NumberOfEvents = 0;
+  this->EventArraySize = 0;
+  this->StartTime      = vtkTimerLog::GetUniversalTime();
+  this->Lock           = vtkMutexLock::New();
+}
+
+EMLocalTrace::~EMLocalTrace() {
+  if (EMLocalTrace_Active == this) EMLocalTrace_Active = NULL;
+  delete[] this->Events;
+  this->Lock->Delete();
+}
+
+void EMLocalTrace::Start() {
+  this->Lock->Lock();
+  this->NumberOfEvents = 0;
+  this->StartTime      = vtkTimerLog::GetUniversalTime();
+  this->Lock->Unlock();
+}
+
+double EMLocalTrace::GetTime() {
+  return vtkTimerLog::GetUniversalTime() - this->StartTime;
+}
+
+void EMLocalTrace::AddEvent(const char* Name, const char* Category, int Thread, double StartTime, double Duration) {
+  this->Lock->Lock();
+  if (this->NumberOfEvents == this->EventArraySize) {
+    int NewSize = (this->EventArraySize ? 2*this->EventArraySize : 1024);
+    EMLocalTrace_Event *NewEvents = new EMLocalTrace_Event[NewSize];
+    if (this->NumberOfEvents) memcpy(NewEvents, this->Events, sizeof(EMLocalTrace_Event)*this->NumberOfEvents);
+    delete[] this->Events;
+    this->Events         = NewEvents;
+    this->EventArraySize = NewSize;
+  }
+  EMLocalTrace_Event *Event = &this->Events[this->NumberOfEvents++];
+  strncpy(Event->Name, Name, EMLOCALTRACE_MAX_NAME - 1);
+  Event->Name[EMLOCALTRACE_MAX_NAME - 1] = '\0';
+  Event->Category = Category;
+  Event->Thread   = Thread;
+  Event->Start    = StartTime;
+  Event->Duration = Duration;
+  this->Lock->Unlock();
+}
+
+double EMLocalTrace::GetTotalTime(const char* Name, int* Count) {
+  double Total = 0.0;
+  int    NumberOfMatches = 0;
+  this->Lock->Lock();
+  for (int i = 0; i < this->NumberOfEvents; i++) {
+    if (strcmp(this->Events[i].Name, Name)) continue;
+    Total += this->Events[i].Duration;
+    NumberOfMatches ++;
+  }
+  this->Lock->Unlock();
+  if (Count) *Count = NumberOfMatches;
+  return Total;
+}
+
+double EMLocalTrace::GetExclusiveTime(const char* Name, int* Count) {
+  // The events of a thread are added when their scope ends, so the events nested in an event are added 
+  // before it. For each thread the stack holds the events that are not yet known to be nested in another one 
+  std::map<int, std::vector<EMLocalTrace_Event*> > Stacks;
+  double Total = 0.0;
+  int    NumberOfMatches = 0;
+  this->Lock->Lock();
+  for (int i = 0; i < this->NumberOfEvents; i++) {
+    EMLocalTrace_Event* Event = &this->Events[i];
+    std::vector<EMLocalTrace_Event*> &Stack = Stacks[Event->Thread];
+    double NestedTime = 0.0;
+    while (!Stack.empty() && (Stack.back()->Start >= Event->Start)) {
+      NestedTime += Stack.back()->Duration;
+      Stack.pop_back();
+    }
+    Stack.push_back(Event);
+    if (strcmp(Event->Name, Name)) continue;
+    Total += Event->Duration - NestedTime;
+    NumberOfMatches ++;
+  }
+  this->Lock->Unlock();
+  if (Count) *Count = NumberOfMatches;
+  return Total;
+}
+
+// Names only contain printable characters - quotes and backslashes have to be escaped 
+static void EMLocalTrace_WriteString(FILE* File, const char* Str) {
+  fputc('"', File);
+  for (; *Str; Str++) {
+    if ((*Str == '"') || (*Str == '\\')) fputc('\\', File);
+    fputc(*Str, File);
+  }
+  fputc('"', File);
+}
+
+int EMLocalTrace::WriteChromeTrace(const char* FileName) {
+  FILE* File = fopen(FileName, "w");
+  if (!File) {
+    std::cerr << "EMLocalTrace::WriteChromeTrace: Could not open " << FileName << std::endl;
+    return 0;
+  }
+
+  this->Lock->Lock();
+  fprintf(File, "{\"traceEvents\":[\n");
+
+  // Thread names 
+  int MaxThread = 0;
+  for (int i = 0; i < this->NumberOfEvents; i++) if (this->Events[i].Thread > MaxThread) MaxThread = this->Events[i].Thread;
+  for (int t = 0; t <= MaxThread; t++) {
+    if (t) fprintf(File, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"E-Step thread %d\"}},\n", t, t - 1);
+    else   fprintf(File, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}},\n");
+  }
+
+  // Complete events - times in microseconds 
+  for (int i = 0; i < this->NumberOfEvents; i++) {
+    EMLocalTrace_Event *Event = &this->Events[i];
+    fprintf(File, "{\"name\":");
+    EMLocalTrace_WriteString(File, Event->Name);
+    fprintf(File, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}%s\n", Event->Category, 1e6*Event->Start, 1e6*Event->Duration, 
+            Event->Thread, (i + 1 < this->NumberOfEvents ? "," : ""));
+  }
+  fprintf(File, "],\"displayTimeUnit\":\"ms\"}\n");
+  this->Lock->Unlock();
+
+  int Success = !ferror(File);
+  if (fclose(File)) Success = 0;
+  if (!Success) std::cerr << "EMLocalTrace::WriteChromeTrace: Could not write " << FileName << std::endl;
+  return Success;
+}
+
+typedef struct {
+  const char *Name;
+  int    Count;
+  int    NumberOfThreads;
+  double Total;
+  double Max;
+  vtkTypeUInt64 ThreadMask;
+} EMLocalTrace_Summary;
+
+void EMLocalTrace::PrintSummary(std::ostream& os) {
+  this->Lock->Lock();
+
+  // Aggregate events by name - first event of each name defines the entry 
+  EMLocalTrace_Summary *Summary = new EMLocalTrace_Summary[this->NumberOfEvents + 1];
+  int NumberOfEntries = 0;
+  for (int i = 0; i < this->NumberOfEvents; i++) {
+    EMLocalTrace_Event *Event = &this->Events[i];
+    int j = 0;
+    while ((j < NumberOfEntries) && strcmp(Summary[j].Name, Event->Name)) j++;
+    if (j == NumberOfEntries) {
+      Summary[j].Name  = Event->Name;
+      Summary[j].Count = Summary[j].NumberOfThreads = 0;
+      Summary[j].Total = Summary[j].Max = 0.0;
+      Summary[j].ThreadMask = 0;
+      NumberOfEntries ++;
+    }
+    // Only count a thread the first time it shows up for this name (threads beyond 63 share a bit)
+    vtkTypeUInt64 ThreadBit = vtkTypeUInt64(1) << (Event->Thread < 63 ? Event->Thread : 63);
+    if (!(Summary[j].ThreadMask & ThreadBit)) {
+      Summary[j].ThreadMask |= ThreadBit;
+      Summary[j].NumberOfThreads ++;
+    }
+
+    Summary[j].Count ++;
+    Summary[j].Total += Event->Duration;
+    if (Event->Duration > Summary[j].Max) Summary[j].Max = Event->Duration;
+  }
+
+  // Sort by total time  
+  for (int i = 1; i < NumberOfEntries; i++) {
+    EMLocalTrace_Summary Entry = Summary[i];
+    int j = i;
+    while ((j > 0) && (Summary[j-1].Total < Entry.Total)) {
+      Summary[j] = Summary[j-1];
+      j--;
+    }
+    Summary[j] = Entry;
+  }
+
+  char Line[256];
+  os << "==================== EM Trace Summary ====================" << std::endl;
+  sprintf(Line, "%-32s %8s %12s %12s %12s %8s", "Name", "Count", "Total (s)", "Mean (s)", "Max (s)", "Threads");
+  os << Line << std::endl;
+  for (int i = 0; i < NumberOfEntries; i++) {
+    sprintf(Line, "%-32.32s %8d %12.4f %12.6f %12.6f %8d", Summary[i].Name, Summary[i].Count, Summary[i].Total, Summary[i].Total/double(Summary[i].Count), 
+            Summary[i].Max, Summary[i].NumberOfThreads);
+    os << Line << std::endl;
+  }
+  os << "==========================================================" << std::endl;
+
+  delete[] Summary;
+  this->Lock->Unlock();
+}
@@ -0,0 +1,131 @@
+/*=auto=========================================================================
+
+(c) Copyright 2001 Massachusetts Institute of Technology 
+
+Permission is hereby granted, without payment, to copy, modify, display 
+and distribute this software and its documentation, if any, for any purpose, 
+provided that the above copyright notice and the following three paragraphs 
+appear on all copies of this software.  Use of this software constitutes 
+acceptance of these terms and conditions.
+
+IN NO EVENT SHALL MIT BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, 
+INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT OF THE USE OF THIS SOFTWARE 
+AND ITS DOCUMENTATION, EVEN IF MIT HAS BEEN ADVISED OF THE POSSIBILITY OF 
+SUCH DAMAGE.
+
+MIT SPECIFICALLY DISCLAIMS ANY EXPRESS OR IMPLIED WARRANTIES INCLUDING, 
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR 
+A PARTICULAR PURPOSE, AND NON-INFRINGEMENT.
+
+THE SOFTWARE IS PROVIDED "AS IS."  MIT HAS NO OBLIGATION TO PROVIDE 
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+=========================================================================auto=*/
+// Timing of the individual phases of the EM algorithm 
+//
+// While a trace is active (see EMLocalTrace::SetActive) each EMLocalTraceScope records the time 
+// between its construction and destruction as an event. Events carry a category (e.g. "estep", "level") 
+// and the index of the thread that recorded them (0 = main thread, i+1 = i-th E-Step thread). 
+// The events can be written as Chrome trace-event JSON (chrome://tracing, Perfetto) and are 
+// summarized per name. If no trace is active a scope does nothing.
+
+#ifndef _EMLOCALTRACE_H_INCLUDED
+#define _EMLOCALTRACE_H_INCLUDED 1
+
+#include "vtkEMSegment.h"
+#include <iostream>
+
+#define EMLOCALTRACE_MAX_NAME 64
+
+typedef struct {
+  char   Name[EMLOCALTRACE_MAX_NAME];
+  const char *Category;
+  int    Thread;
+  // In seconds since Start
+  double Start;
+  double Duration;
+} EMLocalTrace_Event;
+
+class vtkMutexLock;
+
+class VTK_EMSEGMENT_EXPORT EMLocalTrace {
+public:
+  EMLocalTrace();
+  ~EMLocalTrace();
+
+  // Description:
+  // Removes all events and resets the time origin 
+  void Start();
+
+  // Description:
+  // Time in seconds since Start 
+  double GetTime();
+
+  // Description:
+  // Thread safe - Category has to be a string literal
+  void AddEvent(const char* Name, const char* Category, int Thread, double StartTime, double Duration);
+
+  int GetNumberOfEvents() {return this->NumberOfEvents;}
+
+  // Description:
+  // Total time of all events called Name - Count (if not NULL) is set to their number 
+  double GetTotalTime(const char* Name, int* Count = NULL);
+
+  // Description:
+  // Same as GetTotalTime but without the time of the events nested in them (recorded by the same thread 
+  // within their lifetime), e.g. the exclusive time of "MF sweep" does not include its E-Step and label map
+  double GetExclusiveTime(const char* Name, int* Count = NULL);
+
+  // Description:
+  // Chrome trace-event JSON - returns 0 if the file cannot be written 
+  int WriteChromeTrace(const char* FileName);
+
+  // Description:
+  // Table of count, total, mean and maximum time and number of threads per event name - sorted by total time
+  void PrintSummary(std::ostream& os);
+
+  // Description:
+  // The trace the scopes are recorded to - NULL disables tracing 
+  static void SetActive(EMLocalTrace* Trace);
+  static EMLocalTrace* GetActive();
+
+protected:
+  EMLocalTrace_Event *Events;
+  int NumberOfEvents;
+  int EventArraySize;
+  double StartTime;
+  vtkMutexLock *Lock;
+
+private:
+  EMLocalTrace(const EMLocalTrace&);
+  void operator=(const EMLocalTrace&);
+};
+
+// Records the lifetime of the scope in the active trace 
+class VTK_EMSEGMENT_EXPORT EMLocalTraceScope {
+public:
+  EMLocalTraceScope(const char* Name, const char* Category, int Thread = 0) {
+    this->Trace = EMLocalTrace::GetActive();
+    if (!this->Trace) return;
+    this->Name     = Name;
+    this->Category = Category;
+    this->Thread   = Thread;
+    this->Start    = this->Trace->GetTime();
+  }
+  ~EMLocalTraceScope() {
+    if (this->Trace) this->Trace->AddEvent(this->Name, this->Category, this->Thread, this->Start, this->Trace->GetTime() - this->Start);
+  }
+
+protected:
+  EMLocalTrace *Trace;
+  const char   *Name;
+  const char   *Category;
+  int          Thread;
+  double       Start;
+
+private:
+  EMLocalTraceScope(const EMLocalTraceScope&);
+  void operator=(const EMLocalTraceScope&);
+};
+
+#endif
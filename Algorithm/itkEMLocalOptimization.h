@@ -29,6 +29,7 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 #include "itkSingleValuedCostFunction.h"
 #include "EMLocalRegistrationCostFunction.h"
 #include "EMLocalShapeCostFunction.h"
+#include "EMLocalTrace.h"
 #include "itkPowellOptimizer.h"
 //BTX
 namespace itk
@@ -83,9 +84,19 @@ public:
   {
     itkDebugMacro("GetValue( " << parameters << " ) ");
     const double* para_double = parameters.data_block();
-
-    if (this->m_Registration) return this->m_Registration->ComputeCostFunction(para_double);
-    if (this->m_Shape) return this->m_Shape->ComputeCostFunction(para_double);
+    this->m_NumberOfEvaluations ++;
+
+    // Each evaluation is traced so that the summary shows the number of evaluations per optimization 
+    if (this->m_Registration) 
+      {
+      EMLocalTraceScope Trace("Registration cost evaluation", "registration");
+      return this->m_Registration->ComputeCostFunction(para_double);
+      }
+    if (this->m_Shape) 
+      {
+      EMLocalTraceScope Trace("Shape cost evaluation", "shape");
+      return this->m_Shape->ComputeCostFunction(para_double);
+      }
     itkExceptionMacro( "Neither registration nor shape cost function is set!" );
   }
 
@@ -106,11 +117,15 @@ public:
   void SetRegistrationCostFunction(EMLocalRegistrationCostFunction* init) {assert(!this->m_Shape); this->m_Registration = init;} 
   void SetShapeCostFunction(EMLocalShapeCostFunction* init) {assert(!this->m_Registration); this->m_Shape = init;} 
 
+  /** Number of calls to GetValue */
+  int GetNumberOfEvaluations() const {return this->m_NumberOfEvaluations;}
+
 protected:
-  EMLocalCostFunctionWrapper() { m_Registration = NULL; m_Shape = NULL;}; 
+  EMLocalCostFunctionWrapper() { m_Registration = NULL; m_Shape = NULL; m_NumberOfEvaluations = 0;}; 
   virtual ~EMLocalCostFunctionWrapper() { };
   EMLocalRegistrationCostFunction* m_Registration;
   EMLocalShapeCostFunction* m_Shape;
+  mutable int m_NumberOfEvaluations;
 
 private:
   EMLocalCostFunctionWrapper(const Self&); //purposely not implemented
@@ -122,7 +137,8 @@ private:
 
 /* Run optimzation */
 // Seperate from itk function bc it is only a wrapper around 
-void  itkEMLocalOptimization_Registration_Start(EMLocalRegistrationCostFunction* RegCostFunction,
+// Both functions return the number of cost function evaluations 
+int  itkEMLocalOptimization_Registration_Start(EMLocalRegistrationCostFunction* RegCostFunction,
                                                 double* Parameters,
                                                 float &vtkNotUsed(Cost))
 {
@@ -130,6 +146,7 @@ void  itkEMLocalOptimization_Registration_Start(EMLocalRegistrationCostFunction*
 
   RegCostFunction->InitializeCostFunction();
   int NumOfFunctionEvaluations;
+  int NumOfCostEvaluations;
 
   {
      // EMLocalRegistration::Pointer em = EMLocalRegistration::New();
@@ -165,20 +182,22 @@ void  itkEMLocalOptimization_Registration_Start(EMLocalRegistrationCostFunction*
        std::cerr << "An error ocurred during Optimization" << std::endl;
        std::cerr << "Location    = " << e.GetLocation()    << std::endl;
        std::cerr << "Description = " << e.GetDescription() << std::endl;
-       return;
+       return itkRegCostFunction->GetNumberOfEvaluations();
      }
 
      NumOfFunctionEvaluations = optimizer->GetCurrentIteration();
+     NumOfCostEvaluations     = itkRegCostFunction->GetNumberOfEvaluations();
 
      ParametersType finalPosition = optimizer->GetCurrentPosition();
      memcpy(Parameters,finalPosition.data_block(), sizeof(double) *  NumPara);
   }
   RegCostFunction->FinalizeCostFunction(Parameters, NumOfFunctionEvaluations);
   std::cerr << "==================== End Registration =========================== " << endl;
+  return NumOfCostEvaluations;
 }
 
 
-void  itkEMLocalOptimization_Shape_Start(EMLocalShapeCostFunction* ShapeCostFunction, float **PCAShapeParameters, int PCAMaxX, int PCAMinX, 
+int  itkEMLocalOptimization_Shape_Start(EMLocalShapeCostFunction* ShapeCostFunction, float **PCAShapeParameters, int PCAMaxX, int PCAMinX, 
                        int PCAMaxY, int PCAMinY, int PCAMaxZ, int PCAMinZ, int BoundaryMinX, int BoundaryMinY, int BoundaryMinZ, 
                        int Boundary_LengthX, int Boundary_LengthY, float** w_m, unsigned char* PCA_ROI, void  **initProbDataPtr, 
                        float** initPCAMeanShapePtr, int* initPCAMeanShapeIncY, int *initPCAMeanShapeIncZ, float*** initPCAEigenVectorsPtr, 
@@ -227,7 +246,8 @@ void  itkEMLocalOptimization_Shape_Start(EMLocalShapeCostFunction* ShapeCostFunc
       std::cerr << "An error ocurred during Optimization" << std::endl;
       std::cerr << "Location    = " << e.GetLocation()    << std::endl;
       std::cerr << "Description = " << e.GetDescription() << std::endl;
-      return;
+      delete[] PCAParameters;
+      return itkShapeCostFunction->GetNumberOfEvaluations();
     }
 
   Cost = float(optimizer->GetCurrentCost()); 
@@ -242,6 +262,7 @@ void  itkEMLocalOptimization_Shape_Start(EMLocalShapeCostFunction* ShapeCostFunc
   delete[] PCAParameters;
 
   std::cerr << "==================== End Shape Deformation =========================== " << endl;
+  return itkShapeCostFunction->GetNumberOfEvaluations();
 }
 
 
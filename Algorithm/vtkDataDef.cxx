@@ -12,6 +12,13 @@
 
 =========================================================================auto=*/
 #include "vtkDataDef.h"
+#include "vtkFileOps.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#endif
 
 // Convolution and polynomial multiplication . 
 // This is assuming u and 'this' have the same dimensio
@@ -202,6 +209,153 @@ void EMVolume::ConvZ(float *v, int vLen) {
 } 
 
 
+void EMVolume::SaveDataToFile(char *FileName) {
+  char VolumeFileName[1024];
+  sprintf(VolumeFileName,"%s.img.gz",FileName); 
+  if (!vtkFileOps::WriteCompressedFile(VolumeFileName, this->Data, sizeof(float)*size_t(this->MaxXYZ), 0))
+    {
+    std::cerr << "SaveDataToFile: failed to write " << this->MaxXYZ << " voxels to file " << VolumeFileName << std::endl;
+    }
+}
+
+void EMVolume::ReadDataFromFile(char *FileName) {
+  char VolumeFileName[1024];
+  sprintf(VolumeFileName,"%s.img.gz",FileName); 
+  FILE *File = fopen(VolumeFileName, "rb");
+  if (File == NULL)
+    {
+    /// Uncompressed files written by older versions
+    sprintf(VolumeFileName,"%s.img",FileName);
+    File = fopen(VolumeFileName, "rb");
+    if (File == NULL) 
+      {
+      std::cerr << "ReadDataFromFile: unable to open file " << FileName << ".img.gz" << std::endl;
+      return;
+      }
+    }
+  fclose(File);
+
+  if (!vtkFileOps::ReadCompressedFile(VolumeFileName, this->Data, sizeof(float)*size_t(this->MaxXYZ)))
+    {
+    std::cerr << "ReadDataFromFile: error reading " << VolumeFileName << ", expected to read " << this->MaxXYZ << " voxels" << std::endl;
+    }
+}
+
+void EMVolume::EraseDataFile(char *FileName) {
+  char VolumeFileName[1024];
+  sprintf(VolumeFileName,"%s.img.gz",FileName);
+  if (remove(VolumeFileName) != 0)
+    {
+    std::cerr << "EraseDataFile: error erasing file " << VolumeFileName << std::endl;
+    }
+}
+
+// ---------------------------------------------------------
+// EMScratchArray Definiton 
+// ---------------------------------------------------------
+float* EMScratchArray::Allocate(const char* ScratchDir, size_t initLength) {
+  this->Deallocate();
+  if (!initLength) return NULL;
+  this->Length = initLength;
+
+#ifndef _WIN32
+  const char* Dir = ScratchDir;
+  if (!Dir) Dir = getenv("TMPDIR");
+  if (!Dir) Dir = "/tmp";
+
+  char FileName[1024];
+  sprintf(FileName,"%s/EMScratchXXXXXX",Dir);
+  this->FileDescriptor = mkstemp(FileName);
+  if (this->FileDescriptor != -1) {
+    // The file is removed as soon as the descriptor is closed
+    unlink(FileName);
+    size_t NumBytes = sizeof(float)*this->Length;
+    if (ftruncate(this->FileDescriptor, off_t(NumBytes)) == 0) {
+      void* Map = mmap(NULL, NumBytes, PROT_READ | PROT_WRITE, MAP_SHARED, this->FileDescriptor, 0);
+      if (Map != MAP_FAILED) {
+        this->Data = (float*) Map;
+        this->MappedFlag = 1;
+        return this->Data;
+      }
+    }
+    close(this->FileDescriptor);
+    this->FileDescriptor = -1;
+  }
+  std::cerr << "EMScratchArray::Allocate: could not map scratch file in " << Dir << " - falling back to memory" << std::endl;
+#endif
+
+  this->Data = new float[this->Length];
+  return this->Data;
+}
+
+void EMScratchArray::Deallocate() {
+  if (this->Data) {
+#ifndef _WIN32
+    if (this->MappedFlag) munmap(this->Data,sizeof(float)*this->Length);
+    else delete[] this->Data;
+#else
+    delete[] this->Data;
+#endif
+  }
+#ifndef _WIN32
+  if (this->FileDescriptor != -1) close(this->FileDescriptor);
+#endif
+  this->Data = NULL;
+  this->Length = 0;
+  this->MappedFlag = 0;
+  this->FileDescriptor = -1;
+}
+
+void EMScratchArray::ReleaseRange(size_t Start, size_t Num) {
+#ifndef _WIN32
+  if (!this->MappedFlag || !Num || (Start >= this->Length)) return;
+  if (Start + Num > this->Length) Num = this->Length - Start;
+
+  size_t PageSize = size_t(sysconf(_SC_PAGESIZE));
+  size_t First    = sizeof(float)*Start;
+  size_t Last     = First + sizeof(float)*Num;
+  // Only release pages which are completely inside the range - the mapping itself is page aligned
+  First = ((First + PageSize - 1)/PageSize)*PageSize;
+  Last  = (Last/PageSize)*PageSize;
+  if (Last <= First) return;
+
+  char* Begin = (char*) this->Data + First;
+  // Dirty pages have to be on disk before the page cache can let go of them
+  msync(Begin, Last - First, MS_SYNC);
+  // Unmaps the pages from the process - for a shared file mapping they would stay in the page cache ...
+  madvise(Begin, Last - First, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+  // ... so they are dropped from there as well 
+  posix_fadvise(this->FileDescriptor, off_t(First), off_t(Last - First), POSIX_FADV_DONTNEED);
+#endif
+#endif
+}
+
+size_t EMScratchArray::GetResidentBytes() {
+  size_t NumBytes = sizeof(float)*this->Length;
+#ifndef _WIN32
+  if (!this->MappedFlag || !NumBytes) return NumBytes;
+
+  size_t PageSize = size_t(sysconf(_SC_PAGESIZE));
+  size_t NumPages = (NumBytes + PageSize - 1)/PageSize;
+#ifdef __APPLE__
+  char* InCore = new char[NumPages];
+#else
+  unsigned char* InCore = new unsigned char[NumPages];
+#endif
+  size_t Resident = NumBytes;
+  if (!mincore(this->Data, NumBytes, InCore)) {
+    Resident = 0;
+    for (size_t i = 0; i < NumPages; i++) if (InCore[i] & 1) Resident += PageSize;
+    if (Resident > NumBytes) Resident = NumBytes;
+  }
+  delete[] InCore;
+  return Resident;
+#else
+  return NumBytes;
+#endif
+}
+
 // ---------------------------------------------------------
 // Functions to Multi Thread Convolution
 // somehow copied from Simon convolution.cxx
@@ -110,93 +110,11 @@ public:
   }
   float* GetData() {return this->Data;}
 
-  void SaveDataToFile(char *FileName) {
-    char VolumeFileName[1024];
-    sprintf(VolumeFileName,"%s.img",FileName); 
-    FILE *File= fopen(VolumeFileName, "wb");
-    /// Could not open file
-    if (File == NULL)
-      {
-      std::cerr << "SaveDataToFile: unable to open file " << VolumeFileName << " for writing." << std::endl;
-      return;
-      }
-    size_t written = fwrite(this->Data, sizeof(float),this->MaxXYZ, File);
-    if (written != (size_t)(this->MaxXYZ))
-      {
-      std::cerr << "SaveDataToFile: failed to write " << this->MaxXYZ << " to file " << VolumeFileName << ", instead wrote " << written << std::endl;
-      }
-    fflush(File);
-    fclose(File);
-
-#ifndef _WIN32
-    /// Compress file 
-    char command[1024];
-    sprintf(command,"gzip --fast -f \"%s\"",VolumeFileName);
-    if (system(command) != 0)
-      {
-      std::cout << "Error runing system command " << command << std::endl;
-      }
-#endif
-  }
- 
-
- void ReadDataFromFile(char *FileName) {
-    char VolumeFileName[1024];
-
-#ifndef _WIN32
-    /// First uncompress file
-    char command[1024];
-    sprintf(command,"gunzip --fast -f \"%s.img.gz\"",FileName);
-    /// Do not quit here bc could have been unzipped before - if file does not exist next check will catch it 
-    int returnVal = system(command);
-    if (returnVal != 0)
-      {
-      std::cout <<  "ReadDataFromFile: error executing system command " << command << std::endl;
-      }
-#endif
-
-    sprintf(VolumeFileName,"%s.img",FileName);
-    FILE *File= fopen(VolumeFileName, "rb");
-    /// Could not open file
-    if (File == NULL)
-      {
-      std::cerr << "ReadDataFromFile: unable to open file " << VolumeFileName << std::endl;
-      return;
-      }
-    size_t numRead = fread (this->Data,sizeof(float),this->MaxXYZ,File);
-    if (numRead != (size_t)(this->MaxXYZ))
-      {
-      std::cerr << "ReadDataFromFile: error reading " << VolumeFileName << ", expected to read " << this->MaxXYZ << ", instead got " << numRead << std::endl;
-      }
-    /// terminate
-    fclose (File);
-
-#ifndef _WIN32
-    /// Compress it back 
-    sprintf(command,"gzip --fast -f \"%s\"",VolumeFileName);
-    returnVal = system(command);
-    if (returnVal != 0)
-      {
-      std::cout << "ReadDataFromFile: error executing system command " << command << std::endl;
-      }
-#endif
-
- }
-
- void EraseDataFile(char *FileName)
- {
-    char VolumeFileName[1024];
-#ifndef _WIN32
-    /// Compress it back 
-    sprintf(VolumeFileName,"%s.img.gz",FileName);
-#else 
-    sprintf(VolumeFileName,"%s.img",FileName);
-#endif
-    if (remove(VolumeFileName) != 0)
-      {
-      std::cerr << "EraseDataFile: error erasing file " << VolumeFileName << std::endl;
-      }
- }
+  // Description:
+  // Stores the volume in <FileName>.img.gz and reads it back - compression is done in process 
+  void SaveDataToFile(char *FileName);
+  void ReadDataFromFile(char *FileName);
+  void EraseDataFile(char *FileName);
 
  int GetMaxX() {return this->MaxX;} 
  int GetMaxY() {return this->MaxY;} 
@@ -332,6 +250,45 @@ void EraseDataFile(char *FileName) {
 };
 
 
+/// ----------------------------------------------------------------------------------------------
+/// Definitions for float arrays backed by a memory mapped scratch file
+/// ----------------------------------------------------------------------------------------------/
+/// Used by the slab streaming mode of the segmenter so that class weights do not have to be
+/// resident. The scratch file is unlinked right after creation, so it disappears with the process.
+/// On systems without mmap the array falls back to heap memory.
+class VTK_EMSEGMENT_EXPORT EMScratchArray {
+public:
+  EMScratchArray() {this->Data = NULL; this->Length = 0; this->MappedFlag = 0; this->FileDescriptor = -1;}
+  ~EMScratchArray() {this->Deallocate();}
+
+  /// Returns NULL if neither a mapping nor heap memory could be allocated
+  /// If ScratchDir is NULL TMPDIR (or /tmp) is used
+  float* Allocate(const char* ScratchDir, size_t initLength);
+  void Deallocate();
+
+  /// Writes the pages of [Start, Start+Num) back to the scratch file and drops them from memory, 
+  /// i.e. from the address space of the process and from the page cache. 
+  /// Only whole pages inside the range are released
+  void ReleaseRange(size_t Start, size_t Num);
+
+  /// Bytes of the array currently held in memory - all of them if the array is not mapped
+  size_t GetResidentBytes();
+
+  float* GetData() {return this->Data;}
+  size_t GetLength() {return this->Length;}
+  int GetMappedFlag() {return this->MappedFlag;}
+
+protected:
+  float  *Data;
+  size_t Length;
+  int    MappedFlag;
+  int    FileDescriptor;
+
+private:
+  EMScratchArray(const EMScratchArray&);
+  void operator=(const EMScratchArray&);
+};
+
 /// ----------------------------------------------------------------------------------------------
 /// Dummy class 
 /// ----------------------------------------------------------------------------------------------/ 
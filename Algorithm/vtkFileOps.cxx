@@ -19,6 +19,8 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <vtksys/SystemTools.hxx>
+#include "vtkMultiThreader.h"
+#include "vtk_zlib.h"
 
 // Opens up a new file and writes down result in the file
 void vtkFileOps::WriteVectorMatlabFile (const char *filename, const char *name, unsigned char *vec, int xMax) const {
@@ -103,6 +105,178 @@ void vtkFileOps::WriteMatrixMatlabFile (FILE *f, const char *name, double **mat,
   if (name != NULL) fprintf(f,"];\n");
   fprintf(f,"\n");
 }
+
+// ---------------------------------------------------------
+// In-process gzip compression 
+// ---------------------------------------------------------
+// The data is cut into blocks of VTKFILEOPS_GZIP_BLOCKSIZE bytes that are deflated independently 
+// by the threads (same idea as pigz). Each block is a raw deflate stream that ends byte aligned 
+// (Z_SYNC_FLUSH) - only the last one is terminated (Z_FINISH). Written one after another between 
+// a single gzip header and trailer they form a regular .gz file that gunzip can read.
+// Only NumberOfThreads blocks are compressed at a time so that the memory overhead is bounded.
+
+#define VTKFILEOPS_GZIP_BLOCKSIZE (1 << 20)
+
+typedef struct {
+  const unsigned char *In;
+  uLong               InLength;
+  unsigned char       *Out;
+  uLong               OutSize;
+  uLong               OutLength;
+  int                 LastFlag;
+  int                 ErrorFlag;
+} vtkFileOps_DeflateBlock;
+
+typedef struct {
+  vtkFileOps_DeflateBlock *Block;
+  int                     NumberOfBlocks;
+} vtkFileOps_DeflateJob;
+
+static VTK_THREAD_RETURN_TYPE vtkFileOps_DeflateThreader(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *Info = static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkFileOps_DeflateJob *Job = static_cast<vtkFileOps_DeflateJob *>(Info->UserData);
+  if (Info->ThreadID >= Job->NumberOfBlocks) return VTK_THREAD_RETURN_VALUE;
+
+  vtkFileOps_DeflateBlock *Block = Job->Block + Info->ThreadID;
+  z_stream Stream;
+  memset(&Stream, 0, sizeof(z_stream));
+  // Negative window bits => raw deflate - header and trailer are written once for the whole file 
+  if (deflateInit2(&Stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    Block->ErrorFlag = 1;
+    return VTK_THREAD_RETURN_VALUE;
+  }
+  Stream.next_in   = const_cast<Bytef *>(Block->In);
+  Stream.avail_in  = uInt(Block->InLength);
+  Stream.next_out  = Block->Out;
+  Stream.avail_out = uInt(Block->OutSize);
+
+  int Result = deflate(&Stream, (Block->LastFlag ? Z_FINISH : Z_SYNC_FLUSH));
+  Block->ErrorFlag = (Stream.avail_in || (Block->LastFlag ? (Result != Z_STREAM_END) : (Result != Z_OK)));
+  Block->OutLength = Stream.total_out;
+  deflateEnd(&Stream);
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+static int vtkFileOps_WriteLittleEndian(FILE *f, uLong Value) 
+{
+  unsigned char Buffer[4];
+  for (int i = 0; i < 4; i++) Buffer[i] = (unsigned char)((Value >> (8*i)) & 0xff);
+  return (fwrite(Buffer, 1, 4, f) == 4);
+}
+
+int vtkFileOps::WriteCompressedFile(const char *FileName, const void *Data, size_t NumBytes, int NumberOfThreads)
+{
+  return vtkFileOps::WriteCompressedFile(FileName, NULL, 0, Data, NumBytes, NumberOfThreads);
+}
+
+int vtkFileOps::WriteCompressedFile(const char *FileName, const void *Header, size_t HeaderBytes, const void *Data, size_t NumBytes, 
+                                    int NumberOfThreads)
+{
+  FILE *f = fopen(FileName,"wb");
+  if (f == NULL) {
+    fprintf(stderr, "WriteCompressedFile: Could not open file %s\n", FileName);
+    return 0;
+  }
+
+  // The header gets blocks of its own - blocks do not have to be of equal size 
+  const unsigned char *Segment[2]  = {static_cast<const unsigned char *>(Header), static_cast<const unsigned char *>(Data)};
+  size_t              SegmentBytes[2] = {(Header ? HeaderBytes : 0), NumBytes};
+  size_t NumberOfBlocks = 0;
+  for (int s = 0; s < 2; s++) NumberOfBlocks += (SegmentBytes[s] + VTKFILEOPS_GZIP_BLOCKSIZE - 1) / VTKFILEOPS_GZIP_BLOCKSIZE;
+  if (!NumberOfBlocks) NumberOfBlocks = 1;
+  if (NumberOfThreads < 1) NumberOfThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  if (size_t(NumberOfThreads) > NumberOfBlocks) NumberOfThreads = int(NumberOfBlocks);
+
+  // Sync flush adds an empty stored block (5 bytes) to the bound of deflate 
+  uLong OutSize = compressBound(VTKFILEOPS_GZIP_BLOCKSIZE) + 16;
+  vtkFileOps_DeflateBlock *Block = new vtkFileOps_DeflateBlock[NumberOfThreads];
+  unsigned char *OutBuffer = new unsigned char[OutSize*NumberOfThreads];
+  for (int i = 0; i < NumberOfThreads; i++) {
+    Block[i].Out     = OutBuffer + i*OutSize;
+    Block[i].OutSize = OutSize;
+  }
+
+  vtkFileOps_DeflateJob Job;
+  Job.Block = Block;
+
+  vtkMultiThreader *Threader = vtkMultiThreader::New();
+  Threader->SetSingleMethod(vtkFileOps_DeflateThreader, &Job);
+
+  // gzip header - no file name, no time stamp, fastest compression, unix 
+  const unsigned char GzipHeader[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 4, 3};
+  int SuccessFlag = (fwrite(GzipHeader, 1, 10, f) == 10);
+
+  uLong Crc = crc32(0L, Z_NULL, 0);
+  size_t BlockIndex = 0;
+  // Position of the next block 
+  int    SegmentIndex = (SegmentBytes[0] ? 0 : 1);
+  size_t Start = 0;
+  while (SuccessFlag && (BlockIndex < NumberOfBlocks)) {
+    Job.NumberOfBlocks = int(NumberOfBlocks - BlockIndex);
+    if (Job.NumberOfBlocks > NumberOfThreads) Job.NumberOfBlocks = NumberOfThreads;
+    for (int i = 0; i < Job.NumberOfBlocks; i++) {
+      size_t Length = SegmentBytes[SegmentIndex] - Start;
+      if (Length > VTKFILEOPS_GZIP_BLOCKSIZE) Length = VTKFILEOPS_GZIP_BLOCKSIZE;
+      Block[i].In        = Segment[SegmentIndex] + Start;
+      Block[i].InLength  = uLong(Length);
+      Block[i].LastFlag  = (BlockIndex + i + 1 == NumberOfBlocks);
+      Block[i].ErrorFlag = 0;
+      Start += Length;
+      if ((Start == SegmentBytes[SegmentIndex]) && (SegmentIndex == 0)) {
+        SegmentIndex = 1;
+        Start = 0;
+      }
+    }
+    Threader->SetNumberOfThreads(Job.NumberOfBlocks);
+    Threader->SingleMethodExecute();
+
+    // Write in order - the checksum is computed over the uncompressed stream 
+    for (int i = 0; SuccessFlag && (i < Job.NumberOfBlocks); i++) {
+      if (Block[i].ErrorFlag) {
+        fprintf(stderr, "WriteCompressedFile: Failed compressing data for %s\n", FileName);
+        SuccessFlag = 0;
+        break;
+      }
+      Crc = crc32(Crc, Block[i].In, uInt(Block[i].InLength));
+      SuccessFlag = (fwrite(Block[i].Out, 1, Block[i].OutLength, f) == Block[i].OutLength);
+    }
+    BlockIndex += Job.NumberOfBlocks;
+  }
+
+  // gzip trailer - CRC32 and size modulo 2^32 
+  if (SuccessFlag) SuccessFlag = vtkFileOps_WriteLittleEndian(f, Crc) && vtkFileOps_WriteLittleEndian(f, uLong((SegmentBytes[0] + NumBytes) & 0xffffffff));
+  if (!SuccessFlag) fprintf(stderr, "WriteCompressedFile: Failed writing %s\n", FileName);
+
+  Threader->Delete();
+  delete[] OutBuffer;
+  delete[] Block;
+  if (fclose(f)) SuccessFlag = 0;
+  return SuccessFlag;
+}
+
+int vtkFileOps::ReadCompressedFile(const char *FileName, void *Data, size_t NumBytes)
+{
+  // gzread decompresses while reading - files that are not compressed are read as they are
+  gzFile f = gzopen(FileName, "rb");
+  if (f == NULL) return 0;
+
+  unsigned char *Out = static_cast<unsigned char *>(Data);
+  size_t NumRead = 0;
+  while (NumRead < NumBytes) {
+    unsigned int Length = (unsigned int)((NumBytes - NumRead < VTKFILEOPS_GZIP_BLOCKSIZE) ? NumBytes - NumRead : VTKFILEOPS_GZIP_BLOCKSIZE);
+    int Result = gzread(f, Out + NumRead, Length);
+    if (Result <= 0) break;
+    NumRead += size_t(Result);
+  }
+  gzclose(f);
+  if (NumRead != NumBytes) {
+    fprintf(stderr, "ReadCompressedFile: error reading %s, expected %lu bytes, instead got %lu\n", FileName, (unsigned long) NumBytes, (unsigned long) NumRead);
+    return 0;
+  }
+  return 1;
+}
+
 #if 0
 // int XSize, int YSize are only important if FlagUpsideDown is set 
 void  vtkFileOps::WriteDoubleToUShortToGEFile(const char* FileName, double* vec,int XSize, int YSize, int XYSize, double min, double max, unsigned short MaxOutput, bool FlagUpsideDown) const {
@@ -332,7 +506,6 @@ int vtkFileOps::WriteMRIfile(char *fname, unsigned char *header, int headersize,
 
   /* To handle automatic compression */
   char *uncompressedName = NULL;
-  char command[4*PATH_MAX];
   int errcode = 0;
 
   int writeItCompressed = 0;
@@ -348,6 +521,29 @@ int vtkFileOps::WriteMRIfile(char *fname, unsigned char *header, int headersize,
       return -1;
    }
 
+  /* So we can write out the pixels in GE order on non-GE order machines */
+  this->ensureGEByteOrderForShort(data,npixels);
+
+  /* New behaviour: only compress files if it was already compressed - 
+     the compressed file is written directly without going through the uncompressed one */
+  if (writeItCompressed) {
+    if (this->uncompressedFileName(fname, &uncompressedName) != 0) {
+      fprintf(stderr,"Failed attempting to determine uncompressed file name");
+    }
+    char *compressedName = (char *)malloc(strlen(uncompressedName) + 4);
+    sprintf(compressedName,"%s.gz",uncompressedName);
+    free(uncompressedName);
+
+    errcode = !vtkFileOps::WriteCompressedFile(compressedName, header, size_t(headersize), data, sizeof(short)*size_t(npixels), 0);
+    free(compressedName);
+
+    if (errcode != 0) {
+      fprintf(stderr,"Failed attempting to compress file %s\n",fname);
+      return -1; /* Failure */
+    }
+    return npixels; /* Success */
+  }
+
   /* open the file */
   fp = fopen(fname,"wb");
   if (fp == NULL) {
@@ -363,8 +559,6 @@ int vtkFileOps::WriteMRIfile(char *fname, unsigned char *header, int headersize,
       exit(1);
     }
   }
-  /* So we can write out the pixels in GE order on non-GE order machines */
-  this->ensureGEByteOrderForShort(data,npixels);
   
   // Original: if (fwrite(data,sizeof(unsigned short), npixels,fp) < npixels) {
   if (fwrite(data,sizeof(short), npixels,fp) < 
@@ -376,38 +570,6 @@ int vtkFileOps::WriteMRIfile(char *fname, unsigned char *header, int headersize,
   }
   fclose(fp);
 
-  /* 
-   *   I want to support automatic and transparent compression of files.
-   *  If the file name does not end in .gz, I don't want to compress the file,
-   * unless there is another file already present that does end in .gz.
-   *  If the file name already ends in .gz, I need to be careful, since
-   *  gzip will refuse to process such a file.
-   */
- 
-  /* New behaviour: only compress files if it was already compressed */
-  if (writeItCompressed) {
-    /*File is currently compressed */
-    if (this->uncompressedFileName(fname, &uncompressedName) != 0) {
-      fprintf(stderr,"Failed attempting to determine uncompressed file name");
-    }
-    /* save the file using its uncompressed name, then move it to its
-       compressed name
-     */
-    if (strcmp(fname,uncompressedName) == 0) {
-      sprintf(command,"gzip --fast -f \"%s\"",fname);
-    } else {
-      sprintf(command,"mv \"%s\" \"%s\" ; gzip --fast -f \"%s\"",fname, 
-        uncompressedName, uncompressedName);
-    }
-    free(uncompressedName);
-
-    errcode = system(command);
-    if (errcode != 0) {
-      perror("Failed attempting to compress file");
-      return -1; /* Failure */
-    }
-  }
-
   return npixels; /* Success */
 #endif
   return 0;
@@ -27,6 +27,15 @@ class VTK_EMSEGMENT_EXPORT vtkFileOps { //; prevent man page generation
   void WriteVectorMatlabFile (const char *filename, const char *varname,double *vec, int xMax) const;
   void WriteMatrixMatlabFile (const char *filename, const char *varname, double **mat, int imgY, int imgX) const;
 
+  // Writes NumBytes of Data gzip compressed to FileName - blocks of the data are compressed in parallel 
+  // by NumberOfThreads threads (< 1 => vtkMultiThreader default). Returns 1 on success and 0 otherwise
+  static int WriteCompressedFile(const char *FileName, const void *Data, size_t NumBytes, int NumberOfThreads);
+  // Same but the compressed stream starts with HeaderBytes of Header (if not NULL) - no copy of header and data is made 
+  static int WriteCompressedFile(const char *FileName, const void *Header, size_t HeaderBytes, const void *Data, size_t NumBytes, 
+                                 int NumberOfThreads);
+  // Reads NumBytes from a gzip compressed (or uncompressed) file into Data. Returns 1 on success and 0 otherwise
+  static int ReadCompressedFile(const char *FileName, void *Data, size_t NumBytes);
+
   // ----------------------------------------------
   // Kilian: Old Stuff - I think you can take all of this out  
   // GE Format
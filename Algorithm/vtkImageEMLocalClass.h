@@ -64,6 +64,8 @@ class VTK_EMSEGMENT_EXPORT vtkImageEMLocalClass : public vtkImageEMLocalGenericC
 
   //BTX
   void* GetPCAMeanShapePtr(int Type) { return this->GetDataPtr(this->PCAMeanShapeImageData,Type);}
+  vtkImageData* GetPCAMeanShapeImageData() {return this->PCAMeanShapeImageData;}
+  vtkImageData* GetPCAEigenVectorImageData(int index) {return (this->PCAEigenVectorImageData ? this->PCAEigenVectorImageData[index] : NULL);}
   //ETX
 
   // Description:
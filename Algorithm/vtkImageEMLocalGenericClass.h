@@ -59,6 +59,7 @@ class VTK_EMSEGMENT_EXPORT vtkImageEMLocalGenericClass : public vtkImageEMGeneri
   // Description:
   // Probability Data defining the spatial conditional label distribution
   void SetProbDataPtr(vtkImageData *image) {this->SetInput(1,image);}
+  vtkImageData* GetProbImageData() {return this->ProbImageData;}
   //BTX
   // Description:
   // SegmentationBoundary condition are taken into account (Type == 1) or not (Type == 0);
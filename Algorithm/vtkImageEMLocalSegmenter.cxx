@@ -43,6 +43,20 @@ vtkImageEMLocalSegmenter::vtkImageEMLocalSegmenter()
   this->DisableMultiThreading = 0;       // For validation purposes you might want to disable MultiThreading 
                                          // so that you get the same results on different machines. If disabled 
                                          // and run on multi processor machines it will lower the performance 
+  this->SlabStreaming = 0;               // Weights are kept in memory mapped scratch files and the E-Step runs slab by slab
+  this->SlabThickness = 16;
+  this->ScratchDir    = NULL;
+  this->CorrectedIntensity = NULL;
+
+  this->CheckpointFileName   = NULL;   // No checkpointing 
+  this->ResumeFromCheckpoint = 0;
+  this->CheckpointHierarchyHash = EMLOCALCHECKPOINT_HASH_SEED;
+
+  this->Trace         = 0;
+  this->TraceFileName = NULL;
+
+  this->MetricsFileName = NULL;
+  this->PrintMetrics    = 0;
  
   this->PrintDir = NULL;                 // Directory in which everything should be printed out  
   memset(this->Extent, 0, sizeof(int)*6);  // Need to know the original extent for several functions in the class 
@@ -70,6 +84,19 @@ void vtkImageEMLocalSegmenter::DeleteVariables() {
   if (this->PrintDir) delete[] this->PrintDir;
   this->PrintDir = NULL;
 
+  if (this->ScratchDir) delete[] this->ScratchDir;
+  this->ScratchDir = NULL;
+
+  if (this->CheckpointFileName) delete[] this->CheckpointFileName;
+  this->CheckpointFileName = NULL;
+  this->Checkpoint.Close();
+
+  if (this->TraceFileName) delete[] this->TraceFileName;
+  this->TraceFileName = NULL;
+
+  if (this->MetricsFileName) delete[] this->MetricsFileName;
+  this->MetricsFileName = NULL;
+
   this->NumInputImages = 0 ;
   this->activeSuperClass = NULL;
   this->activeClass = NULL;
@@ -111,6 +138,15 @@ void vtkImageEMLocalSegmenter::PrintSelf(ostream& os,vtkIndent indent) {
   for (i=0; i < 6; i++) os << this->Extent[i]<< " " ; 
   os << "\n";
   os << indent << "RegistrationInterpolationType: " << this->RegistrationInterpolationType  << "\n";
+  os << indent << "SlabStreaming:              " << this->SlabStreaming << "\n";
+  os << indent << "SlabThickness:              " << this->SlabThickness << "\n";
+  os << indent << "ScratchDir:                 " << (this->ScratchDir ? this->ScratchDir : "(none)") << "\n"; 
+  os << indent << "CheckpointFileName:         " << (this->CheckpointFileName ? this->CheckpointFileName : "(none)") << "\n"; 
+  os << indent << "ResumeFromCheckpoint:       " << this->ResumeFromCheckpoint << "\n";
+  os << indent << "Trace:                      " << this->Trace << "\n";
+  os << indent << "TraceFileName:              " << (this->TraceFileName ? this->TraceFileName : "(none)") << "\n"; 
+  os << indent << "MetricsFileName:            " << (this->MetricsFileName ? this->MetricsFileName : "(none)") << "\n"; 
+  os << indent << "PrintMetrics:               " << this->PrintMetrics << "\n";
 
   this->HeadClass->PrintSelf(os,indent);
 }
@@ -208,56 +244,6 @@ void vtkImageEMLocalSegmenter::SetHeadClass(vtkImageEMLocalSuperClass *InitHead)
 }
 
 
-//----------------------------------------------------------------------------
-// This templated function executes the filter for any type of data.
-template <class T>
-static void vtkImageEMLocalSegmenterReadInputChannel(vtkImageEMLocalSegmenter *self,vtkImageData *in1Data, T *in1Ptr,int inExt[6],float** InputVector,int InputIndex)
-{
-
-  int idxR, idxY, idxZ;
-  vtkIdType inIncX, inIncY, inIncZ;
-  int *SegmentationBoundaryMin = self->GetSegmentationBoundaryMin();
-  vtkNotUsed(int *SegmentationBoundaryMax = self->GetSegmentationBoundaryMax(););
-  int ImageMaxZ = self->GetDimensionZ();
-  int ImageMaxY = self->GetDimensionY();
-  int ImageMaxX = self->GetDimensionX();
-
-  int index = 0; 
-  double IntensityCorrection = 0.0;
-
-  // Get increments to march through data 
-  in1Data->GetContinuousIncrements(inExt, inIncX, inIncY, inIncZ);
-  // We assume here input is 1 scalar -> it is checked in CheckInputImages
-
-  int LengthOfXDim = inExt[1] - inExt[0]+1 + inIncY;
-  int LengthOfYDim = LengthOfXDim*(inExt[3] - inExt[2]+1) + inIncZ;  
-  int jump = (SegmentationBoundaryMin[0] - 1) + (SegmentationBoundaryMin[1] - 1) * LengthOfXDim
-    + LengthOfYDim *(SegmentationBoundaryMin[2] - 1);
-
-  int BoundaryDataIncY = LengthOfXDim - ImageMaxX;
-  int BoundaryDataIncZ = LengthOfYDim - ImageMaxY *LengthOfXDim;
-
-  in1Ptr += jump;
-
-  // std::cerr << "-- jump " << jump << "BoundaryDataIncY " << BoundaryDataIncY << " BoundaryDataIncZ " << BoundaryDataIncZ << endl;
-  for (idxZ = 0; idxZ < ImageMaxZ ; idxZ++) { 
-    for (idxY = 0; idxY <  ImageMaxY; idxY++) {
-      for (idxR = 0; idxR < ImageMaxX; idxR++) {
-        if (double(* in1Ptr) >  IntensityCorrection) {
-          InputVector[index][InputIndex] = log(float(* in1Ptr) +1);
-        } else {
-          InputVector[index][InputIndex] = 0.0;
-        }
-        index ++; 
-        in1Ptr++;
-      }
-      in1Ptr += BoundaryDataIncY;
-    }
-    in1Ptr += BoundaryDataIncZ;
-  }
-}
-
-
 // --------------------------------------------------------------------------------------------------------------------------
 //  Running Segmentation 
 // --------------------------------------------------------------------------------------------------------------------------
@@ -376,16 +362,223 @@ int vtkImageEMLocalSegmenter::CheckInputImage(vtkImageData * inData,int DataType
 }
 
 
+// --------------------------------------------------------------------------------------------------------------------------
+//  Checkpoint  
+// --------------------------------------------------------------------------------------------------------------------------
+// Copies registration (translation, rotation, scale) and shape parameters of head and all its descendants from (ReadFlag == 0) 
+// or to (ReadFlag == 1) the lists. If the lists are NULL it only counts the number of parameters 
+static void vtkImageEMLocalSegmenter_TransfereCheckpointParameters(vtkImageEMLocalGenericClass* Class, classType Type, double* Registration, 
+                                                                    float* Shape, int &NumRegistration, int &NumShape, int ReadFlag) {
+  if (Registration) {
+    double* Para[3] = {Class->GetRegistrationTranslation(), Class->GetRegistrationRotation(), Class->GetRegistrationScale()};
+    for (int i = 0; i < 3; i++) {
+      if (ReadFlag) memcpy(Para[i], Registration + NumRegistration + 3*i, sizeof(double)*3);
+      else memcpy(Registration + NumRegistration + 3*i, Para[i], sizeof(double)*3);
+    }
+  }
+  NumRegistration += 9;
+
+  if (Type == CLASS) {
+    vtkImageEMLocalClass* LeafClass = (vtkImageEMLocalClass*) Class;
+    int NumModes = LeafClass->GetPCANumberOfEigenModes();
+    if (Shape && NumModes) {
+      if (ReadFlag) LeafClass->SetPCAShapeParameters(Shape + NumShape);
+      else memcpy(Shape + NumShape, LeafClass->GetPCAShapeParameters(), sizeof(float)*NumModes);
+    }
+    NumShape += NumModes;
+    return;
+  }
+
+  vtkImageEMLocalSuperClass* SuperClass = (vtkImageEMLocalSuperClass*) Class;
+  for (int i = 0; i < SuperClass->GetNumClasses(); i++) 
+    vtkImageEMLocalSegmenter_TransfereCheckpointParameters((vtkImageEMLocalGenericClass*) SuperClass->GetClassList()[i], SuperClass->GetClassListType()[i], 
+                                                           Registration, Shape, NumRegistration, NumShape, ReadFlag);
+}
+
+// Continues Hash with the scalar type, dimensions and voxels of Image 
+static vtkTypeUInt64 vtkImageEMLocalSegmenter_CheckpointImageHash(vtkImageData* Image, vtkTypeUInt64 Hash) {
+  int Info[5] = {0, 0, 0, 0, 0};
+  if (Image && Image->GetScalarPointer()) {
+    Image->GetDimensions(Info);
+    Info[3] = Image->GetScalarType();
+    Info[4] = Image->GetNumberOfScalarComponents();
+  }
+  Hash = EMLocalCheckpoint::HashParameters(Hash, Info, sizeof(Info));
+  if (!Info[4]) return Hash;
+  return EMLocalCheckpoint::HashData(Hash, Image->GetScalarPointer(), size_t(Image->GetNumberOfPoints())*size_t(Info[4])*size_t(Image->GetScalarSize()));
+}
+
+// Continues Hash with the parameters and atlases of Class and all its descendants that define the segmentation of a level 
+// (everything except the print settings) 
+static vtkTypeUInt64 vtkImageEMLocalSegmenter_CheckpointParameterHash(vtkImageEMLocalGenericClass* Class, classType Type, vtkTypeUInt64 Hash) {
+  int    NumInputImages = Class->GetNumInputImages();
+  int    IntPara[5]     = {int(Type), int(Class->GetLabel()), NumInputImages, Class->GetRegistrationClassSpecificRegistrationFlag(), 
+                           Class->GetExcludeFromIncompleteEStepFlag()};
+  double DoublePara[11] = {Class->GetTissueProbability(), double(Class->GetProbDataWeight())};
+  for (int i = 0; i < 3; i++) {
+    DoublePara[2 + i] = Class->GetRegistrationTranslation(i);
+    DoublePara[5 + i] = Class->GetRegistrationRotation(i);
+    DoublePara[8 + i] = Class->GetRegistrationScale(i);
+  }
+  Hash = EMLocalCheckpoint::HashParameters(Hash, IntPara, sizeof(IntPara));
+  Hash = EMLocalCheckpoint::HashParameters(Hash, DoublePara, sizeof(DoublePara));
+  Hash = EMLocalCheckpoint::HashParameters(Hash, Class->GetRegistrationInvCovariance(), sizeof(double)*9);
+  if (NumInputImages && Class->GetInputChannelWeights()) Hash = EMLocalCheckpoint::HashParameters(Hash, Class->GetInputChannelWeights(), sizeof(float)*NumInputImages);
+  Hash = vtkImageEMLocalSegmenter_CheckpointImageHash(Class->GetProbImageData(), Hash);
+
+  if (Type == CLASS) {
+    vtkImageEMLocalClass* LeafClass = (vtkImageEMLocalClass*) Class;
+    int NumModes = LeafClass->GetPCANumberOfEigenModes();
+    if (NumInputImages) {
+      Hash = EMLocalCheckpoint::HashParameters(Hash, LeafClass->GetLogMu(), sizeof(double)*NumInputImages);
+      for (int i = 0; i < NumInputImages; i++) Hash = EMLocalCheckpoint::HashParameters(Hash, LeafClass->GetLogCovariance(i), sizeof(double)*NumInputImages);
+    }
+    Hash = EMLocalCheckpoint::HashParameters(Hash, &NumModes, sizeof(int));
+    if (!NumModes) return Hash;
+
+    float LogisticPara[4] = {LeafClass->GetPCALogisticMax(), LeafClass->GetPCALogisticMin(), LeafClass->GetPCALogisticBoundary(), LeafClass->GetPCALogisticSlope()};
+    Hash = EMLocalCheckpoint::HashParameters(Hash, LogisticPara, sizeof(LogisticPara));
+    Hash = EMLocalCheckpoint::HashParameters(Hash, LeafClass->GetPCAEigenValues(), sizeof(double)*NumModes);
+    Hash = EMLocalCheckpoint::HashParameters(Hash, LeafClass->GetPCAShapeParameters(), sizeof(float)*NumModes);
+    Hash = vtkImageEMLocalSegmenter_CheckpointImageHash(LeafClass->GetPCAMeanShapeImageData(), Hash);
+    for (int i = 0; i < NumModes; i++) Hash = vtkImageEMLocalSegmenter_CheckpointImageHash(LeafClass->GetPCAEigenVectorImageData(i), Hash);
+    return Hash;
+  }
+
+  vtkImageEMLocalSuperClass* SuperClass = (vtkImageEMLocalSuperClass*) Class;
+  int NumClasses = SuperClass->GetNumClasses();
+  int    SuperIntPara[11]   = {NumClasses, SuperClass->GetStopEMType(), SuperClass->GetStopEMMaxIter(), SuperClass->GetStopBiasCalculation(), 
+                               SuperClass->GetStopMFAType(), SuperClass->GetStopMFAMaxIter(), SuperClass->GetRegistrationType(), 
+                               SuperClass->GetGenerateBackgroundProbability(), SuperClass->GetRegistrationIndependentSubClassFlag(), 
+                               SuperClass->GetPCAShapeModelType(), SuperClass->GetProbDataScalarType()};
+  double SuperDoublePara[3] = {double(SuperClass->GetStopEMValue()), double(SuperClass->GetStopMFAValue()), SuperClass->GetAlpha()};
+  Hash = EMLocalCheckpoint::HashParameters(Hash, SuperIntPara, sizeof(SuperIntPara));
+  Hash = EMLocalCheckpoint::HashParameters(Hash, SuperDoublePara, sizeof(SuperDoublePara));
+  for (int k = 0; k < 6; k++) {
+    for (int j = 0; j < NumClasses; j++) Hash = EMLocalCheckpoint::HashParameters(Hash, SuperClass->GetMrfParams()[k][j], sizeof(double)*NumClasses);
+  }
+  for (int i = 0; i < NumClasses; i++) 
+    Hash = vtkImageEMLocalSegmenter_CheckpointParameterHash((vtkImageEMLocalGenericClass*) SuperClass->GetClassList()[i], SuperClass->GetClassListType()[i], Hash);
+  return Hash;
+}
+
+//------------------------------------------------------------------------------
+int vtkImageEMLocalSegmenter::InitializeCheckpoint() {
+  this->Checkpoint.Close();
+  this->CheckpointHierarchyHash = EMLOCALCHECKPOINT_HASH_SEED;
+  if (!this->CheckpointFileName) return 1;
+
+  // Levels are only restored for the same input images and global settings - the hash of each level 
+  // continues from this one (the classes and their atlases are added by vtkImageEMLocalSegmenter_CheckpointParameterHash)
+  {
+    int* BoundaryMin = this->GetSegmentationBoundaryMin();
+    int* BoundaryMax = this->GetSegmentationBoundaryMax();
+    int IntPara[11] = {this->NumInputImages, this->SmoothingWidth, this->SmoothingSigma, this->NumberOfTrainingSamples, this->RegistrationInterpolationType, 
+                       BoundaryMin[0], BoundaryMin[1], BoundaryMin[2], BoundaryMax[0], BoundaryMax[1], BoundaryMax[2]};
+    vtkTypeUInt64 Hash = EMLocalCheckpoint::HashParameters(EMLOCALCHECKPOINT_HASH_SEED, IntPara, sizeof(IntPara));
+    for (int i = 0; i < this->NumInputImages; i++) Hash = vtkImageEMLocalSegmenter_CheckpointImageHash(this->GetInput(i), Hash);
+    this->CheckpointHierarchyHash = Hash;
+  }
+
+  int Dimension[3] = {this->GetDimensionX(), this->GetDimensionY(), this->GetDimensionZ()};
+  if (this->ResumeFromCheckpoint) {
+    if (this->Checkpoint.Open(this->CheckpointFileName, Dimension, this->NumInputImages)) {
+      std::cerr << "Resume segmentation from " << this->CheckpointFileName << " (" << this->Checkpoint.GetNumberOfLevels() << " completed levels)" << endl;
+      return 1;
+    }
+    vtkEMAddWarningMessage("Could not resume from checkpoint " << this->CheckpointFileName << " - segmentation starts from the beginning");
+  }
+
+  if (!this->Checkpoint.Create(this->CheckpointFileName, Dimension, this->NumInputImages)) {
+    vtkEMAddWarningMessage("Could not create checkpoint " << this->CheckpointFileName << " - checkpointing is disabled");
+    return 0;
+  }
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+int vtkImageEMLocalSegmenter::WriteCheckpointLevel(vtkImageEMLocalSuperClass* head, char* LevelName, vtkTypeUInt64 ParameterHash, short *SegmentationResult, 
+                                                   EMTriVolume & iv_m, EMVolume *r_m, float GlobalRegInvRotation[9], float GlobalRegInvTranslation[3]) {
+  int NumRegistration = 0;
+  int NumShape = 0;
+  vtkImageEMLocalSegmenter_TransfereCheckpointParameters(head, SUPERCLASS, NULL, NULL, NumRegistration, NumShape, 0);
+  double *Registration = new double[NumRegistration];
+  float  *Shape        = new float[NumShape + 1];
+  NumRegistration = NumShape = 0; 
+  vtkImageEMLocalSegmenter_TransfereCheckpointParameters(head, SUPERCLASS, Registration, Shape, NumRegistration, NumShape, 0);
+
+  float GlobalRegistration[12];
+  memcpy(GlobalRegistration, GlobalRegInvRotation, sizeof(float)*9);
+  memcpy(GlobalRegistration + 9, GlobalRegInvTranslation, sizeof(float)*3);
+
+  int Success = this->Checkpoint.BeginRecord(LevelName, ParameterHash) 
+    && this->Checkpoint.WriteBlock(EMLOCALCHECKPOINT_LABELMAP, SegmentationResult, sizeof(short), this->ImageProd)
+    && this->Checkpoint.WriteBlock(EMLOCALCHECKPOINT_GLOBAL_REGISTRATION, GlobalRegistration, sizeof(float), 12)
+    && this->Checkpoint.WriteBlock(EMLOCALCHECKPOINT_REGISTRATION, Registration, sizeof(double), NumRegistration)
+    && this->Checkpoint.WriteBlock(EMLOCALCHECKPOINT_SHAPE, Shape, sizeof(float), NumShape)
+    && this->Checkpoint.WriteBias(iv_m, r_m, this->NumInputImages)
+    && this->Checkpoint.EndRecord();
+
+  delete[] Registration;
+  delete[] Shape;
+
+  if (!Success) {
+    vtkEMAddWarningMessage("Could not write level " << LevelName << " to checkpoint " << this->CheckpointFileName << " - checkpointing is disabled");
+    this->Checkpoint.Close();
+  }
+  return Success;
+}
+
+//------------------------------------------------------------------------------
+int vtkImageEMLocalSegmenter::ReadCheckpointLevel(int LevelIndex, vtkImageEMLocalSuperClass* head, short *SegmentationResult, EMTriVolume & iv_m, 
+                                                  EMVolume *r_m, float GlobalRegInvRotation[9], float GlobalRegInvTranslation[3]) {
+  int NumRegistration = 0;
+  int NumShape = 0;
+  vtkImageEMLocalSegmenter_TransfereCheckpointParameters(head, SUPERCLASS, NULL, NULL, NumRegistration, NumShape, 1);
+  double *Registration = new double[NumRegistration];
+  float  *Shape        = new float[NumShape + 1];
+  float  GlobalRegistration[12];
+
+  int Success = this->Checkpoint.ReadBlock(LevelIndex, EMLOCALCHECKPOINT_LABELMAP, SegmentationResult, sizeof(short), this->ImageProd)
+    && this->Checkpoint.ReadBlock(LevelIndex, EMLOCALCHECKPOINT_GLOBAL_REGISTRATION, GlobalRegistration, sizeof(float), 12)
+    && this->Checkpoint.ReadBlock(LevelIndex, EMLOCALCHECKPOINT_REGISTRATION, Registration, sizeof(double), NumRegistration)
+    && this->Checkpoint.ReadBlock(LevelIndex, EMLOCALCHECKPOINT_SHAPE, Shape, sizeof(float), NumShape)
+    && this->Checkpoint.ReadBias(LevelIndex, iv_m, r_m, this->NumInputImages);
+
+  if (Success) {
+    NumRegistration = NumShape = 0; 
+    vtkImageEMLocalSegmenter_TransfereCheckpointParameters(head, SUPERCLASS, Registration, Shape, NumRegistration, NumShape, 1);
+    memcpy(GlobalRegInvRotation, GlobalRegistration, sizeof(float)*9);
+    memcpy(GlobalRegInvTranslation, GlobalRegistration + 9, sizeof(float)*3);
+  } else {
+    vtkEMAddErrorMessage("Could not restore level " << LevelIndex << " from checkpoint " << this->CheckpointFileName << " - the file does not match the current hierarchy");
+  }
+
+  delete[] Registration;
+  delete[] Shape;
+  return Success;
+}
+
 template <class T>  
-void vtkImageEMLocalSegment_RunEMAlgorithm(vtkImageEMLocalSegmenter *self, T** ProbDataPtr, int NumTotalTypeCLASS, int ImageProd,  float **InputVector, short *ROI, 
+void vtkImageEMLocalSegment_RunEMAlgorithm(vtkImageEMLocalSegmenter *self, T** ProbDataPtr, int NumTotalTypeCLASS, int ImageProd,  EMLocalInputChannels *InputChannels, short *ROI, 
                                            char *LevelName, float GlobalRegInvRotation[9], float GlobalRegInvTranslation[3], int RegistrationType, 
                                            EMTriVolume& iv_m, EMVolume *r_m, short *SegmentationResult, int DataType, int &SegmentLevelSucessfullFlag) {
 
   // Initialize Values
   float **w_m    = new float*[NumTotalTypeCLASS];
+  // In slab streaming mode all weights live in one memory mapped scratch file 
   try
   {
-    for (int i=0; i< NumTotalTypeCLASS; i++) w_m[i] = new float[ImageProd];
+    if (self->GetSlabStreaming()) 
+      {
+      float *w_mStart = self->GetWeightScratch()->Allocate(self->GetScratchDir(), size_t(NumTotalTypeCLASS)*size_t(ImageProd));
+      if (!w_mStart) throw std::bad_alloc();
+      for (int i=0; i< NumTotalTypeCLASS; i++) w_m[i] = w_mStart + size_t(i)*size_t(ImageProd);
+      }
+    else 
+      {
+      for (int i=0; i< NumTotalTypeCLASS; i++) w_m[i] = new float[ImageProd];
+      }
   }
   catch (std::exception& e)
   {
@@ -394,7 +587,11 @@ void vtkImageEMLocalSegment_RunEMAlgorithm(vtkImageEMLocalSegmenter *self, T** P
     throw e;
   }
 
-  EMLocalAlgorithm<T> Algorithm(self, ProbDataPtr, InputVector, ROI, w_m, LevelName, GlobalRegInvRotation, GlobalRegInvTranslation, RegistrationType, 
+  // Streamed weights are only resident slab by slab - they are measured separately (see StreamedWeightsPeakResidentBytes)
+  vtkIdType WeightBytes = (self->GetSlabStreaming() ? 0 : vtkIdType(NumTotalTypeCLASS)*vtkIdType(ImageProd)*vtkIdType(sizeof(float)));
+  self->GetMetrics()->AddMemory(EMLOCALMETRICS_WEIGHTS, WeightBytes);
+
+  EMLocalAlgorithm<T> Algorithm(self, ProbDataPtr, InputChannels, ROI, w_m, LevelName, GlobalRegInvRotation, GlobalRegInvTranslation, RegistrationType, 
                                 DataType,SegmentLevelSucessfullFlag);
 
   // Run Algorithm
@@ -408,8 +605,16 @@ void vtkImageEMLocalSegment_RunEMAlgorithm(vtkImageEMLocalSegmenter *self, T** P
   if (Algorithm.GetWarningFlag()) vtkEMJustAddWarningMessageSelf(Algorithm.GetWarningMessages());
 
   // Clean up 
-  for (int i=0; i<NumTotalTypeCLASS; i++) delete[] w_m[i]; 
+  if (self->GetSlabStreaming()) 
+    {
+    self->GetWeightScratch()->Deallocate();
+    }
+  else 
+    {
+    for (int i=0; i<NumTotalTypeCLASS; i++) delete[] w_m[i]; 
+    }
   delete []w_m;
+  self->GetMetrics()->RemoveMemory(EMLOCALMETRICS_WEIGHTS, WeightBytes);
 } 
 
 
@@ -417,7 +622,7 @@ void vtkImageEMLocalSegment_RunEMAlgorithm(vtkImageEMLocalSegmenter *self, T** P
 // Needed to define hierarchies! => this will be done at a later point int time at vtkImageEMLocalSuperClass
 // I did this design to multi thread it later
 // If you start it always set ROI == NULL
-int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass* head, float** InputVector,short *ROI, short *OutputVector, EMTriVolume & iv_m, 
+int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass* head, EMLocalInputChannels* InputChannels,short *ROI, short *OutputVector, EMTriVolume & iv_m, 
                                                        EMVolume *r_m,char* LevelName, float GlobalRegInvRotation[9], float GlobalRegInvTranslation[3]) {
   std::cerr << "Start vtkImageEMLocalSegmenter::HierarchicalSegmentation"<< endl;  
   // Nothing to segment
@@ -493,6 +698,7 @@ int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass
     *OutputVectorPtr    = OutputVector;
 
   memset(SegmentationResult,0,sizeof(short)*this->ImageProd);
+  this->Metrics.AddMemory(EMLOCALMETRICS_LABELMAP, vtkIdType(this->ImageProd)*vtkIdType(sizeof(short)));
 
 
 
@@ -524,9 +730,31 @@ int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass
   int ProbDataScalarType = (head->GetProbDataScalarType() > -1 ? head->GetProbDataScalarType() : VTK_CHAR) ;
   // std::cerr << "Probability data is of type " << vtkImageScalarTypeNameMacro(ProbDataScalarType) << endl;
   
+  // The checkpoint record of the level is identified by a hash that includes the parameters of all levels 
+  // above it as their results define the ROI of this level
+  vtkTypeUInt64 CheckpointLevelHash = EMLocalCheckpoint::HashParameters(this->CheckpointHierarchyHash, &RegistrationType, sizeof(int));
+  CheckpointLevelHash = vtkImageEMLocalSegmenter_CheckpointParameterHash(head, SUPERCLASS, CheckpointLevelHash);
+
+  // Only the segmentation of this level is timed - sub levels have their own event
+  {
+  char LevelTraceName[EMLOCALTRACE_MAX_NAME];
+  sprintf(LevelTraceName,"Level %.50s",LevelName);
+  EMLocalTraceScope LevelTrace(LevelTraceName, "level");
+  EMLocalMetrics_Level* LevelMetrics = this->Metrics.BeginLevel(LevelName);
+
+  // Levels completed in a previous run are restored from the checkpoint 
+  int CheckpointLevelIndex = ((this->GetCheckpoint() && this->ResumeFromCheckpoint) ? this->Checkpoint.GetLevelIndex(LevelName, CheckpointLevelHash) : -1);
+  if (CheckpointLevelIndex > -1) 
+    {
+    std::cerr << "Restore level " << LevelName << " from checkpoint " << this->CheckpointFileName << endl;
+    SegmentLevelSucessfullFlag = this->ReadCheckpointLevel(CheckpointLevelIndex, head, SegmentationResult, iv_m, r_m, GlobalRegInvRotation, GlobalRegInvTranslation);
+    LevelMetrics->RestoredFlag = 1;
+    }
+  else 
+  {
   switch (ProbDataScalarType) 
     {
-      vtkTemplateMacro(vtkImageEMLocalSegment_RunEMAlgorithm(this, (VTK_TT**) ProbDataPtr, NumTotalTypeCLASS, this->ImageProd, InputVector, ROI, LevelName, 
+      vtkTemplateMacro(vtkImageEMLocalSegment_RunEMAlgorithm(this, (VTK_TT**) ProbDataPtr, NumTotalTypeCLASS, this->ImageProd, InputChannels, ROI, LevelName, 
                                                              GlobalRegInvRotation, GlobalRegInvTranslation, RegistrationType, iv_m, r_m, SegmentationResult, 
                                                              ProbDataScalarType,SegmentLevelSucessfullFlag )); 
     default :
@@ -547,6 +775,12 @@ int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass
     memcpy(GlobalRegInvRotation, NewGlobalRegInvRotation,sizeof(float)*9);
     memcpy(GlobalRegInvTranslation, NewGlobalRegInvTranslation,sizeof(float)*3);
   } 
+
+  if (SegmentLevelSucessfullFlag && this->GetCheckpoint()) 
+    this->WriteCheckpointLevel(head, LevelName, CheckpointLevelHash, SegmentationResult, iv_m, r_m, GlobalRegInvRotation, GlobalRegInvTranslation);
+  }
+  this->Metrics.EndLevel();
+  }
   
   // ---------------------------------------------------------------
   // 4. Segment Subclasses
@@ -571,12 +805,14 @@ int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass
         // we should really create a copy of iv_m and r_m !! otherwise things can go wrong here
         if ((RegistrationType > EMSEGMENT_REGISTRATION_DISABLED) &&  (((vtkImageEMLocalSuperClass*) ClassList[i])->GetRegistrationType() == EMSEGMENT_REGISTRATION_DISABLED)) 
           vtkEMAddWarningMessage("SuperClass had registration enabled , but child had it disabled . Thus, the registration parameters wont be transfered to the next segmentation level");
-        SegmentLevelSucessfullFlag = this->HierarchicalSegmentation((vtkImageEMLocalSuperClass*) ClassList[i],InputVector,SegmentationResult,OutputVector,iv_m,r_m,NewLevelName, 
+        this->CheckpointHierarchyHash = CheckpointLevelHash;
+        SegmentLevelSucessfullFlag = this->HierarchicalSegmentation((vtkImageEMLocalSuperClass*) ClassList[i],InputChannels,SegmentationResult,OutputVector,iv_m,r_m,NewLevelName, 
                                                                     GlobalRegInvRotation, GlobalRegInvTranslation);
       } 
     }
   }
   delete []SegmentationResult;
+  this->Metrics.RemoveMemory(EMLOCALMETRICS_LABELMAP, vtkIdType(this->ImageProd)*vtkIdType(sizeof(short)));
   delete []NewLevelName;
   delete []ProbDataPtr;
   std::cerr << "End vtkImageEMLocalSegmenter::HierachicalSegmentation"<< endl; 
@@ -587,7 +823,7 @@ int vtkImageEMLocalSegmenter::HierarchicalSegmentation(vtkImageEMLocalSuperClass
 //----------------------------------------------------------------------------
 // This templated function executes the filter for any type of data.
 template <class TOut>
-static void vtkImageEMLocalSegmenterExecute(vtkImageEMLocalSegmenter *self,float **InputVector,vtkImageData *outData, TOut *outPtr,int outExt[6])
+static void vtkImageEMLocalSegmenterExecute(vtkImageEMLocalSegmenter *self,EMLocalInputChannels *InputChannels,vtkImageData *outData, TOut *outPtr,int outExt[6])
 {
   // -----------------------------------------------------
   // 1.) Setup  Hierarchical Segmentation
@@ -602,10 +838,14 @@ static void vtkImageEMLocalSegmenterExecute(vtkImageEMLocalSegmenter *self,float
   EMTriVolume iv_m(NumInputImages,DimensionZ,DimensionY,DimensionX); // weighted inverse covariances 
   EMVolume *r_m  = new EMVolume[NumInputImages]; // weighted residuals
   for (int i=0; i < NumInputImages; i++) r_m[i].Resize(DimensionZ,DimensionY,DimensionX);
+
+  vtkIdType BiasBytes = vtkIdType(NumInputImages*(NumInputImages+3)/2)*vtkIdType(self->GetImageProd())*vtkIdType(sizeof(float));
+  self->GetMetrics()->AddMemory(EMLOCALMETRICS_BIAS, BiasBytes);
+  self->GetMetrics()->AddMemory(EMLOCALMETRICS_LABELMAP, vtkIdType(self->GetImageProd())*vtkIdType(sizeof(short)));
   // Print information
   std::cerr << "Multi Threading is " ;
   if (self->GetDisableMultiThreading()) std::cerr << "disabled." << endl;
-  else std::cerr << "working (" << vtkMultiThreader::GetGlobalDefaultNumberOfThreads() << " cpus)" << endl;
+  else std::cerr << "working (" << EMLocalInterface_GetNumberOfThreads(0, self->GetNumberOfThreads()) << " threads)" << endl;
 
   if ( (DimensionX != (outExt[1] - outExt[0] +1)) ||(DimensionY != (outExt[3] - outExt[2] +1)) ||(DimensionZ != (outExt[5] - outExt[4] +1)))  
     std::cerr << "Segmentation Boundary is activated (" <<DimensionX  <<"," << DimensionY << "," << DimensionZ <<") !" << endl;    
@@ -641,10 +881,12 @@ static void vtkImageEMLocalSegmenterExecute(vtkImageEMLocalSegmenter *self,float
   float GlobalRegInvTranslation[3];
   GlobalRegInvTranslation[0] = GlobalRegInvTranslation[1] = GlobalRegInvTranslation[2] = 0.0;
 
+  self->InitializeCheckpoint();
+
   // -----------------------------------------------------
   // 2.) Run  Hierarchical Segmentation
   // -----------------------------------------------------
-  if (self->HierarchicalSegmentation(self->GetHeadClass(),InputVector, NULL, OutputVector,iv_m,r_m,LevelName,GlobalRegInvRotation,GlobalRegInvTranslation) == 0) {
+  if (self->HierarchicalSegmentation(self->GetHeadClass(),InputChannels, NULL, OutputVector,iv_m,r_m,LevelName,GlobalRegInvRotation,GlobalRegInvTranslation) == 0) {
     memset(OutputVector,0,sizeof(short)*self->GetImageProd());
   }
 
@@ -658,6 +900,9 @@ static void vtkImageEMLocalSegmenterExecute(vtkImageEMLocalSegmenter *self,float
 
   delete[] OutputVector;
   delete[] r_m;
+  self->GetMetrics()->RemoveMemory(EMLOCALMETRICS_LABELMAP, vtkIdType(self->GetImageProd())*vtkIdType(sizeof(short)));
+  self->GetMetrics()->RemoveMemory(EMLOCALMETRICS_BIAS, BiasBytes);
+  if (self->GetCheckpoint()) self->GetCheckpoint()->Close();
 
   std::cerr << "End vtkImageEMLocalSegmenterExecute "<< endl;
 }
@@ -770,25 +1015,33 @@ void vtkImageEMLocalSegmenter::ExecuteData(vtkDataObject *)
   // -----------------------------------------------------
   // Read Input Images
   // -----------------------------------------------------
-  float **InputVector = new float*[this->ImageProd];
-  std::cerr << "Reserve memory for InputVector...";
-  for(idx1 = 0; idx1 < this->ImageProd; idx1++)
-    {
-      //    std::cerr << idx1 << "/" << this->ImageProd << "*" << this->NumInputImages << std::endl;
-      InputVector[idx1] = new float[this->NumInputImages];
-    }
-  std::cerr << "Done" << std::endl;
- 
+  // The intensities are read directly from the scalars of the input images - no copy is made
+  EMLocalInputChannels InputChannels;
+  {
+    int Dimension[3] = {this->GetDimensionX(), this->GetDimensionY(), this->GetDimensionZ()};
+    InputChannels.Initialize(this->NumInputImages, Dimension);
+  }
   for (idx1 = 0; idx1 < this->NumInputImages ; idx1++){  
     if (this->CheckInputImage(inData[idx1],this->GetInput(0)->GetScalarType(), this->GetInput(0)->GetSpacing(), idx1+1)) return;
-    switch (this->GetInput(idx1)->GetScalarType()) {
-      vtkTemplateMacro6(vtkImageEMLocalSegmenterReadInputChannel,this, inData[idx1], (VTK_TT *)(inData[idx1]->GetScalarPointerForExtent(this->Extent)),this->Extent,InputVector,idx1);
-    default:
+    if (!InputChannels.SetChannel(idx1, inData[idx1], this->Extent, this->GetSegmentationBoundaryMin())) {
       vtkEMAddErrorMessage( "Execute: Unknown ScalarType");
       return;
     } 
   }
 
+  // Bias corrected log intensities - shared by all levels of the hierarchy
+  this->Metrics.Reset();
+  try 
+  {
+    this->CorrectedIntensity = new float[vtkIdType(this->NumInputImages)*vtkIdType(this->ImageProd)];
+    this->Metrics.AddMemory(EMLOCALMETRICS_INTENSITY, vtkIdType(this->NumInputImages)*vtkIdType(this->ImageProd)*vtkIdType(sizeof(float)));
+  }
+  catch (std::exception& e)
+  {
+    vtkEMAddErrorMessage( "Execute: Failed to allocate " << vtkIdType(this->NumInputImages)*vtkIdType(this->ImageProd)*vtkIdType(sizeof(float)) << " bytes for the corrected intensities (" << e.what() << ")");
+    return;
+  }
+
   // -----------------------------------------------------
   // Read in Debugging Data 
   // -----------------------------------------------------
@@ -818,13 +1071,33 @@ void vtkImageEMLocalSegmenter::ExecuteData(vtkDataObject *)
   // -----------------------------------------------------
   // Execute Segmentation Algorithmm
   // -----------------------------------------------------
+  if (this->Trace || this->TraceFileName) {
+    this->TraceLog.Start();
+    EMLocalTrace::SetActive(&this->TraceLog);
+  }
+
   outPtr = outData->GetScalarPointerForExtent(outData->GetExtent());
   switch (this->GetOutput()->GetScalarType()) {
-    vtkTemplateMacro5(vtkImageEMLocalSegmenterExecute, this, InputVector, outData, (VTK_TT*)outPtr,this->Extent);
+    vtkTemplateMacro5(vtkImageEMLocalSegmenterExecute, this, &InputChannels, outData, (VTK_TT*)outPtr,this->Extent);
   default:
     vtkEMAddErrorMessage("Execute: Unknown ScalarType");
-    return;
   }
-  for(idx1 = 0; idx1 <this->ImageProd; idx1++) delete[] InputVector[idx1];
-  delete[] InputVector;
+
+  if (EMLocalTrace::GetActive() == &this->TraceLog) {
+    EMLocalTrace::SetActive(NULL);
+    this->TraceLog.PrintSummary(std::cerr);
+    if (this->TraceFileName) {
+      if (this->TraceLog.WriteChromeTrace(this->TraceFileName)) std::cerr << "Trace written to " << this->TraceFileName << endl;
+      else vtkEMAddWarningMessage("Could not write trace to " << this->TraceFileName);
+    }
+  }
+  delete[] this->CorrectedIntensity;
+  this->CorrectedIntensity = NULL;
+  this->Metrics.RemoveMemory(EMLOCALMETRICS_INTENSITY, vtkIdType(this->NumInputImages)*vtkIdType(this->ImageProd)*vtkIdType(sizeof(float)));
+
+  if (this->PrintMetrics) this->Metrics.Print(std::cerr);
+  if (this->MetricsFileName) {
+    if (this->Metrics.WriteJSON(this->MetricsFileName)) std::cerr << "Metrics written to " << this->MetricsFileName << endl;
+    else vtkEMAddWarningMessage("Could not write metrics to " << this->MetricsFileName);
+  }
 }
@@ -20,6 +20,10 @@
 #include "vtkEMSegment.h"
 #include "vtkImageEMGeneral.h" 
 #include "vtkImageEMLocalSuperClass.h"
+#include "EMLocalCheckpoint.h"
+#include "EMLocalInputChannels.h"
+#include "EMLocalTrace.h"
+#include "EMLocalMetrics.h"
 
 // Just for debugging purposes
 #define EM_DEBUG 1
@@ -80,9 +84,67 @@ class VTK_EMSEGMENT_EXPORT vtkImageEMLocalSegmenter : public vtkImageEMGeneral
   // For validation purposes you might want to disable MultiThreading 
   // so that you get the same results on different machines. If disabled 
   // and run on multi processor machines it will lower the performance 
+  // The number of threads otherwise is set with SetNumberOfThreads (default: vtkMultiThreader global default)
   vtkGetMacro(DisableMultiThreading,int); 
   vtkSetMacro(DisableMultiThreading,int); 
 
+  // Description:
+  // Slab streaming for volumes whose class weights do not fit into memory.
+  // The weights are kept in memory mapped scratch files in ScratchDir (TMPDIR if not set)
+  // and the E-Step walks through the volume in z-slabs of SlabThickness slices, 
+  // releasing the pages of a slab (except for the one slice halo needed by the 
+  // MRF stencil) once it is done. The mean field, bias, label map and convergence 
+  // passes release the weights in the same way. 
+  // Limits: the registration and shape cost functions still evaluate the whole volume 
+  // (their peak residency is reported as streamedWeightsPeakResidentBytes of the level 
+  // metrics) and the atlas priors are inputs of the filter and are not streamed.
+  vtkGetMacro(SlabStreaming,int); 
+  vtkSetMacro(SlabStreaming,int); 
+  vtkBooleanMacro(SlabStreaming,int); 
+
+  vtkGetMacro(SlabThickness,int); 
+  vtkSetMacro(SlabThickness,int); 
+
+  vtkGetStringMacro(ScratchDir);
+  vtkSetStringMacro(ScratchDir);
+
+  // Description:
+  // Checkpointing of long segmentations: if CheckpointFileName is defined the state after 
+  // each completed hierarchy level (label map, bias, registration and shape parameters) is 
+  // written to that file. With ResumeFromCheckpoint the levels completed in an existing file are 
+  // restored instead of segmented again - a level is only restored if the input images, the global settings 
+  // and the parameters and atlases of the level, its sub-hierarchy and all levels above it are unchanged 
+  // (print settings excepted). An interrupted level is segmented again.
+  vtkGetStringMacro(CheckpointFileName);
+  vtkSetStringMacro(CheckpointFileName);
+
+  vtkGetMacro(ResumeFromCheckpoint,int); 
+  vtkSetMacro(ResumeFromCheckpoint,int); 
+  vtkBooleanMacro(ResumeFromCheckpoint,int); 
+
+  // Description:
+  // Timing of the phases of the segmentation (E-Step, MF sweeps, bias, registration, shape, 
+  // label map, each hierarchy level - E-Step threads are timed separately). 
+  // If Trace is on a summary table is printed at the end of the segmentation. 
+  // If TraceFileName is defined tracing is turned on and the events are also written to 
+  // that file in Chrome trace-event format.
+  vtkGetMacro(Trace,int); 
+  vtkSetMacro(Trace,int); 
+  vtkBooleanMacro(Trace,int); 
+
+  vtkGetStringMacro(TraceFileName);
+  vtkSetStringMacro(TraceFileName);
+
+  // Description:
+  // Counters of the last run (see GetMetrics) are written as JSON to MetricsFileName if defined 
+  // and printed at the end of the segmentation if PrintMetrics is on 
+  vtkGetStringMacro(MetricsFileName);
+  vtkSetStringMacro(MetricsFileName);
+
+  vtkGetMacro(PrintMetrics,int); 
+  vtkSetMacro(PrintMetrics,int); 
+  vtkBooleanMacro(PrintMetrics,int); 
+
   // Desciption:
   // Head Class is the inital class under which all subclasses are attached  
   void SetHeadClass(vtkImageEMLocalSuperClass *InitHead);
@@ -123,7 +185,7 @@ class VTK_EMSEGMENT_EXPORT vtkImageEMLocalSegmenter : public vtkImageEMGeneral
   // Needs to be public so we can access it from template functions
   //BTX
   int HierarchicalSegmentation(vtkImageEMLocalSuperClass* head, 
-                               float** InputVector,
+                               EMLocalInputChannels* InputChannels,
                                short *ROI, 
                                short *OutputVector, 
                                EMTriVolume & iv_m, 
@@ -132,6 +194,24 @@ class VTK_EMSEGMENT_EXPORT vtkImageEMLocalSegmenter : public vtkImageEMGeneral
                                float GlobalRotInvRotation[9], 
                                float GlobalRotInvTranslation[3]);
 
+  // Description:
+  // Bias corrected log intensities (NumInputImages values per voxel) - one buffer shared by all levels 
+  float* GetCorrectedIntensity() {return this->CorrectedIntensity;}
+
+  // Description:
+  // Scratch file holding the weights of the level currently segmented in slab streaming mode 
+  EMScratchArray* GetWeightScratch() {return &this->WeightScratch;}
+
+  // Description:
+  // Returns NULL if checkpointing is not active 
+  EMLocalCheckpoint* GetCheckpoint() {return (this->Checkpoint.IsOpen() ? &this->Checkpoint : NULL);}
+
+  // Description:
+  // Counters of the last run - ROI voxels, EM iterations, MF sweeps, E-Step throughput, 
+  // cost evaluations and incomplete model voxels per level as well as memory per subsystem  
+  EMLocalMetrics* GetMetrics() {return &this->Metrics;}
+  int  InitializeCheckpoint();
+
   vtkImageEMLocalSuperClass* GetActiveSuperClass() {return this->activeSuperClass;}
   vtkImageEMLocalSuperClass* GetHeadClass() {return this->HeadClass;}
 
@@ -188,6 +268,31 @@ protected:
 
   int    DisableMultiThreading;     // For validation purposes you might want to disable MultiThreading 
                                     // so that you get the same results on different machines 
+
+  int    SlabStreaming;             // Keep weights in memory mapped scratch files and run the E-Step slab by slab 
+  int    SlabThickness;             // Number of slices per slab 
+  char*  ScratchDir;                // Directory of the scratch files 
+  EMScratchArray WeightScratch;     // Memory mapped weights of the current level  
+
+  float* CorrectedIntensity;        // Bias corrected log intensities of the level currently segmented 
+
+  char*  CheckpointFileName;        // File to which the state of the segmentation is saved 
+  vtkTypeUInt64 CheckpointHierarchyHash; // Parameter hash of the levels above the one currently segmented 
+  int    ResumeFromCheckpoint;      // Restore completed levels from CheckpointFileName 
+  EMLocalCheckpoint Checkpoint;
+
+  int    Trace;                     // Time the phases of the segmentation 
+  char*  TraceFileName;             // Chrome trace-event file 
+  EMLocalTrace TraceLog;
+
+  char*  MetricsFileName;           // JSON file the metrics are written to 
+  int    PrintMetrics;              // Print the metrics at the end of the segmentation 
+  EMLocalMetrics Metrics;
+
+  int WriteCheckpointLevel(vtkImageEMLocalSuperClass* head, char* LevelName, vtkTypeUInt64 ParameterHash, short *SegmentationResult, EMTriVolume & iv_m, 
+                           EMVolume *r_m, float GlobalRegInvRotation[9], float GlobalRegInvTranslation[3]);
+  int ReadCheckpointLevel(int LevelIndex, vtkImageEMLocalSuperClass* head, short *SegmentationResult, EMTriVolume & iv_m, EMVolume *r_m, 
+                          float GlobalRegInvRotation[9], float GlobalRegInvTranslation[3]);
   //ETX
 };
 #endif
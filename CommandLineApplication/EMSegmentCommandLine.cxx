@@ -314,6 +314,31 @@ int main(int argc, char** argv)
       emMRMLManager->SetSaveIntermediateResults(false);
       }
 
+    // ================== Trace  ==================
+    EMSLogic->SetTrace(trace || !traceFileName.empty());
+    if (!traceFileName.empty())
+      {
+      EMSLogic->SetTraceFileName(traceFileName.c_str());
+      }
+    if (verbose && EMSLogic->GetTrace())
+      std::cout << "Timing of the EM algorithm is enabled"
+                << (traceFileName.empty() ? "" : " - trace will be written to ")
+                << traceFileName << std::endl;
+
+    // ================== Threads  ==================
+    EMSLogic->SetNumberOfThreads(numberOfThreads);
+    if (verbose && numberOfThreads > 0)
+      std::cout << "Number of threads: " << numberOfThreads << std::endl;
+
+    // ================== Run Metrics  ==================
+    if (!statsJSONFileName.empty())
+      {
+      EMSLogic->SetMetricsFileName(statsJSONFileName.c_str());
+      if (verbose)
+        std::cout << "Run metrics will be written to: "
+                  << statsJSONFileName << std::endl;
+      }
+
     // ================== Segmentation Boundary  ==================
     int segmentationBoundaryMin[3];
     int segmentationBoundaryMax[3];
@@ -38,6 +38,7 @@ PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 #include "vtkImageIslandFilter.h"
 #include "vtkObjectFactory.h"
 #include "vtkImageData.h"
+#include "vtkMultiThreader.h"
 
 #define IMAGEISLANDFILTER_DYNAMIC 0
 #define IMAGEISLANDFILTER_STATIC 1
@@ -375,6 +376,183 @@ template<class T> void EMStack<T>::Print() {
   }
 }
 
+//------------------------------------------------------------------------------
+// Connected component labelling 
+//------------------------------------------------------------------------------
+// Parameters of the first pass of IslandLabeling<T>::Execute - each thread labels the slab [SlabStart[ID], SlabStart[ID+1])
+template <class T> struct IslandLabeling_ThreadedParameters {
+  T*   inPtr;
+  int* Parent;
+  int* SlabStart;
+  int  SizeX;
+  int  SizeY;
+  int  SizeXY;
+  int  NeighborhoodDim;
+};
+
+// Parents always have a smaller index than their children so that the root of an island is its first voxel 
+static inline int vtkImageIslandFilter_FindRoot(int* Parent, int index) {
+  // Path halving 
+  while (Parent[index] != index) {
+    Parent[index] = Parent[Parent[index]];
+    index = Parent[index];
+  }
+  return index;
+}
+
+static inline void vtkImageIslandFilter_Union(int* Parent, int index1, int index2) {
+  index1 = vtkImageIslandFilter_FindRoot(Parent,index1);
+  index2 = vtkImageIslandFilter_FindRoot(Parent,index2);
+  if (index1 < index2) Parent[index2] = index1;
+  else if (index2 < index1) Parent[index1] = index2;
+}
+
+// First pass: joins each voxel in [Start,End) with its neighbors in [Start,index) that have the same label 
+template <class T>
+static void vtkImageIslandFilter_LabelSlab(T* inPtr, int* Parent, int Start, int End, int SizeX, int SizeY, int SizeXY, int NeighborhoodDim) {
+  int x = Start % SizeX;
+  int y = (Start / SizeX) % SizeY;
+  int z = Start / SizeXY;
+  int Use3D = (NeighborhoodDim == IMAGEISLANDFILTER_NEIGHBORHOOD_3D); 
+
+  for (int index = Start; index < End; index++) {
+    T Label = inPtr[index];
+    if (x && (index - 1 >= Start) && (inPtr[index - 1] == Label)) Parent[index] = index - 1;
+    else Parent[index] = index;
+    if (y && (index - SizeX >= Start) && (inPtr[index - SizeX] == Label)) vtkImageIslandFilter_Union(Parent, index, index - SizeX);
+    if (Use3D && z && (index - SizeXY >= Start) && (inPtr[index - SizeXY] == Label)) vtkImageIslandFilter_Union(Parent, index, index - SizeXY);
+
+    if (++x == SizeX) {
+      x = 0;
+      if (++y == SizeY) {y = 0; z++;}
+    }
+  }
+}
+
+// Joins voxels in [Start,End) with neighbors of the same label that are in front of the slab boundary Start
+template <class T>
+static void vtkImageIslandFilter_MergeSlabBoundary(T* inPtr, int* Parent, int Start, int End, int SizeX, int SizeY, int SizeXY, int NeighborhoodDim) {
+  int x = Start % SizeX;
+  int y = (Start / SizeX) % SizeY;
+  int z = Start / SizeXY;
+  int Use3D = (NeighborhoodDim == IMAGEISLANDFILTER_NEIGHBORHOOD_3D); 
+
+  for (int index = Start; index < End; index++) {
+    T Label = inPtr[index];
+    if (x && (index - 1 < Start) && (inPtr[index - 1] == Label)) vtkImageIslandFilter_Union(Parent, index, index - 1);
+    if (y && (index - SizeX < Start) && (inPtr[index - SizeX] == Label)) vtkImageIslandFilter_Union(Parent, index, index - SizeX);
+    if (Use3D && z && (index - SizeXY < Start) && (inPtr[index - SizeXY] == Label)) vtkImageIslandFilter_Union(Parent, index, index - SizeXY);
+
+    if (++x == SizeX) {
+      x = 0;
+      if (++y == SizeY) {y = 0; z++;}
+    }
+  }
+}
+
+template <class T>
+static VTK_THREAD_RETURN_TYPE IslandLabeling_LabelSlab_Function(void *arg) {
+  int CurrentThread = ((ThreadInfoStruct*)(arg))->ThreadID;
+  IslandLabeling_ThreadedParameters<T>* Para = (IslandLabeling_ThreadedParameters<T>*) (((ThreadInfoStruct*)(arg))->UserData);
+  vtkImageIslandFilter_LabelSlab(Para->inPtr, Para->Parent, Para->SlabStart[CurrentThread], Para->SlabStart[CurrentThread+1], Para->SizeX, Para->SizeY, 
+                                 Para->SizeXY, Para->NeighborhoodDim);
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+template <class T> void IslandLabeling<T>::DeleteVariables() {
+  if (this->IslandID)         delete[] this->IslandID;
+  if (this->IslandSize)       delete[] this->IslandSize;
+  if (this->IslandLabel)      delete[] this->IslandLabel;
+  if (this->IslandStartVoxel) delete[] this->IslandStartVoxel;
+  this->IslandID = this->IslandSize = this->IslandStartVoxel = NULL;
+  this->IslandLabel = NULL;
+  this->NumberOfIslands = 0;
+}
+
+template <class T> int IslandLabeling<T>::Execute(T* inPtr, int initSizeX, int initSizeY, int initSizeZ, int NeighborhoodDim, int NumberOfThreads) {
+  this->DeleteVariables();
+  this->SizeX = initSizeX;
+  this->SizeY = initSizeY;
+  this->SizeZ = initSizeZ;
+  int SizeXY  = this->SizeX * this->SizeY;
+  int SizeXYZ = SizeXY * this->SizeZ;
+  if (SizeXYZ < 1) return 0; 
+
+  // During the labelling the array holds the parent of each voxel
+  this->IslandID = new int[SizeXYZ];
+  int* Parent = this->IslandID;
+
+  // Define slabs - they are aligned with the slices if there are enough of them, otherwise with the rows
+  int NumberOfRows  = this->SizeY * this->SizeZ;
+  int NumberOfSlabs = (NumberOfThreads < 1 ? 1 : (NumberOfThreads > NumberOfRows ? NumberOfRows : NumberOfThreads));
+  int Use3D = (NeighborhoodDim == IMAGEISLANDFILTER_NEIGHBORHOOD_3D); 
+  int SliceAligned = (this->SizeZ >= NumberOfSlabs);
+
+  int* SlabStart = new int[NumberOfSlabs + 1];
+  for (int s = 0; s < NumberOfSlabs; s++) {
+    if (SliceAligned) SlabStart[s] = int((long(s) * this->SizeZ) / NumberOfSlabs) * SizeXY;
+    else SlabStart[s] = int((long(s) * NumberOfRows) / NumberOfSlabs) * this->SizeX;
+  }
+  SlabStart[NumberOfSlabs] = SizeXYZ;
+
+  // First pass - independently for each slab 
+  if (NumberOfSlabs > 1) {
+    IslandLabeling_ThreadedParameters<T> Para;
+    Para.inPtr           = inPtr;
+    Para.Parent          = Parent;
+    Para.SlabStart       = SlabStart;
+    Para.SizeX           = this->SizeX;
+    Para.SizeY           = this->SizeY;
+    Para.SizeXY          = SizeXY;
+    Para.NeighborhoodDim = NeighborhoodDim;
+
+    vtkMultiThreader* Threader = vtkMultiThreader::New();
+    Threader->SetNumberOfThreads(NumberOfSlabs);
+    Threader->SetSingleMethod(IslandLabeling_LabelSlab_Function<T>, (void*) &Para);
+    Threader->SingleMethodExecute();
+    Threader->Delete();
+
+    // Merge islands across the slab boundaries - only the voxels of the first row or slice of a slab can have neighbors in front of it  
+    for (int s = 1; s < NumberOfSlabs; s++) {
+      if (SliceAligned && !Use3D) continue;
+      int End = SlabStart[s] + (Use3D ? SizeXY : this->SizeX);
+      if (End > SlabStart[s+1]) End = SlabStart[s+1];
+      vtkImageIslandFilter_MergeSlabBoundary(inPtr, Parent, SlabStart[s], End, this->SizeX, this->SizeY, SizeXY, NeighborhoodDim);
+    }
+  } else {
+    vtkImageIslandFilter_LabelSlab(inPtr, Parent, 0, SizeXYZ, this->SizeX, this->SizeY, SizeXY, NeighborhoodDim);
+  }
+  delete[] SlabStart;
+
+  // Second pass - every root is a new island. As parents are always in front of their children, 
+  // a single sweep replaces the parent of each voxel with the ID of its island
+  for (int index = 0; index < SizeXYZ; index++) if (Parent[index] == index) this->NumberOfIslands ++;
+
+  this->IslandSize       = new int[this->NumberOfIslands + 1];
+  this->IslandLabel      = new T[this->NumberOfIslands + 1];
+  this->IslandStartVoxel = new int[this->NumberOfIslands + 1];
+  this->IslandSize[0] = this->IslandStartVoxel[0] = -1;
+  this->IslandLabel[0] = T(0);
+
+  int ID = 0;
+  for (int index = 0; index < SizeXYZ; index++) {
+    int ParentIndex = Parent[index];
+    if (ParentIndex == index) {
+      ID ++;
+      Parent[index] = ID;
+      this->IslandSize[ID] = 1;
+      this->IslandLabel[ID] = inPtr[index];
+      this->IslandStartVoxel[ID] = index;
+    } else {
+      Parent[index] = Parent[ParentIndex];
+      this->IslandSize[Parent[index]] ++;
+    }
+  }
+  assert(ID == this->NumberOfIslands);
+
+  return this->NumberOfIslands;
+}
+
 
 
 
@@ -401,6 +579,8 @@ vtkImageIslandFilter::vtkImageIslandFilter()
   PrintInformation = IMAGEISLANDFILTER_PRINT_DISABLED;
   NeighborhoodDim = IMAGEISLANDFILTER_NEIGHBORHOOD_3D;
   RemoveHoleOnlyFlag = 0;
+  BatchReassignmentFlag = 0;
+  PeakMemory = 0;
 }
 
 vtkImageIslandFilter::~vtkImageIslandFilter(){ }
@@ -427,41 +607,6 @@ void vtkImageIslandFilter::ExecuteInformation(vtkImageData *inData, vtkImageData
   outData->SetSpacing(inData->GetSpacing());
   outData->SetScalarType(inData->GetScalarType());
 }
-//----------------------------------------------------------------------------
-template <class T>
-static void vtkImageIslandFilter_FindIslands(int* Checked,int index,int & IslandSize,T Label, int ID, T* inPtr, int const SizeX, int const SizeY, int const SizeXY, int const SizeZ, EMStack<int> *Stack) {
-   if ((index % SizeX)              && (inPtr[index-1]     ==  Label)  && (!Checked[index-1])) {
-      Checked[index-1] = ID;
-      IslandSize++;
-      Stack->Push(index-1);
-   }
-   if (((index+1) % SizeX)          && (inPtr[index+1]     ==  Label)  && (!Checked[index+1])) {
-      Checked[index+1] = ID;
-      IslandSize++;
-      Stack->Push(index+1);
-   }
-   if ((int(index/SizeX)%SizeY)    && (inPtr[index-SizeX] ==  Label) && (!Checked[index-SizeX])) {
-     Checked[index-SizeX] = ID;
-     IslandSize++;
-     Stack->Push(index-SizeX);
-   }
-   if ((int(index/SizeX +1)%SizeY) && (inPtr[index+SizeX] ==  Label) && (!Checked[index+SizeX])) {
-     Checked[index+SizeX] = ID;
-     IslandSize++;
-     Stack->Push(index+SizeX);
-   }
-   if ((int(index/(SizeXY)))  && (inPtr[index-SizeXY] ==  Label) && (!Checked[index-SizeXY])) {
-     Checked[index-(SizeXY)] = ID;
-     IslandSize++;
-     Stack->Push(index-(SizeXY));
-   }
-   if ((int(index/(SizeXY)+1) % SizeZ)  && (inPtr[index+SizeXY] ==  Label) && (!Checked[index+(SizeXY)])) {
-     Checked[index+(SizeXY)] = ID;
-     IslandSize++;
-     Stack->Push(index+(SizeXY));
-   }
-}
-
 //----------------------------------------------------------------------------
 template <class T>
 static void vtkImageIslandFilter_GetBorder_Island_ImageEdgeFlag(EMStack<int>* OuterBorder,int index, T Label, T* OutPtr, char *Checked, int const SizeX, int const SizeY, 
@@ -562,6 +707,10 @@ static IslandMemory<T>* vtkImageIslandFilter_DeleteIslandFromImage(IslandMemoryG
   // Make sure that the island memory stack is not empty
   // cout << "============== vtkImageIslandFilter_DeleteIslandFromImage Start Deleting ID "<< DeleteIslandPtr->GetID() << " ========== " << endl;
   assert(Mem->GetID() > -1);
+
+  // Removing a bordering island from Mem can move the entry of DeleteIslandPtr to another node 
+  int DeleteID   = DeleteIslandPtr->GetID();
+  int DeleteSize = DeleteIslandPtr->GetSize();
   
   EMStack<int> *OuterBorder     = new EMStack<int>;
   EMStack<int> *IslandVoxels    = new EMStack<int>;
@@ -718,7 +867,7 @@ static IslandMemory<T>* vtkImageIslandFilter_DeleteIslandFromImage(IslandMemoryG
    
     // b) Change the label for each voxel of the island and delete it 
 
-    IslandSize += DeleteIslandPtr->GetSize();
+    IslandSize += DeleteSize;
     int contIndex;
     while (IslandVoxels->Pop(contIndex)) {
       outPtr[contIndex] = MaxLabel;
@@ -738,7 +887,7 @@ static IslandMemory<T>* vtkImageIslandFilter_DeleteIslandFromImage(IslandMemoryG
   delete BorderIslands;
 
   // Do not delete until the end so that we can provide a pointer the next valid element in the stack 
-  IslandMemory<T>* NEXT = Mem->DeleteIsland(DeleteIslandPtr->GetID(),DeleteIslandPtr->GetSize()); 
+  IslandMemory<T>* NEXT = Mem->DeleteIsland(DeleteID,DeleteSize); 
 
   // cout << "============== vtkImageIslandFilter_DeleteIslandFromImage Start ========== " << endl;
 
@@ -747,40 +896,522 @@ static IslandMemory<T>* vtkImageIslandFilter_DeleteIslandFromImage(IslandMemoryG
 }
 
 //----------------------------------------------------------------------------
-// This templated function executes the filter for any type of data.
-template <class T> static int vtkImageIslandFilter_DefineIsland(int index, EMStack<int> *VoxelStackMem, int *Checked,
-                                T  *inPtr,int const SizeX, int const SizeY, int const SizeXY, int const SizeZ,  int IslandID) {
-
-  // Initializing 
-  T label  = inPtr[index];
-  int IslandSize = 1;
-  EMStack<int> *VoxelStack = new EMStack<int>;
-  Checked[index] = IslandID;
-      
-  // Define Island
-  if (VoxelStackMem) VoxelStackMem->Push(index);
-  // Push in all the neighbors of voxel index that have the same label
-  vtkImageIslandFilter_FindIslands(Checked,index,IslandSize,label,IslandID,inPtr,SizeX, SizeY, SizeXY, SizeZ, VoxelStack);
-
-  // Keep on adding voxels with labels to the stack that are neighbors to voxels in current stack until no new ones can be added 
-  while (VoxelStack->Pop(index)) {
-    if (VoxelStackMem) VoxelStackMem->Push(index);
-    vtkImageIslandFilter_FindIslands(Checked,index,IslandSize,label,IslandID,inPtr, SizeX, SizeY, SizeXY, SizeZ, VoxelStack);
+// Batch reassignment of islands (see vtkImageIslandFilter::SetBatchReassignmentFlag)
+//----------------------------------------------------------------------------
+// Min-heap of islands ordered by size and then by ID
+class IslandQueue {
+public:
+  void Push(int NewSize, int NewID) {
+    if (this->Num == this->MaxNum) {
+      this->MaxNum = (this->MaxNum ? 2*this->MaxNum : 1024);
+      int* NewEntry = new int[2*this->MaxNum];
+      if (this->Entry) {
+        memcpy(NewEntry,this->Entry,sizeof(int)*2*this->Num);
+        delete[] this->Entry;
+      }
+      this->Entry = NewEntry;
+    }
+    int i = this->Num++;
+    while (i && this->Less(NewSize, NewID, (i-1)/2)) {
+      this->Entry[2*i]   = this->Entry[2*((i-1)/2)];
+      this->Entry[2*i+1] = this->Entry[2*((i-1)/2)+1];
+      i = (i-1)/2;
+    }
+    this->Entry[2*i]   = NewSize;
+    this->Entry[2*i+1] = NewID;
+  }
+
+  bool Pop(int& Size, int& ID) {
+    if (!this->Num) return false;
+    Size = this->Entry[0];
+    ID   = this->Entry[1];
+    this->Num --;
+    int LastSize = this->Entry[2*this->Num];
+    int LastID   = this->Entry[2*this->Num+1];
+    int i = 0;
+    while (2*i+1 < this->Num) {
+      int Child = 2*i+1;
+      if ((Child + 1 < this->Num) && this->Less(this->Entry[2*(Child+1)], this->Entry[2*(Child+1)+1], Child)) Child ++;
+      if (!this->Less(this->Entry[2*Child], this->Entry[2*Child+1], LastSize, LastID)) break;
+      this->Entry[2*i]   = this->Entry[2*Child];
+      this->Entry[2*i+1] = this->Entry[2*Child+1];
+      i = Child;
+    }
+    this->Entry[2*i]   = LastSize;
+    this->Entry[2*i+1] = LastID;
+    return true;
+  }
+
+  IslandQueue() {this->Entry = NULL; this->Num = this->MaxNum = 0;}
+  ~IslandQueue() {if (this->Entry) delete[] this->Entry;}
+
+private:
+  bool Less(int Size1, int ID1, int Size2, int ID2) {return ((Size1 < Size2) || ((Size1 == Size2) && (ID1 < ID2)));}
+  bool Less(int Size1, int ID1, int i) {return this->Less(Size1, ID1, this->Entry[2*i], this->Entry[2*i+1]);}
+
+  // Pairs of (size, ID)
+  int* Entry;
+  int  Num;
+  int  MaxNum;
+};
+
+// Pairs of (small island, island of a voxel bordering it) found by one thread 
+typedef struct {
+  int* Pairs;
+  int  NumberOfPairs;
+  int  MaxNumberOfPairs;
+} IslandBorderBuffer;
+
+template <class T> struct IslandBatch_ThreadedParameters {
+  int*   IslandID;
+  char*  SmallFlag;
+  int*   SlabStart;
+  int    SizeX;
+  int    SizeY;
+  int    SizeZ;
+  IslandBorderBuffer* Buffer;
+  T*     outPtr;
+  T*     FinalLabel;
+};
+
+static inline void vtkImageIslandFilter_AddBorderPair(IslandBorderBuffer* Buffer, int SmallID, int BorderID) {
+  if (Buffer->NumberOfPairs == Buffer->MaxNumberOfPairs) {
+    Buffer->MaxNumberOfPairs = (Buffer->MaxNumberOfPairs ? 2*Buffer->MaxNumberOfPairs : 4096);
+    int* NewPairs = new int[2*Buffer->MaxNumberOfPairs];
+    if (Buffer->Pairs) {
+      memcpy(NewPairs,Buffer->Pairs,sizeof(int)*2*Buffer->NumberOfPairs);
+      delete[] Buffer->Pairs;
+    }
+    Buffer->Pairs = NewPairs;
   }
+  Buffer->Pairs[2*Buffer->NumberOfPairs]   = SmallID;
+  Buffer->Pairs[2*Buffer->NumberOfPairs+1] = BorderID;
+  Buffer->NumberOfPairs ++;
+}
 
-  // Clean Up
-  delete VoxelStack;
+// Every voxel is reported once for each small island it borders - same neighborhood as vtkImageIslandFilter_GetBorder_Island_ImageEdgeFlag
+static void vtkImageIslandFilter_FindBorderPairs(int* IslandID, char* SmallFlag, int Start, int End, int SizeX, int SizeY, int SizeZ, IslandBorderBuffer* Buffer) {
+  int SizeXY = SizeX*SizeY;
+  int x = Start % SizeX;
+  int y = (Start / SizeX) % SizeY;
+  int z = Start / SizeXY;
+  int Neighbor[6];
+
+  for (int index = Start; index < End; index++) {
+    int ID = IslandID[index];
+    int NumberOfNeighbors = 0;
+    if (x)           Neighbor[NumberOfNeighbors++] = IslandID[index - 1];
+    if (x < SizeX-1) Neighbor[NumberOfNeighbors++] = IslandID[index + 1];
+    if (y)           Neighbor[NumberOfNeighbors++] = IslandID[index - SizeX];
+    if (y < SizeY-1) Neighbor[NumberOfNeighbors++] = IslandID[index + SizeX];
+    if (z)           Neighbor[NumberOfNeighbors++] = IslandID[index - SizeXY];
+    if (z < SizeZ-1) Neighbor[NumberOfNeighbors++] = IslandID[index + SizeXY];
+
+    for (int i = 0; i < NumberOfNeighbors; i++) {
+      if ((Neighbor[i] == ID) || !SmallFlag[Neighbor[i]]) continue;
+      int j = 0;
+      while ((j < i) && (Neighbor[j] != Neighbor[i])) j++;
+      if (j == i) vtkImageIslandFilter_AddBorderPair(Buffer, Neighbor[i], ID);
+    }
 
-  return IslandSize;
+    if (++x == SizeX) {
+      x = 0;
+      if (++y == SizeY) {y = 0; z++;}
+    }
+  }
 }
 
+template <class T>
+static VTK_THREAD_RETURN_TYPE IslandBatch_FindBorderPairs_Function(void *arg) {
+  int CurrentThread = ((ThreadInfoStruct*)(arg))->ThreadID;
+  IslandBatch_ThreadedParameters<T>* Para = (IslandBatch_ThreadedParameters<T>*) (((ThreadInfoStruct*)(arg))->UserData);
+  vtkImageIslandFilter_FindBorderPairs(Para->IslandID, Para->SmallFlag, Para->SlabStart[CurrentThread], Para->SlabStart[CurrentThread+1], Para->SizeX, Para->SizeY, 
+                                       Para->SizeZ, &(Para->Buffer[CurrentThread]));
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+template <class T>
+static VTK_THREAD_RETURN_TYPE IslandBatch_Relabel_Function(void *arg) {
+  int CurrentThread = ((ThreadInfoStruct*)(arg))->ThreadID;
+  IslandBatch_ThreadedParameters<T>* Para = (IslandBatch_ThreadedParameters<T>*) (((ThreadInfoStruct*)(arg))->UserData);
+  for (int index = Para->SlabStart[CurrentThread]; index < Para->SlabStart[CurrentThread+1]; index++) Para->outPtr[index] = Para->FinalLabel[Para->IslandID[index]];
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+static inline int vtkImageIslandFilter_FindSet(int* SetParent, int ID) {
+  while (SetParent[ID] != ID) {
+    SetParent[ID] = SetParent[SetParent[ID]];
+    ID = SetParent[ID];
+  }
+  return ID;
+}
+
+// Reassigns all islands in one go instead of calling vtkImageIslandFilter_DeleteIslandFromImage island by island. 
+// 1. The voxels bordering small islands are collected in one parallel pass over the image 
+// 2. Islands are merged in the order of a priority queue of their size. An island is merged with the largest neighboring island 
+//    of the most frequent label along its border, like vtkImageIslandFilter_DeleteIslandFromImage does. 
+//    Only the border of an island that absorbed others is recomputed - from the voxels of its members.  
+// 3. The image is relabeled in one parallel pass
+// Results are the same as for the island by island removal except for ties: labels with the same number of border voxels and 
+// neighboring islands (or islands in the queue) of the same size are decided by the smaller label and ID. Also all border voxels 
+// are counted - the island by island removal skips one of them.  
+template <class T>
+// Returns the working memory (in bytes) allocated in addition to the labelling 
+static vtkIdType vtkImageIslandFilter_BatchReassignment(IslandLabeling<T>* Labeling, T* outPtr, int IslandMinSize, int IslandInputLabelFlag, 
+                                                        int IslandInputLabelMin, int IslandInputLabelMax, int RemoveHoleOnlyFlag, int NumberOfThreads, 
+                                                        int PrintInformation) {
+  int NumberOfIslands   = Labeling->GetNumberOfIslands();
+  int *IslandID         = Labeling->GetIslandID();
+  int *IslandSize       = Labeling->GetIslandSize();
+  T   *IslandLabel      = Labeling->GetIslandLabel();
+  int SizeX   = Labeling->GetSizeX();
+  int SizeY   = Labeling->GetSizeY();
+  int SizeZ   = Labeling->GetSizeZ();
+  int SizeXY  = SizeX*SizeY;
+  int SizeXYZ = SizeXY*SizeZ;
+
+  if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED) cout << "There are currently " << NumberOfIslands << " Islands in the image." << endl; 
+
+  // Islands that might be removed  
+  char *SmallFlag = new char[NumberOfIslands + 1];
+  int  MaxSetSize = 0;
+  int  NumberOfSmallIslands = 0;
+  SmallFlag[0] = 0;
+  for (int ID = 1; ID <= NumberOfIslands; ID++) {
+    SmallFlag[ID] = ((IslandSize[ID] < IslandMinSize) && (!IslandInputLabelFlag || ((T(IslandInputLabelMin) <= IslandLabel[ID]) && (IslandLabel[ID] <= T(IslandInputLabelMax)))));
+    if (SmallFlag[ID]) NumberOfSmallIslands ++;
+    if (IslandSize[ID] > MaxSetSize) MaxSetSize = IslandSize[ID];
+  }
+  if (!NumberOfSmallIslands) {
+    delete[] SmallFlag;
+    if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED) cout << "No Islands where deleted " << endl;
+    return vtkIdType(NumberOfIslands + 1)*sizeof(char);
+  }
+
+  // -------------------------------------------- 
+  // 1. Voxels bordering small islands 
+  int NumberOfRows  = SizeY*SizeZ;
+  int NumberOfSlabs = (NumberOfThreads < 1 ? 1 : (NumberOfThreads > NumberOfRows ? NumberOfRows : NumberOfThreads));
+  int* SlabStart = new int[NumberOfSlabs + 1];
+  for (int s = 0; s < NumberOfSlabs; s++) SlabStart[s] = int((long(s) * NumberOfRows) / NumberOfSlabs) * SizeX;
+  SlabStart[NumberOfSlabs] = SizeXYZ;
+
+  IslandBorderBuffer* Buffer = new IslandBorderBuffer[NumberOfSlabs];
+  for (int s = 0; s < NumberOfSlabs; s++) {
+    Buffer[s].Pairs = NULL;
+    Buffer[s].NumberOfPairs = Buffer[s].MaxNumberOfPairs = 0;
+  }
+
+  IslandBatch_ThreadedParameters<T> Para;
+  Para.IslandID   = IslandID;
+  Para.SmallFlag  = SmallFlag;
+  Para.SlabStart  = SlabStart;
+  Para.SizeX      = SizeX;
+  Para.SizeY      = SizeY;
+  Para.SizeZ      = SizeZ;
+  Para.Buffer     = Buffer;
+  Para.outPtr     = outPtr;
+  Para.FinalLabel = NULL;
+
+  vtkMultiThreader* Threader = vtkMultiThreader::New();
+  Threader->SetNumberOfThreads(NumberOfSlabs);
+  Threader->SetSingleMethod(IslandBatch_FindBorderPairs_Function<T>, (void*) &Para);
+  Threader->SingleMethodExecute();
+
+  // Border histogram of each small island: BorderID[BorderStart[ID] ... BorderEnd[ID]-1] are the bordering islands and  
+  // BorderCount the number of border voxels in them
+  int *BorderStart = new int[NumberOfIslands + 2];
+  int *BorderEnd   = new int[NumberOfIslands + 1];
+  memset(BorderStart,0,sizeof(int)*(NumberOfIslands + 2));
+  for (int s = 0; s < NumberOfSlabs; s++) {
+    for (int i = 0; i < Buffer[s].NumberOfPairs; i++) BorderStart[Buffer[s].Pairs[2*i] + 1] ++;
+  }
+  for (int ID = 1; ID <= NumberOfIslands + 1; ID++) BorderStart[ID] += BorderStart[ID-1];
+  int NumberOfPairs = BorderStart[NumberOfIslands + 1];
+  int *BorderID    = new int[NumberOfPairs > 0 ? NumberOfPairs : 1];
+  int *BorderCount = new int[NumberOfPairs > 0 ? NumberOfPairs : 1];
+  for (int ID = 0; ID <= NumberOfIslands; ID++) BorderEnd[ID] = BorderStart[ID];
+  for (int s = 0; s < NumberOfSlabs; s++) {
+    for (int i = 0; i < Buffer[s].NumberOfPairs; i++) BorderID[BorderEnd[Buffer[s].Pairs[2*i]]++] = Buffer[s].Pairs[2*i+1];
+    if (Buffer[s].Pairs) delete[] Buffer[s].Pairs;
+  }
+  delete[] Buffer;
+
+  // Count border voxels per bordering island  
+  int *Owner    = new int[NumberOfIslands + 1];
+  int *Position = new int[NumberOfIslands + 1];
+  memset(Owner,0,sizeof(int)*(NumberOfIslands + 1));
+  for (int ID = 1; ID <= NumberOfIslands; ID++) {
+    int End = BorderStart[ID];
+    for (int i = BorderStart[ID]; i < BorderEnd[ID]; i++) {
+      int NeighborID = BorderID[i];
+      if (Owner[NeighborID] == ID) BorderCount[Position[NeighborID]] ++;
+      else {
+        Owner[NeighborID]    = ID;
+        Position[NeighborID] = End;
+        BorderID[End]    = NeighborID;
+        BorderCount[End] = 1;
+        End ++;
+      }
+    }
+    BorderEnd[ID] = End;
+  }
+
+  // Voxels of each small island 
+  int *VoxelStart = new int[NumberOfIslands + 2];
+  memset(VoxelStart,0,sizeof(int)*(NumberOfIslands + 2));
+  for (int ID = 1; ID <= NumberOfIslands; ID++) VoxelStart[ID+1] = VoxelStart[ID] + (SmallFlag[ID] ? IslandSize[ID] : 0);
+  int *Voxels   = new int[VoxelStart[NumberOfIslands + 1]];
+  int *VoxelEnd = new int[NumberOfIslands + 1];
+  memcpy(VoxelEnd,VoxelStart,sizeof(int)*(NumberOfIslands + 1));
+  for (int index = 0; index < SizeXYZ; index++) {
+    if (SmallFlag[IslandID[index]]) Voxels[VoxelEnd[IslandID[index]]++] = index;
+  }
+  delete[] VoxelEnd;
+
+  // Islands touching the edge of the image - same definition as vtkImageIslandFilter_GetBorder_Island_ImageEdgeFlag
+  char *SetEdgeFlag = new char[NumberOfIslands + 1];
+  memset(SetEdgeFlag,0,sizeof(char)*(NumberOfIslands + 1));
+  if (RemoveHoleOnlyFlag) {
+    for (int z = 0; z < SizeZ; z++) {
+      for (int y = 0; y < SizeY; y++) {
+        int *RowID = IslandID + z*SizeXY + y*SizeX;
+        int EdgeRow = (((SizeZ > 2) && ((z == 0) || (z == SizeZ-1))) || ((SizeY > 2) && ((y == 0) || (y == SizeY-1))));
+        if (EdgeRow) {
+          for (int x = 0; x < SizeX; x++) SetEdgeFlag[RowID[x]] = 1;
+        } else if (SizeX > 2) {
+          SetEdgeFlag[RowID[0]] = SetEdgeFlag[RowID[SizeX-1]] = 1;
+        }
+      }
+    }
+  }
+
+  // -------------------------------------------- 
+  // 2. Merge islands - the islands merged into each other form sets, which are identified by their ID
+  int  *SetParent  = new int[NumberOfIslands + 1];
+  int  *SetSize    = new int[NumberOfIslands + 1];
+  T    *SetLabel   = new T[NumberOfIslands + 1];
+  // Islands of a set are linked via NextMember
+  int  *NextMember = new int[NumberOfIslands + 1];
+  int  *LastMember = new int[NumberOfIslands + 1];
+  IslandQueue Queue;
+  for (int ID = 0; ID <= NumberOfIslands; ID++) {
+    SetParent[ID]  = ID;
+    SetSize[ID]    = IslandSize[ID];
+    SetLabel[ID]   = IslandLabel[ID];
+    NextMember[ID] = 0;
+    LastMember[ID] = ID;
+    if (SmallFlag[ID]) Queue.Push(SetSize[ID],ID);
+  }
+
+  // Border of the current set - bordering islands, number of border voxels and labels 
+  int MaxNumberOfNeighbors = 64;
+  int *NeighborID    = new int[MaxNumberOfNeighbors];
+  int *NeighborCount = new int[MaxNumberOfNeighbors];
+  int *LabelCount    = new int[MaxNumberOfNeighbors];
+  T   *LabelName     = new T[MaxNumberOfNeighbors];
+  int *Stamp = NULL;
+  int CurrentStamp = 0;
+  int IslandDeleteCount = 0; 
+
+  int DeleteSize, DeleteID;
+  while (Queue.Pop(DeleteSize,DeleteID)) {
+    // Entry is outdated 
+    if ((SetParent[DeleteID] != DeleteID) || (SetSize[DeleteID] != DeleteSize)) continue;
+    // Never remove the largest islands 
+    if (DeleteSize >= MaxSetSize) break;
+
+    // a) Define bordering islands 
+    int NumberOfNeighbors = 0;
+    if (NextMember[DeleteID]) {
+      // Set has absorbed other islands - recompute its border  
+      if (!Stamp) {
+        Stamp = new int[SizeXYZ];
+        memset(Stamp,0,sizeof(int)*SizeXYZ);
+      }
+      CurrentStamp ++;
+      for (int Member = DeleteID; Member; Member = NextMember[Member]) {
+        for (int i = VoxelStart[Member]; i < VoxelStart[Member+1]; i++) {
+          int index = Voxels[i];
+          int x = index % SizeX;
+          int y = (index / SizeX) % SizeY;
+          int z = index / SizeXY;
+          int Neighbor[6];
+          int NumberOfVoxelNeighbors = 0;
+          if (x)           Neighbor[NumberOfVoxelNeighbors++] = index - 1;
+          if (x < SizeX-1) Neighbor[NumberOfVoxelNeighbors++] = index + 1;
+          if (y)           Neighbor[NumberOfVoxelNeighbors++] = index - SizeX;
+          if (y < SizeY-1) Neighbor[NumberOfVoxelNeighbors++] = index + SizeX;
+          if (z)           Neighbor[NumberOfVoxelNeighbors++] = index - SizeXY;
+          if (z < SizeZ-1) Neighbor[NumberOfVoxelNeighbors++] = index + SizeXY;
+          for (int j = 0; j < NumberOfVoxelNeighbors; j++) {
+            int NeighborIndex = Neighbor[j];
+            if ((Stamp[NeighborIndex] == CurrentStamp) || (vtkImageIslandFilter_FindSet(SetParent,IslandID[NeighborIndex]) == DeleteID)) continue; 
+            Stamp[NeighborIndex] = CurrentStamp;
+            int ID = IslandID[NeighborIndex];
+            if (Owner[ID] == -CurrentStamp) {
+              NeighborCount[Position[ID]] ++;
+              continue;
+            }
+            if (NumberOfNeighbors == MaxNumberOfNeighbors) {
+              MaxNumberOfNeighbors *= 2;
+              int *NewNeighborID    = new int[MaxNumberOfNeighbors];
+              int *NewNeighborCount = new int[MaxNumberOfNeighbors];
+              memcpy(NewNeighborID,NeighborID,sizeof(int)*NumberOfNeighbors);
+              memcpy(NewNeighborCount,NeighborCount,sizeof(int)*NumberOfNeighbors);
+              delete[] NeighborID;
+              delete[] NeighborCount;
+              delete[] LabelCount;
+              delete[] LabelName;
+              NeighborID    = NewNeighborID;
+              NeighborCount = NewNeighborCount;
+              LabelCount    = new int[MaxNumberOfNeighbors];
+              LabelName     = new T[MaxNumberOfNeighbors];
+            }
+            Owner[ID]    = -CurrentStamp;
+            Position[ID] = NumberOfNeighbors;
+            NeighborID[NumberOfNeighbors]    = ID;
+            NeighborCount[NumberOfNeighbors] = 1;
+            NumberOfNeighbors ++;
+          }
+        }
+      }
+    } else {
+      NumberOfNeighbors = BorderEnd[DeleteID] - BorderStart[DeleteID];
+      if (NumberOfNeighbors > MaxNumberOfNeighbors) {
+        while (NumberOfNeighbors > MaxNumberOfNeighbors) MaxNumberOfNeighbors *= 2;
+        delete[] NeighborID;
+        delete[] NeighborCount;
+        delete[] LabelCount;
+        delete[] LabelName;
+        NeighborID    = new int[MaxNumberOfNeighbors];
+        NeighborCount = new int[MaxNumberOfNeighbors];
+        LabelCount    = new int[MaxNumberOfNeighbors];
+        LabelName     = new T[MaxNumberOfNeighbors];
+      }
+      memcpy(NeighborID, BorderID + BorderStart[DeleteID], sizeof(int)*NumberOfNeighbors);
+      memcpy(NeighborCount, BorderCount + BorderStart[DeleteID], sizeof(int)*NumberOfNeighbors);
+    }
+    if (!NumberOfNeighbors) continue;
+
+    // b) Number of border voxels per label - islands are replaced by the set they belong to 
+    int NumberOfLabels = 0;
+    for (int i = 0; i < NumberOfNeighbors; i++) {
+      NeighborID[i] = vtkImageIslandFilter_FindSet(SetParent,NeighborID[i]);
+      T Label = SetLabel[NeighborID[i]];
+      int j = 0;
+      while ((j < NumberOfLabels) && (LabelName[j] != Label)) j++;
+      if (j == NumberOfLabels) {
+        LabelName[j]  = Label;
+        LabelCount[j] = 0;
+        NumberOfLabels ++;
+      }
+      LabelCount[j] += NeighborCount[i];
+    }
+
+    // Only remove islands that are holes, i.e. encircled by one label
+    if (RemoveHoleOnlyFlag && (SetEdgeFlag[DeleteID] || (NumberOfLabels > 1))) continue;
+
+    T MaxLabel = LabelName[0];
+    int MaxNumber = LabelCount[0];
+    for (int j = 1; j < NumberOfLabels; j++) {
+      if ((LabelCount[j] > MaxNumber) || ((LabelCount[j] == MaxNumber) && (LabelName[j] < MaxLabel))) {
+        MaxNumber = LabelCount[j];
+        MaxLabel  = LabelName[j];
+      }
+    }
+
+    // Largest bordering set with that label
+    int MaxID = -1;
+    for (int i = 0; i < NumberOfNeighbors; i++) {
+      int ID = NeighborID[i];
+      if ((SetLabel[ID] == MaxLabel) && ((MaxID < 0) || (SetSize[ID] > SetSize[MaxID]) || ((SetSize[ID] == SetSize[MaxID]) && (ID < MaxID)))) MaxID = ID;
+    }
+
+    // c) Merge the other bordering sets with that label (unless they are big enough to stay anyway) and the island into the largest one  
+    for (int i = 0; i <= NumberOfNeighbors; i++) {
+      int ID = (i < NumberOfNeighbors ? NeighborID[i] : DeleteID);
+      if ((ID == MaxID) || (SetParent[ID] != ID)) continue;
+      if ((i < NumberOfNeighbors) && ((SetLabel[ID] != MaxLabel) || (SetSize[ID] >= IslandMinSize))) continue;
+      SetParent[ID] = MaxID;
+      SetSize[MaxID] += SetSize[ID];
+      SetEdgeFlag[MaxID] |= SetEdgeFlag[ID];
+      NextMember[LastMember[MaxID]] = ID;
+      LastMember[MaxID] = LastMember[ID];
+    }
+    IslandDeleteCount ++;
+
+#ifndef _WIN32  
+    if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED && !(IslandDeleteCount % 100)) {  
+      cout << DeleteSize << " "; 
+      cout.flush();
+    }
+#endif
+
+    if (SetSize[MaxID] > MaxSetSize) MaxSetSize = SetSize[MaxID];
+    if ((SetSize[MaxID] < IslandMinSize) && (!IslandInputLabelFlag || ((T(IslandInputLabelMin) <= MaxLabel) && (MaxLabel <= T(IslandInputLabelMax))))) {
+      Queue.Push(SetSize[MaxID],MaxID);
+    }
+  }
+
+  // -------------------------------------------- 
+  // 3. Relabel image 
+  if (IslandDeleteCount) {
+    T *FinalLabel = new T[NumberOfIslands + 1];
+    for (int ID = 0; ID <= NumberOfIslands; ID++) FinalLabel[ID] = SetLabel[vtkImageIslandFilter_FindSet(SetParent,ID)];
+    Para.FinalLabel = FinalLabel;
+    Threader->SetSingleMethod(IslandBatch_Relabel_Function<T>, (void*) &Para);
+    Threader->SingleMethodExecute();
+    delete[] FinalLabel;
+  }
+
+  if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED) {
+    if (IslandDeleteCount) {
+      if (IslandDeleteCount > 99) cout << endl;
+      int NumberOfSets = 0;
+      for (int ID = 1; ID <= NumberOfIslands; ID++) if (SetParent[ID] == ID) NumberOfSets ++;
+      cout << "New number of Islands: " << NumberOfSets << endl; 
+    } else {
+      cout << "No Islands where deleted " << endl;
+    }
+  }
+
+  // Per island arrays, border histograms, voxel lists, border of the current set and stamps 
+  vtkIdType WorkingMemory = vtkIdType(NumberOfIslands + 1)*(2*sizeof(char) + 9*sizeof(int) + sizeof(T)) 
+    + vtkIdType(NumberOfPairs)*2*sizeof(int) + vtkIdType(VoxelStart[NumberOfIslands + 1])*sizeof(int) 
+    + vtkIdType(MaxNumberOfNeighbors)*(3*sizeof(int) + sizeof(T)) + (Stamp ? vtkIdType(SizeXYZ)*sizeof(int) : 0);
+
+  Threader->Delete();
+  delete[] SlabStart;
+  delete[] SmallFlag;
+  delete[] BorderStart;
+  delete[] BorderEnd;
+  delete[] BorderID;
+  delete[] BorderCount;
+  delete[] Owner;
+  delete[] Position;
+  delete[] VoxelStart;
+  delete[] Voxels;
+  delete[] SetEdgeFlag;
+  delete[] SetParent;
+  delete[] SetSize;
+  delete[] SetLabel;
+  delete[] NextMember;
+  delete[] LastMember;
+  delete[] NeighborID;
+  delete[] NeighborCount;
+  delete[] LabelCount;
+  delete[] LabelName;
+  if (Stamp) delete[] Stamp;
+
+  return WorkingMemory;
+}
 
 template <class T>
 static void vtkImageIslandFilterExecute(vtkImageIslandFilter *self, T *inPtr, int inExt[6], short* IslandROIPtr, T *outPtr)
 {
   // cout << "vtkImageIslandFilterExecute Start " << endl;
 
-  int index = 0; 
   int IslandCount = 0;
 
   // find the region to loop over
@@ -790,11 +1421,8 @@ static void vtkImageIslandFilterExecute(vtkImageIslandFilter *self, T *inPtr, in
 
   int SizeXY = SizeX * SizeY;
   int SizeXYZ = SizeXY*SizeZ;
-  memcpy(outPtr,inPtr,sizeof(T)*SizeXYZ);
+  if (outPtr != inPtr) memcpy(outPtr,inPtr,sizeof(T)*SizeXYZ);
 
-  // The Slices of the images 
-  int *Checked = new int[SizeXYZ];
-  memset(Checked,0,SizeXYZ*sizeof(int));
   int DeletedIslands = 0;
 
 
@@ -819,114 +1447,114 @@ static void vtkImageIslandFilterExecute(vtkImageIslandFilter *self, T *inPtr, in
   // Currently only implemented as static 
   if (IslandRemovalType == IMAGEISLANDFILTER_DYNAMIC) assert(!IslandROIPtr);
 
-  IslandMemoryGroup<T> *Mem = (IslandRemovalType == IMAGEISLANDFILTER_STATIC ? NULL : new IslandMemoryGroup<T>);
-  if (Mem) Mem->SetMaxSize(IslandMinSize);
+  if (PrintInformation == IMAGEISLANDFILTER_PRINT_COMPREHENSIVE)  cout << "vtkImageIslandFilterExecute: Detect Islands in the image" << endl;
 
+  IslandLabeling<T> Labeling;
+  int NumberOfIslands   = Labeling.Execute(inPtr, SizeX, SizeY, SizeZ, self->GetNeighborhoodDim(), self->GetNumberOfThreads());
+  int *Checked          = Labeling.GetIslandID();
+  int *IslandSize       = Labeling.GetIslandSize();
+  T   *IslandLabel      = Labeling.GetIslandLabel();
 
-  EMStack<int> *VoxelStackMem = NULL;
-  EMStack<int> **ListVoxelStackMem = NULL;
-  int  *ListVoxelStackSize = NULL;
-  int  ListVoxelStackMinSize = -1;
-  
-  //  Memory  
   if (IslandRemovalType == IMAGEISLANDFILTER_STATIC) {
-    VoxelStackMem = new EMStack<int>;
+    // 0 = not visited, 1 = visited, 2 = relabel with IslandOutputLabel   
+    char *IslandStatus = new char[NumberOfIslands + 1];
+    memset(IslandStatus,0,sizeof(char)*(NumberOfIslands + 1));
+    self->UpdatePeakMemory(Labeling.GetMemorySize() + vtkIdType(NumberOfIslands + 1)*sizeof(char) + vtkIdType(IslandMaxNum > 0 ? IslandMaxNum : 0)*2*sizeof(int));
+
+    // The IslandMaxNum largest islands 
+    int  *ListIslandID = NULL;
+    int  *ListIslandSize = NULL;
+    int  ListIslandMinSize = -1;
     if (IslandMaxNum > 0) {
-      ListVoxelStackMem = new EMStack<int>*[IslandMaxNum];
-      ListVoxelStackSize = new int[IslandMaxNum];
+      ListIslandID = new int[IslandMaxNum];
+      ListIslandSize = new int[IslandMaxNum];
       for (int i = 0; i < IslandMaxNum; i++) {
-    ListVoxelStackMem[i] = NULL;
-    ListVoxelStackSize[i] = -1; 
+        ListIslandID[i] = 0;
+        ListIslandSize[i] = -1; 
       }
     }
-  }
 
-  if (PrintInformation == IMAGEISLANDFILTER_PRINT_COMPREHENSIVE)  cout << "vtkImageIslandFilterExecute: Detect Islands in the image" << endl;
+    // Islands are visited in the order of their first voxel in the ROI
+    int ID = 0;
+    int index = 0; 
+    while (1) {
+      if (IslandROIPtr) {
+        while ((index < SizeXYZ) && (!IslandROIPtr[index] || IslandStatus[Checked[index]])) index ++;
+        if (index == SizeXYZ) break;
+        ID = Checked[index];
+      } else if (++ID > NumberOfIslands) break; 
+      IslandStatus[ID] = 1;
 
-  while (index < SizeXYZ) {
-    if (!Checked[index]) {
-      switch (IslandRemovalType) {
-      case IMAGEISLANDFILTER_DYNAMIC: {
-      IslandCount ++;
-      int NewID = IslandCount; 
-      int IslandSize = vtkImageIslandFilter_DefineIsland(index, NULL, Checked, inPtr, SizeX, SizeY, SizeXY, SizeZ, NewID);
-          // If it is not the same then island must be alread part of it 
-          int currentIslandCount = Mem->AddIsland(index,IslandSize,inPtr[index],IslandCount);
-          assert(currentIslandCount == IslandCount);
-      break;
-      }
-      case IMAGEISLANDFILTER_STATIC: {
-      // Only delete it if it is a certain lable and if activated - touching the ROI
-    if ((IslandInputLabelFlag  && ((T(IslandInputLabelMin) >  inPtr[index]) || (T(IslandInputLabelMax) <  inPtr[index])))
-                     || (IslandROIPtr && !*IslandROIPtr)) break;
+      // Only delete it if it is a certain lable 
+      if (IslandInputLabelFlag  && ((T(IslandInputLabelMin) >  IslandLabel[ID]) || (T(IslandInputLabelMax) <  IslandLabel[ID]))) continue;
 
       IslandCount ++;
-      int IslandSize = vtkImageIslandFilter_DefineIsland(index, VoxelStackMem, Checked, inPtr, SizeX, SizeY, SizeXY, SizeZ, IslandCount);
-      int contIndex; 
       // Relabel all of them  if true and otherwise do not do anything
-      if (IslandSize < IslandMinSize) {
+      if (IslandSize[ID] < IslandMinSize) {
         if ((IslandMaxNum < 1) || (IslandCount > IslandMaxNum)) {
+          int DeleteID = ID;
           if (IslandMaxNum  > 0 ) {
-        IslandCount --;
-        if (ListVoxelStackMinSize < IslandSize) {
-          // throw one out of the list 
-          int i = 0 ;
-          while ((i < IslandMaxNum) && (ListVoxelStackSize[i] != ListVoxelStackMinSize)) i ++;
-          assert(i < IslandMaxNum);
-          EMStack<int> *VoxelStackMemTemp =  ListVoxelStackMem[i];
-          ListVoxelStackMem[i] = VoxelStackMem;
-          ListVoxelStackSize[i] =  IslandSize;
-          VoxelStackMem = VoxelStackMemTemp;
+            IslandCount --;
+            if (ListIslandMinSize < IslandSize[ID]) {
+              // throw one out of the list 
+              int i = 0 ;
+              while ((i < IslandMaxNum) && (ListIslandSize[i] != ListIslandMinSize)) i ++;
+              assert(i < IslandMaxNum);
+              DeleteID = ListIslandID[i];
+              ListIslandID[i] = ID;
+              ListIslandSize[i] = IslandSize[ID];
     
-          ListVoxelStackMinSize = ListVoxelStackSize[0];
-          for (int j = 1; j <  IslandMaxNum; j++) {if (ListVoxelStackSize[j] < ListVoxelStackMinSize) ListVoxelStackMinSize = ListVoxelStackSize[j];}
-        }
+              ListIslandMinSize = ListIslandSize[0];
+              for (int j = 1; j <  IslandMaxNum; j++) {if (ListIslandSize[j] < ListIslandMinSize) ListIslandMinSize = ListIslandSize[j];}
+            }
           }
           DeletedIslands ++;
-          while (VoxelStackMem->Pop(contIndex))  outPtr[contIndex] = T(IslandOutputLabel);
+          IslandStatus[DeleteID] = 2;
         } else {
           // Add to memory list 
-          if ((ListVoxelStackMinSize > IslandSize) || (IslandCount == 1 )) ListVoxelStackMinSize = IslandSize;
-          ListVoxelStackMem[IslandCount - 1] = VoxelStackMem;
-          ListVoxelStackSize[IslandCount - 1] = IslandSize;
-          VoxelStackMem = new EMStack<int>;
+          if ((ListIslandMinSize > IslandSize[ID]) || (IslandCount == 1 )) ListIslandMinSize = IslandSize[ID];
+          ListIslandID[IslandCount - 1] = ID;
+          ListIslandSize[IslandCount - 1] = IslandSize[ID];
         }
-      } else while (VoxelStackMem->Pop(contIndex));
-      break;
-      }
-      default :
-      cout << "Do not know type " << IslandRemovalType << endl;
-      exit(1);
-      }
+      } 
     }
 
-    if (IslandROIPtr) IslandROIPtr ++;
-    index ++;
-  }
+    if (DeletedIslands) {
+      for (int i = 0; i < SizeXYZ; i++) if (IslandStatus[Checked[i]] == 2) outPtr[i] = T(IslandOutputLabel);
+    }
 
-  if (IslandRemovalType == IMAGEISLANDFILTER_STATIC) {
     // Already deleted all Islands 
     if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED) 
       cout << "Deleted " << DeletedIslands << " from " << IslandCount << " between label " << IslandInputLabelMin << " and " << IslandInputLabelMax <<  endl;
-    delete[] Checked;
     
+    delete[] IslandStatus;
     if (IslandMaxNum > 0) {
-      for (int i = 0; i < IslandMaxNum; i++) {
-    if (ListVoxelStackMem[i] ) {
-      int blub; 
-      while (ListVoxelStackMem[i]->Pop(blub));
-      delete ListVoxelStackMem[i];
-      ListVoxelStackMem[i] = NULL;
-    }
-      }
-      delete[] ListVoxelStackMem; 
-      delete[] ListVoxelStackSize;
+      delete[] ListIslandID; 
+      delete[] ListIslandSize;
     }
+    return;
+  }
 
-    delete VoxelStackMem;
+  if (self->GetBatchReassignmentFlag()) {
+    self->UpdatePeakMemory(Labeling.GetMemorySize() + 
+                           vtkImageIslandFilter_BatchReassignment(&Labeling, outPtr, IslandMinSize, IslandInputLabelFlag, IslandInputLabelMin, IslandInputLabelMax, 
+                                                                  RemoveHoleOnlyFlag, self->GetNumberOfThreads(), PrintInformation));
     return;
   }
 
+  IslandMemoryGroup<T> *Mem = new IslandMemoryGroup<T>;
+  Mem->SetMaxSize(IslandMinSize);
+
+  int *IslandStartVoxel = Labeling.GetIslandStartVoxel();
+  for (int ID = 1; ID <= NumberOfIslands; ID++) {
+    // If it is not the same then island must be alread part of it 
+    int currentIslandCount = Mem->AddIsland(IslandStartVoxel[ID],IslandSize[ID],IslandLabel[ID],ID);
+    assert(currentIslandCount == ID);
+  }
+  IslandCount = NumberOfIslands;
+  // The list of islands and the voxels checked when deleting an island 
+  self->UpdatePeakMemory(Labeling.GetMemorySize() + vtkIdType(NumberOfIslands)*sizeof(IslandMemory<T>) + vtkIdType(SizeXYZ)*sizeof(char));
+
   // Now we define Dynamic Displacement 
 
   // Have to delete islands now 
@@ -996,8 +1624,7 @@ static void vtkImageIslandFilterExecute(vtkImageIslandFilter *self, T *inPtr, in
     }
   }
 
-  if (Mem) delete Mem;
-  delete[] Checked;
+  delete Mem;
   // cout << "vtkImageIslandFilterExecute End " << endl;
 }
 
@@ -1026,9 +1653,6 @@ static void vtkImageIslandFilterExecuteBySlice(vtkImageIslandFilter *self, T *in
 // void vtkImageIslandFilter::ThreadedExecute(vtkImageData *inData, vtkImageData *outData,int outExt[6], int id)
 void vtkImageIslandFilter::ExecuteData(vtkDataObject *)
 {
-  void *inPtr;
-  void *outPtr;
-
   int inExt[6];
   vtkIdType inInc[3];
   int outExt[6];
@@ -1059,6 +1683,43 @@ void vtkImageIslandFilter::ExecuteData(vtkDataObject *)
      return;
   }
 
+  this->RemoveIslands(inData, inData->GetScalarPointerForExtent(inExt), inExt, outData->GetScalarPointerForExtent(outExt));
+}
+
+//----------------------------------------------------------------------------
+int vtkImageIslandFilter::RemoveIslandsInPlace(vtkImageData *LabelMap)
+{
+  if (LabelMap == NULL) {
+    vtkErrorMacro(<< "RemoveIslandsInPlace: LabelMap must be specified.");
+    return 0;
+  }
+  if (LabelMap->GetNumberOfScalarComponents() != 1) {
+     vtkErrorMacro(<< "Number Of Scalar Components for LabelMap has to be 1.");
+     return 0;
+  }
+  int Ext[6];
+  vtkIdType Inc[3];
+  LabelMap->GetExtent(Ext);
+  LabelMap->GetContinuousIncrements(Ext, Inc[0], Inc[1], Inc[2]);
+  if ( Inc[0] || Inc[1] || Inc[2] ) {
+     vtkErrorMacro(<< "Increments for LabelMap have to be 0!");
+     return 0;
+  }
+  void *Ptr = LabelMap->GetScalarPointerForExtent(Ext);
+  if (Ptr == NULL) {
+    vtkErrorMacro(<< "RemoveIslandsInPlace: LabelMap has no scalars.");
+    return 0;
+  }
+  if (!this->RemoveIslands(LabelMap, Ptr, Ext, Ptr)) return 0;
+  LabelMap->Modified();
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageIslandFilter::RemoveIslands(vtkImageData *inData, void *inPtr, int inExt[6], void *outPtr)
+{
+  this->PeakMemory = 0;
+
   // Check IslandROI 
   short *islandROIPtr = NULL;
   if (IslandROI) {
@@ -1072,9 +1733,6 @@ void vtkImageIslandFilter::ExecuteData(vtkDataObject *)
     islandROIPtr = (short*)this->IslandROI->GetScalarPointerForExtent(islandExt);
   }
 
-  inPtr = inData->GetScalarPointerForExtent(inExt);
-  outPtr = outData->GetScalarPointerForExtent(outExt);
-
   if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED) { 
     cout << "====================================================== " << endl;
     cout << "vtkImageIslandFilter::ExecuteData: Delete Islands smaller " << this->IslandMinSize << " in Mode " << (this->NeighborhoodDim == IMAGEISLANDFILTER_NEIGHBORHOOD_3D ? 3 : 2) << "D" << endl;  
@@ -1086,51 +1744,34 @@ void vtkImageIslandFilter::ExecuteData(vtkDataObject *)
       vtkTemplateMacro(vtkImageIslandFilterExecute(this, (VTK_TT *)(inPtr),inExt, islandROIPtr, (VTK_TT *)(outPtr)));
     default:
       vtkErrorMacro(<< "Execute: Unknown ScalarType");
-      return;
+      return 0;
     }
   } else {
       switch (inData->GetScalarType()) {
     vtkTemplateMacro(vtkImageIslandFilterExecuteBySlice(this, (VTK_TT *)(inPtr),inExt, islandROIPtr, (VTK_TT *)(outPtr)));
       default:
     vtkErrorMacro(<< "Execute: Unknown ScalarType");
-    return;
+    return 0;
       }
   }
   if (PrintInformation > IMAGEISLANDFILTER_PRINT_DISABLED) {
     cout << "vtkImageIslandFilter::ExecuteData: Finished Deleting " << endl;
     cout << "====================================================== " << endl;
   }
-
+  return 1;
 }
 
 template <class T>
-static void vtkImageIslandFilter_GetMaxIslandSize(T* inPtr, int LabelMin , int LabelMax, int inExt[6], int& maxSize ) {
-
-   int SizeX = inExt[1] - inExt[0] + 1;
-   int SizeY = inExt[3] - inExt[2] + 1; 
-   int SizeZ = inExt[5] - inExt[4] + 1; 
-   int SizeXY = SizeX * SizeY;
-   int SizeXYZ = SizeXY*SizeZ;
+static void vtkImageIslandFilter_GetMaxIslandSize(T* inPtr, int LabelMin , int LabelMax, int inExt[6], int NumberOfThreads, int& maxSize ) {
+   IslandLabeling<T> Labeling;
+   int NumberOfIslands = Labeling.Execute(inPtr, inExt[1] - inExt[0] + 1, inExt[3] - inExt[2] + 1, inExt[5] - inExt[4] + 1, IMAGEISLANDFILTER_NEIGHBORHOOD_3D, NumberOfThreads);
+   int *IslandSize  = Labeling.GetIslandSize();
+   T   *IslandLabel = Labeling.GetIslandLabel();
 
-   int *Checked = new int[SizeXYZ];
-   memset(Checked,0,SizeXYZ*sizeof(int));
-
-   int index = 0; 
-   int IslandCount = 0;
    maxSize = -1; 
-
-   while (index < SizeXYZ) {
-     if (!Checked[index]) {
-
-       if ((T(LabelMin) <=  inPtr[index]) && (inPtr[index] <= T(LabelMax))) {
-    IslandCount ++;
-    int IslandSize = vtkImageIslandFilter_DefineIsland(index, NULL, Checked, inPtr, SizeX, SizeY, SizeXY, SizeZ, IslandCount);
-    if (IslandSize > maxSize ) {maxSize= IslandSize;}
-       }
-     }
-     index ++;
+   for (int ID = 1; ID <= NumberOfIslands; ID++) {
+     if ((T(LabelMin) <=  IslandLabel[ID]) && (IslandLabel[ID] <= T(LabelMax)) && (IslandSize[ID] > maxSize)) maxSize = IslandSize[ID];
    }
-   delete[] Checked;
 }
 
 
@@ -1147,7 +1788,7 @@ int vtkImageIslandFilter::GetMaxIslandSize(vtkImageData *InputData) {
    void* inPtr = InputData->GetScalarPointerForExtent(inExt);
    int result;
    switch (InputData->GetScalarType()) {
-      vtkTemplateMacro(vtkImageIslandFilter_GetMaxIslandSize((VTK_TT *)(inPtr), IslandInputLabelMin,  IslandInputLabelMax, inExt, result)); 
+      vtkTemplateMacro(vtkImageIslandFilter_GetMaxIslandSize((VTK_TT *)(inPtr), IslandInputLabelMin,  IslandInputLabelMax, inExt, this->GetNumberOfThreads(), result)); 
    default:
     vtkErrorMacro(<< "Execute: Unknown ScalarType");
     return -1;
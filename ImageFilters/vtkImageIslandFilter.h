@@ -214,6 +214,50 @@ template<class T> class EMStack {
     bool Valid;
     EMStack* Next;
 };
+
+// Connected component labelling of a label map by two pass union-find.
+// The first pass runs in parallel over slabs of the image, the slabs are then merged along their
+// boundaries and a final linear sweep numbers the islands. Islands are numbered from 1 in the
+// order of their first voxel, i.e. the same order in which the flood fill used to find them.
+// Per island statistics are kept in flat arrays indexed by the island ID (entry 0 is unused).
+template<class T> class IslandLabeling {
+public:
+  // NeighborhoodDim is IMAGEISLANDFILTER_NEIGHBORHOOD_3D or IMAGEISLANDFILTER_NEIGHBORHOOD_2D, in 2D slices are labelled independently
+  // Returns the number of islands
+  int Execute(T* inPtr, int initSizeX, int initSizeY, int initSizeZ, int NeighborhoodDim, int NumberOfThreads);
+
+  int  GetNumberOfIslands() {return this->NumberOfIslands;}
+  // ID of the island of each voxel
+  int* GetIslandID() {return this->IslandID;}
+  int* GetIslandSize() {return this->IslandSize;}
+  T*   GetIslandLabel() {return this->IslandLabel;}
+  // First voxel of the island in scan order
+  int* GetIslandStartVoxel() {return this->IslandStartVoxel;}
+
+  int GetSizeX() {return this->SizeX;}
+  int GetSizeY() {return this->SizeY;}
+  int GetSizeZ() {return this->SizeZ;}
+
+  // Bytes allocated for the island IDs and the statistics of the islands
+  vtkIdType GetMemorySize() {return vtkIdType(this->SizeX)*this->SizeY*this->SizeZ*sizeof(int) + vtkIdType(this->NumberOfIslands + 1)*(2*sizeof(int) + sizeof(T));}
+
+  IslandLabeling() {this->IslandID = this->IslandSize = this->IslandStartVoxel = NULL; this->IslandLabel = NULL; this->NumberOfIslands = 0; this->SizeX = this->SizeY = this->SizeZ = 0;}
+  ~IslandLabeling() {this->DeleteVariables();}
+
+protected:
+  void DeleteVariables();
+
+  int  NumberOfIslands;
+  int  SizeX, SizeY, SizeZ;
+  int* IslandID;
+  int* IslandSize;
+  T*   IslandLabel;
+  int* IslandStartVoxel;
+
+private:
+  IslandLabeling(const IslandLabeling&);
+  void operator=(const IslandLabeling&);
+};
 //ETX
 
 class VTK_EMSEGMENT_EXPORT  vtkImageIslandFilter : public vtkImageToImageFilter
@@ -273,16 +317,38 @@ class VTK_EMSEGMENT_EXPORT  vtkImageIslandFilter : public vtkImageToImageFilter
   vtkSetMacro(RemoveHoleOnlyFlag,int); 
   vtkGetMacro(RemoveHoleOnlyFlag,int); 
 
+  // Description:
+  // If this flag is true then islands are reassigned to their neighbors in one batch instead of one island at a time.
+  // Only works for dynamic assignment. Much faster for images with many small islands - the result only differs  
+  // from the island by island removal where the choice of neighbor is a tie (see vtkImageIslandFilter_BatchReassignment)
+  vtkSetMacro(BatchReassignmentFlag,int); 
+  vtkGetMacro(BatchReassignmentFlag,int); 
+
   // Description:
   // Returns the size of the largest island in the label range of  [IslandInputLabelMin,IslandInputLabelMax]
   int GetMaxIslandSize(vtkImageData *InputData);
 
   // Description:
   // Do you want to do island removal slice by slice or in 3D 
+  // Islands are detected by IslandLabeling using GetNumberOfThreads() threads
   void SetNeighborhoodDim3D()  {this->NeighborhoodDim = IMAGEISLANDFILTER_NEIGHBORHOOD_3D;} 
   void SetNeighborhoodDim2D()  {this->NeighborhoodDim = IMAGEISLANDFILTER_NEIGHBORHOOD_2D;} 
   vtkGetMacro(NeighborhoodDim,int);
 
+  // Description:
+  // Removes the islands directly in LabelMap instead of writing them to the output - no copy of the label map is made.
+  // Uses the same settings as the filter, LabelMap must have a single component and the extent of IslandROI (if set). 
+  // Returns 0 if the islands could not be removed 
+  int RemoveIslandsInPlace(vtkImageData *LabelMap);
+
+  // Description:
+  // Largest working memory (in bytes) allocated by the last execution of the filter or RemoveIslandsInPlace 
+  // in addition to the input and output, i.e. island IDs, island statistics and the buffers of the reassignment 
+  vtkGetMacro(PeakMemory,vtkIdType);
+  //BTX
+  void UpdatePeakMemory(vtkIdType Bytes) {if (Bytes > this->PeakMemory) this->PeakMemory = Bytes;}
+  //ETX
+
 
 protected:
 
@@ -300,6 +366,10 @@ protected:
   void ExecuteInformation(vtkImageData *inData,vtkImageData *outData);
   void ComputeInputUpdateExtent(int inExt[6], int outExt[6]);
 
+  // Runs the island removal on inPtr and writes the result to outPtr - both can point to the same buffer 
+  // Returns 0 if the scalar type is not supported
+  int RemoveIslands(vtkImageData *inData, void *inPtr, int inExt[6], void *outPtr);
+
   int IslandMinSize;        // Smalles size of islands allowed, otherwise will be erased
   int IslandInputLabelMin;
   int IslandInputLabelMax;
@@ -311,6 +381,8 @@ protected:
   int NeighborhoodDim;
  
   int RemoveHoleOnlyFlag; 
+  int BatchReassignmentFlag; 
+  vtkIdType PeakMemory;
   // this is not so clean but works 
   vtkImageData *IslandROI;
 
@@ -46,6 +46,7 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 #include "vtkInformation.h"
 #include "vtkInformationVector.h"
 #include "vtkStreamingDemandDrivenPipeline.h"
+#include "vtkMultiThreader.h"
 
 #include <math.h>
 
@@ -59,6 +60,8 @@ vtkImageLabelPropagation::vtkImageLabelPropagation()
   this->MaximumDistance = 5000;
   this->Initialize = 1;
   this->ConsiderAnisotropy = 1;
+  this->Algorithm = VTK_EMKILIAN_EDT_SAITO;
+  this->NumberOfThreads = 0;
   this->PropagatedMap = vtkImageData::New();
 }
 
@@ -67,6 +70,24 @@ vtkImageLabelPropagation::~vtkImageLabelPropagation() {
   this->PropagatedMap->Delete();
 }
 
+//----------------------------------------------------------------------------
+void vtkImageLabelPropagation::SetAlgorithm(int algorithm)
+{
+  if (this->Algorithm == algorithm) return;
+  this->Algorithm = algorithm;
+  // Felzenszwalb processes all axes within one iteration 
+  this->SetNumberOfIterations(algorithm == VTK_EMKILIAN_EDT_FELZENSZWALB ? 1 : this->Dimensionality);
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageLabelPropagation::SetDimensionality(int dim)
+{
+  this->vtkImageDecomposeFilter::SetDimensionality(dim);
+  // The superclass sets one iteration per axis 
+  if (this->Algorithm == VTK_EMKILIAN_EDT_FELZENSZWALB) this->SetNumberOfIterations(1);
+}
+
 //----------------------------------------------------------------------------
 // This extent of the components changes to real and imaginary values.
 int vtkImageLabelPropagation::IterativeRequestInformation(
@@ -558,6 +579,205 @@ void vtkImageLabelPropagationDefineSignedDistanceMap(vtkImageLabelPropagation *s
   }
 }
 
+//----------------------------------------------------------------------------
+// Execute the algorithm of Felzenszwalb and Huttenlocher.
+//
+// P. Felzenszwalb and D. Huttenlocher. Distance Transforms of Sampled Functions.
+// Cornell Computing and Information Science TR2004-1963, 2004.
+//
+// Each axis is a 1D transform of the lines along it: the squared distance of a voxel 
+// is the lower envelope of the parabolas f(q) + spacing^2 (p-q)^2 of all voxels q of the line.
+// The label of the voxel whose parabola defines the envelope is propagated with it.
+// Like in Saito's algorithm values of MaximumDistance are infinite and a voxel only 
+// changes if its distance decreases.   
+template <class T> struct vtkImageLabelPropagationFelzenszwalbParameters {
+  T*     inPtr;
+  T*     proPtr;
+  float* outPtr;
+  int    Size[3];
+  float  Spacing2[3];
+  float  MaximumDistance;
+  int    Initialize;
+  int    NumberOfAxes;
+  int    Axis;
+};
+
+// Value of the voxel before the first axis is processed - same as vtkImageLabelPropagationInitialize 
+template <class T>
+static inline float vtkImageLabelPropagationFelzenszwalbInitialValue(T* inPtr, int index, int x, int y, int z, const int Size[3], float maxDist)
+{
+  T label = inPtr[index];
+  if (!label) return maxDist;
+  int SizeXY = Size[0]*Size[1];
+  if ((x > 0)         && (inPtr[index - 1]      != label)) return 0.0;
+  if ((x < Size[0]-1) && (inPtr[index + 1]      != label)) return 0.0;
+  if ((y > 0)         && (inPtr[index - Size[0]] != label)) return 0.0;
+  if ((y < Size[1]-1) && (inPtr[index + Size[0]] != label)) return 0.0;
+  if ((z > 0)         && (inPtr[index - SizeXY]  != label)) return 0.0;
+  if ((z < Size[2]-1) && (inPtr[index + SizeXY]  != label)) return 0.0;
+  return maxDist;
+}
+
+// Lower envelope of line f with n voxels - v are the voxels defining the envelope, z the boundaries between them. 
+// Returns the number of parabolas in the envelope 
+static int vtkImageLabelPropagationFelzenszwalbEnvelope(const float* f, int n, float spacing2, float maxDist, int* v, double* z)
+{
+  int k = -1;
+  for (int q = 0; q < n; q++)
+    {
+    if (f[q] >= maxDist) continue;
+    if (k < 0)
+      {
+      k = 0;
+      v[0] = q;
+      z[0] = -VTK_DOUBLE_MAX;
+      z[1] = VTK_DOUBLE_MAX;
+      continue;
+      }
+    double s;
+    while (1)
+      {
+      // z[0] is -infinity so that the loop ends at the latest with k = 0
+      s = ((double(f[q]) + spacing2*double(q)*q) - (double(f[v[k]]) + spacing2*double(v[k])*v[k])) / (2.0*spacing2*(q - v[k]));
+      if (s <= z[k]) k--;
+      else break;
+      }
+    k++;
+    v[k]   = q;
+    z[k]   = s;
+    z[k+1] = VTK_DOUBLE_MAX;
+    }
+  return k + 1;
+}
+
+template <class T>
+static void vtkImageLabelPropagationFelzenszwalbLines(vtkImageLabelPropagationFelzenszwalbParameters<T>* Para, int FirstLine, int LastLine)
+{
+  const int* Size = Para->Size;
+  int Axis    = Para->Axis;
+  int n       = Size[Axis];
+  int SizeXY  = Size[0]*Size[1];
+  int Stride  = (Axis == 0 ? 1 : (Axis == 1 ? Size[0] : SizeXY));
+  float maxDist  = Para->MaximumDistance;
+  float spacing2 = Para->Spacing2[Axis];
+  int InitializeFlag = (Axis == 0);
+  int SignedFlag     = (Axis == Para->NumberOfAxes - 1);
+
+  float*  f     = new float[n];
+  T*      label = new T[n];
+  int*    v     = new int[n];
+  double* z     = new double[n + 1];
+
+  for (int line = FirstLine; line < LastLine; line++)
+    {
+    // Lines along x are indexed by (y,z), along y by (x,z) and along z by (x,y) 
+    int Start;
+    if (Axis == 1) Start = (line / Size[0])*SizeXY + line % Size[0];
+    else Start = (Axis == 0 ? line*Size[0] : line);
+
+    float* outPtr = Para->outPtr + Start;
+    T*     proPtr = Para->proPtr + Start;
+    if (InitializeFlag)
+      {
+      T* inPtr = Para->inPtr + Start;
+      int y = line % Size[1];
+      int zIdx = line / Size[1];
+      for (int q = 0; q < n; q++)
+        {
+        label[q] = inPtr[q];
+        if (Para->Initialize) f[q] = vtkImageLabelPropagationFelzenszwalbInitialValue(Para->inPtr, Start + q, q, y, zIdx, Size, maxDist);
+        else f[q] = float(inPtr[q]);
+        }
+      }
+    else
+      {
+      for (int q = 0; q < n; q++)
+        {
+        f[q]     = outPtr[q*Stride];
+        label[q] = proPtr[q*Stride];
+        }
+      }
+
+    int NumberOfParabolas = vtkImageLabelPropagationFelzenszwalbEnvelope(f, n, spacing2, maxDist, v, z);
+
+    int k = 0;
+    for (int p = 0; p < n; p++)
+      {
+      float dist  = f[p];
+      T     value = label[p];
+      if (NumberOfParabolas)
+        {
+        while (z[k+1] < p) k++;
+        float envelope = f[v[k]] + spacing2*float(p - v[k])*float(p - v[k]);
+        if (envelope < dist)
+          {
+          dist  = envelope;
+          value = label[v[k]];
+          }
+        }
+      // Turns the outside negative (see vtkImageLabelPropagationDefineSignedDistanceMap)
+      if (SignedFlag && !Para->inPtr[Start + p*Stride] && (dist > 0.0)) dist = -dist;
+      outPtr[p*Stride] = dist;
+      proPtr[p*Stride] = value;
+      }
+    }
+
+  delete[] f;
+  delete[] label;
+  delete[] v;
+  delete[] z;
+}
+
+template <class T>
+static VTK_THREAD_RETURN_TYPE vtkImageLabelPropagationFelzenszwalbThreaded(void *arg)
+{
+  int ThreadID        = ((ThreadInfoStruct*)(arg))->ThreadID;
+  int NumberOfThreads = ((ThreadInfoStruct*)(arg))->NumberOfThreads;
+  vtkImageLabelPropagationFelzenszwalbParameters<T>* Para = (vtkImageLabelPropagationFelzenszwalbParameters<T>*) (((ThreadInfoStruct*)(arg))->UserData);
+
+  int NumberOfLines = (Para->Size[0]*Para->Size[1]*Para->Size[2]) / Para->Size[Para->Axis];
+  int FirstLine = int((long(ThreadID) * NumberOfLines) / NumberOfThreads);
+  int LastLine  = int((long(ThreadID + 1) * NumberOfLines) / NumberOfThreads);
+  vtkImageLabelPropagationFelzenszwalbLines(Para, FirstLine, LastLine);
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Computes the signed distance map and the propagated labels in one go - the first Dimensionality axes are 
+// processed one after the other, within an axis the lines are distributed over the threads 
+template <class T>
+static void vtkImageLabelPropagationExecuteFelzenszwalb(vtkImageLabelPropagation *self, vtkImageData *inData, T* inPtr, 
+                                                        T* proPtr, vtkImageData *outData, int outExt[6], float *outPtr)
+{
+  vtkImageLabelPropagationFelzenszwalbParameters<T> Para;
+  Para.inPtr  = inPtr;
+  Para.proPtr = proPtr;
+  Para.outPtr = outPtr;
+  Para.MaximumDistance = self->GetMaximumDistance();
+  Para.Initialize = self->GetInitialize();
+  Para.NumberOfAxes = self->GetDimensionality();
+  if (Para.NumberOfAxes < 1) Para.NumberOfAxes = 1;
+  if (Para.NumberOfAxes > 3) Para.NumberOfAxes = 3;
+  for (int i = 0; i < 3; i++)
+    {
+    Para.Size[i] = outExt[2*i+1] - outExt[2*i] + 1;
+    double spacing = (self->GetConsiderAnisotropy() ? outData->GetSpacing()[i] : 1.0);
+    Para.Spacing2[i] = float(spacing*spacing);
+    }
+  if ((Para.Size[0] < 1) || (Para.Size[1] < 1) || (Para.Size[2] < 1)) return;
+
+  vtkMultiThreader* Threader = vtkMultiThreader::New();
+  if (self->GetNumberOfThreads() > 0) Threader->SetNumberOfThreads(self->GetNumberOfThreads());
+  for (Para.Axis = 0; Para.Axis < Para.NumberOfAxes; Para.Axis++)
+    {
+    int NumberOfLines = (Para.Size[0]*Para.Size[1]*Para.Size[2]) / Para.Size[Para.Axis];
+    if (Threader->GetNumberOfThreads() > NumberOfLines) Threader->SetNumberOfThreads(NumberOfLines);
+    Threader->SetSingleMethod(vtkImageLabelPropagationFelzenszwalbThreaded<T>, (void*) &Para);
+    Threader->SingleMethodExecute();
+    self->UpdateProgress((Para.Axis+1.0)/double(Para.NumberOfAxes));
+    }
+  Threader->Delete();
+}
+
 //----------------------------------------------------------------------------
 void vtkImageLabelPropagation::AllocateOutputScalars(vtkImageData *outData)
 {
@@ -604,6 +824,31 @@ int vtkImageLabelPropagation::IterativeRequestData( vtkInformation* vtkNotUsed(
     vtkErrorMacro(<< "Execute: Cannot handle more than 1 components");
     return 1;
     }
+
+  if (this->Algorithm == VTK_EMKILIAN_EDT_FELZENSZWALB)
+    {
+    if (inData->GetNumberOfScalarComponents() != 1 )
+      {
+      vtkErrorMacro(<< "Execute: Cannot handle more than 1 components");
+      return 1;
+      }
+    // The labels are written by the first axis - no copy of the input needed 
+    this->PropagatedMap->CopyStructure(inData);
+    this->PropagatedMap->SetScalarType(inData->GetScalarType());
+    this->PropagatedMap->SetNumberOfScalarComponents(1);
+    this->PropagatedMap->AllocateScalars();
+    void *proPtr = this->PropagatedMap->GetScalarPointerForExtent(outExt);
+
+    switch (inData->GetScalarType())
+      {
+      vtkTemplateMacro(vtkImageLabelPropagationExecuteFelzenszwalb(this, inData, (VTK_TT *)(inPtr), (VTK_TT *)(proPtr), 
+                                                                   outData, outExt, (float *)(outPtr)));
+      default:
+        vtkErrorMacro(<< "Execute: Unknown ScalarType");
+        return 1;
+      } 
+    return 1;
+    }
   
   if ( this->GetIteration() == 0 )
     {
@@ -677,6 +922,8 @@ void vtkImageLabelPropagation::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "Maximum Distance: " << this->MaximumDistance << "\n";
   os << indent << "Consider Anisotropy: " 
      << (this->ConsiderAnisotropy ? "On\n" : "Off\n");  
+  os << indent << "Algorithm: " << this->Algorithm << "\n";
+  os << indent << "Number Of Threads: " << this->NumberOfThreads << "\n";
 }
   
 
@@ -58,6 +58,12 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 // slow it very significantly. In that case, one should use 
 // ::SetAlgorithmToSaitoCached() instead for better performance. 
 //
+// ::SetAlgorithmToFelzenszwalb() computes the same maps with the lower envelope 
+// of parabolas, which runs in linear time per axis. The lines of each axis are 
+// processed by NumberOfThreads threads and the first Dimensionality axes, the signed 
+// distance (applied with the last axis) and the propagated labels are computed within 
+// a single iteration.
+//
 // References:
 //
 // T. Saito and J.I. Toriwaki. New algorithms for Euclidean distance 
@@ -67,6 +73,9 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 // O. Cuisenaire. Distance Transformation: fast algorithms and applications
 // to medical image processing. PhD Thesis, Universite catholique de Louvain,
 // October 1999. http://ltswww.epfl.ch/~cuisenai/papers/oc_thesis.pdf 
+//
+// P. Felzenszwalb and D. Huttenlocher. Distance Transforms of Sampled Functions.
+// Cornell Computing and Information Science TR2004-1963, 2004.
  
 
 #ifndef __vtkImageLabelPropagation_h
@@ -77,6 +86,7 @@ MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
 
 #define VTK_EMKILIAN_EDT_SAITO_CACHED 0
 #define VTK_EMKILIAN_EDT_SAITO 1 
+#define VTK_EMKILIAN_EDT_FELZENSZWALB 2 
 
 #define VTK_EMKILIAN_EDT_EUCLIDEAN  0
 #define VTK_EMKILIAN_EDT_SQUARE_ROOT 1
@@ -91,6 +101,23 @@ public:
   vtkGetMacro(Initialize, int);
   vtkGetMacro(MaximumDistance, float);
   vtkGetMacro(ConsiderAnisotropy, int);
+
+  // Description:
+  // Algorithm used for the distance transform (default: Saito)
+  void SetAlgorithm(int algorithm);
+  vtkGetMacro(Algorithm, int);
+  void SetAlgorithmToSaito() {this->SetAlgorithm(VTK_EMKILIAN_EDT_SAITO);}
+  void SetAlgorithmToFelzenszwalb() {this->SetAlgorithm(VTK_EMKILIAN_EDT_FELZENSZWALB);}
+
+  // Description:
+  // Number of axes processed - Felzenszwalb keeps a single iteration, so it can be set before or after the algorithm
+  void SetDimensionality(int dim);
+
+  // Description:
+  // Number of threads of the Felzenszwalb algorithm (< 1 => vtkMultiThreader default)
+  vtkSetMacro(NumberOfThreads, int);
+  vtkGetMacro(NumberOfThreads, int);
+
   vtkImageData* GetDistanceMap() {return this->GetOutput();}
 
   vtkImageData* GetPropagatedMap() { return this->PropagatedMap; } 
@@ -105,6 +132,8 @@ protected:
   float MaximumDistance;
   int Initialize;
   int ConsiderAnisotropy;
+  int Algorithm;
+  int NumberOfThreads;
   vtkImageData *PropagatedMap;
 
   // Replaces "EnlargeOutputUpdateExtent"
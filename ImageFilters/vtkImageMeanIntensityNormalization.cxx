@@ -14,8 +14,11 @@
 #include "vtkImageMeanIntensityNormalization.h"
 #include "vtkObjectFactory.h"
 #include "vtkImageData.h"
-#include "vtkImageMathematics.h"
+#include "vtkMultiThreader.h"
 #include <assert.h>
+#include <math.h>
+#include <limits>
+#include <vector>
 
 //------------------------------------------------------------------------------
 vtkImageMeanIntensityNormalization* vtkImageMeanIntensityNormalization::New()
@@ -53,28 +56,185 @@ void vtkImageMeanIntensityNormalization::PrintSelf(ostream& os, vtkIndent indent
   Superclass::PrintSelf(os,indent);
 }
 
-int* vtkImageMeanIntensityNormalization::InitializeHistogram(vtkImageAccumulate *HIST, vtkImageData *Input, int &HistMin, int &HistMax)
+//----------------------------------------------------------------------------
+// MeanMRI only looks at the image twice: once to build the histogram and once to write the corrected image.  
+// Both are split into slabs of voxels processed by their own thread - each thread counts into its own histogram, 
+// which are added up afterwards. 
+#define MEANMRI_PASS_EXTREMA   0
+#define MEANMRI_PASS_HISTOGRAM 1
+#define MEANMRI_PASS_CORRECT   2
+
+template <class T>
+struct vtkImageMeanIntensityNormalization_ThreadedParameters
 {
-  // 1. Detect extrema 
-  HIST->SetInput(Input);
-  HIST->SetComponentSpacing(1,1,1);
-  HIST->SetComponentOrigin(0,0,0);
-  HIST->Update();
-  
-  // 2. Compute Histogram
-  double EXTREMA[3];
-  HIST->GetMin(EXTREMA);
-  HistMin = int(EXTREMA[0]);
-  HIST->GetMax(EXTREMA);
-  HistMax = int(ceil(EXTREMA[0]));
-
-  // Here is a change from the original 
-  int EXTENT[6] = {HistMin,HistMax,0,0,0,0};
-  HIST->SetComponentExtent(EXTENT);
-  HIST->Update();
-    
-  HIST->GetOutput()->GetWholeExtent(EXTENT);
-  return (int*)(HIST->GetOutput()->GetScalarPointerForExtent(EXTENT));
+  T*        inPtr;
+  T*        outPtr;
+  vtkIdType NumVoxels;
+  int       Pass;
+  // MEANMRI_PASS_EXTREMA: minimum and maximum of each slab
+  double*   SlabMin;
+  double*   SlabMax;
+  // MEANMRI_PASS_HISTOGRAM: histogram of each slab - the bin of a voxel is floor(value) - HistMin
+  int**     SlabHist;
+  int       HistMin;
+  int       HistLength;
+  // MEANMRI_PASS_CORRECT
+  double    CorrectionRatio;
+};
+
+template <class T>
+static VTK_THREAD_RETURN_TYPE vtkImageMeanIntensityNormalization_ThreadedFunction(void *arg)
+{
+  int ThreadID        = ((ThreadInfoStruct*)(arg))->ThreadID;
+  int NumberOfThreads = ((ThreadInfoStruct*)(arg))->NumberOfThreads;
+  vtkImageMeanIntensityNormalization_ThreadedParameters<T>* Para = 
+    (vtkImageMeanIntensityNormalization_ThreadedParameters<T>*) (((ThreadInfoStruct*)(arg))->UserData);
+
+  vtkIdType Start = (Para->NumVoxels * ThreadID) / NumberOfThreads;
+  vtkIdType End   = (Para->NumVoxels * (ThreadID + 1)) / NumberOfThreads;
+  const T* inPtr  = Para->inPtr + Start;
+
+  switch (Para->Pass)
+    {
+    case MEANMRI_PASS_EXTREMA:
+      {
+      double Min = double(*inPtr);
+      double Max = Min;
+      for (vtkIdType i = Start; i < End; i++, inPtr++)
+        {
+        if (*inPtr < Min) Min = double(*inPtr);
+        if (*inPtr > Max) Max = double(*inPtr);
+        }
+      Para->SlabMin[ThreadID] = Min;
+      Para->SlabMax[ThreadID] = Max;
+      break;
+      }
+    case MEANMRI_PASS_HISTOGRAM:
+      {
+      int* Hist = Para->SlabHist[ThreadID];
+      const int HistMin    = Para->HistMin;
+      const int HistLength = Para->HistLength;
+      for (vtkIdType i = Start; i < End; i++, inPtr++)
+        {
+        // same binning as vtkImageAccumulate with origin 0 and spacing 1 
+        int Index = (std::numeric_limits<T>::is_integer ? int(*inPtr) : int(floor(double(*inPtr)))) - HistMin;
+        if ((Index >= 0) && (Index < HistLength)) Hist[Index]++;
+        }
+      break;
+      }
+    case MEANMRI_PASS_CORRECT:
+      {
+      // same as vtkImageMathematics::SetOperationToMultiplyByK
+      T* outPtr = Para->outPtr + Start;
+      const double Ratio = Para->CorrectionRatio;
+      for (vtkIdType i = Start; i < End; i++)
+        {
+        *outPtr++ = static_cast<T>(Ratio * (*inPtr++));
+        }
+      break;
+      }
+    }
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+template <class T>
+static void vtkImageMeanIntensityNormalization_Execute(vtkImageMeanIntensityNormalization_ThreadedParameters<T>* Para, int NumberOfThreads)
+{
+  vtkMultiThreader* Threader = vtkMultiThreader::New();
+  Threader->SetNumberOfThreads(NumberOfThreads);
+  Threader->SetSingleMethod(vtkImageMeanIntensityNormalization_ThreadedFunction<T>, (void*) Para);
+  Threader->SingleMethodExecute();
+  Threader->Delete();
+}
+
+// Histogram of the input from HistMin = int(minimum) to HistMax = int(ceil(maximum)), followed by one empty bin. 
+// For 8 and 16 bit integers the histogram covers the whole range of the type so that it is computed in a single pass,
+// otherwise the extrema are determined first.  
+template <class T>
+static void vtkImageMeanIntensityNormalization_InitializeHistogram(T* inPtr, vtkIdType NumVoxels, int NumberOfThreads, 
+                                                                   int &HistMin, int &HistMax, std::vector<int> &Hist)
+{
+  vtkImageMeanIntensityNormalization_ThreadedParameters<T> Para;
+  Para.inPtr     = inPtr;
+  Para.outPtr    = NULL;
+  Para.NumVoxels = NumVoxels;
+  int NumberOfSlabs = (NumberOfThreads < 1 ? 1 : NumberOfThreads);
+  if (NumberOfSlabs > NumVoxels) NumberOfSlabs = int(NumVoxels);
+
+  bool SinglePass = std::numeric_limits<T>::is_integer && (sizeof(T) <= 2);
+  if (SinglePass)
+    {
+    HistMin = int(std::numeric_limits<T>::min());
+    HistMax = int(std::numeric_limits<T>::max());
+    }
+  else
+    {
+    std::vector<double> SlabMin(NumberOfSlabs), SlabMax(NumberOfSlabs);
+    Para.Pass    = MEANMRI_PASS_EXTREMA;
+    Para.SlabMin = &SlabMin[0];
+    Para.SlabMax = &SlabMax[0];
+    vtkImageMeanIntensityNormalization_Execute(&Para, NumberOfSlabs);
+    double Min = SlabMin[0];
+    double Max = SlabMax[0];
+    for (int s = 1; s < NumberOfSlabs; s++)
+      {
+      if (SlabMin[s] < Min) Min = SlabMin[s];
+      if (SlabMax[s] > Max) Max = SlabMax[s];
+      }
+    HistMin = int(Min);
+    HistMax = int(ceil(Max));
+    }
+
+  // every slab needs its own histogram - do not use more memory for them than the image itself 
+  int HistLength = HistMax - HistMin + 1;
+  if ((NumberOfSlabs > 1) && (vtkIdType(HistLength) * NumberOfSlabs > NumVoxels))
+    {
+    NumberOfSlabs = int(NumVoxels / HistLength);
+    if (NumberOfSlabs < 1) NumberOfSlabs = 1;
+    }
+  std::vector<int>  SlabHistData(size_t(HistLength) * NumberOfSlabs, 0);
+  std::vector<int*> SlabHist(NumberOfSlabs);
+  for (int s = 0; s < NumberOfSlabs; s++) SlabHist[s] = &SlabHistData[size_t(HistLength) * s];
+
+  Para.Pass       = MEANMRI_PASS_HISTOGRAM;
+  Para.SlabHist   = &SlabHist[0];
+  Para.HistMin    = HistMin;
+  Para.HistLength = HistLength;
+  vtkImageMeanIntensityNormalization_Execute(&Para, NumberOfSlabs);
+
+  for (int s = 1; s < NumberOfSlabs; s++)
+    {
+    int* SumPtr  = SlabHist[0];
+    int* SlabPtr = SlabHist[s];
+    for (int i = 0; i < HistLength; i++) *SumPtr++ += *SlabPtr++;
+    }
+
+  int First = 0;
+  int Last  = HistLength - 1;
+  if (SinglePass)
+    {
+    // the extrema are the first and last bin that is not empty
+    while ((First < Last) && !SlabHist[0][First]) First++;
+    while ((Last > First) && !SlabHist[0][Last]) Last--;
+    HistMin += First;
+    HistMax  = HistMin + Last - First;
+    }
+  Hist.assign(SlabHist[0] + First, SlabHist[0] + Last + 1);
+  Hist.push_back(0);
+}
+
+template <class T>
+static void vtkImageMeanIntensityNormalization_Correct(T* inPtr, T* outPtr, vtkIdType NumVoxels, int NumberOfThreads, double CorrectionRatio)
+{
+  vtkImageMeanIntensityNormalization_ThreadedParameters<T> Para;
+  Para.inPtr           = inPtr;
+  Para.outPtr          = outPtr;
+  Para.NumVoxels       = NumVoxels;
+  Para.Pass            = MEANMRI_PASS_CORRECT;
+  Para.CorrectionRatio = CorrectionRatio;
+  int NumberOfSlabs = (NumberOfThreads < 1 ? 1 : NumberOfThreads);
+  if (NumberOfSlabs > NumVoxels) NumberOfSlabs = int(NumVoxels);
+  vtkImageMeanIntensityNormalization_Execute(&Para, NumberOfSlabs);
 }
 
 // Determines the index in the Histogram at which point the sum over the number of voxels with lower or equal the index is smaller than NumMaxVoxel 
@@ -92,34 +252,31 @@ int vtkImageMeanIntensityNormalization::DetermineFilterMax(int *HIST_Ptr, const
   return FilterHistogramMax;
 }
 
-void vtkImageMeanIntensityNormalization::SmoothHistogram(const int* Input , const int InputLength, const int SmoothWidth, int &MaxIndex, int* Output)
+// Output[x] = sum of Input[x .. x + SmoothWidth] / SmoothWidth, where PrefixSum[i] is the sum of Input[0 .. i-1]. 
+// Output[MaxIndex] is set to 0 so that DetermineFirstValey can look one bin past the end  
+void vtkImageMeanIntensityNormalization::SmoothHistogram(const int* PrefixSum , const int InputLength, const int SmoothWidth, int &MaxIndex, int* Output)
 {
   float InverseSmoothWidth = 1.0 / float(SmoothWidth);
   MaxIndex =  InputLength - SmoothWidth;
-  memset(Output,0, sizeof(int)*MaxIndex);
+  if (MaxIndex < 0) MaxIndex = 0;
 
-  for (int k = 0; k <= SmoothWidth; k++ )
+  const int* WindowEnd = PrefixSum + SmoothWidth + 1;
+  for (int x = 0; x < MaxIndex; x ++ )
     {
-    *Output += *Input;
-    for (int i = 1; i <= k ; i++) Output[i] += *Input;
-    Input ++;
-    }
-  *Output = int(*Output * InverseSmoothWidth);
-  Output++;
-
-  for (int x = 1; x < MaxIndex; x ++ )
-    {
-    for (int i = 0; i <= SmoothWidth ; i++) Output[i] += *Input;
-    *Output = int(*Output * InverseSmoothWidth);
-    Output++;
-    Input++; 
+    int Sum = *WindowEnd++ - *PrefixSum++;
+    *Output++ = int(Sum * InverseSmoothWidth);
     }
+  *Output = 0;
 }
 
 int vtkImageMeanIntensityNormalization::DetermineFilterMin(const int* HIST_PTR, const int HIST_Length)
 {
 
-  int *HIST_SMOOTH_Ptr    = new int[ HIST_Length];
+  // each smoothing width only needs two lookups per bin 
+  int *HIST_PREFIX_Ptr    = new int[ HIST_Length + 1];
+  int *HIST_SMOOTH_Ptr    = new int[ HIST_Length + 1];
+  HIST_PREFIX_Ptr[0] = 0;
+  for (int i = 0; i < HIST_Length; i++) HIST_PREFIX_Ptr[i+1] = HIST_PREFIX_Ptr[i] + HIST_PTR[i];
 
   int iter = 1;
   int result = -1;
@@ -127,6 +284,7 @@ int vtkImageMeanIntensityNormalization::DetermineFilterMin(const int* HIST_PTR,
   while ((SmoothWidthPara <= this->MaxHistogramSmoothingWidth) && (result < 0))
     { 
     int SmoothWidth = HIST_Length / SmoothWidthPara;
+    if (SmoothWidth < 1) SmoothWidth = 1;
     int HIST_SMOOTH_Length;
     if (this->PrintInfo)
       {
@@ -135,7 +293,7 @@ int vtkImageMeanIntensityNormalization::DetermineFilterMin(const int* HIST_PTR,
       iter++;
       }
     
-    this->SmoothHistogram(HIST_PTR,HIST_Length, SmoothWidth, HIST_SMOOTH_Length, HIST_SMOOTH_Ptr);
+    this->SmoothHistogram(HIST_PREFIX_Ptr,HIST_Length, SmoothWidth, HIST_SMOOTH_Length, HIST_SMOOTH_Ptr);
     result = this->DetermineFirstValey(HIST_SMOOTH_Ptr,HIST_SMOOTH_Length);
     SmoothWidthPara ++;
     }
@@ -145,6 +303,7 @@ int vtkImageMeanIntensityNormalization::DetermineFilterMin(const int* HIST_PTR,
     result = 0;
     }
 
+  delete[] HIST_PREFIX_Ptr;
   delete[] HIST_SMOOTH_Ptr;
   return result;
 }
@@ -221,8 +380,7 @@ void vtkImageMeanIntensityNormalization::MeanMRI(vtkImageData *Input, vtkImageDa
   // Filter Values
   int    FilterHistogramMax;
   int    FilterHistogramMin;
-  vtkImageAccumulate *HIST = NULL;
-  vtkImageMathematics *CORRECTED = NULL;
+  std::vector<int> HIST;
   int* HIST_PTR;
 
   {
@@ -231,9 +389,25 @@ void vtkImageMeanIntensityNormalization::MeanMRI(vtkImageData *Input, vtkImageDa
   NumVoxels = (INPUT_EXTENT[1] - INPUT_EXTENT[0] + 1) * (INPUT_EXTENT[3] - INPUT_EXTENT[2] + 1) * (INPUT_EXTENT[5] - INPUT_EXTENT[4] + 1);
   }
 
+  if (NumVoxels < 1)
+    {
+    vtkErrorMacro(<< "Input is empty");
+    this->ErrorExecutionFlag = true;
+    return;
+    }
+
   // Define Histogram
-  HIST = vtkImageAccumulate::New();
-  HIST_PTR = this->InitializeHistogram(HIST,Input, ImageIntensityMin, ImageIntensityMax);
+  void* inPtr = Input->GetScalarPointer();
+  switch (Input->GetScalarType())
+    {
+    vtkTemplateMacro(vtkImageMeanIntensityNormalization_InitializeHistogram((VTK_TT*) inPtr, NumVoxels, this->GetNumberOfThreads(), 
+                                                                           ImageIntensityMin, ImageIntensityMax, HIST));
+    default:
+      vtkErrorMacro(<< "Execute: Unknown ScalarType");
+      this->ErrorExecutionFlag = true;
+      return;
+    }
+  HIST_PTR = &HIST[0];
 
   if (this->PrintInfo)
     {
@@ -257,28 +431,28 @@ void vtkImageMeanIntensityNormalization::MeanMRI(vtkImageData *Input, vtkImageDa
   //  Compute Mean
   // -------------------------------------
   ImageIntensityMean = 0;
-  NumVoxels = 0;
+  int NumFilterVoxels = 0;
   HIST_PTR += FilterHistogramMin;
   for (int x = FilterHistogramMin; x <= FilterHistogramMax; x++)
     {
     int val = *HIST_PTR ++;
     // we have to add ImageIntensityMin bc we do not start histogram anymore at 0 !
     ImageIntensityMean += double(x + ImageIntensityMin)*val;
-    NumVoxels += val;
+    NumFilterVoxels += val;
     }
-  ImageIntensityMean = ImageIntensityMean / double(NumVoxels);
+  ImageIntensityMean = ImageIntensityMean / double(NumFilterVoxels);
   assert(ImageIntensityMean);
   ImageIntensityCorrectionRatio = NormValue/ImageIntensityMean;
  
   // -------------------------------------
   //  Correct Image 
   // -------------------------------------
-  CORRECTED = vtkImageMathematics::New();
-  CORRECTED->SetInput(0,Input);
-  CORRECTED->SetConstantK(ImageIntensityCorrectionRatio);
-  CORRECTED->SetOperationToMultiplyByK();
-  CORRECTED->Update();
-  Output->DeepCopy(CORRECTED->GetOutput());
+  // Output was allocated by ExecuteData - write the corrected voxels straight into it
+  switch (Input->GetScalarType())
+    {
+    vtkTemplateMacro(vtkImageMeanIntensityNormalization_Correct((VTK_TT*) inPtr, (VTK_TT*) Output->GetScalarPointer(), NumVoxels, 
+                                                                this->GetNumberOfThreads(), ImageIntensityCorrectionRatio));
+    }
 
   if (this->PrintInfo)
     {
@@ -290,11 +464,6 @@ void vtkImageMeanIntensityNormalization::MeanMRI(vtkImageData *Input, vtkImageDa
     std::cerr << "  Normalization Factor:   " << ImageIntensityCorrectionRatio << endl;
     }
 
-  // -------------------------------------
-  //  Clean up  
-  // -------------------------------------
-  CORRECTED->Delete();    
-  HIST->Delete();
 }
 
 
@@ -18,7 +18,6 @@
 
 
 #include "vtkImageToImageFilter.h"
-#include "vtkImageAccumulate.h"
 #include "vtkEMSegment.h"
 
 #define INTENSITY_NORM_UNDEFINED 0
@@ -67,9 +66,7 @@ protected:
   vtkImageMeanIntensityNormalization();
   ~vtkImageMeanIntensityNormalization();
 
-  // When it works on parallel machines use : 
-  //  void ThreadedExecute(vtkImageData *inData, vtkImageData *outData,int outExt[6], int id);
-  // If you do not want to have it multi threaded 
+  // The histogram and the correction of MeanMRI are computed with GetNumberOfThreads() threads 
   void ExecuteData(vtkDataObject *);
   void ExecuteInformation(){this->vtkImageToImageFilter::ExecuteInformation();};
   void ExecuteInformation(vtkImageData *inData,vtkImageData *outData);
@@ -78,12 +75,12 @@ protected:
   // Core function
   void MeanMRI(vtkImageData *Input, vtkImageData *Output);
   // Functions called from MeanMRI
-  int* InitializeHistogram(vtkImageAccumulate *HIST, vtkImageData *Input, int &HistMin, int &HistMax);
   int  DetermineFilterMax(int *HIST_Ptr, const int HIST_Length, const int FilterNumMaxVoxels);
   int  DetermineFilterMin(const int* HIST_PTR, const int HIST_Length);
   // Functions needed to determine lower bound of filter (DetermineFilterMin)
   int  DetermineFirstValey(const int *SmoothHistogram,const int SmoothHistogramLength);
-  void SmoothHistogram(const int* Input , const int InputLength, const int SmoothWidth, int &MaxIndex, int* Output);
+  // PrefixSum has InputLength + 1 entries, Output needs room for MaxIndex + 1 entries 
+  void SmoothHistogram(const int* PrefixSum , const int InputLength, const int SmoothWidth, int &MaxIndex, int* Output);
 
   double NormValue; 
   int NormType; 
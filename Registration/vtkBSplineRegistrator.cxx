@@ -19,12 +19,19 @@
 #include "itkMeanSquaresImageToImageMetric.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
+#include "itkBSplineDeformableTransform.h"
+#include "itkResampleImageFilter.h"
+#include "itkBSplineResampleImageFunction.h"
+#include "itkBSplineDecompositionImageFilter.h"
+#include "itkIdentityTransform.h"
+#include "itkImageRegionConstIterator.h"
 
 #include "itkRealTimeClock.h"
 #include "itkPixelTraits.h"
 
 #include "vtkTransformToGrid.h"
 #include "vtkRegistratorTypeTraits.h"
+#include "vtkRegistrationPyramidCacheFilter.h"
 #include "vtkImageChangeInformation.h"
 #include "vtkImagePermute.h"
 #include "vtkMatrix4x4.h"
@@ -40,6 +47,7 @@ vtkStandardNewMacro(vtkBSplineRegistrator);
 //
 #include "itkCommand.h"
 #include <iomanip>
+#include <algorithm>
 
 template <class TOptimizer>
 class CommandIterationUpdate : public itk::Command
@@ -164,6 +172,153 @@ public:
   }
 };
 
+//
+// Moves the B-spline transform on to the control grid of the next
+// pyramid level.  The coefficient images of the current grid are
+// evaluated at the knots of the new grid and turned back into B-spline
+// coefficients (knot insertion - exact if the new grid refines the
+// current one, e.g. by halving its spacing).
+template <class TRegistration, class TTransform, class TOptimizer>
+class CommandGridRefinementUpdate : public itk::Command
+{
+public:
+  typedef  CommandGridRefinementUpdate   Self;
+  typedef  itk::Command                  Superclass;
+  typedef itk::SmartPointer<Self>        Pointer;
+  itkNewMacro( Self );
+protected:
+  CommandGridRefinementUpdate() {};
+public:
+  typedef TRegistration                          RegistrationType;
+  typedef RegistrationType   *                   RegistrationPointer;
+  typedef TTransform                             TransformType;
+  typedef TransformType*                         TransformPointer;
+  typedef TOptimizer                             OptimizerType;
+  typedef OptimizerType*                         OptimizerPointer;
+  typedef typename TransformType::RegionType     RegionType;
+  typedef typename TransformType::SpacingType    SpacingType;
+  typedef typename TransformType::OriginType     OriginType;
+  typedef typename TransformType::ParametersType ParametersType;
+  typedef typename TransformType::ImageType      CoefficientImageType;
+
+  // control grid of the next level
+  void AddLevel(const RegionType& region, const SpacingType& spacing, 
+                const OriginType& origin)
+  {
+    this->m_Regions.push_back(region);
+    this->m_Spacings.push_back(spacing);
+    this->m_Origins.push_back(origin);
+  }
+
+  void Execute(const itk::Object *caller, const itk::EventObject & event)
+  {
+    return;
+  }
+
+  void Execute(itk::Object * object, const itk::EventObject & event)
+  {
+    RegistrationPointer registration =
+      dynamic_cast< RegistrationPointer >( object );
+    if( ! itk::IterationEvent().CheckEvent( &event ) || !registration )
+      {
+      return;
+      }
+    unsigned int level = registration->GetCurrentLevel();
+    if (level == 0 || level >= this->m_Regions.size())
+      {
+      // the first level starts on its own grid 
+      return;
+      }
+    TransformPointer transform = 
+      dynamic_cast<TransformPointer>(registration->GetTransform());
+    if (transform == NULL ||
+        (transform->GetGridRegion()  == this->m_Regions[level] &&
+         transform->GetGridSpacing() == this->m_Spacings[level] &&
+         transform->GetGridOrigin()  == this->m_Origins[level]))
+      {
+      return;
+      }
+
+    typedef itk::ResampleImageFilter<CoefficientImageType, 
+      CoefficientImageType>                                ResamplerType;
+    typedef itk::BSplineResampleImageFunction<CoefficientImageType, 
+      double>                                              FunctionType;
+    typedef itk::IdentityTransform<double, 3>              IdentityType;
+    typedef itk::BSplineDecompositionImageFilter<CoefficientImageType, 
+      CoefficientImageType>                                DecompositionType;
+    typedef itk::ImageRegionConstIterator<CoefficientImageType> IteratorType;
+
+    // the coefficient images still wrap the parameters of the last level
+    ParametersType parameters(3 * this->m_Regions[level].GetNumberOfPixels());
+    unsigned int   index = 0;
+    for (unsigned int k = 0; k < 3; ++k)
+      {
+      typename ResamplerType::Pointer     upsampler = ResamplerType::New();
+      typename FunctionType::Pointer      function  = FunctionType::New();
+      typename IdentityType::Pointer      identity  = IdentityType::New();
+      upsampler->SetInput(transform->GetCoefficientImage()[k]);
+      upsampler->SetInterpolator(function);
+      upsampler->SetTransform(identity);
+      upsampler->SetSize(this->m_Regions[level].GetSize());
+      upsampler->SetOutputSpacing(this->m_Spacings[level]);
+      upsampler->SetOutputOrigin(this->m_Origins[level]);
+
+      typename DecompositionType::Pointer decomposition = 
+        DecompositionType::New();
+      decomposition->SetSplineOrder(TransformType::SplineOrder);
+      decomposition->SetInput(upsampler->GetOutput());
+      decomposition->Update();
+
+      IteratorType it(decomposition->GetOutput(), 
+                      decomposition->GetOutput()->GetBufferedRegion());
+      for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+        {
+        parameters[index++] = it.Get();
+        }
+      }
+
+    transform->SetGridSpacing(this->m_Spacings[level]);
+    transform->SetGridOrigin(this->m_Origins[level]);
+    transform->SetGridRegion(this->m_Regions[level]);
+    // SetGridRegion leaves the transform wrapping the coefficients of the
+    // last level - the transform keeps a reference to the parameters, so
+    // they live in the command
+    this->m_Parameters = parameters;
+    transform->SetParameters(this->m_Parameters);
+    registration->SetInitialTransformParametersOfNextLevel(this->m_Parameters);
+
+    OptimizerPointer optimizer = dynamic_cast<OptimizerPointer>
+      (registration->GetOptimizer());
+    if (optimizer)
+      {
+      typename OptimizerType::BoundSelectionType 
+        boundSelect(parameters.Size());
+      typename OptimizerType::BoundValueType 
+        upperBound(parameters.Size());
+      typename OptimizerType::BoundValueType 
+        lowerBound(parameters.Size());
+      boundSelect.Fill(0);
+      upperBound.Fill(0.0);
+      lowerBound.Fill(0.0);
+      optimizer->SetBoundSelection(boundSelect);
+      optimizer->SetUpperBound(upperBound);
+      optimizer->SetLowerBound(lowerBound);
+      }
+
+    std::cerr << "       BSpline knots total: " 
+              << this->m_Regions[level].GetSize() << std::endl;
+    std::cerr << "       BSpline number of parameters: " 
+              << parameters.Size() << std::endl;
+  }
+
+protected:
+  std::vector<RegionType>  m_Regions;
+  std::vector<SpacingType> m_Spacings;
+  std::vector<OriginType>  m_Origins;
+  // refined coefficients of the current level
+  ParametersType           m_Parameters;
+};
+
 class vtkMyCallback : public vtkCommand
 {
 public:
@@ -184,6 +339,7 @@ vtkBSplineRegistrator()
 
   this->FixedIJKToXYZ  = NULL;
   this->MovingIJKToXYZ = NULL;
+  this->PyramidCache   = NULL;
 
   this->BulkTransform = NULL;
   this->Transform   = vtkGridTransform::New();
@@ -194,6 +350,7 @@ vtkBSplineRegistrator()
   this->ImageToImageMetric   = vtkBSplineRegistrator::MutualInformation;
   this->MetricComputationSamplingRatio = 1.0;
   this->NumberOfKnotPoints = 5;
+  this->GridRefinement = 1;
 }
 
 //----------------------------------------------------------------------------
@@ -204,6 +361,7 @@ vtkBSplineRegistrator::
   this->SetMovingImage(NULL);
   this->SetFixedIJKToXYZ(NULL);
   this->SetMovingIJKToXYZ(NULL);
+  this->SetPyramidCache(NULL);
   this->SetBulkTransform(NULL);
 
   this->Transform->Delete();
@@ -226,6 +384,84 @@ PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "InterpolationType: " 
      << GetStringFromInterpolationType(this->IntensityInterpolationType)
      << std::endl;
+  os << indent << "NumberOfKnotPoints: " << this->NumberOfKnotPoints 
+     << std::endl;
+  os << indent << "GridRefinement: " << this->GridRefinement << std::endl;
+  for (unsigned int i = 0; i < this->KnotPointsSchedule.size(); ++i)
+    {
+    if (this->KnotPointsSchedule[i] > 0)
+      {
+      os << indent << "NumberOfKnotPointsAtLevel " << i << ": " 
+         << this->KnotPointsSchedule[i] << std::endl;
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+void
+vtkBSplineRegistrator::
+SetNumberOfKnotPointsAtLevel(int level, int numberOfKnots)
+{
+  if (level < 0)
+    {
+    vtkErrorMacro("SetNumberOfKnotPointsAtLevel: invalid level " << level);
+    return;
+    }
+  if (numberOfKnots < 1)
+    {
+    numberOfKnots = 0;
+    }
+  if (level >= static_cast<int>(this->KnotPointsSchedule.size()))
+    {
+    if (numberOfKnots == 0)
+      {
+      return;
+      }
+    this->KnotPointsSchedule.resize(level + 1, 0);
+    }
+  if (this->KnotPointsSchedule[level] != numberOfKnots)
+    {
+    this->KnotPointsSchedule[level] = numberOfKnots;
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+int
+vtkBSplineRegistrator::
+GetNumberOfKnotPointsAtLevel(int level)
+{
+  if (level < 0 || level >= static_cast<int>(this->KnotPointsSchedule.size()))
+    {
+    return 0;
+    }
+  return this->KnotPointsSchedule[level];
+}
+
+//----------------------------------------------------------------------------
+void
+vtkBSplineRegistrator::
+ComputeKnotPointsSchedule(int numberOfLevels, std::vector<int>& numberOfKnots)
+{
+  numberOfKnots.assign(numberOfLevels, this->NumberOfKnotPoints);
+  if (!this->GridRefinement)
+    {
+    return;
+    }
+  // from the finest level to the coarsest one
+  for (int level = numberOfLevels - 1; level >= 0; --level)
+    {
+    if (this->GetNumberOfKnotPointsAtLevel(level) > 0)
+      {
+      numberOfKnots[level] = this->GetNumberOfKnotPointsAtLevel(level);
+      }
+    else if (level < numberOfLevels - 1)
+      {
+      // half the knots - i.e. twice the spacing - of the next finer level
+      int finer = numberOfKnots[level + 1];
+      numberOfKnots[level] = std::min(finer, std::max(3, (finer - 1) / 2 + 1));
+      }
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -399,12 +635,15 @@ RegisterImagesInternal3()
 
   //
   // set up multires registration
-  typedef typename itk::MultiResolutionPyramidImageFilter
-    <ITKImageType, ITKImageType>   ImagePyramidType;
+  typedef RegistrationPyramidCacheFilter<ITKImageType> ImagePyramidType;
   typename ImagePyramidType::Pointer fixedImagePyramid = 
     ImagePyramidType::New();
   typename ImagePyramidType::Pointer movingImagePyramid = 
     ImagePyramidType::New();
+  fixedImagePyramid->
+    SetCache(this->PyramidCache, this->FixedImage, IJKToXYZMatrixFixed);
+  movingImagePyramid->
+    SetCache(this->PyramidCache, this->MovingImage, IJKToXYZMatrixMoving);
   typedef typename itk::MultiResolutionImageRegistrationMethod
     <ITKImageType, ITKImageType> MultiResolutionRegistrationType;
   typename MultiResolutionRegistrationType::Pointer multiResRegistration = 
@@ -604,28 +843,50 @@ RegisterImagesInternal3()
     bSplineTransform->SetBulkTransform(itkBulkTransform);
     }
 
-  TransformType::RegionType            bSplineRegion;
+  //
+  // control grid of each pyramid level, the coarse levels are registered
+  // on coarser grids (see CommandGridRefinementUpdate)
+  std::vector<int> numberOfKnots;
+  this->ComputeKnotPointsSchedule(finalNumberOfLevels, numberOfKnots);
+
+  std::vector<TransformType::RegionType>  bSplineRegions(finalNumberOfLevels);
+  std::vector<TransformType::SpacingType> bSplineSpacings(finalNumberOfLevels);
+  std::vector<TransformType::OriginType>  bSplineOrigins(finalNumberOfLevels);
   TransformType::RegionType::SizeType  gridSizeOnImage;
   TransformType::RegionType::SizeType  gridBorderSize;
   TransformType::RegionType::SizeType  totalGridSize;
-
-  gridSizeOnImage.Fill(this->NumberOfKnotPoints);
   gridBorderSize.Fill(3);
-  totalGridSize = gridSizeOnImage + gridBorderSize;
-  bSplineRegion.SetSize(totalGridSize);
-
-  TransformType::SpacingType spacing = 
-    fixedImageITKImporter->GetOutput()->GetSpacing();
-  TransformType::OriginType  origin  = 
-    fixedImageITKImporter->GetOutput()->GetOrigin();
 
-  for (unsigned int r = 0; r < 3; ++r)
+  for (int level = 0; level < finalNumberOfLevels; ++level)
     {
-    spacing[r] *= floor(static_cast<double>(fixedImageSize[r]-1) /
-                        static_cast<double>(gridSizeOnImage[r]-1));
-    origin[r]  -= spacing[r];
+    gridSizeOnImage.Fill(std::max(2, numberOfKnots[level]));
+    totalGridSize = gridSizeOnImage + gridBorderSize;
+    bSplineRegions[level].SetSize(totalGridSize);
+
+    TransformType::SpacingType spacing = 
+      fixedImageITKImporter->GetOutput()->GetSpacing();
+    TransformType::OriginType  origin  = 
+      fixedImageITKImporter->GetOutput()->GetOrigin();
+
+    for (unsigned int r = 0; r < 3; ++r)
+      {
+      spacing[r] *= floor(static_cast<double>(fixedImageSize[r]-1) /
+                          static_cast<double>(gridSizeOnImage[r]-1));
+      origin[r]  -= spacing[r];
+      }
+    bSplineSpacings[level] = spacing;
+    bSplineOrigins[level]  = origin;
+
+    std::cerr << "   BSpline level " << level+1 << " knots on image: "
+              << gridSizeOnImage << std::endl;
     }
 
+  // start on the grid of the coarsest level
+  TransformType::RegionType   bSplineRegion = bSplineRegions[0];
+  TransformType::SpacingType  spacing       = bSplineSpacings[0];
+  TransformType::OriginType   origin        = bSplineOrigins[0];
+  totalGridSize = bSplineRegion.GetSize();
+
   bSplineTransform->SetGridSpacing(spacing);
   bSplineTransform->SetGridOrigin(origin);
   bSplineTransform->SetGridRegion(bSplineRegion);
@@ -634,8 +895,6 @@ RegisterImagesInternal3()
   std::cerr << "   BSpline spacing: " << spacing << std::endl;
   std::cerr << "   BSpline origin: "  << origin  << std::endl;
   std::cerr << "   BSpline region: "  << bSplineRegion  << std::endl;
-  std::cerr << "   BSpline knots on image:       "     
-            << gridSizeOnImage << std::endl;
   std::cerr << "   BSpline knots total:          "     
             << totalGridSize << std::endl;
   std::cerr << "   BSpline number of parameters: " << numberOfParameters 
@@ -690,6 +949,19 @@ RegisterImagesInternal3()
   startLevelCommand->SetNumberOfIterations(this->NumberOfIterations);
   multiResRegistration->AddObserver(itk::IterationEvent(), startLevelCommand);
 
+  typedef CommandGridRefinementUpdate<MultiResolutionRegistrationType, 
+    TransformType, OptimizerType> GridRefinementCommandType;
+  typename GridRefinementCommandType::Pointer gridRefinementCommand = 
+    GridRefinementCommandType::New();
+  for (int level = 0; level < finalNumberOfLevels; ++level)
+    {
+    gridRefinementCommand->AddLevel(bSplineRegions[level], 
+                                    bSplineSpacings[level], 
+                                    bSplineOrigins[level]);
+    }
+  multiResRegistration->AddObserver(itk::IterationEvent(), 
+                                    gridRefinementCommand);
+
   //
   // everything should be set up, run the registration
   //
@@ -8,6 +8,9 @@
 #include "vtkGridTransform.h"
 #include "vtkTransform.h"
 #include "vtkEMSegmentWin32Header.h"
+#include "vtkRegistrationPyramidCache.h"
+
+#include <vector>
 
 class VTK_EMSEGMENT_EXPORT vtkBSplineRegistrator : 
   public vtkObject
@@ -67,9 +70,26 @@ public:
   vtkSetClampMacro(MetricComputationSamplingRatio, double, 0, 1);
   vtkGetMacro(MetricComputationSamplingRatio, double);
 
+  // Description:
+  // Number of knots of the control grid along each axis at the finest
+  // pyramid level
   vtkSetMacro(NumberOfKnotPoints, int);
   vtkGetMacro(NumberOfKnotPoints, int);
 
+  // Description:
+  // Coarse-to-fine refinement of the control grid.  The coarse pyramid
+  // levels are registered with fewer knots and the coefficients are
+  // carried over to the denser grid of the next level by knot insertion.
+  // By default a level uses about half the knots of the next finer one
+  // (but at least 3).  SetNumberOfKnotPointsAtLevel overrides this for a
+  // level (0 = coarsest level of the pyramid, values < 1 restore the
+  // default).  With GridRefinement off all levels use NumberOfKnotPoints.
+  vtkSetMacro(GridRefinement, int);
+  vtkGetMacro(GridRefinement, int);
+  vtkBooleanMacro(GridRefinement, int);
+  void SetNumberOfKnotPointsAtLevel(int level, int numberOfKnots);
+  int  GetNumberOfKnotPointsAtLevel(int level);
+
   vtkSetObjectMacro(BulkTransform, vtkTransform);
   vtkGetObjectMacro(BulkTransform, vtkTransform);
   
@@ -78,6 +98,12 @@ public:
   vtkSetObjectMacro(FixedIJKToXYZ, vtkMatrix4x4);
   vtkSetObjectMacro(MovingIJKToXYZ, vtkMatrix4x4);
 
+  // Description:
+  // Optional cache of the image pyramids, share it with the other
+  // registrator to compute the pyramids of an image only once
+  vtkSetObjectMacro(PyramidCache, vtkRegistrationPyramidCache);
+  vtkGetObjectMacro(PyramidCache, vtkRegistrationPyramidCache);
+
   void RegisterImages();
 
 protected:
@@ -94,6 +120,10 @@ protected:
   void RegisterImagesInternal2();
   template <class CommonVoxelType>
   void RegisterImagesInternal3();
+
+  // number of knots of each level of a pyramid with numberOfLevels levels
+  void ComputeKnotPointsSchedule(int numberOfLevels, 
+                                 std::vector<int>& numberOfKnots);
   //ETX
 
 private:
@@ -118,6 +148,8 @@ private:
   vtkMatrix4x4*                   FixedIJKToXYZ;
   vtkMatrix4x4*                   MovingIJKToXYZ;
 
+  vtkRegistrationPyramidCache*    PyramidCache;
+
   vtkTransform*                   BulkTransform;
   vtkGridTransform*               Transform;
 
@@ -127,6 +159,10 @@ private:
   double                          MetricComputationSamplingRatio;
 
   int                             NumberOfKnotPoints;
+  int                             GridRefinement;
+  //BTX
+  std::vector<int>                KnotPointsSchedule;
+  //ETX
 };
 
 #endif // __vtkBSplineRegistrator_h
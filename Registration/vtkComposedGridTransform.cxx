@@ -0,0 +1,311 @@
+#include "vtkComposedGridTransform.h"
+#include "vtkObjectFactory.h"
+#include "vtkGridTransform.h"
+#include "vtkMatrix4x4.h"
+#include "vtkImageData.h"
+#include <math.h>
+
+vtkCxxRevisionMacro(vtkComposedGridTransform, "$Revision: 1.0 $");
+vtkStandardNewMacro(vtkComposedGridTransform);
+
+vtkCxxSetObjectMacro(vtkComposedGridTransform, PreMatrix, vtkMatrix4x4);
+vtkCxxSetObjectMacro(vtkComposedGridTransform, GridTransform, vtkGridTransform);
+vtkCxxSetObjectMacro(vtkComposedGridTransform, PostMatrix, vtkMatrix4x4);
+
+//----------------------------------------------------------------------------
+vtkComposedGridTransform::vtkComposedGridTransform()
+{
+  this->PreMatrix     = NULL;
+  this->GridTransform = NULL;
+  this->PostMatrix    = NULL;
+  for (int r = 0; r < 3; r++)
+    {
+    for (int c = 0; c < 4; c++)
+      {
+      this->Pre[r][c]  = (r == c ? 1.0 : 0.0);
+      this->Post[r][c] = (r == c ? 1.0 : 0.0);
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+vtkComposedGridTransform::~vtkComposedGridTransform()
+{
+  this->SetPreMatrix(NULL);
+  this->SetGridTransform(NULL);
+  this->SetPostMatrix(NULL);
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::PrintSelf(ostream& os, vtkIndent indent)
+{
+  Superclass::PrintSelf(os,indent);
+  os << indent << "PreMatrix: " << this->PreMatrix << "\n";
+  if (this->PreMatrix)
+    {
+    this->PreMatrix->PrintSelf(os, indent.GetNextIndent());
+    }
+  os << indent << "GridTransform: " << this->GridTransform << "\n";
+  if (this->GridTransform)
+    {
+    this->GridTransform->PrintSelf(os, indent.GetNextIndent());
+    }
+  os << indent << "PostMatrix: " << this->PostMatrix << "\n";
+  if (this->PostMatrix)
+    {
+    this->PostMatrix->PrintSelf(os, indent.GetNextIndent());
+    }
+}
+
+//----------------------------------------------------------------------------
+unsigned long vtkComposedGridTransform::GetMTime()
+{
+  unsigned long mtime = this->Superclass::GetMTime();
+  if (this->PreMatrix && (this->PreMatrix->GetMTime() > mtime))
+    {
+    mtime = this->PreMatrix->GetMTime();
+    }
+  if (this->GridTransform && (this->GridTransform->GetMTime() > mtime))
+    {
+    mtime = this->GridTransform->GetMTime();
+    }
+  if (this->PostMatrix && (this->PostMatrix->GetMTime() > mtime))
+    {
+    mtime = this->PostMatrix->GetMTime();
+    }
+  return mtime;
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::InternalUpdate()
+{
+  for (int r = 0; r < 3; r++)
+    {
+    for (int c = 0; c < 4; c++)
+      {
+      this->Pre[r][c]  = (this->PreMatrix  ? this->PreMatrix->GetElement(r, c)  : (r == c ? 1.0 : 0.0));
+      this->Post[r][c] = (this->PostMatrix ? this->PostMatrix->GetElement(r, c) : (r == c ? 1.0 : 0.0));
+      }
+    }
+  if (this->GridTransform)
+    {
+    this->GridTransform->Update();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::InternalDeepCopy(vtkAbstractTransform* transform)
+{
+  this->vtkWarpTransform::InternalDeepCopy(transform);
+  vtkComposedGridTransform* composed = static_cast<vtkComposedGridTransform*>(transform);
+  this->SetPreMatrix(composed->PreMatrix);
+  this->SetGridTransform(composed->GridTransform);
+  this->SetPostMatrix(composed->PostMatrix);
+}
+
+//----------------------------------------------------------------------------
+static inline void vtkComposedGridTransformAffine(const double m[3][4], const double in[3], double out[3])
+{
+  double x = in[0], y = in[1], z = in[2];
+  for (int r = 0; r < 3; r++)
+    {
+    out[r] = m[r][0]*x + m[r][1]*y + m[r][2]*z + m[r][3];
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::ForwardTransformPoint(const double in[3], double out[3])
+{
+  double pt[3];
+  vtkComposedGridTransformAffine(this->Pre, in, pt);
+  if (this->GridTransform)
+    {
+    this->GridTransform->InternalTransformPoint(pt, pt);
+    }
+  vtkComposedGridTransformAffine(this->Post, pt, out);
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::ForwardTransformPoint(const float in[3], float out[3])
+{
+  double pt[3] = {in[0], in[1], in[2]};
+  this->ForwardTransformPoint(pt, pt);
+  out[0] = static_cast<float>(pt[0]);
+  out[1] = static_cast<float>(pt[1]);
+  out[2] = static_cast<float>(pt[2]);
+}
+
+//----------------------------------------------------------------------------
+// Chain rule: Post * d(Grid) * Pre
+void vtkComposedGridTransform::ForwardTransformDerivative(const double in[3], double out[3], double derivative[3][3])
+{
+  double pt[3];
+  double gridDerivative[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  vtkComposedGridTransformAffine(this->Pre, in, pt);
+  if (this->GridTransform)
+    {
+    this->GridTransform->InternalTransformDerivative(pt, pt, gridDerivative);
+    }
+  vtkComposedGridTransformAffine(this->Post, pt, out);
+
+  double tmp[3][3];
+  for (int r = 0; r < 3; r++)
+    {
+    for (int c = 0; c < 3; c++)
+      {
+      tmp[r][c] = gridDerivative[r][0]*this->Pre[0][c] + gridDerivative[r][1]*this->Pre[1][c] + gridDerivative[r][2]*this->Pre[2][c];
+      }
+    }
+  for (int r = 0; r < 3; r++)
+    {
+    for (int c = 0; c < 3; c++)
+      {
+      derivative[r][c] = this->Post[r][0]*tmp[0][c] + this->Post[r][1]*tmp[1][c] + this->Post[r][2]*tmp[2][c];
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::ForwardTransformDerivative(const float in[3], float out[3], float derivative[3][3])
+{
+  double pt[3] = {in[0], in[1], in[2]};
+  double result[3];
+  double doubleDerivative[3][3];
+  this->ForwardTransformDerivative(pt, result, doubleDerivative);
+  for (int r = 0; r < 3; r++)
+    {
+    out[r] = static_cast<float>(result[r]);
+    for (int c = 0; c < 3; c++)
+      {
+      derivative[r][c] = static_cast<float>(doubleDerivative[r][c]);
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Trilinear interpolation of the displacement along a row. Follows vtkGridTransform: positions outside the
+// grid are clamped to its border. gridPos and base are the grid index and the undeformed output of the first
+// point, the steps their change from one point to the next.
+template <class T>
+static void vtkComposedGridTransformRow(const T* gridPtr, const int gridExt[6], const vtkIdType gridInc[3],
+                                        double scale, double shift, const double gridPos[3], const double gridStep[3],
+                                        const double base[3], const double baseStep[3], const double post[3][4],
+                                        int numPoints, double* out)
+{
+  int maxId[3] = {gridExt[1] - gridExt[0], gridExt[3] - gridExt[2], gridExt[5] - gridExt[4]};
+  for (int i = 0; i < numPoints; i++)
+    {
+    const T* p = gridPtr;
+    vtkIdType step[3];
+    double f[3];
+    for (int r = 0; r < 3; r++)
+      {
+      double pos = gridPos[r] + i*gridStep[r];
+      double floorPos = floor(pos);
+      int id = int(floorPos) - gridExt[2*r];
+      f[r] = pos - floorPos;
+      step[r] = gridInc[r];
+      if (id < 0)
+        {
+        id = 0;
+        f[r] = 0.0;
+        }
+      else if (id + 1 > maxId[r])
+        {
+        id = maxId[r];
+        f[r] = 0.0;
+        }
+      if (f[r] == 0.0)
+        {
+        step[r] = 0;
+        }
+      p += id*gridInc[r];
+      }
+
+    double rx = 1.0 - f[0], ry = 1.0 - f[1], rz = 1.0 - f[2];
+    double displacement[3];
+    for (int c = 0; c < 3; c++, p++)
+      {
+      double value = rz*(ry*(rx*p[0]                + f[0]*p[step[0]])
+                         + f[1]*(rx*p[step[1]]      + f[0]*p[step[1]+step[0]]))
+                   + f[2]*(ry*(rx*p[step[2]]        + f[0]*p[step[2]+step[0]])
+                         + f[1]*(rx*p[step[2]+step[1]] + f[0]*p[step[2]+step[1]+step[0]]));
+      displacement[c] = value*scale + shift;
+      }
+
+    for (int r = 0; r < 3; r++)
+      {
+      *out++ = base[r] + i*baseStep[r] + post[r][0]*displacement[0] + post[r][1]*displacement[1] + post[r][2]*displacement[2];
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkComposedGridTransform::TransformRow(const double start[3], const double step[3], int numPoints, double* out)
+{
+  vtkImageData* grid = (this->GridTransform ? this->GridTransform->GetDisplacementGrid() : NULL);
+  bool incremental = !this->InverseFlag;
+  if (incremental && this->GridTransform)
+    {
+    incremental = grid && (grid->GetNumberOfScalarComponents() == 3) && !this->GridTransform->GetInverseFlag() &&
+      (this->GridTransform->GetInterpolationMode() == VTK_GRID_LINEAR);
+    }
+  if (!incremental)
+    {
+    for (int i = 0; i < numPoints; i++, out += 3)
+      {
+      double pt[3] = {start[0] + i*step[0], start[1] + i*step[1], start[2] + i*step[2]};
+      this->InternalTransformPoint(pt, out);
+      }
+    return;
+    }
+
+  // Everything but the displacement is affine along the row
+  double pre[3], preEnd[3], preStep[3];
+  double end[3] = {start[0] + step[0], start[1] + step[1], start[2] + step[2]};
+  vtkComposedGridTransformAffine(this->Pre, start, pre);
+  vtkComposedGridTransformAffine(this->Pre, end, preEnd);
+  double base[3], baseEnd[3], baseStep[3];
+  vtkComposedGridTransformAffine(this->Post, pre, base);
+  vtkComposedGridTransformAffine(this->Post, preEnd, baseEnd);
+  for (int r = 0; r < 3; r++)
+    {
+    preStep[r]  = preEnd[r] - pre[r];
+    baseStep[r] = baseEnd[r] - base[r];
+    }
+
+  if (!this->GridTransform)
+    {
+    for (int i = 0; i < numPoints; i++)
+      {
+      for (int r = 0; r < 3; r++)
+        {
+        *out++ = base[r] + i*baseStep[r];
+        }
+      }
+    return;
+    }
+
+  double* origin  = grid->GetOrigin();
+  double* spacing = grid->GetSpacing();
+  int* gridExt = grid->GetExtent();
+  vtkIdType gridInc[3];
+  grid->GetIncrements(gridInc);
+  double gridPos[3], gridStep[3];
+  for (int r = 0; r < 3; r++)
+    {
+    gridPos[r]  = (pre[r] - origin[r]) / spacing[r];
+    gridStep[r] = preStep[r] / spacing[r];
+    }
+
+  double scale = this->GridTransform->GetDisplacementScale();
+  double shift = this->GridTransform->GetDisplacementShift();
+  void* gridPtr = grid->GetScalarPointer();
+  switch (grid->GetScalarType())
+    {
+    vtkTemplateMacro(vtkComposedGridTransformRow(static_cast<VTK_TT*>(gridPtr), gridExt, gridInc, scale, shift, gridPos, gridStep,
+                                                 base, baseStep, this->Post, numPoints, out));
+    default:
+      vtkErrorMacro("TransformRow: unsupported displacement grid type " << grid->GetScalarType());
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef __vtkComposedGridTransform_h
+#define __vtkComposedGridTransform_h
+
+#include "vtkWarpTransform.h"
+#include "vtkEMSegmentWin32Header.h"
+
+class vtkGridTransform;
+class vtkMatrix4x4;
+
+//
+// Lazily evaluated composition  out = PostMatrix( GridTransform( PreMatrix(in) ) )
+//
+// It replaces the dense displacement grid that vtkEMSegmentLogic::ComposeGridTransform fills for the whole
+// output image. The composed transform is only evaluated where it is asked for: per point by vtkImageReslice
+// (InternalTransformPoint) or per row by our own resamplers (TransformRow). Along a row the affine parts and
+// the position within the displacement grid change linearly, so TransformRow only interpolates the
+// displacements and steps everything else incrementally. The grid transform is optional (affine only).
+class VTK_EMSEGMENT_EXPORT vtkComposedGridTransform :
+  public vtkWarpTransform
+{
+public:
+  static vtkComposedGridTransform *New();
+  vtkTypeRevisionMacro(vtkComposedGridTransform, vtkWarpTransform);
+  virtual void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Affine transform applied before the grid transform (NULL = identity)
+  virtual void SetPreMatrix(vtkMatrix4x4*);
+  vtkGetObjectMacro(PreMatrix, vtkMatrix4x4);
+
+  // Description:
+  // Deformation in between the two affine transforms (NULL = none)
+  virtual void SetGridTransform(vtkGridTransform*);
+  vtkGetObjectMacro(GridTransform, vtkGridTransform);
+
+  // Description:
+  // Affine transform applied after the grid transform (NULL = identity)
+  virtual void SetPostMatrix(vtkMatrix4x4*);
+  vtkGetObjectMacro(PostMatrix, vtkMatrix4x4);
+
+  // Description:
+  // Transforms the numPoints points start + i*step (i = 0 .. numPoints-1) and writes them to out[3*i].
+  // Update() has to be called before - afterwards it is safe to call it from several threads at once.
+  // Falls back to evaluating point by point if the grid is not interpolated linearly or inverted.
+  void TransformRow(const double start[3], const double step[3], int numPoints, double* out);
+
+  vtkAbstractTransform* MakeTransform()
+  { return vtkComposedGridTransform::New(); }
+
+  unsigned long GetMTime();
+
+protected:
+  vtkComposedGridTransform();
+  ~vtkComposedGridTransform();
+
+  void InternalUpdate();
+  void InternalDeepCopy(vtkAbstractTransform* transform);
+
+  // Description:
+  // Internal functions for calculating the transformation.
+  void ForwardTransformPoint(const float in[3], float out[3]);
+  void ForwardTransformPoint(const double in[3], double out[3]);
+
+  void ForwardTransformDerivative(const float in[3], float out[3], float derivative[3][3]);
+  void ForwardTransformDerivative(const double in[3], double out[3], double derivative[3][3]);
+
+  vtkMatrix4x4*     PreMatrix;
+  vtkGridTransform* GridTransform;
+  vtkMatrix4x4*     PostMatrix;
+
+  // Set by InternalUpdate
+  double Pre[3][4];
+  double Post[3][4];
+
+private:
+  vtkComposedGridTransform(const vtkComposedGridTransform&);  // Not implemented.
+  void operator=(const vtkComposedGridTransform&);  // Not implemented.
+};
+
+#endif // __vtkComposedGridTransform_h
@@ -0,0 +1,132 @@
+#include "vtkRegistrationPyramidCache.h"
+#include "vtkObjectFactory.h"
+#include "vtkImageData.h"
+#include "vtkMatrix4x4.h"
+
+#include "itkDataObject.h"
+
+#include <map>
+#include <string>
+#include <sstream>
+
+vtkCxxRevisionMacro(vtkRegistrationPyramidCache, "$Revision: 1.0 $");
+vtkStandardNewMacro(vtkRegistrationPyramidCache);
+
+//----------------------------------------------------------------------------
+class vtkRegistrationPyramidCacheInternals
+{
+public:
+  typedef std::map<std::string, itk::DataObject::Pointer> LevelMapType;
+  LevelMapType Levels;
+
+  static std::string GetKey(vtkImageData* image, vtkMatrix4x4* IJKToXYZ,
+                            int scalarType,
+                            const unsigned int shrinkFactors[3])
+  {
+    std::ostringstream key;
+    key.precision(17);
+    key << image << " " << image->GetMTime() << " " << scalarType;
+    for (int i = 0; i < 3; ++i)
+      {
+      key << " " << shrinkFactors[i];
+      }
+    // the image is reoriented according to the matrix before the pyramid is built
+    for (int r = 0; r < 3; ++r)
+      {
+      for (int c = 0; c < 4; ++c)
+        {
+        key << " " << (IJKToXYZ ? IJKToXYZ->GetElement(r, c) : (r == c ? 1.0 : 0.0));
+        }
+      }
+    return key.str();
+  }
+};
+
+//----------------------------------------------------------------------------
+vtkRegistrationPyramidCache::
+vtkRegistrationPyramidCache()
+{
+  this->Internals      = new vtkRegistrationPyramidCacheInternals;
+  this->NumberOfHits   = 0;
+  this->NumberOfMisses = 0;
+}
+
+//----------------------------------------------------------------------------
+vtkRegistrationPyramidCache::
+~vtkRegistrationPyramidCache()
+{
+  delete this->Internals;
+  this->Internals = NULL;
+}
+
+//----------------------------------------------------------------------------
+void
+vtkRegistrationPyramidCache::
+PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+  os << indent << "NumberOfLevels: " << this->GetNumberOfLevels()
+     << std::endl;
+  os << indent << "NumberOfHits: " << this->NumberOfHits << std::endl;
+  os << indent << "NumberOfMisses: " << this->NumberOfMisses << std::endl;
+}
+
+//----------------------------------------------------------------------------
+int
+vtkRegistrationPyramidCache::
+GetNumberOfLevels()
+{
+  return static_cast<int>(this->Internals->Levels.size());
+}
+
+//----------------------------------------------------------------------------
+void
+vtkRegistrationPyramidCache::
+RemoveAllLevels()
+{
+  if (this->Internals->Levels.size())
+    {
+    this->Internals->Levels.clear();
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+itk::DataObject*
+vtkRegistrationPyramidCache::
+GetLevel(vtkImageData* image, vtkMatrix4x4* IJKToXYZ, int scalarType,
+         const unsigned int shrinkFactors[3])
+{
+  if (image == NULL)
+    {
+    return NULL;
+    }
+  vtkRegistrationPyramidCacheInternals::LevelMapType::iterator it =
+    this->Internals->Levels.
+    find(vtkRegistrationPyramidCacheInternals::
+         GetKey(image, IJKToXYZ, scalarType, shrinkFactors));
+  if (it == this->Internals->Levels.end())
+    {
+    this->NumberOfMisses++;
+    return NULL;
+    }
+  this->NumberOfHits++;
+  return it->second;
+}
+
+//----------------------------------------------------------------------------
+void
+vtkRegistrationPyramidCache::
+AddLevel(vtkImageData* image, vtkMatrix4x4* IJKToXYZ, int scalarType,
+         const unsigned int shrinkFactors[3], itk::DataObject* level)
+{
+  if (image == NULL || level == NULL)
+    {
+    vtkErrorMacro("AddLevel: image or level not defined");
+    return;
+    }
+  this->Internals->
+    Levels[vtkRegistrationPyramidCacheInternals::
+           GetKey(image, IJKToXYZ, scalarType, shrinkFactors)] = level;
+  this->Modified();
+}
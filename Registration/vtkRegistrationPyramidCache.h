@@ -0,0 +1,64 @@
+#ifndef __vtkRegistrationPyramidCache_h
+#define __vtkRegistrationPyramidCache_h
+
+#include "vtkObject.h"
+#include "vtkEMSegmentWin32Header.h"
+
+class vtkImageData;
+class vtkMatrix4x4;
+class vtkRegistrationPyramidCacheInternals;
+//BTX
+namespace itk
+{
+class DataObject;
+}
+//ETX
+
+//
+// Smoothed and downsampled images of the registration pyramids.  Hand
+// the same cache to vtkRigidRegistrator and vtkBSplineRegistrator so
+// that the affine-then-deformable sequence smooths and decimates each
+// image only once per shrink factor.  A level is identified by the
+// vtkImageData it was computed from and its modified time, the
+// IJKToXYZ matrix, the voxel type used for the registration and the
+// shrink factors of the level.  The levels are kept until
+// RemoveAllLevels is called or the cache is deleted.
+class VTK_EMSEGMENT_EXPORT vtkRegistrationPyramidCache :
+  public vtkObject
+{
+public:
+  static vtkRegistrationPyramidCache *New();
+  vtkTypeRevisionMacro(vtkRegistrationPyramidCache, vtkObject);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  int  GetNumberOfLevels();
+  void RemoveAllLevels();
+
+  vtkGetMacro(NumberOfHits, int);
+  vtkGetMacro(NumberOfMisses, int);
+
+  //BTX
+  // Description:
+  // Level computed from image or NULL if it is not in the cache
+  itk::DataObject* GetLevel(vtkImageData* image, vtkMatrix4x4* IJKToXYZ,
+                            int scalarType,
+                            const unsigned int shrinkFactors[3]);
+  void AddLevel(vtkImageData* image, vtkMatrix4x4* IJKToXYZ,
+                int scalarType, const unsigned int shrinkFactors[3],
+                itk::DataObject* level);
+  //ETX
+
+protected:
+  vtkRegistrationPyramidCache();
+  virtual ~vtkRegistrationPyramidCache();
+
+private:
+  vtkRegistrationPyramidCache(const vtkRegistrationPyramidCache&);  // not implemented
+  void operator=(const vtkRegistrationPyramidCache&);              // not implemented
+
+  vtkRegistrationPyramidCacheInternals* Internals;
+  int                                   NumberOfHits;
+  int                                   NumberOfMisses;
+};
+
+#endif // __vtkRegistrationPyramidCache_h
@@ -0,0 +1,162 @@
+#ifndef __vtkRegistrationPyramidCacheFilter_h
+#define __vtkRegistrationPyramidCacheFilter_h
+
+#include "vtkRegistrationPyramidCache.h"
+#include "vtkImageData.h"
+#include "vtkMatrix4x4.h"
+#include "vtkTypeTraits.h"
+
+#include "itkMultiResolutionPyramidImageFilter.h"
+
+#include <algorithm>
+#include <vector>
+
+//BTX
+//
+// Image pyramid of the registrators that takes its levels from a
+// vtkRegistrationPyramidCache.  Only the missing levels are computed
+// and added to the cache, so pyramids with different schedules share
+// the levels of their common shrink factors.  Without a cache it
+// behaves like its superclass.
+template <class TImage>
+class RegistrationPyramidCacheFilter :
+  public itk::MultiResolutionPyramidImageFilter<TImage, TImage>
+{
+public:
+  typedef RegistrationPyramidCacheFilter                        Self;
+  typedef itk::MultiResolutionPyramidImageFilter<TImage, TImage> Superclass;
+  typedef itk::SmartPointer<Self>                               Pointer;
+  typedef itk::SmartPointer<const Self>                         ConstPointer;
+  itkNewMacro( Self );
+  itkTypeMacro( RegistrationPyramidCacheFilter, MultiResolutionPyramidImageFilter );
+
+  typedef TImage                                ImageType;
+  typedef typename ImageType::PixelType         PixelType;
+  typedef typename Superclass::ScheduleType     ScheduleType;
+
+  // image and IJKToXYZ identify the vtk image the input was imported from
+  void SetCache(vtkRegistrationPyramidCache* cache, vtkImageData* image,
+                vtkMatrix4x4* IJKToXYZ)
+  {
+    this->m_Cache    = cache;
+    this->m_Image    = image;
+    this->m_IJKToXYZ = IJKToXYZ;
+    this->Modified();
+  }
+
+protected:
+  RegistrationPyramidCacheFilter()
+  {
+    this->m_Cache    = NULL;
+    this->m_Image    = NULL;
+    this->m_IJKToXYZ = NULL;
+  }
+
+  void GenerateData()
+  {
+    if (this->m_Cache == NULL || this->m_Image == NULL)
+      {
+      this->Superclass::GenerateData();
+      return;
+      }
+
+    const unsigned int  numberOfLevels = this->GetNumberOfLevels();
+    const ScheduleType& schedule       = this->GetSchedule();
+    const int           scalarType     = vtkTypeTraits<PixelType>::VTKTypeID();
+
+    std::vector<ImageType*> cachedLevels(numberOfLevels, NULL);
+    unsigned int numberOfCachedLevels = 0;
+    for (unsigned int level = 0; level < numberOfLevels; ++level)
+      {
+      unsigned int shrinkFactors[3];
+      GetShrinkFactors(schedule, level, shrinkFactors);
+      cachedLevels[level] = dynamic_cast<ImageType*>
+        (this->m_Cache->GetLevel(this->m_Image, this->m_IJKToXYZ,
+                                 scalarType, shrinkFactors));
+      if (cachedLevels[level] != NULL)
+        {
+        ++numberOfCachedLevels;
+        }
+      }
+
+    if (numberOfCachedLevels == 0)
+      {
+      this->Superclass::GenerateData();
+
+      // the cache keeps its own copy - the outputs are reused when the filter runs again
+      for (unsigned int level = 0; level < numberOfLevels; ++level)
+        {
+        unsigned int shrinkFactors[3];
+        GetShrinkFactors(schedule, level, shrinkFactors);
+        typename ImageType::Pointer copy = ImageType::New();
+        CopyLevel(this->GetOutput(level), copy);
+        this->m_Cache->AddLevel(this->m_Image, this->m_IJKToXYZ,
+                                scalarType, shrinkFactors, copy);
+        }
+      return;
+      }
+
+    std::cerr << "   Using " << numberOfCachedLevels << " of "
+              << numberOfLevels << " levels of the cached image pyramid"
+              << std::endl;
+    for (unsigned int level = 0; level < numberOfLevels; ++level)
+      {
+      if (cachedLevels[level] == NULL)
+        {
+        // each level is smoothed and shrunk from the input, so a single
+        // level pyramid with the same shrink factors computes it
+        unsigned int shrinkFactors[3];
+        GetShrinkFactors(schedule, level, shrinkFactors);
+        ScheduleType levelSchedule(1, ImageType::ImageDimension);
+        for (unsigned int i = 0; i < ImageType::ImageDimension; ++i)
+          {
+          levelSchedule[0][i] = schedule[level][i];
+          }
+        typename Superclass::Pointer levelPyramid = Superclass::New();
+        levelPyramid->SetInput(this->GetInput());
+        levelPyramid->SetNumberOfLevels(1);
+        levelPyramid->SetSchedule(levelSchedule);
+        levelPyramid->Update();
+
+        typename ImageType::Pointer copy = ImageType::New();
+        CopyLevel(levelPyramid->GetOutput(0), copy);
+        this->m_Cache->AddLevel(this->m_Image, this->m_IJKToXYZ,
+                                scalarType, shrinkFactors, copy);
+        cachedLevels[level] = copy;
+        }
+      CopyLevel(cachedLevels[level], this->GetOutput(level));
+      }
+  }
+
+  static void GetShrinkFactors(const ScheduleType& schedule,
+                               unsigned int level,
+                               unsigned int shrinkFactors[3])
+  {
+    for (unsigned int i = 0; i < 3; ++i)
+      {
+      shrinkFactors[i] = schedule[level][i];
+      }
+  }
+
+  static void CopyLevel(const ImageType* source, ImageType* target)
+  {
+    target->CopyInformation(source);
+    target->SetRegions(source->GetBufferedRegion());
+    target->Allocate();
+    std::copy(source->GetBufferPointer(),
+              source->GetBufferPointer() +
+              source->GetBufferedRegion().GetNumberOfPixels(),
+              target->GetBufferPointer());
+  }
+
+private:
+  RegistrationPyramidCacheFilter(const Self&); // not implemented
+  void operator=(const Self&);                 // not implemented
+
+  vtkRegistrationPyramidCache* m_Cache;
+  vtkImageData*                m_Image;
+  vtkMatrix4x4*                m_IJKToXYZ;
+};
+//ETX
+
+#endif // __vtkRegistrationPyramidCacheFilter_h
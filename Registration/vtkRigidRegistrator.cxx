@@ -19,6 +19,7 @@
 #include "itkCenteredVersorTransformInitializer.h"
 #include "itkVersorRigid3DTransformOptimizer.h"
 #include "vtkRegistratorTypeTraits.h"
+#include "vtkRegistrationPyramidCacheFilter.h"
 #include "vtkImageChangeInformation.h"
 #include "vtkImagePermute.h"
 #include "itkImageFileWriter.h"
@@ -188,6 +189,7 @@ vtkRigidRegistrator()
 
   this->FixedIJKToXYZ  = NULL;
   this->MovingIJKToXYZ = NULL;
+  this->PyramidCache   = NULL;
 
   this->Transform   = vtkTransform::New();
   this->Transform->Identity();
@@ -209,6 +211,7 @@ vtkRigidRegistrator::
   this->SetMovingImage(NULL);
   this->SetFixedIJKToXYZ(NULL);
   this->SetMovingIJKToXYZ(NULL);
+  this->SetPyramidCache(NULL);
   this->Transform->Delete();
   this->Transform = NULL;
 }
@@ -422,12 +425,15 @@ RegisterImagesInternal3()
   // set up registration class
   //
 
-  typedef typename itk::MultiResolutionPyramidImageFilter
-    <ITKImageType, ITKImageType>   ImagePyramidType;
+  typedef RegistrationPyramidCacheFilter<ITKImageType> ImagePyramidType;
   typename ImagePyramidType::Pointer fixedImagePyramid = 
     ImagePyramidType::New();
   typename ImagePyramidType::Pointer movingImagePyramid = 
     ImagePyramidType::New();
+  fixedImagePyramid->
+    SetCache(this->PyramidCache, this->FixedImage, IJKToXYZMatrixFixed);
+  movingImagePyramid->
+    SetCache(this->PyramidCache, this->MovingImage, IJKToXYZMatrixMoving);
   typedef typename itk::MultiResolutionImageRegistrationMethod
     <ITKImageType, ITKImageType> MultiResolutionRegistrationType;
   typename MultiResolutionRegistrationType::Pointer multiResRegistration = 
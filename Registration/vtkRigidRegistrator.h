@@ -5,6 +5,7 @@
 #include "vtkImageData.h"
 #include "vtkTransform.h"
 #include "vtkEMSegmentWin32Header.h"
+#include "vtkRegistrationPyramidCache.h"
 
 class VTK_EMSEGMENT_EXPORT vtkRigidRegistrator : 
   public vtkObject
@@ -89,6 +90,12 @@ public:
   vtkSetObjectMacro(FixedIJKToXYZ, vtkMatrix4x4);
   vtkSetObjectMacro(MovingIJKToXYZ, vtkMatrix4x4);
 
+  // Description:
+  // Optional cache of the image pyramids, share it with the other
+  // registrator to compute the pyramids of an image only once
+  vtkSetObjectMacro(PyramidCache, vtkRegistrationPyramidCache);
+  vtkGetObjectMacro(PyramidCache, vtkRegistrationPyramidCache);
+
   void RegisterImages();
 
 protected:
@@ -130,6 +137,8 @@ private:
   vtkMatrix4x4*                   FixedIJKToXYZ;
   vtkMatrix4x4*                   MovingIJKToXYZ;
 
+  vtkRegistrationPyramidCache*    PyramidCache;
+
   vtkTransform*                   Transform;
 
   int                             NumberOfIterations;
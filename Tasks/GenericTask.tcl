@@ -49,6 +49,10 @@ namespace eval EMSegmenterPreProcessingTcl {
     variable inputSubParcellationNode
     variable outputSubParcellationNode
 
+    ## Registrations queued with the preprocessing scheduler of LOGIC - indexed by "handle,name"
+    variable registrationJob
+    variable registrationJobCount 0
+
     ## Task Specific GUI variables
     variable TextLabelSize 1
     variable CheckButtonSize 0
@@ -69,14 +73,36 @@ namespace eval EMSegmenterPreProcessingTcl {
     }
 
 
+    #------------------------------------------------------
+    # directory of the intermediate files - see vtkEMSegmentLogic::SetScratchDirectory
+    proc GetScratchDirectory { } {
+        variable GUI
+        variable LOGIC
+
+        set scratchDir [$LOGIC GetScratchDirectory]
+        if { $scratchDir != "" && [file isdirectory $scratchDir] && [file writable $scratchDir] } {
+            return $scratchDir
+        }
+        return [$GUI GetTemporaryDirectory]
+    }
+
     #------------------------------------------------------
     # returns filename when no error occurs
     proc CreateTemporaryFileNameForNode { Node } {
         variable GUI
         variable LOGIC
 
+        # volumes go to shared memory if there is room for them (see vtkEMSegmentLogic::GetSharedMemoryDirectoryForVolume)
+        set tmpDir ""
+        if { [$Node GetClassName] == "vtkMRMLScalarVolumeNode" } {
+            set tmpDir [$LOGIC GetSharedMemoryDirectoryForVolume $Node]
+        }
+        if { $tmpDir == "" } {
+            set tmpDir [GetScratchDirectory]
+        }
+
         # dry-run, XXXXXX cannot be in the middle of the name on some platforms (fc11)
-        set CMD "mktemp -u \"[$GUI GetTemporaryDirectory]/XXXXXX\""
+        set CMD "mktemp -u \"$tmpDir/XXXXXX\""
         set basefilename [ eval exec $CMD ]
 
         set filename ""
@@ -111,7 +137,7 @@ namespace eval EMSegmenterPreProcessingTcl {
         variable LOGIC
 
         # dry-run, XXXXXX cannot be in the middle of the name on some platforms (fc11)
-        set CMD "mktemp -u \"[$GUI GetTemporaryDirectory]/XXXXXX\""
+        set CMD "mktemp -u \"[GetScratchDirectory]/XXXXXX\""
         set basefilename [ eval exec $CMD ]
 
         set filename ""
@@ -145,7 +171,7 @@ namespace eval EMSegmenterPreProcessingTcl {
         variable LOGIC
 
         # dry-run, XXXXXX cannot be in the middle of the name on some platforms (fc11)
-        set CMD "mktemp -u -d \"[$GUI GetTemporaryDirectory]/XXXXXX\""
+        set CMD "mktemp -u -d \"[GetScratchDirectory]/XXXXXX\""
         set basefilename [ eval exec $CMD ]
 
         set dirname ""
@@ -519,6 +545,8 @@ namespace eval EMSegmenterPreProcessingTcl {
 
             $LOGIC PrintText "TCL: ===> Register Target To Target "
 
+            # The registrations of the channels are independent of each other - queue all of them first
+            # so that the scheduler of the logic can run them at the same time
             for { set i 0 } {$i < [$alignedTargetNode GetNumberOfVolumes] } { incr i } {
                 if { $i == $fixedTargetImageIndex } {
                     continue;
@@ -526,12 +554,27 @@ namespace eval EMSegmenterPreProcessingTcl {
 
                 set movingVolumeNode $intputVolumeNode($i)
                 set outVolumeNode $outputVolumeNode($i)
-                set backgroundLevel [$LOGIC GuessRegistrationBackgroundLevel $movingVolumeNode]
+                set backgroundLevel($i) [$LOGIC GuessRegistrationBackgroundLevel $movingVolumeNode]
 
                 # Using BRAINS suite, TODO: is affine=off here?
                 set tmpAffineType 2
                 set tmpDeformableType 0
-                set transformNode [BRAINSRegistration $fixedVolumeNode $movingVolumeNode $outVolumeNode $backgroundLevel $tmpAffineType $tmpDeformableType]
+                set registrationHandle($i) [BRAINSRegistrationStart $fixedVolumeNode $movingVolumeNode $outVolumeNode $backgroundLevel($i) $tmpAffineType $tmpDeformableType]
+                if { $registrationHandle($i) == "" } {
+                    PrintError "Transform node is null"
+                    return 1
+                }
+            }
+
+            $LOGIC RunPreprocessingJobs
+
+            for { set i 0 } {$i < [$alignedTargetNode GetNumberOfVolumes] } { incr i } {
+                if { $i == $fixedTargetImageIndex } {
+                    continue;
+                }
+
+                set movingVolumeNode $intputVolumeNode($i)
+                set transformNode [BRAINSRegistrationFinish $registrationHandle($i)]
                 if { $transformNode == "" } {
                     PrintError "Transform node is null"
                     return 1
@@ -544,7 +587,7 @@ namespace eval EMSegmenterPreProcessingTcl {
                 set outputNodeID [$outputNode GetID]
                 $outputNode Delete
 
-                if { [Resample $movingVolumeNode $fixedVolumeNode $transformNode "NotUsedForBSpline" "BSplineTransform" Linear  $backgroundLevel [$SCENE GetNodeByID $outputNodeID]] } {
+                if { [Resample $movingVolumeNode $fixedVolumeNode $transformNode "NotUsedForBSpline" "BSplineTransform" Linear  $backgroundLevel($i) [$SCENE GetNodeByID $outputNodeID]] } {
                     return 1
                 }
                 ## $SCENE RemoveNode $transformNode
@@ -579,6 +622,7 @@ namespace eval EMSegmenterPreProcessingTcl {
         $output DeepCopy $input
 
         set voronoi [vtkImageLabelPropagation New]
+        $voronoi SetAlgorithmToFelzenszwalb
         $voronoi SetInput $output
         $voronoi Update
 
@@ -684,6 +728,7 @@ namespace eval EMSegmenterPreProcessingTcl {
     proc InitPreProcessing { } {
         variable mrmlManager
         variable LOGIC
+        variable registrationJob
         variable workingDN
         variable alignedTargetNode
         variable inputAtlasNode
@@ -712,6 +757,11 @@ namespace eval EMSegmenterPreProcessingTcl {
 
         $LOGIC StartPreprocessingInitializeInputData
 
+        # Forget about the registrations queued by previous runs
+        $LOGIC RemoveAllPreprocessingJobs
+        array unset registrationJob
+        $LOGIC RemoveAllSharedMemoryVolumes
+
 
         # -----------------------------------------------------------
         # Define Target Node
@@ -1527,6 +1577,13 @@ namespace eval EMSegmenterPreProcessingTcl {
         variable SCENE
         variable LOGIC
 
+        # hand the voxels over in shared memory, the temporary directory is the fallback
+        if { "$Type" == "Volume" } {
+            set shmName [$LOGIC WriteVolumeToSharedMemory $Node]
+            if { $shmName != "" } {
+                return "$shmName"
+            }
+        }
 
         set tmpName [CreateTemporaryFileNameForNode $Node]
         if { $tmpName == "" } { return "" }
@@ -1542,6 +1599,8 @@ namespace eval EMSegmenterPreProcessingTcl {
 
         $out SetScene $SCENE
         $out SetFileName $tmpName
+        # intermediate files are only read once - see vtkEMSegmentLogic::SetScratchCompressionFlag
+        $out SetUseCompression [$LOGIC GetScratchCompressionFlag]
         if { [file exists $tmpName] && [file size $tmpName] == 0 } {
             # remove empty file immediately before we write into it.
             file delete $tmpName
@@ -1603,11 +1662,113 @@ namespace eval EMSegmenterPreProcessingTcl {
         return 1
     }
 
+    # Handle of a registration queued with the preprocessing scheduler (see BRAINSRegistrationStart)
+    proc NewRegistrationJob { } {
+        variable registrationJobCount
+        incr registrationJobCount
+        return "registration$registrationJobCount"
+    }
+
+    # ----------------------------------------------------------------------------
+    # Registration cache - the results of BRAINSRegistration and CMTKRegistration are stored under a key built from
+    # the content of the fixed and moving volume and the registration options (see vtkEMSegmentLogic::GetRegistrationCacheKey),
+    # so that re-segmenting the same subject does not repeat the registrations
+    # returns the cache directory or "" if the cache is disabled
+    proc GetRegistrationCacheDir { } {
+        variable GUI
+        variable LOGIC
+
+        if { [$LOGIC GetRegistrationCacheFlag] == 0 } {
+            return ""
+        }
+
+        set cacheDir [$LOGIC GetRegistrationCacheDirectory]
+        if { $cacheDir == "" } {
+            set cacheDir "[$GUI GetTemporaryDirectory]/EMSegmentRegistrationCache"
+        }
+
+        if { [file isdirectory $cacheDir] == 0 } {
+            if { [catch { file mkdir $cacheDir } errmsg] } {
+                PrintError "GetRegistrationCacheDir: could not create $cacheDir - $errmsg"
+                return ""
+            }
+        }
+        return $cacheDir
+    }
+
+    # returns the key or "" if the cache is disabled
+    proc GetRegistrationCacheKey { fixedVolumeNode movingVolumeNode parameters } {
+        variable LOGIC
+
+        if { [GetRegistrationCacheDir] == "" } {
+            return ""
+        }
+        return [$LOGIC GetRegistrationCacheKey $fixedVolumeNode $movingVolumeNode $parameters]
+    }
+
+    # returns the cached file or directory or "" if it is not cached
+    proc ReadRegistrationCache { cacheKey entry } {
+        if { $cacheKey == "" } {
+            return ""
+        }
+
+        set cacheName "[GetRegistrationCacheDir]/${cacheKey}_$entry"
+        if { [file exists $cacheName] == 0 } {
+            return ""
+        }
+        return $cacheName
+    }
+
+    # copies a result file or directory into the cache and returns its name in the cache or "" 
+    # empty results of failed registrations are not cached 
+    proc WriteRegistrationCache { cacheKey entry fileName } {
+        variable LOGIC
+
+        if { $cacheKey == "" || $fileName == "" || [file exists $fileName] == 0 } {
+            return ""
+        }
+        if { [file isdirectory $fileName] } {
+            if { [llength [glob -nocomplain -directory $fileName *]] == 0 } {
+                return ""
+            }
+        } elseif { [file size $fileName] == 0 } {
+            return ""
+        }
+
+        # copy under a temporary name first so that an interrupted copy is never read as a cache entry
+        set cacheName "[GetRegistrationCacheDir]/${cacheKey}_$entry"
+        set tmpName "$cacheName.[pid]"
+        if { [catch { file delete -force $tmpName $cacheName ; file copy $fileName $tmpName ; file rename $tmpName $cacheName } errmsg] } {
+            PrintError "WriteRegistrationCache: could not write $cacheName - $errmsg"
+            catch { file delete -force $tmpName }
+            return ""
+        }
+
+        $LOGIC PrintText "TCL: Cached registration result $cacheName"
+        return $cacheName
+    }
+
     # returns a transformation Node
+    # Runs BRAINSFit right away - see BRAINSRegistrationStart to run several registrations at once
     proc BRAINSRegistration { fixedVolumeNode movingVolumeNode outputVolumeNode backgroundLevel affineType deformableType } {
+        variable LOGIC
+
+        set handle [BRAINSRegistrationStart $fixedVolumeNode $movingVolumeNode $outputVolumeNode $backgroundLevel $affineType $deformableType]
+        if { $handle == "" } {
+            return ""
+        }
+        $LOGIC RunPreprocessingJobs
+        return [BRAINSRegistrationFinish $handle]
+    }
+
+    # Prepares the registration and queues BRAINSFit with the preprocessing scheduler of the logic instead of
+    # running it. Returns a handle for BRAINSRegistrationFinish, which has to be called after $LOGIC RunPreprocessingJobs
+    # (or "" if the registration could not be set up)
+    proc BRAINSRegistrationStart { fixedVolumeNode movingVolumeNode outputVolumeNode backgroundLevel affineType deformableType } {
         variable SCENE
         variable LOGIC
         variable mrmlManager
+        variable registrationJob
 
         $LOGIC PrintText "TCL: =========================================="
         $LOGIC PrintText "TCL: == BRAINSRegistration: affine: $affineType , deformable: $deformableType"
@@ -1617,130 +1778,164 @@ namespace eval EMSegmenterPreProcessingTcl {
             PrintError "AlignInputImages: fixed volume node not correctly defined"
             return ""
         }
-        set fixedVolumeFileName [WriteDataToTemporaryDir $fixedVolumeNode Volume]
-        set RemoveFiles "\"$fixedVolumeFileName\""
-        if { $fixedVolumeFileName == "" } { return "" }
-
 
         if { $movingVolumeNode == "" || [$movingVolumeNode GetImageData] == "" } {
             PrintError "AlignInputImages: moving volume node not correctly defined"
             return ""
         }
-        set movingVolumeFileName [WriteDataToTemporaryDir $movingVolumeNode Volume]
-        set RemoveFiles "$RemoveFiles $movingVolumeFileName"
-        if { $movingVolumeFileName == "" } { return "" }
-
 
         if { $outputVolumeNode == "" } {
             PrintError "AlignInputImages: output volume node not correctly defined"
             return ""
         }
-        set outputVolumeFileName [CreateTemporaryFileNameForNode $outputVolumeNode]
-        set RemoveFiles "$RemoveFiles \"$outputVolumeFileName\""
-        if { $outputVolumeFileName == "" } { return "" }
-
-
-
-        set PLUGINS_DIR "[$::slicer3::Application GetPluginsDir]"
-
-        # First BRAINSFit call
-
-        set CMD "\"${PLUGINS_DIR}/BRAINSFit\""
 
+        # All options besides the file names - they also define the key of the registration cache
         # Filter options - just set it here to make sure that if default values are changed this still works as it supposed to
-        set CMD "$CMD --backgroundFillValue $backgroundLevel"
-        set CMD "$CMD --interpolationMode Linear"
-        set CMD "$CMD --outputVolumePixelType [BRAINSGetPixelTypeFromVolumeNode $fixedVolumeNode]"
-
-        set CMD "$CMD --fixedVolume \"$fixedVolumeFileName\""
-        set CMD "$CMD --movingVolume \"$movingVolumeFileName\""
-        set CMD "$CMD --outputVolume \"$outputVolumeFileName\""
-
-        # Do not worry about fileExtensions=".mat" type="linear" reference="movingVolume"
-        # these are set in vtkCommandLineModuleLogic.cxx automatically
-        if {  $deformableType != 0 } {
-            set transformNode [vtkMRMLBSplineTransformNode New]
-            $transformNode SetName "EMSegmentBSplineTransform"
-            $SCENE AddNode $transformNode
-            set transID [$transformNode GetID]
-            set outputTransformFileName [CreateTemporaryFileNameForNode $transformNode]
-            set CMD "$CMD --bsplineTransform \"$outputTransformFileName\""
-        } else {
-            set transformNode [vtkMRMLLinearTransformNode New]
-            $transformNode SetName "EMSegmentLinearTransform"
-            $SCENE AddNode $transformNode
-            set transID [$transformNode GetID]
-            set outputTransformFileName [CreateTemporaryFileNameForNode $transformNode]
-            set CMD "$CMD --outputTransform \"$outputTransformFileName\""
-        }
-        $transformNode Delete
-        set RemoveFiles "$RemoveFiles \"$outputTransformFileName\""
-
+        set OPTIONS "--backgroundFillValue $backgroundLevel"
+        set OPTIONS "$OPTIONS --interpolationMode Linear"
+        set OPTIONS "$OPTIONS --outputVolumePixelType [BRAINSGetPixelTypeFromVolumeNode $fixedVolumeNode]"
 
 #        if { $affineType == [$mrmlManager GetRegistrationTypeFromString RegistrationTest] } {
-#            set CMD "$CMD --numberOfIterations 3    --numberOfSamples 100"
+#            set OPTIONS "$OPTIONS --numberOfIterations 3    --numberOfSamples 100"
 #        } elseif { $affineType == [$mrmlManager GetRegistrationTypeFromString RegistrationFast] } {
-#            set CMD "$CMD --numberOfIterations 1500 --numberOfSamples 1000"
+#            set OPTIONS "$OPTIONS --numberOfIterations 1500 --numberOfSamples 1000"
 #        } elseif { $affineType == [$mrmlManager GetRegistrationTypeFromString RegistrationSlow] } {
-#            set CMD "$CMD --numberOfIterations 1500 --numberOfSamples 300000"
+#            set OPTIONS "$OPTIONS --numberOfIterations 1500 --numberOfSamples 300000"
 #        } else {
 #            PrintError "BRAINSRegistration: Unknown affineType: $affineType"
 #            return ""
 #        }
 
         if { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationTest] } {
-            set CMD "$CMD --numberOfIterations 3    --numberOfSamples 100"
+            set OPTIONS "$OPTIONS --numberOfIterations 3    --numberOfSamples 100"
         } elseif { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationFast] } {
-            set CMD "$CMD --numberOfIterations 500  --numberOfSamples 30000"
+            set OPTIONS "$OPTIONS --numberOfIterations 500  --numberOfSamples 30000"
         } elseif { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationSlow] } {
-            set CMD "$CMD --numberOfIterations 1500 --numberOfSamples 300000"
+            set OPTIONS "$OPTIONS --numberOfIterations 1500 --numberOfSamples 300000"
         } else {
             PrintError "BRAINSRegistration: Unknown deformableType: $deformableType"
             return ""
         }
 
+        set OPTIONS "$OPTIONS --useRigid --useScaleSkewVersor3D --useAffine"
+        if { $deformableType != 0 } {
+          set OPTIONS "$OPTIONS --useBSpline"
+          set OPTIONS "$OPTIONS --splineGridSize 6,6,6"
+          set OPTIONS "$OPTIONS --maxBSplineDisplacement 0"
+          set OPTIONS "$OPTIONS --useCachingOfBSplineWeightsMode ON"
+        }
+        set OPTIONS "$OPTIONS --initializeTransformMode useCenterOfHeadAlign"
+        set OPTIONS "$OPTIONS --minimumStepLength 0.005"
+        set OPTIONS "$OPTIONS --translationScale 1000"
+        set OPTIONS "$OPTIONS --reproportionScale 1"
+        set OPTIONS "$OPTIONS --skewScale 1"
+        set OPTIONS "$OPTIONS --maskProcessingMode NOMASK"
+        set OPTIONS "$OPTIONS --numberOfHistogramBins 40"
+        set OPTIONS "$OPTIONS --numberOfMatchPoints 10"
+        set OPTIONS "$OPTIONS --costMetric MMI"
+
+        set OPTIONS "$OPTIONS --fixedVolumeTimeIndex 0"
+        set OPTIONS "$OPTIONS --movingVolumeTimeIndex 0"
+        set OPTIONS "$OPTIONS --debugNumberOfThreads -1"
+        set OPTIONS "$OPTIONS --debugLevel 0"
+        set OPTIONS "$OPTIONS --failureExitCode -1"
+
+#        set OPTIONS "$OPTIONS --medianFilterSize 0,0,0"
+#        set OPTIONS "$OPTIONS --useExplicitPDFDerivativesMode AUTO"
+#        set OPTIONS "$OPTIONS --relaxationFactor 0.5"
+#        set OPTIONS "$OPTIONS --maximumStepLength 0.2"
+#        set OPTIONS "$OPTIONS --costFunctionConvergenceFactor 1e+9"
+#        set OPTIONS "$OPTIONS --projectedGradientTolerance 1e-5"
+#        set OPTIONS "$OPTIONS --maskProcessingMode ROIAUTO"
+#        set OPTIONS "$OPTIONS --ROIAutoDilateSize 3.0"
+#        set OPTIONS "$OPTIONS --maskInferiorCutOffFromCenter 65.0"
+
+#        set OPTIONS "$OPTIONS --initialTransform \"$linearTransformFileName\""
+#        set OPTIONS "$OPTIONS --initializeTransformMode Off"
+
+        # Do not worry about fileExtensions=".mat" type="linear" reference="movingVolume"
+        # these are set in vtkCommandLineModuleLogic.cxx automatically
+        if {  $deformableType != 0 } {
+            set transformNode [vtkMRMLBSplineTransformNode New]
+            $transformNode SetName "EMSegmentBSplineTransform"
+        } else {
+            set transformNode [vtkMRMLLinearTransformNode New]
+            $transformNode SetName "EMSegmentLinearTransform"
+        }
+        $SCENE AddNode $transformNode
+        set transID [$transformNode GetID]
+
+        set cacheKey [GetRegistrationCacheKey $fixedVolumeNode $movingVolumeNode "BRAINSFit $OPTIONS"]
+        set outputVolumeFileName [ReadRegistrationCache $cacheKey output.nrrd]
+        set outputTransformFileName [ReadRegistrationCache $cacheKey transform.mat]
 
+        if { $outputVolumeFileName != "" && $outputTransformFileName != "" } {
+            $LOGIC PrintText "TCL: Found registration in cache - $cacheKey"
+            $transformNode Delete
+            set RemoveFiles ""
+            set jobID -1
+        } else {
+            set fixedVolumeFileName [WriteDataToTemporaryDir $fixedVolumeNode Volume]
+            set RemoveFiles "\"$fixedVolumeFileName\""
+            if { $fixedVolumeFileName == "" } { $SCENE RemoveNode $transformNode ; $transformNode Delete ; return "" }
 
-        set CMD "$CMD --useRigid --useScaleSkewVersor3D --useAffine"
-        if { $deformableType != 0 } {
-          set CMD "$CMD --useBSpline"
-          set CMD "$CMD --splineGridSize 6,6,6"
-          set CMD "$CMD --maxBSplineDisplacement 0"
-          set CMD "$CMD --useCachingOfBSplineWeightsMode ON"
-        }
-        set CMD "$CMD --initializeTransformMode useCenterOfHeadAlign"
-        set CMD "$CMD --minimumStepLength 0.005"
-        set CMD "$CMD --translationScale 1000"
-        set CMD "$CMD --reproportionScale 1"
-        set CMD "$CMD --skewScale 1"
-        set CMD "$CMD --maskProcessingMode NOMASK"
-        set CMD "$CMD --numberOfHistogramBins 40"
-        set CMD "$CMD --numberOfMatchPoints 10"
-        set CMD "$CMD --costMetric MMI"
-
-        set CMD "$CMD --fixedVolumeTimeIndex 0"
-        set CMD "$CMD --movingVolumeTimeIndex 0"
-        set CMD "$CMD --debugNumberOfThreads -1"
-        set CMD "$CMD --debugLevel 0"
-        set CMD "$CMD --failureExitCode -1"
-
-#        set CMD "$CMD --medianFilterSize 0,0,0"
-#        set CMD "$CMD --useExplicitPDFDerivativesMode AUTO"
-#        set CMD "$CMD --relaxationFactor 0.5"
-#        set CMD "$CMD --maximumStepLength 0.2"
-#        set CMD "$CMD --costFunctionConvergenceFactor 1e+9"
-#        set CMD "$CMD --projectedGradientTolerance 1e-5"
-#        set CMD "$CMD --maskProcessingMode ROIAUTO"
-#        set CMD "$CMD --ROIAutoDilateSize 3.0"
-#        set CMD "$CMD --maskInferiorCutOffFromCenter 65.0"
-
-#        set CMD "$CMD --initialTransform \"$linearTransformFileName\""
-#        set CMD "$CMD --initializeTransformMode Off"
+            set movingVolumeFileName [WriteDataToTemporaryDir $movingVolumeNode Volume]
+            set RemoveFiles "$RemoveFiles $movingVolumeFileName"
+            if { $movingVolumeFileName == "" } { $SCENE RemoveNode $transformNode ; $transformNode Delete ; return "" }
 
+            set outputVolumeFileName [CreateTemporaryFileNameForNode $outputVolumeNode]
+            set RemoveFiles "$RemoveFiles \"$outputVolumeFileName\""
+            if { $outputVolumeFileName == "" } { $SCENE RemoveNode $transformNode ; $transformNode Delete ; return "" }
 
-        $LOGIC PrintText "TCL: Executing $CMD"
-        catch { eval exec $CMD } errmsg
-        $LOGIC PrintText "TCL: $errmsg"
+            set outputTransformFileName [CreateTemporaryFileNameForNode $transformNode]
+            $transformNode Delete
+            set RemoveFiles "$RemoveFiles \"$outputTransformFileName\""
+
+            set PLUGINS_DIR "[$::slicer3::Application GetPluginsDir]"
+
+            # First BRAINSFit call
+            set CMD "\"${PLUGINS_DIR}/BRAINSFit\""
+            set CMD "$CMD --fixedVolume \"$fixedVolumeFileName\""
+            set CMD "$CMD --movingVolume \"$movingVolumeFileName\""
+            set CMD "$CMD --outputVolume \"$outputVolumeFileName\""
+            if {  $deformableType != 0 } {
+                set CMD "$CMD --bsplineTransform \"$outputTransformFileName\""
+            } else {
+                set CMD "$CMD --outputTransform \"$outputTransformFileName\""
+            }
+            set CMD "$CMD $OPTIONS"
+
+            $LOGIC PrintText "TCL: Queuing $CMD"
+            set jobID [$LOGIC AddPreprocessingJob $CMD]
+        }
+
+        set handle [NewRegistrationJob]
+        foreach VAR { jobID cacheKey movingVolumeNode outputVolumeNode transID outputVolumeFileName outputTransformFileName RemoveFiles } {
+            set registrationJob($handle,$VAR) [set $VAR]
+        }
+        return $handle
+    }
+
+    # Reads the results of a registration queued by BRAINSRegistrationStart back into the scene
+    # returns the transformation node or ""
+    proc BRAINSRegistrationFinish { handle } {
+        variable SCENE
+        variable LOGIC
+        variable registrationJob
+
+        foreach VAR { jobID cacheKey movingVolumeNode outputVolumeNode transID outputVolumeFileName outputTransformFileName RemoveFiles } {
+            set $VAR $registrationJob($handle,$VAR)
+        }
+        array unset registrationJob "$handle,*"
+
+        if { $jobID >= 0 } {
+            $LOGIC PrintText "TCL: [$LOGIC GetPreprocessingJobOutput $jobID]"
+            if { [$LOGIC GetPreprocessingJobExitCode $jobID] == 0 } {
+                if { [WriteRegistrationCache $cacheKey transform.mat $outputTransformFileName] != "" } {
+                    WriteRegistrationCache $cacheKey output.nrrd $outputVolumeFileName
+                }
+            }
+        }
 
 
         # Read results back to scene
@@ -1784,11 +1979,27 @@ namespace eval EMSegmenterPreProcessingTcl {
 
 
     # ----------------------------------------------------------------------------
+    # Runs the CMTK registration right away - see CMTKRegistrationStart to run several registrations at once
     proc CMTKRegistration { fixedVolumeNode movingVolumeNode outVolumeNode backgroundLevel deformableType affineType} {
+        variable LOGIC
+
+        set handle [CMTKRegistrationStart $fixedVolumeNode $movingVolumeNode $outVolumeNode $backgroundLevel $deformableType $affineType]
+        if { $handle == "" } {
+            return ""
+        }
+        $LOGIC RunPreprocessingJobs
+        return [CMTKRegistrationFinish $handle]
+    }
+
+    # Prepares the registration and queues the affine (and non-rigid) registration as one job with the preprocessing
+    # scheduler of the logic. Returns a handle for CMTKRegistrationFinish, which has to be called after
+    # $LOGIC RunPreprocessingJobs (or "" if the registration could not be set up)
+    proc CMTKRegistrationStart { fixedVolumeNode movingVolumeNode outVolumeNode backgroundLevel deformableType affineType} {
         variable SCENE
         variable LOGIC
         variable CMTKFOLDER
         variable mrmlManager
+        variable registrationJob
 
         # Do not get rid of debug mode variable - it is sometimes very helpful !
         set CMTK_DEBUG_MODE 0
@@ -1820,107 +2031,150 @@ namespace eval EMSegmenterPreProcessingTcl {
             return ""
         }
 
-        set fixedVolumeFileName [WriteDataToTemporaryDir $fixedVolumeNode Volume]
-        if { $fixedVolumeFileName == "" } {
-            # remove files
-            return ""
-        }
-        set RemoveFiles "$fixedVolumeFileName"
-
-
-        set movingVolumeFileName [WriteDataToTemporaryDir $movingVolumeNode Volume]
-        if { $movingVolumeFileName == "" } {
-            #remove files
-            return ""
-        }
-        set RemoveFiles "$RemoveFiles $movingVolumeFileName"
-
-
-        set outVolumeFileName [CreateTemporaryFileNameForNode $outVolumeNode]
-        if { $outVolumeFileName == "" } {
-            #remove files
-            return ""
-        }
-        set RemoveFiles "$RemoveFiles $outVolumeFileName"
-
-        ## CMTK specific arguments
-
-        set CMD "$CMTKFOLDER/registration"
+        ## CMTK specific arguments - besides the file names they also define the key of the registration cache
 
         if { $affineType == [$mrmlManager GetRegistrationTypeFromString RegistrationTest] } {
-            set CMD "$CMD --dofs 0"
+            set AFFINE_OPTIONS "--dofs 0"
         } elseif { $affineType == [$mrmlManager GetRegistrationTypeFromString RegistrationFast] } {
-            set CMD "$CMD --accuracy 0.5 --initxlate --exploration 8.0 --dofs 6 --dofs 9"
+            set AFFINE_OPTIONS "--accuracy 0.5 --initxlate --exploration 8.0 --dofs 6 --dofs 9"
         } elseif { $affineType == [$mrmlManager GetRegistrationTypeFromString RegistrationSlow] } {
-            set CMD "$CMD --accuracy 0.1 --initxlate --exploration 8.0 --dofs 6 --dofs 9"
+            set AFFINE_OPTIONS "--accuracy 0.1 --initxlate --exploration 8.0 --dofs 6 --dofs 9"
         } else {
             PrintError "CMTKRegistration: Unknown affineType: $affineType"
             return ""
         }
 
+        set WARP_OPTIONS ""
+        if { $deformableType != 0 } {
+            set WARP_OPTIONS "--verbose"
+            set WARP_OPTIONS "$WARP_OPTIONS --fast"
+            if { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationTest] } {
+                set WARP_OPTIONS "$WARP_OPTIONS --delta-f-threshold 1"
+            } elseif { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationFast] } {
+                set WARP_OPTIONS "$WARP_OPTIONS --grid-spacing 40 --refine 1"
+                set WARP_OPTIONS "$WARP_OPTIONS --energy-weight 5e-2"
+                set WARP_OPTIONS "$WARP_OPTIONS --accuracy 1 --coarsest 6"
+            } elseif { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationSlow] } {
+                set WARP_OPTIONS "$WARP_OPTIONS --grid-spacing 40 --refine 4"
+                set WARP_OPTIONS "$WARP_OPTIONS --energy-weight 5e-2"
+                set WARP_OPTIONS "$WARP_OPTIONS --exploration 16 --accuracy 0.1 --coarsest 6"
+            } else {
+                PrintError "CMTKRegistration: Unknown deformableType: $deformableType"
+                return ""
+            }
+        }
 
-        # affine
-        set outLinearTransformDirName [CreateDirName "xform"]
-
-        set outTransformDirName $outLinearTransformDirName
-
-        set CMD "$CMD -o \"$outLinearTransformDirName\""
-        set CMD "$CMD --write-reformatted \"$outVolumeFileName\""
-        set CMD "$CMD \"$fixedVolumeFileName\""
-        set CMD "$CMD \"$movingVolumeFileName\""
-
+        set cacheKey ""
+        if { $CMTK_DEBUG_MODE == 0 } {
+            set cacheKey [GetRegistrationCacheKey $fixedVolumeNode $movingVolumeNode "CMTK registration $AFFINE_OPTIONS warp $WARP_OPTIONS"]
+        }
+        set outVolumeFileName [ReadRegistrationCache $cacheKey output.nrrd]
+        set outTransformDirName [ReadRegistrationCache $cacheKey transform.xform]
 
-        ## execute affine registration
-        if { $CMTK_DEBUG_MODE } {
-            $LOGIC PrintText ""
-            $LOGIC PrintText "DEBUG: ========== Skip Affine Registration ============="
-            $LOGIC PrintText ""
+        if { $outVolumeFileName != "" && $outTransformDirName != "" } {
+            $LOGIC PrintText "TCL: Found registration in cache - $cacheKey"
+            set RemoveFiles ""
+            set jobID -1
         } else {
-            $LOGIC PrintText "TCL: Executing $CMD"
-            catch { eval exec $CMD } errmsg
-            $LOGIC PrintText "TCL: $errmsg"
-        }
+            set jobID -1
+            set fixedVolumeFileName [WriteDataToTemporaryDir $fixedVolumeNode Volume]
+            if { $fixedVolumeFileName == "" } {
+                # remove files
+                return ""
+            }
+            set RemoveFiles "$fixedVolumeFileName"
 
-        if { $deformableType != 0 } {
 
-            set CMD "$CMTKFOLDER/warp"
+            set movingVolumeFileName [WriteDataToTemporaryDir $movingVolumeNode Volume]
+            if { $movingVolumeFileName == "" } {
+                #remove files
+                return ""
+            }
+            set RemoveFiles "$RemoveFiles $movingVolumeFileName"
 
-            # BSpline
-            set outNonLinearTransformDirName [CreateDirName "xform"]
-            set outTransformDirName $outNonLinearTransformDirName
 
-            set CMD "$CMD --verbose"
-            set CMD "$CMD --fast"
-            if { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationTest] } {
-                set CMD "$CMD --delta-f-threshold 1"
-            } elseif { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationFast] } {
-                set CMD "$CMD --grid-spacing 40 --refine 1"
-                set CMD "$CMD --energy-weight 5e-2"
-                set CMD "$CMD --accuracy 1 --coarsest 6"
-            } elseif { $deformableType == [$mrmlManager GetRegistrationTypeFromString RegistrationSlow] } {
-                set CMD "$CMD --grid-spacing 40 --refine 4"
-                set CMD "$CMD --energy-weight 5e-2"
-                set CMD "$CMD --exploration 16 --accuracy 0.1 --coarsest 6"
-            } else {
-                PrintError "CMTKRegistration: Unknown deformableType: $deformableType"
+            set outVolumeFileName [CreateTemporaryFileNameForNode $outVolumeNode]
+            if { $outVolumeFileName == "" } {
+                #remove files
                 return ""
             }
+            set RemoveFiles "$RemoveFiles $outVolumeFileName"
 
-            set CMD "$CMD --initial \"$outLinearTransformDirName\""
-            set CMD "$CMD -o \"$outNonLinearTransformDirName\""
+            set CMD "$CMTKFOLDER/registration $AFFINE_OPTIONS"
+
+            # affine
+            set outLinearTransformDirName [CreateDirName "xform"]
+
+            set outTransformDirName $outLinearTransformDirName
+
+            set CMD "$CMD -o \"$outLinearTransformDirName\""
             set CMD "$CMD --write-reformatted \"$outVolumeFileName\""
             set CMD "$CMD \"$fixedVolumeFileName\""
             set CMD "$CMD \"$movingVolumeFileName\""
 
-            ## execute bspline registration
+
+            ## execute affine registration
             if { $CMTK_DEBUG_MODE } {
                 $LOGIC PrintText ""
-                $LOGIC PrintText "DEBUG: ========== Skip Non-Rigid Registration ============="
+                $LOGIC PrintText "DEBUG: ========== Skip Affine Registration ============="
                 $LOGIC PrintText ""
             } else {
-                $LOGIC PrintText "TCL: Executing $CMD"
-                catch { eval exec $CMD } errmsg
-                $LOGIC PrintText "TCL: $errmsg"
+                $LOGIC PrintText "TCL: Queuing $CMD"
+                set jobID [$LOGIC AddPreprocessingJob $CMD]
+            }
+
+            if { $deformableType != 0 } {
+
+                set CMD "$CMTKFOLDER/warp $WARP_OPTIONS"
+
+                # BSpline
+                set outNonLinearTransformDirName [CreateDirName "xform"]
+                set outTransformDirName $outNonLinearTransformDirName
+
+                set CMD "$CMD --initial \"$outLinearTransformDirName\""
+                set CMD "$CMD -o \"$outNonLinearTransformDirName\""
+                set CMD "$CMD --write-reformatted \"$outVolumeFileName\""
+                set CMD "$CMD \"$fixedVolumeFileName\""
+                set CMD "$CMD \"$movingVolumeFileName\""
+
+                ## execute bspline registration
+                if { $CMTK_DEBUG_MODE } {
+                    $LOGIC PrintText ""
+                    $LOGIC PrintText "DEBUG: ========== Skip Non-Rigid Registration ============="
+                    $LOGIC PrintText ""
+                } else {
+                    # only runs once the affine registration succeeded
+                    $LOGIC PrintText "TCL: Queuing $CMD"
+                    $LOGIC AddPreprocessingJobCommand $jobID $CMD
+                }
+            }
+        }
+
+        set handle [NewRegistrationJob]
+        foreach VAR { CMTK_DEBUG_MODE jobID cacheKey movingVolumeNode outVolumeNode outVolumeFileName outTransformDirName RemoveFiles } {
+            set registrationJob($handle,$VAR) [set $VAR]
+        }
+        return $handle
+    }
+
+    # Reads the results of a registration queued by CMTKRegistrationStart back into the scene
+    # returns the transformation directory name or ""
+    proc CMTKRegistrationFinish { handle } {
+        variable SCENE
+        variable LOGIC
+        variable registrationJob
+
+        foreach VAR { CMTK_DEBUG_MODE jobID cacheKey movingVolumeNode outVolumeNode outVolumeFileName outTransformDirName RemoveFiles } {
+            set $VAR $registrationJob($handle,$VAR)
+        }
+        array unset registrationJob "$handle,*"
+
+        if { $jobID >= 0 } {
+            $LOGIC PrintText "TCL: [$LOGIC GetPreprocessingJobOutput $jobID]"
+            if { [$LOGIC GetPreprocessingJobExitCode $jobID] == 0 } {
+                if { [WriteRegistrationCache $cacheKey transform.xform $outTransformDirName] != "" } {
+                    WriteRegistrationCache $cacheKey output.nrrd $outVolumeFileName
+                }
             }
         }
 
@@ -2521,26 +2775,50 @@ namespace eval EMSegmenterPreProcessingTcl {
         # ----------------------------------------------------------------
 
         # Spatial prior
+        # With a deformation field all priors of the same background level are resampled in one pass
+        array unset priorInputNodes
+        array unset priorOutputNodes
         for { set i 0 } { $i < [$outputAtlasNode GetNumberOfVolumes] } { incr i } {
             if { $i == $atlasRegistrationVolumeIndex} { continue }
-            $LOGIC PrintText "TCL: Resampling atlas image $i ..."
             set movingVolumeNode [$inputAtlasNode GetNthVolumeNode $i]
-            set outputVolumeNode [$outputAtlasNode GetNthVolumeNode $i]
             set backgroundLevel [$LOGIC GuessRegistrationBackgroundLevel $movingVolumeNode]
-            $LOGIC PrintText "TCL: Guessed background level: $backgroundLevel"
+            $LOGIC PrintText "TCL: Guessed background level of atlas image $i: $backgroundLevel"
+            lappend priorInputNodes($backgroundLevel) $movingVolumeNode
+            lappend priorOutputNodes($backgroundLevel) [$outputAtlasNode GetNthVolumeNode $i]
+        }
 
-            if { [Resample $movingVolumeNode $fixedTargetVolumeNode $transformNode $transformDirName $transformNodeType Linear $backgroundLevel $outputVolumeNode] } {
-                return 1
+        foreach backgroundLevel [array names priorInputNodes] {
+            if { ($transformNodeType == "DeformVolumeTransform") && ([ResampleWithDeformationField $priorInputNodes($backgroundLevel) $priorOutputNodes($backgroundLevel) $fixedTargetVolumeNode $transformNode Linear $backgroundLevel] == 0) } {
+                continue
+            }
+            foreach movingVolumeNode $priorInputNodes($backgroundLevel) outputVolumeNode $priorOutputNodes($backgroundLevel) {
+                $LOGIC PrintText "TCL: Resampling atlas image [$movingVolumeNode GetName] ..."
+                if { [Resample $movingVolumeNode $fixedTargetVolumeNode $transformNode $transformDirName $transformNodeType Linear $backgroundLevel $outputVolumeNode] } {
+                    return 1
+                }
             }
         }
 
         # Sub parcelation
+        set parcellationInputNodes ""
+        set parcellationOutputNodes ""
+        for { set i 0 } { $i < [$outputSubParcellationNode GetNumberOfVolumes] } { incr i } {
+            lappend parcellationInputNodes [$inputSubParcellationNode GetNthVolumeNode $i]
+            lappend parcellationOutputNodes [$outputSubParcellationNode GetNthVolumeNode $i]
+        }
+        set parcellationResampledFlag 0
+        if { ($transformNodeType == "DeformVolumeTransform") && ($parcellationInputNodes != "") } {
+            set parcellationResampledFlag [expr ([ResampleWithDeformationField $parcellationInputNodes $parcellationOutputNodes $fixedTargetVolumeNode $transformNode NearestNeighbor 0] == 0)]
+        }
+
         for { set i 0 } { $i < [$outputSubParcellationNode GetNumberOfVolumes] } { incr i } {
-            $LOGIC PrintText "TCL: Resampling subparcallation map  $i ..."
             set movingVolumeNode [$inputSubParcellationNode GetNthVolumeNode $i]
             set outputVolumeNode [$outputSubParcellationNode GetNthVolumeNode $i]
-            if { [Resample $movingVolumeNode  $fixedTargetVolumeNode  $transformNode "$transformDirName" $transformNodeType "NearestNeighbor" 0 $outputVolumeNode] } {
-                return 1
+            if { $parcellationResampledFlag == 0 } {
+                $LOGIC PrintText "TCL: Resampling subparcallation map  $i ..."
+                if { [Resample $movingVolumeNode  $fixedTargetVolumeNode  $transformNode "$transformDirName" $transformNodeType "NearestNeighbor" 0 $outputVolumeNode] } {
+                    return 1
+                }
             }
 
             # Create Voronoi diagram with correct scalar type from aligned subparcellation
@@ -2564,6 +2842,44 @@ namespace eval EMSegmenterPreProcessingTcl {
     }
 
 
+    # Resamples the volumes of inputVolumeNodes into those of outputVolumeNodes in a single pass of the logic
+    # (see vtkEMSegmentLogic::ResampleVolumesWithDeformationField)
+    # deformationFieldFileName: output of calcDFVolumeNode
+    # interpolationType : NearestNeighbor|Linear
+    # returns 1 if the field could not be applied - the volumes then have to be resampled with Resample
+    proc ResampleWithDeformationField { inputVolumeNodes outputVolumeNodes referenceVolumeNode deformationFieldFileName interpolationType backgroundLevel } {
+        variable LOGIC
+        variable mrmlManager
+
+        $LOGIC PrintText "TCL: Resampling [llength $inputVolumeNodes] images with the deformation field ..."
+
+        set fieldNode [vtkMRMLVectorVolumeNode New]
+        if { [ReadDataFromDisk $fieldNode $deformationFieldFileName Volume] == 0 } {
+            $fieldNode Delete
+            return 1
+        }
+
+        set inputCollection [vtkCollection New]
+        set outputCollection [vtkCollection New]
+        foreach inputVolumeNode $inputVolumeNodes outputVolumeNode $outputVolumeNodes {
+            $inputCollection AddItem $inputVolumeNode
+            $outputCollection AddItem $outputVolumeNode
+        }
+
+        set interpolationType [$mrmlManager GetInterpolationTypeFromString Interpolation$interpolationType]
+        set FLAG [$LOGIC ResampleVolumesWithDeformationField $inputCollection $outputCollection $referenceVolumeNode $fieldNode $interpolationType $backgroundLevel]
+
+        $inputCollection Delete
+        $outputCollection Delete
+        $fieldNode Delete
+
+        if { $FLAG == 0 } {
+            $LOGIC PrintText "TCL: Deformation field could not be applied - resampling each image with BRAINSResample"
+            return 1
+        }
+        return 0
+    }
+
     # output: outputVolumeNode
     # no side effects
     # interpolationType : NearestNeighbor|Linear|BSpline|WindowedSinc
@@ -0,0 +1,146 @@
+// Multi-level grid refinement of vtkBSplineRegistrator
+//
+// A smooth blob is registered to a translated copy of itself. The registration runs on a
+// three level pyramid with a control grid that is refined from level to level, so the
+// coefficients of each coarse level have to be carried over to the denser grid of the next one.
+// The test fails if the deformation found does not recover the translation at the center of the
+// blob or does not reduce the mean squared error between the images.
+//
+// Usage: vtkBSplineRegistratorRefinementTest [--size N] [--shift S] [--knots K] [--iterations I]
+
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vtkImageData.h"
+#include "vtkImageReslice.h"
+#include "vtkGridTransform.h"
+#include "vtkBSplineRegistrator.h"
+
+//----------------------------------------------------------------------------
+// Gaussian blob centered at Center
+static vtkImageData* NewBlobImage(int Size, const double Center[3])
+{
+  vtkImageData* Image = vtkImageData::New();
+  Image->SetDimensions(Size, Size, Size);
+  Image->SetScalarTypeToFloat();
+  Image->SetNumberOfScalarComponents(1);
+  Image->AllocateScalars();
+
+  double Sigma = Size/6.0;
+  float* Ptr = static_cast<float*>(Image->GetScalarPointer());
+  for (int z = 0; z < Size; z++)
+    {
+    for (int y = 0; y < Size; y++)
+      {
+      for (int x = 0; x < Size; x++)
+        {
+        double Distance = (x - Center[0])*(x - Center[0]) + (y - Center[1])*(y - Center[1]) + (z - Center[2])*(z - Center[2]);
+        *Ptr++ = float(100.0*exp(-Distance/(2.0*Sigma*Sigma)));
+        }
+      }
+    }
+  return Image;
+}
+
+static double MeanSquaredError(vtkImageData* A, vtkImageData* B)
+{
+  int NumberOfVoxels = int(A->GetNumberOfPoints());
+  const float* PtrA = static_cast<const float*>(A->GetScalarPointer());
+  const float* PtrB = static_cast<const float*>(B->GetScalarPointer());
+  double Sum = 0.0;
+  for (int i = 0; i < NumberOfVoxels; i++) Sum += double(PtrA[i] - PtrB[i])*double(PtrA[i] - PtrB[i]);
+  return Sum/NumberOfVoxels;
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  int    Size       = 32;
+  double Shift      = 2.0;
+  int    Knots      = 7;
+  int    Iterations = 30;
+
+  int ValidFlag = 1;
+  for (int i = 1; ValidFlag && (i < argc); i += 2)
+    {
+    if (i + 1 >= argc) ValidFlag = 0;
+    else if (!strcmp(argv[i], "--size")) Size = atoi(argv[i+1]);
+    else if (!strcmp(argv[i], "--shift")) Shift = atof(argv[i+1]);
+    else if (!strcmp(argv[i], "--knots")) Knots = atoi(argv[i+1]);
+    else if (!strcmp(argv[i], "--iterations")) Iterations = atoi(argv[i+1]);
+    else ValidFlag = 0;
+    }
+  if (!ValidFlag || (Size < 16) || (Knots < 3) || (Iterations < 1))
+    {
+    std::cerr << "Usage: vtkBSplineRegistratorRefinementTest [--size N] [--shift S] [--knots K] [--iterations I]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  double FixedCenter[3]  = {0.5*(Size-1), 0.5*(Size-1), 0.5*(Size-1)};
+  double MovingCenter[3] = {FixedCenter[0] + Shift, FixedCenter[1], FixedCenter[2]};
+  vtkImageData* FixedImage  = NewBlobImage(Size, FixedCenter);
+  vtkImageData* MovingImage = NewBlobImage(Size, MovingCenter);
+
+  // The coarse pyramid levels use fewer knots than the finest one
+  vtkBSplineRegistrator* Registrator = vtkBSplineRegistrator::New();
+  Registrator->SetFixedImage(FixedImage);
+  Registrator->SetMovingImage(MovingImage);
+  Registrator->SetImageToImageMetricToMeanSquaredError();
+  Registrator->SetIntensityInterpolationTypeToLinear();
+  Registrator->SetNumberOfIterations(Iterations);
+  Registrator->SetNumberOfKnotPoints(Knots);
+  Registrator->GridRefinementOn();
+
+  int Success = 1;
+  try
+    {
+    Registrator->RegisterImages();
+    }
+  catch (...)
+    {
+    std::cerr << "RegisterImages failed" << std::endl;
+    Success = 0;
+    }
+
+  if (Success)
+    {
+    // The transform maps points of the fixed image to the moving image
+    double Point[3];
+    Registrator->GetTransform()->TransformPoint(FixedCenter, Point);
+    double Error = sqrt((Point[0] - MovingCenter[0])*(Point[0] - MovingCenter[0]) + (Point[1] - MovingCenter[1])*(Point[1] - MovingCenter[1])
+                        + (Point[2] - MovingCenter[2])*(Point[2] - MovingCenter[2]));
+
+    vtkImageReslice* Reslice = vtkImageReslice::New();
+    Reslice->SetInput(MovingImage);
+    Reslice->SetResliceTransform(Registrator->GetTransform());
+    Reslice->SetInformationInput(FixedImage);
+    Reslice->SetInterpolationModeToLinear();
+    Reslice->Update();
+
+    double InitialError = MeanSquaredError(FixedImage, MovingImage);
+    double FinalError   = MeanSquaredError(FixedImage, Reslice->GetOutput());
+    Reslice->Delete();
+
+    std::cout << "Center displacement error: " << Error << " voxels" << std::endl;
+    std::cout << "Mean squared error: " << InitialError << " before, " << FinalError << " after registration" << std::endl;
+
+    if (Error > 0.25*Shift)
+      {
+      std::cerr << "The translation at the center of the blob was not recovered" << std::endl;
+      Success = 0;
+      }
+    if (!(FinalError < 0.25*InitialError))
+      {
+      std::cerr << "The registration did not reduce the mean squared error enough" << std::endl;
+      Success = 0;
+      }
+    }
+
+  Registrator->Delete();
+  FixedImage->Delete();
+  MovingImage->Delete();
+  return (Success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
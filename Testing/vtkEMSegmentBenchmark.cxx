@@ -0,0 +1,205 @@
+// Micro-benchmark of the core kernels of the EM segmenter
+//
+// A synthetic phantom (see NewPhantomSegmenter) is segmented with the parameters given
+// on the command line. The time spent in each phase is taken from the trace of the segmenter
+// (see EMLocalTrace) and reported under the name of the trace event. The times are exclusive, i.e.
+// the phases nested in an event are not included (e.g. "MF sweep" does not include its "E-Step weights"
+// and "Label map"), so they do not overlap. EMVolume::Conv and vtkImageIslandFilter are timed directly.
+// The results are written as JSON so that different builds can be compared.
+//
+// Usage: vtkEMSegmentBenchmark [--size N] [--channels C] [--classes K] [--roi-fraction F]
+//                              [--mrf 0|1] [--registration 0|1] [--shape 0|1]
+//                              [--iterations I] [--threads T] [--repeat R] [--output file.json]
+
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vtkImageData.h"
+#include "vtkTimerLog.h"
+#include "vtkImageEMLocalSegmenter.h"
+#include "vtkImageIslandFilter.h"
+#include "EMLocalTrace.h"
+#include "EMLocalMetrics.h"
+#include "vtkDataDef.h"
+#include "vtkEMSegmentTestUtilities.h"
+
+struct BenchmarkParameters
+{
+  EMSegmentPhantomParameters Phantom;
+  int         NumberOfThreads;
+  int         Repeat;
+  std::string OutputFileName;
+};
+
+struct BenchmarkResult
+{
+  const char* Name;
+  int         Count;
+  double      Total;
+};
+
+//----------------------------------------------------------------------------
+static double TimeConvolution(BenchmarkParameters& Para, int &Count)
+{
+  int Size = Para.Phantom.Size;
+  EMVolume Volume(Size, Size, Size);
+  float* Data = Volume.GetData();
+  for (int i = 0; i < Size*Size*Size; i++) Data[i] = float(i % 17);
+
+  // Same kernel as used for the bias field
+  const int Width = 11;
+  float Kernel[Width];
+  for (int i = 0; i < Width; i++) Kernel[i] = float(exp(-0.5*(i - Width/2)*(i - Width/2)/25.0));
+
+  double Start = vtkTimerLog::GetUniversalTime();
+  for (Count = 0; Count < Para.Repeat; Count++) Volume.Conv(Kernel, Width);
+  return vtkTimerLog::GetUniversalTime() - Start;
+}
+
+//----------------------------------------------------------------------------
+static double TimeIslandFilter(BenchmarkParameters& Para, vtkImageData* LabelMap, int BatchReassignmentFlag, int &Count)
+{
+  double Total = 0.0;
+  for (Count = 0; Count < Para.Repeat; Count++)
+    {
+    vtkImageIslandFilter* Filter = vtkImageIslandFilter::New();
+    Filter->SetInput(LabelMap);
+    Filter->SetIslandMinSize(10);
+    Filter->SetNeighborhoodDim3D();
+    Filter->SetPrintInformation(0);
+    Filter->SetBatchReassignmentFlag(BatchReassignmentFlag);
+    if (Para.NumberOfThreads > 0) Filter->SetNumberOfThreads(Para.NumberOfThreads);
+    double Start = vtkTimerLog::GetUniversalTime();
+    Filter->Update();
+    Total += vtkTimerLog::GetUniversalTime() - Start;
+    Filter->Delete();
+    }
+  return Total;
+}
+
+//----------------------------------------------------------------------------
+static int ParseArguments(int argc, char** argv, BenchmarkParameters& Para)
+{
+  SetDefaultPhantomParameters(Para.Phantom);
+  Para.NumberOfThreads = 0;
+  Para.Repeat          = 3;
+
+  for (int i = 1; i < argc; i += 2)
+    {
+    if (i + 1 >= argc)
+      {
+      std::cerr << "Missing value for " << argv[i] << std::endl;
+      return 0;
+      }
+    if (SetPhantomParameter(Para.Phantom, argv[i], argv[i+1])) continue;
+    if      (!strcmp(argv[i], "--threads")) Para.NumberOfThreads = atoi(argv[i+1]);
+    else if (!strcmp(argv[i], "--repeat"))  Para.Repeat          = atoi(argv[i+1]);
+    else if (!strcmp(argv[i], "--output"))  Para.OutputFileName  = argv[i+1];
+    else
+      {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 0;
+      }
+    }
+
+  if (!CheckPhantomParameters(Para.Phantom) || (Para.NumberOfThreads < 0) || (Para.Repeat < 1))
+    {
+    std::cerr << "Invalid parameters" << std::endl;
+    return 0;
+    }
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+static void WriteResults(FILE* File, BenchmarkParameters& Para, BenchmarkResult* Results, int NumberOfResults,
+                         double SegmentationTime, EMLocalMetrics* Metrics)
+{
+  const EMSegmentPhantomParameters& Phantom = Para.Phantom;
+  fprintf(File, "{\n");
+  fprintf(File, "  \"parameters\": {\"size\": %d, \"channels\": %d, \"classes\": %d, \"roiFraction\": %g, \"mrf\": %d, "
+          "\"registration\": %d, \"shape\": %d, \"iterations\": %d, \"threads\": %d, \"repeat\": %d},\n",
+          Phantom.Size, Phantom.NumberOfChannels, Phantom.NumberOfClasses, Phantom.ROIFraction, Phantom.MRF,
+          Phantom.Registration, Phantom.Shape, Phantom.Iterations, Para.NumberOfThreads, Para.Repeat);
+  fprintf(File, "  \"segmentationSeconds\": %.6f,\n", SegmentationTime);
+  fprintf(File, "  \"voxelClassEvaluationsPerSecond\": %.1f,\n", Metrics->GetVoxelClassEvaluationsPerSecond());
+  fprintf(File, "  \"peakBytes\": %lld,\n", (long long) Metrics->GetPeakMemory());
+  fprintf(File, "  \"kernels\": {\n");
+  for (int i = 0; i < NumberOfResults; i++)
+    {
+    fprintf(File, "    \"%s\": {\"count\": %d, \"totalSeconds\": %.6f, \"meanSeconds\": %.9f}%s\n", Results[i].Name,
+            Results[i].Count, Results[i].Total, (Results[i].Count ? Results[i].Total/Results[i].Count : 0.0),
+            (i + 1 < NumberOfResults ? "," : ""));
+    }
+  fprintf(File, "  }\n}\n");
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  BenchmarkParameters Para;
+  if (!ParseArguments(argc, argv, Para))
+    {
+    std::cerr << "Usage: vtkEMSegmentBenchmark [--size N] [--channels C] [--classes K] [--roi-fraction F]" << std::endl
+              << "                             [--mrf 0|1] [--registration 0|1] [--shape 0|1] [--iterations I]" << std::endl
+              << "                             [--threads T] [--repeat R] [--output file.json]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  vtkImageEMLocalSegmenter* Segmenter = NewPhantomSegmenter(Para.Phantom);
+  if (!Segmenter) return EXIT_FAILURE;
+  if (Para.NumberOfThreads > 0) Segmenter->SetNumberOfThreads(Para.NumberOfThreads);
+
+  // The phases are timed by the trace of the segmenter
+  EMLocalTrace Trace;
+  Trace.Start();
+  EMLocalTrace::SetActive(&Trace);
+  double Start = vtkTimerLog::GetUniversalTime();
+  Segmenter->Update();
+  double SegmentationTime = vtkTimerLog::GetUniversalTime() - Start;
+  EMLocalTrace::SetActive(NULL);
+
+  int Success = !Segmenter->GetErrorFlag();
+  if (!Success) std::cerr << "Segmentation failed: " << Segmenter->GetErrorMessages() << std::endl;
+
+  // Wall clock time of the phases - "E-Step weights" is the threaded weight calculation of all E-Steps
+  // (incl. those of the MF sweeps), "MF sweep" the rest of the sweeps
+  static const char* PhaseNames[] = {"E-Step weights", "MF sweep", "Label map", "Bias estimation", "Convolution",
+                                     "Intensity correction", "Registration cost evaluation", "Shape cost evaluation"};
+  const int NumberOfPhases = int(sizeof(PhaseNames)/sizeof(PhaseNames[0]));
+  BenchmarkResult Results[NumberOfPhases + 3];
+  for (int i = 0; i < NumberOfPhases; i++)
+    {
+    Results[i].Name  = PhaseNames[i];
+    Results[i].Total = Trace.GetExclusiveTime(PhaseNames[i], &Results[i].Count);
+    }
+  Results[NumberOfPhases].Name = "EMVolume::Conv";
+  Results[NumberOfPhases].Total = TimeConvolution(Para, Results[NumberOfPhases].Count);
+  Results[NumberOfPhases + 1].Name = "vtkImageIslandFilter";
+  Results[NumberOfPhases + 1].Total = TimeIslandFilter(Para, Segmenter->GetOutput(), 0, Results[NumberOfPhases + 1].Count);
+  Results[NumberOfPhases + 2].Name = "vtkImageIslandFilter (batch)";
+  Results[NumberOfPhases + 2].Total = TimeIslandFilter(Para, Segmenter->GetOutput(), 1, Results[NumberOfPhases + 2].Count);
+  const int NumberOfResults = NumberOfPhases + 3;
+
+  WriteResults(stdout, Para, Results, NumberOfResults, SegmentationTime, Segmenter->GetMetrics());
+  if (!Para.OutputFileName.empty())
+    {
+    FILE* File = fopen(Para.OutputFileName.c_str(), "w");
+    if (File)
+      {
+      WriteResults(File, Para, Results, NumberOfResults, SegmentationTime, Segmenter->GetMetrics());
+      fclose(File);
+      }
+    else
+      {
+      std::cerr << "Could not write " << Para.OutputFileName << std::endl;
+      Success = 0;
+      }
+    }
+
+  Segmenter->Delete();
+  return (Success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,160 @@
+// Checkpoint keys of the EM segmenter
+//
+// The synthetic phantom (see NewPhantomSegmenter) is segmented once to write a checkpoint.
+// Resuming from that checkpoint with the same images and parameters has to restore every level
+// and reproduce the label map. If an input image, an atlas or a parameter of the hierarchy is
+// changed, the levels have to be segmented again instead of being restored.
+//
+// Usage: vtkEMSegmentCheckpointTest --checkpoint file [phantom options of vtkEMSegmentBenchmark]
+
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vtkImageData.h"
+#include "vtkImageEMLocalSegmenter.h"
+#include "vtkImageEMLocalSuperClass.h"
+#include "vtkImageEMLocalClass.h"
+#include "vtkEMSegmentTestUtilities.h"
+
+enum CheckpointTestChange
+{
+  CHANGE_NONE = 0,
+  CHANGE_INPUT,
+  CHANGE_ATLAS,
+  CHANGE_PARAMETER,
+  NUMBER_OF_CHANGES
+};
+
+static const char* CheckpointTestChangeNames[NUMBER_OF_CHANGES] =
+  {"nothing", "input image", "atlas", "EM iterations"};
+
+//----------------------------------------------------------------------------
+// Increments the voxel in the center of Image
+static void ChangeCenterVoxel(vtkImageData* Image)
+{
+  int* Dimension = Image->GetDimensions();
+  short* Voxel = (short*) Image->GetScalarPointer(Dimension[0]/2, Dimension[1]/2, Dimension[2]/2);
+  *Voxel += 10;
+  Image->Modified();
+}
+
+//----------------------------------------------------------------------------
+// Segments the phantom after applying Change and returns the number of levels restored from the
+// checkpoint or -1 if the segmentation failed
+static int RunSegmentation(const EMSegmentPhantomParameters& Phantom, const char* CheckpointFileName, int ResumeFlag, int Change,
+                           short** LabelMap, int* NumberOfLevels)
+{
+  vtkImageEMLocalSegmenter* Segmenter = NewPhantomSegmenter(Phantom);
+  if (!Segmenter) return -1;
+  Segmenter->SetCheckpointFileName(CheckpointFileName);
+  Segmenter->SetResumeFromCheckpoint(ResumeFlag);
+
+  // The phantom images are only referenced by the segmenter and the hierarchy, so they can be changed in place
+  vtkImageEMLocalSuperClass* Head = Segmenter->GetHeadClass();
+  switch (Change)
+    {
+    case CHANGE_INPUT:
+      ChangeCenterVoxel(Segmenter->GetInput(0));
+      break;
+    case CHANGE_ATLAS:
+      ChangeCenterVoxel(((vtkImageEMLocalClass*) Head->GetClassList()[0])->GetProbImageData());
+      break;
+    case CHANGE_PARAMETER:
+      Head->SetStopEMMaxIter(Head->GetStopEMMaxIter() + 1);
+      break;
+    }
+
+  Segmenter->Update();
+  if (Segmenter->GetErrorFlag())
+    {
+    std::cerr << "Segmentation failed: " << Segmenter->GetErrorMessages() << std::endl;
+    Segmenter->Delete();
+    return -1;
+    }
+
+  EMLocalMetrics* Metrics = Segmenter->GetMetrics();
+  int NumberOfRestoredLevels = 0;
+  for (int i = 0; i < Metrics->GetNumberOfLevels(); i++) NumberOfRestoredLevels += Metrics->GetLevel(i)->RestoredFlag;
+  *NumberOfLevels = Metrics->GetNumberOfLevels();
+
+  vtkImageData* Output = Segmenter->GetOutput();
+  int NumberOfVoxels = int(Output->GetNumberOfPoints());
+  *LabelMap = new short[NumberOfVoxels];
+  memcpy(*LabelMap, Output->GetScalarPointer(), sizeof(short)*NumberOfVoxels);
+
+  Segmenter->Delete();
+  return NumberOfRestoredLevels;
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  EMSegmentPhantomParameters Phantom;
+  SetDefaultPhantomParameters(Phantom);
+  std::string CheckpointFileName;
+
+  int ValidFlag = 1;
+  for (int i = 1; ValidFlag && (i < argc); i += 2)
+    {
+    if (i + 1 >= argc) ValidFlag = 0;
+    else if (SetPhantomParameter(Phantom, argv[i], argv[i+1])) continue;
+    else if (!strcmp(argv[i], "--checkpoint")) CheckpointFileName = argv[i+1];
+    else ValidFlag = 0;
+    }
+  if (!ValidFlag || CheckpointFileName.empty() || !CheckPhantomParameters(Phantom))
+    {
+    std::cerr << "Usage: vtkEMSegmentCheckpointTest --checkpoint file [--size N] [--channels C] [--classes K] [--roi-fraction F]" << std::endl
+              << "                                  [--mrf 0|1] [--registration 0|1] [--shape 0|1] [--iterations I]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Write the checkpoint
+  short* Reference = NULL;
+  int NumberOfLevels = 0;
+  if (RunSegmentation(Phantom, CheckpointFileName.c_str(), 0, CHANGE_NONE, &Reference, &NumberOfLevels) != 0)
+    {
+    std::cerr << "Levels were restored although the checkpoint was not resumed" << std::endl;
+    delete[] Reference;
+    return EXIT_FAILURE;
+    }
+  int NumberOfVoxels = Phantom.Size*Phantom.Size*Phantom.Size;
+
+  // Resume with each change - the checkpoint keeps the records of all runs, so the unchanged
+  // phantom always finds the levels of the first one
+  int Success = 1;
+  for (int Change = 0; Change < NUMBER_OF_CHANGES; Change++)
+    {
+    short* LabelMap = NULL;
+    int NumberOfResumedLevels = 0;
+    int NumberOfRestoredLevels = RunSegmentation(Phantom, CheckpointFileName.c_str(), 1, Change, &LabelMap, &NumberOfResumedLevels);
+    if (NumberOfRestoredLevels < 0)
+      {
+      Success = 0;
+      }
+    else if (Change == CHANGE_NONE)
+      {
+      int Difference = 0;
+      for (int i = 0; i < NumberOfVoxels; i++) if (LabelMap[i] != Reference[i]) Difference++;
+      if ((NumberOfRestoredLevels != NumberOfLevels) || (NumberOfResumedLevels != NumberOfLevels) || Difference)
+        {
+        std::cerr << "Unchanged phantom: " << NumberOfRestoredLevels << " of " << NumberOfLevels << " levels restored, "
+                  << Difference << " voxels differ from the first run" << std::endl;
+        Success = 0;
+        }
+      }
+    else if (NumberOfRestoredLevels)
+      {
+      std::cerr << "Changed " << CheckpointTestChangeNames[Change] << ": " << NumberOfRestoredLevels
+                << " levels were restored instead of being segmented again" << std::endl;
+      Success = 0;
+      }
+    delete[] LabelMap;
+    }
+
+  delete[] Reference;
+  remove(CheckpointFileName.c_str());
+  return (Success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -4,6 +4,13 @@
 #include "vtkITKArchetypeImageSeriesReader.h"
 #include "vtkITKArchetypeImageSeriesScalarReader.h"
 #include "vtkImageData.h"
+#include "vtkImageEMLocalSegmenter.h"
+#include "vtkImageEMLocalSuperClass.h"
+#include "vtkImageEMLocalClass.h"
+#include "EMLocalInterface.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 //
 // This function checks to see if the image stored in standardFilename
@@ -205,3 +212,236 @@ double* GenerateHistogram (vtkImageAccumulate* Histogram, vtkImageData* InputVol
   return ret;
 }
 
+
+//
+// Synthetic phantom 
+//
+static vtkImageData* NewPhantomVolume(int Size, int ScalarType)
+{
+  vtkImageData* Volume = vtkImageData::New();
+  Volume->SetDimensions(Size, Size, Size);
+  Volume->SetWholeExtent(0, Size - 1, 0, Size - 1, 0, Size - 1);
+  Volume->SetSpacing(1.0, 1.0, 1.0);
+  Volume->SetOrigin(0.0, 0.0, 0.0);
+  Volume->SetScalarType(ScalarType);
+  Volume->SetNumberOfScalarComponents(1);
+  Volume->AllocateScalars();
+  return Volume;
+}
+
+// The phantom consists of NumberOfClasses concentric shells
+static int PhantomClass(int x, int y, int z, int Size, int NumberOfClasses, double* Distance)
+{
+  double c = 0.5*(Size - 1);
+  double r = sqrt((x - c)*(x - c) + (y - c)*(y - c) + (z - c)*(z - c))/(0.5*Size);
+  if (Distance) *Distance = r;
+  int Class = int(r*NumberOfClasses);
+  return (Class < NumberOfClasses ? Class : NumberOfClasses - 1);
+}
+
+static double PhantomMean(int Class, int Channel)
+{
+  return 100.0 + 60.0*Class + 15.0*Channel;
+}
+
+static double PhantomNoise(unsigned int &Seed)
+{
+  double Sum = 0.0;
+  for (int i = 0; i < 4; i++)
+    {
+    Seed = Seed*1103515245 + 12345;
+    Sum += double((Seed >> 16) & 0x7fff)/32767.0;
+    }
+  return (Sum - 2.0)*sqrt(3.0);
+}
+
+void SetDefaultPhantomParameters(EMSegmentPhantomParameters& Para)
+{
+  Para.Size             = 64;
+  Para.NumberOfChannels = 2;
+  Para.NumberOfClasses  = 4;
+  Para.ROIFraction      = 1.0;
+  Para.MRF              = 1;
+  Para.Registration     = 0;
+  Para.Shape            = 0;
+  Para.Iterations       = 5;
+}
+
+bool SetPhantomParameter(EMSegmentPhantomParameters& Para, const char* Option, const char* Value)
+{
+  if      (!strcmp(Option, "--size"))         Para.Size             = atoi(Value);
+  else if (!strcmp(Option, "--channels"))     Para.NumberOfChannels = atoi(Value);
+  else if (!strcmp(Option, "--classes"))      Para.NumberOfClasses  = atoi(Value);
+  else if (!strcmp(Option, "--roi-fraction")) Para.ROIFraction      = atof(Value);
+  else if (!strcmp(Option, "--mrf"))          Para.MRF              = atoi(Value);
+  else if (!strcmp(Option, "--registration")) Para.Registration     = atoi(Value);
+  else if (!strcmp(Option, "--shape"))        Para.Shape            = atoi(Value);
+  else if (!strcmp(Option, "--iterations"))   Para.Iterations       = atoi(Value);
+  else return false;
+  return true;
+}
+
+bool CheckPhantomParameters(const EMSegmentPhantomParameters& Para)
+{
+  return ((Para.Size >= 4) && (Para.NumberOfChannels >= 1) && (Para.NumberOfClasses >= 2) && (Para.ROIFraction > 0.0)
+          && (Para.ROIFraction <= 1.0) && (Para.Iterations >= 1));
+}
+
+vtkImageEMLocalSegmenter* NewPhantomSegmenter(const EMSegmentPhantomParameters& Para)
+{
+  int Size = Para.Size;
+
+  //
+  // Images 
+  vtkImageData** Channels    = new vtkImageData*[Para.NumberOfChannels];
+  vtkImageData** Atlas       = new vtkImageData*[Para.NumberOfClasses];
+  vtkImageData** MeanShape   = new vtkImageData*[Para.NumberOfClasses];
+  vtkImageData** EigenVector = new vtkImageData*[Para.NumberOfClasses];
+  for (int c = 0; c < Para.NumberOfChannels; c++)
+    {
+    Channels[c] = NewPhantomVolume(Size, VTK_SHORT);
+    }
+  for (int k = 0; k < Para.NumberOfClasses; k++)
+    {
+    Atlas[k]       = NewPhantomVolume(Size, VTK_SHORT);
+    MeanShape[k]   = (Para.Shape ? NewPhantomVolume(Size, VTK_FLOAT) : NULL);
+    EigenVector[k] = (Para.Shape ? NewPhantomVolume(Size, VTK_FLOAT) : NULL);
+    }
+
+  unsigned int Seed = 1;
+  int Index = 0;
+  for (int z = 0; z < Size; z++)
+    {
+    for (int y = 0; y < Size; y++)
+      {
+      for (int x = 0; x < Size; x++)
+        {
+        double Distance;
+        int Class = PhantomClass(x, y, z, Size, Para.NumberOfClasses, &Distance);
+        // Smooth multiplicative bias field along x
+        double Bias = 1.0 + 0.1*(double(x)/double(Size) - 0.5);
+        for (int c = 0; c < Para.NumberOfChannels; c++)
+          {
+          double Value = Bias*PhantomMean(Class, c) + 5.0*PhantomNoise(Seed);
+          ((short*) Channels[c]->GetScalarPointer())[Index] = short(Value > 0.0 ? Value : 0.0);
+          }
+        // Atlas is shifted by one voxel so that registration has something to do
+        int AtlasClass = PhantomClass((x > 0 ? x - 1 : 0), y, z, Size, Para.NumberOfClasses, NULL);
+        for (int k = 0; k < Para.NumberOfClasses; k++)
+          {
+          ((short*) Atlas[k]->GetScalarPointer())[Index] = short(AtlasClass == k ? 70 : 30/Para.NumberOfClasses);
+          if (Para.Shape)
+            {
+            // Distance to the outer boundary of the shell mapped into the logistic range
+            double Boundary = double(k + 1)/double(Para.NumberOfClasses);
+            double Shape = 9.5 + (Distance - Boundary)*0.5*Size;
+            ((float*) MeanShape[k]->GetScalarPointer())[Index]   = float(Shape < 0.0 ? 0.0 : (Shape > 20.0 ? 20.0 : Shape));
+            ((float*) EigenVector[k]->GetScalarPointer())[Index] = 1.0;
+            }
+          }
+        Index++;
+        }
+      }
+    }
+
+  //
+  // Hierarchy - the ROI fraction is realised as a centered segmentation boundary
+  int ROILength = int(pow(Para.ROIFraction, 1.0/3.0)*Size + 0.5);
+  if (ROILength < 1) ROILength = 1;
+  if (ROILength > Size) ROILength = Size;
+  int BoundaryMin = (Size - ROILength)/2 + 1;
+  int BoundaryMax = BoundaryMin + ROILength - 1;
+
+  vtkImageEMLocalSuperClass* Head = vtkImageEMLocalSuperClass::New();
+  Head->SetNumInputImages(Para.NumberOfChannels);
+  Head->SetSegmentationBoundaryMin(BoundaryMin, BoundaryMin, BoundaryMin);
+  Head->SetSegmentationBoundaryMax(BoundaryMax, BoundaryMax, BoundaryMax);
+  Head->SetProbDataWeight(0.0);
+  Head->SetTissueProbability(1.0);
+  for (int c = 0; c < Para.NumberOfChannels; c++) Head->SetInputChannelWeights(1.0, c);
+
+  for (int k = 0; k < Para.NumberOfClasses; k++)
+    {
+    vtkImageEMLocalClass* Class = vtkImageEMLocalClass::New();
+    Class->SetNumInputImages(Para.NumberOfChannels);
+    Class->SetLabel(k + 1);
+    Class->SetSegmentationBoundaryMin(BoundaryMin, BoundaryMin, BoundaryMin);
+    Class->SetSegmentationBoundaryMax(BoundaryMax, BoundaryMax, BoundaryMax);
+    Class->SetTissueProbability(1.0/Para.NumberOfClasses);
+    Class->SetProbDataWeight(0.5);
+    Class->SetProbDataPtr(Atlas[k]);
+    for (int c = 0; c < Para.NumberOfChannels; c++)
+      {
+      Class->SetInputChannelWeights(1.0, c);
+      double Mean = PhantomMean(k, c);
+      Class->SetLogMu(log(Mean + 1.0), c);
+      for (int d = 0; d < Para.NumberOfChannels; d++)
+        {
+        // Variance of the log intensity is roughly (sigma/mean)^2
+        Class->SetLogCovariance((c == d ? (10.0/Mean)*(10.0/Mean) : 0.0), c, d);
+        }
+      }
+    if (Para.Shape)
+      {
+      Class->SetPCANumberOfEigenModes(1);
+      Class->SetPCAMeanShape(MeanShape[k]);
+      Class->SetPCAEigenVector(EigenVector[k], 1);
+      Class->SetPCAEigenValues(0, 1.0);
+      }
+    Head->AddSubClass(Class, k);
+    Class->Delete();
+    }
+
+  Head->SetStopEMType(EMSEGMENT_STOP_FIXED);
+  Head->SetStopEMMaxIter(Para.Iterations);
+  Head->SetStopMFAType(EMSEGMENT_STOP_FIXED);
+  Head->SetStopMFAMaxIter(2);
+  Head->SetStopBiasCalculation(-1);
+  Head->SetAlpha(Para.MRF ? 0.7 : 0.0);
+  Head->SetPrintFrequency(0);
+  Head->SetGenerateBackgroundProbability(0);
+  Head->SetRegistrationType(Para.Registration ? EMSEGMENT_REGISTRATION_GLOBAL_ONLY : EMSEGMENT_REGISTRATION_DISABLED);
+  Head->SetPCAShapeModelType(Para.Shape ? EMSEGMENT_PCASHAPE_INDEPENDENT : EMSEGMENT_PCASHAPE_APPLY);
+
+  // Markov matrices - classes only attract themselves
+  for (int d = 0; d < 6; d++)
+    {
+    for (int r = 0; r < Para.NumberOfClasses; r++)
+      {
+      for (int c = 0; c < Para.NumberOfClasses; c++) Head->SetMarkovMatrix((r == c ? 1.0 : 0.0), d, c, r);
+      }
+    }
+
+  //
+  // Segmenter - it keeps references to the images and the hierarchy
+  vtkImageEMLocalSegmenter* Segmenter = NULL;
+  Head->Update();
+  if (Head->GetErrorFlag())
+    {
+    std::cerr << "Could not define phantom hierarchy: " << Head->GetErrorMessages() << std::endl;
+    }
+  else
+    {
+    Segmenter = vtkImageEMLocalSegmenter::New();
+    Segmenter->SetNumInputImages(Para.NumberOfChannels);
+    for (int c = 0; c < Para.NumberOfChannels; c++) Segmenter->SetImageInput(c, Channels[c]);
+    Segmenter->SetNumberOfTrainingSamples(100);
+    Segmenter->SetRegistrationInterpolationType(EMSEGMENT_REGISTRATION_INTERPOLATION_LINEAR);
+    Segmenter->SetHeadClass(Head);
+    }
+
+  Head->Delete();
+  for (int c = 0; c < Para.NumberOfChannels; c++) Channels[c]->Delete();
+  for (int k = 0; k < Para.NumberOfClasses; k++)
+    {
+    Atlas[k]->Delete();
+    if (MeanShape[k]) MeanShape[k]->Delete();
+    if (EigenVector[k]) EigenVector[k]->Delete();
+    }
+  delete[] Channels;
+  delete[] Atlas;
+  delete[] MeanShape;
+  delete[] EigenVector;
+
+  return Segmenter;
+}
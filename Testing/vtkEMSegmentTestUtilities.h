@@ -6,6 +6,7 @@ class vtkImageData;
 class vtkMRMLScene;
 class vtkImageMathematics;
 class vtkImageAccumulate;
+class vtkImageEMLocalSegmenter;
 
 /**
  * Check to see if the image stored in standardFilename differs from
@@ -16,4 +17,39 @@ bool ImageDiff(vtkImageData* resultData, std::string standardFilename);
 double CompareTwoVolumes ( vtkImageData* Volume1, vtkImageData* Volume2 , int Flag );
 double* GenerateHistogram ( vtkImageAccumulate* Histogram, vtkImageData* InputVolume, int bins=-1 );
 
+/**
+ * Synthetic phantom used by the benchmark and the thread scaling
+ * harness: one concentric spherical shell per class with noise and a
+ * smooth bias field. The noise is deterministic so that every build
+ * segments the same images.
+ */
+struct EMSegmentPhantomParameters
+{
+  int    Size;
+  int    NumberOfChannels;
+  int    NumberOfClasses;
+  double ROIFraction;
+  int    MRF;
+  int    Registration;
+  int    Shape;
+  int    Iterations;
+};
+void SetDefaultPhantomParameters(EMSegmentPhantomParameters& Para);
+
+/**
+ * Sets the parameter of a command line option (--size, --channels,
+ * --classes, --roi-fraction, --mrf, --registration, --shape,
+ * --iterations). False is returned if Option is not a phantom
+ * parameter.
+ */
+bool SetPhantomParameter(EMSegmentPhantomParameters& Para, const char* Option, const char* Value);
+bool CheckPhantomParameters(const EMSegmentPhantomParameters& Para);
+
+/**
+ * Returns a segmenter whose inputs and class hierarchy are set to the
+ * phantom or NULL if the hierarchy could not be defined. The caller
+ * has to delete it.
+ */
+vtkImageEMLocalSegmenter* NewPhantomSegmenter(const EMSegmentPhantomParameters& Para);
+
 #endif
@@ -0,0 +1,271 @@
+// Thread scaling harness of the EM segmenter
+//
+// The synthetic phantom (see NewPhantomSegmenter) is segmented once for each thread count
+// of the sweep. For every phase (E-Step, mean field, bias, registration, shape and
+// post-processing) the time is taken from the trace of the segmenter and the strong scaling
+// efficiency relative to the first thread count is reported:
+//
+//   Efficiency(n) = Time(n0) * n0 / (Time(n) * n)
+//
+// The label maps of the segmentation and of the post-processing have to be identical for all
+// thread counts - otherwise the harness fails.
+//
+// Usage: vtkEMSegmentThreadScaling [phantom options of vtkEMSegmentBenchmark]
+//                                  [--threads 1,2,4,8] [--output file.json]
+
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vtkImageData.h"
+#include "vtkTimerLog.h"
+#include "vtkMultiThreader.h"
+#include "vtkImageEMLocalSegmenter.h"
+#include "vtkImageIslandFilter.h"
+#include "EMLocalTrace.h"
+#include "vtkEMSegmentTestUtilities.h"
+
+#define THREADSCALING_MAX_RUNS 32
+
+enum ThreadScalingPhase
+{
+  PHASE_ESTEP = 0,
+  PHASE_MF,
+  PHASE_BIAS,
+  PHASE_REGISTRATION,
+  PHASE_SHAPE,
+  PHASE_POSTPROCESSING,
+  NUMBER_OF_PHASES
+};
+
+static const char* ThreadScalingPhaseNames[NUMBER_OF_PHASES] =
+  {"E-Step", "MF", "Bias", "Registration", "Shape", "PostProcessing"};
+
+struct ThreadScalingRun
+{
+  int    NumberOfThreads;
+  double PhaseTime[NUMBER_OF_PHASES];
+  double TotalTime;
+  // Number of voxels that differ from the label maps of the first run
+  int    SegmentationDifference;
+  int    PostProcessingDifference;
+};
+
+//----------------------------------------------------------------------------
+// Copies the label map so that later runs can be compared with it
+static short* CopyLabelMap(vtkImageData* LabelMap)
+{
+  int NumberOfVoxels = int(LabelMap->GetNumberOfPoints());
+  short* Copy = new short[NumberOfVoxels];
+  memcpy(Copy, LabelMap->GetScalarPointer(), sizeof(short)*NumberOfVoxels);
+  return Copy;
+}
+
+static int CompareLabelMap(vtkImageData* LabelMap, const short* Reference)
+{
+  int NumberOfVoxels = int(LabelMap->GetNumberOfPoints());
+  const short* Data = (const short*) LabelMap->GetScalarPointer();
+  int Difference = 0;
+  for (int i = 0; i < NumberOfVoxels; i++) if (Data[i] != Reference[i]) Difference++;
+  return Difference;
+}
+
+//----------------------------------------------------------------------------
+static int ParseThreadList(const char* List, int* Threads)
+{
+  int NumberOfRuns = 0;
+  const char* Ptr = List;
+  while (*Ptr && (NumberOfRuns < THREADSCALING_MAX_RUNS))
+    {
+    char* End;
+    long Value = strtol(Ptr, &End, 10);
+    if ((End == Ptr) || (Value < 1)) return 0;
+    Threads[NumberOfRuns++] = int(Value);
+    Ptr = (*End == ',' ? End + 1 : End);
+    if (*End && (*End != ',')) return 0;
+    }
+  return NumberOfRuns;
+}
+
+//----------------------------------------------------------------------------
+static int RunSegmentation(const EMSegmentPhantomParameters& Phantom, ThreadScalingRun& Run,
+                           short** SegmentationReference, short** PostProcessingReference)
+{
+  vtkImageEMLocalSegmenter* Segmenter = NewPhantomSegmenter(Phantom);
+  if (!Segmenter) return 0;
+  Segmenter->SetNumberOfThreads(Run.NumberOfThreads);
+
+  EMLocalTrace Trace;
+  Trace.Start();
+  EMLocalTrace::SetActive(&Trace);
+  double Start = vtkTimerLog::GetUniversalTime();
+  Segmenter->Update();
+  EMLocalTrace::SetActive(NULL);
+
+  if (Segmenter->GetErrorFlag())
+    {
+    std::cerr << "Segmentation failed: " << Segmenter->GetErrorMessages() << std::endl;
+    Segmenter->Delete();
+    return 0;
+    }
+
+  // Post-processing of the label map as done by the logic
+  vtkImageIslandFilter* Filter = vtkImageIslandFilter::New();
+  Filter->SetInput(Segmenter->GetOutput());
+  Filter->SetIslandMinSize(10);
+  Filter->SetNeighborhoodDim3D();
+  Filter->SetPrintInformation(0);
+  Filter->SetNumberOfThreads(Run.NumberOfThreads);
+  double PostProcessingStart = vtkTimerLog::GetUniversalTime();
+  Filter->Update();
+  double End = vtkTimerLog::GetUniversalTime();
+
+  // The mean field sweeps are part of the E-Step
+  double MFTime = Trace.GetTotalTime("MF sweep");
+  Run.PhaseTime[PHASE_ESTEP]          = Trace.GetTotalTime("E-Step") - MFTime;
+  Run.PhaseTime[PHASE_MF]             = MFTime;
+  Run.PhaseTime[PHASE_BIAS]           = Trace.GetTotalTime("Bias estimation");
+  Run.PhaseTime[PHASE_REGISTRATION]   = Trace.GetTotalTime("Registration");
+  Run.PhaseTime[PHASE_SHAPE]          = Trace.GetTotalTime("Shape");
+  Run.PhaseTime[PHASE_POSTPROCESSING] = End - PostProcessingStart;
+  Run.TotalTime = End - Start;
+
+  if (*SegmentationReference)
+    {
+    Run.SegmentationDifference   = CompareLabelMap(Segmenter->GetOutput(), *SegmentationReference);
+    Run.PostProcessingDifference = CompareLabelMap(Filter->GetOutput(), *PostProcessingReference);
+    }
+  else
+    {
+    *SegmentationReference   = CopyLabelMap(Segmenter->GetOutput());
+    *PostProcessingReference = CopyLabelMap(Filter->GetOutput());
+    Run.SegmentationDifference = Run.PostProcessingDifference = 0;
+    }
+
+  Filter->Delete();
+  Segmenter->Delete();
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+static double Efficiency(const ThreadScalingRun& Base, const ThreadScalingRun& Run, int Phase)
+{
+  double BaseTime = (Phase < NUMBER_OF_PHASES ? Base.PhaseTime[Phase] : Base.TotalTime);
+  double RunTime  = (Phase < NUMBER_OF_PHASES ? Run.PhaseTime[Phase]  : Run.TotalTime);
+  if ((BaseTime <= 0.0) || (RunTime <= 0.0)) return 0.0;
+  return BaseTime*Base.NumberOfThreads/(RunTime*Run.NumberOfThreads);
+}
+
+static void WriteResults(FILE* File, const EMSegmentPhantomParameters& Phantom, ThreadScalingRun* Runs, int NumberOfRuns)
+{
+  fprintf(File, "{\n");
+  fprintf(File, "  \"parameters\": {\"size\": %d, \"channels\": %d, \"classes\": %d, \"roiFraction\": %g, \"mrf\": %d, "
+          "\"registration\": %d, \"shape\": %d, \"iterations\": %d},\n",
+          Phantom.Size, Phantom.NumberOfChannels, Phantom.NumberOfClasses, Phantom.ROIFraction, Phantom.MRF,
+          Phantom.Registration, Phantom.Shape, Phantom.Iterations);
+  fprintf(File, "  \"runs\": [\n");
+  for (int r = 0; r < NumberOfRuns; r++)
+    {
+    fprintf(File, "    {\"threads\": %d, \"totalSeconds\": %.6f, \"totalEfficiency\": %.4f, "
+            "\"segmentationDifference\": %d, \"postProcessingDifference\": %d, \"phases\": {",
+            Runs[r].NumberOfThreads, Runs[r].TotalTime, Efficiency(Runs[0], Runs[r], NUMBER_OF_PHASES),
+            Runs[r].SegmentationDifference, Runs[r].PostProcessingDifference);
+    for (int p = 0; p < NUMBER_OF_PHASES; p++)
+      {
+      fprintf(File, "%s\"%s\": {\"seconds\": %.6f, \"efficiency\": %.4f}", (p ? ", " : ""), ThreadScalingPhaseNames[p],
+              Runs[r].PhaseTime[p], Efficiency(Runs[0], Runs[r], p));
+      }
+    fprintf(File, "}}%s\n", (r + 1 < NumberOfRuns ? "," : ""));
+    }
+  fprintf(File, "  ]\n}\n");
+}
+
+static void PrintTable(ThreadScalingRun* Runs, int NumberOfRuns)
+{
+  fprintf(stdout, "%8s", "Threads");
+  for (int p = 0; p < NUMBER_OF_PHASES; p++) fprintf(stdout, " %15s", ThreadScalingPhaseNames[p]);
+  fprintf(stdout, " %15s %10s\n", "Total", "Identical");
+  for (int r = 0; r < NumberOfRuns; r++)
+    {
+    fprintf(stdout, "%8d", Runs[r].NumberOfThreads);
+    for (int p = 0; p < NUMBER_OF_PHASES; p++)
+      {
+      fprintf(stdout, " %8.3fs %4.0f%%", Runs[r].PhaseTime[p], 100.0*Efficiency(Runs[0], Runs[r], p));
+      }
+    fprintf(stdout, " %8.3fs %4.0f%% %10s\n", Runs[r].TotalTime, 100.0*Efficiency(Runs[0], Runs[r], NUMBER_OF_PHASES),
+            (Runs[r].SegmentationDifference || Runs[r].PostProcessingDifference ? "no" : "yes"));
+    }
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  EMSegmentPhantomParameters Phantom;
+  SetDefaultPhantomParameters(Phantom);
+  std::string OutputFileName;
+
+  // Default sweep: powers of two up to the number of processors
+  int Threads[THREADSCALING_MAX_RUNS];
+  int NumberOfRuns = 0;
+  int MaxThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  for (int n = 1; n < MaxThreads; n *= 2) Threads[NumberOfRuns++] = n;
+  Threads[NumberOfRuns++] = MaxThreads;
+
+  int ValidFlag = 1;
+  for (int i = 1; ValidFlag && (i < argc); i += 2)
+    {
+    if (i + 1 >= argc) ValidFlag = 0;
+    else if (SetPhantomParameter(Phantom, argv[i], argv[i+1])) continue;
+    else if (!strcmp(argv[i], "--threads")) ValidFlag = ((NumberOfRuns = ParseThreadList(argv[i+1], Threads)) > 0);
+    else if (!strcmp(argv[i], "--output")) OutputFileName = argv[i+1];
+    else ValidFlag = 0;
+    }
+  if (!ValidFlag || !CheckPhantomParameters(Phantom))
+    {
+    std::cerr << "Usage: vtkEMSegmentThreadScaling [--size N] [--channels C] [--classes K] [--roi-fraction F]" << std::endl
+              << "                                 [--mrf 0|1] [--registration 0|1] [--shape 0|1] [--iterations I]" << std::endl
+              << "                                 [--threads 1,2,4,8] [--output file.json]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  ThreadScalingRun Runs[THREADSCALING_MAX_RUNS];
+  short* SegmentationReference   = NULL;
+  short* PostProcessingReference = NULL;
+  int Success = 1;
+  for (int r = 0; Success && (r < NumberOfRuns); r++)
+    {
+    std::cerr << "======== Segmentation with " << Threads[r] << " threads ========" << std::endl;
+    Runs[r].NumberOfThreads = Threads[r];
+    Success = RunSegmentation(Phantom, Runs[r], &SegmentationReference, &PostProcessingReference);
+    if (Success && (Runs[r].SegmentationDifference || Runs[r].PostProcessingDifference))
+      {
+      std::cerr << "Label maps with " << Threads[r] << " threads differ from those with " << Threads[0] << " threads in "
+                << Runs[r].SegmentationDifference << " (segmentation) and " << Runs[r].PostProcessingDifference
+                << " (post-processing) voxels" << std::endl;
+      }
+    }
+  delete[] SegmentationReference;
+  delete[] PostProcessingReference;
+  if (!Success) return EXIT_FAILURE;
+
+  PrintTable(Runs, NumberOfRuns);
+  if (!OutputFileName.empty())
+    {
+    FILE* File = fopen(OutputFileName.c_str(), "w");
+    if (!File)
+      {
+      std::cerr << "Could not write " << OutputFileName << std::endl;
+      return EXIT_FAILURE;
+      }
+    WriteResults(File, Phantom, Runs, NumberOfRuns);
+    fclose(File);
+    }
+
+  for (int r = 0; r < NumberOfRuns; r++)
+    {
+    if (Runs[r].SegmentationDifference || Runs[r].PostProcessingDifference) return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+// Image pyramids shared by vtkRigidRegistrator and vtkBSplineRegistrator
+//
+// A smooth blob is registered to a translated copy of itself, first rigidly and then with
+// B-splines, as done by the affine-then-deformable sequence of the preprocessing. Both
+// registrators share one vtkRegistrationPyramidCache. The test fails if
+//  - the B-spline registration does not take levels from the cache filled by the rigid one,
+//  - the transforms differ from those of registrations without the cache, or
+//  - a modified image or a different IJKToXYZ matrix is served from the cache.
+//
+// Usage: vtkRegistrationPyramidCacheTest [--size N] [--shift S] [--iterations I]
+
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vtkImageData.h"
+#include "vtkMatrix4x4.h"
+#include "vtkTransform.h"
+#include "vtkGridTransform.h"
+#include "vtkRigidRegistrator.h"
+#include "vtkBSplineRegistrator.h"
+#include "vtkRegistrationPyramidCache.h"
+
+//----------------------------------------------------------------------------
+// Gaussian blob centered at Center
+static vtkImageData* NewBlobImage(int Size, const double Center[3])
+{
+  vtkImageData* Image = vtkImageData::New();
+  Image->SetDimensions(Size, Size, Size);
+  Image->SetScalarTypeToFloat();
+  Image->SetNumberOfScalarComponents(1);
+  Image->AllocateScalars();
+
+  double Sigma = Size/6.0;
+  float* Ptr = static_cast<float*>(Image->GetScalarPointer());
+  for (int z = 0; z < Size; z++)
+    {
+    for (int y = 0; y < Size; y++)
+      {
+      for (int x = 0; x < Size; x++)
+        {
+        double Distance = (x - Center[0])*(x - Center[0]) + (y - Center[1])*(y - Center[1]) + (z - Center[2])*(z - Center[2]);
+        *Ptr++ = float(100.0*exp(-Distance/(2.0*Sigma*Sigma)));
+        }
+      }
+    }
+  return Image;
+}
+
+//----------------------------------------------------------------------------
+// Largest distance between the points of a grid over the image mapped by both transforms
+static double TransformDifference(vtkAbstractTransform* A, vtkAbstractTransform* B, int Size)
+{
+  double MaxDifference = 0.0;
+  for (int z = 0; z < Size; z += Size/4)
+    {
+    for (int y = 0; y < Size; y += Size/4)
+      {
+      for (int x = 0; x < Size; x += Size/4)
+        {
+        double Point[3] = {double(x), double(y), double(z)};
+        double PointA[3], PointB[3];
+        A->TransformPoint(Point, PointA);
+        B->TransformPoint(Point, PointB);
+        double Difference = sqrt((PointA[0] - PointB[0])*(PointA[0] - PointB[0]) + (PointA[1] - PointB[1])*(PointA[1] - PointB[1])
+                                 + (PointA[2] - PointB[2])*(PointA[2] - PointB[2]));
+        if (Difference > MaxDifference) MaxDifference = Difference;
+        }
+      }
+    }
+  return MaxDifference;
+}
+
+//----------------------------------------------------------------------------
+// Returns a copy of the rigid transform or NULL if the registration failed
+static vtkTransform* RunRigidRegistration(vtkImageData* FixedImage, vtkImageData* MovingImage, vtkMatrix4x4* FixedIJKToXYZ,
+                                          vtkRegistrationPyramidCache* Cache, int Iterations)
+{
+  vtkRigidRegistrator* Registrator = vtkRigidRegistrator::New();
+  Registrator->SetFixedImage(FixedImage);
+  Registrator->SetMovingImage(MovingImage);
+  Registrator->SetFixedIJKToXYZ(FixedIJKToXYZ);
+  Registrator->SetImageToImageMetricToMeanSquaredError();
+  Registrator->SetIntensityInterpolationTypeToLinear();
+  Registrator->SetTransformInitializationTypeToImageCenters();
+  Registrator->SetNumberOfIterations(Iterations);
+  Registrator->SetPyramidCache(Cache);
+
+  vtkTransform* Transform = NULL;
+  try
+    {
+    Registrator->RegisterImages();
+    Transform = vtkTransform::New();
+    Transform->DeepCopy(Registrator->GetTransform());
+    }
+  catch (...)
+    {
+    std::cerr << "Rigid RegisterImages failed" << std::endl;
+    }
+  Registrator->Delete();
+  return Transform;
+}
+
+// Returns a copy of the B-spline transform or NULL if the registration failed
+static vtkGridTransform* RunBSplineRegistration(vtkImageData* FixedImage, vtkImageData* MovingImage,
+                                                vtkRegistrationPyramidCache* Cache, int Iterations)
+{
+  vtkBSplineRegistrator* Registrator = vtkBSplineRegistrator::New();
+  Registrator->SetFixedImage(FixedImage);
+  Registrator->SetMovingImage(MovingImage);
+  Registrator->SetImageToImageMetricToMeanSquaredError();
+  Registrator->SetIntensityInterpolationTypeToLinear();
+  Registrator->SetNumberOfIterations(Iterations);
+  Registrator->SetNumberOfKnotPoints(5);
+  Registrator->SetPyramidCache(Cache);
+
+  vtkGridTransform* Transform = NULL;
+  try
+    {
+    Registrator->RegisterImages();
+    Transform = vtkGridTransform::New();
+    Transform->DeepCopy(Registrator->GetTransform());
+    }
+  catch (...)
+    {
+    std::cerr << "B-spline RegisterImages failed" << std::endl;
+    }
+  Registrator->Delete();
+  return Transform;
+}
+
+//----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  int    Size       = 32;
+  double Shift      = 2.0;
+  int    Iterations = 10;
+
+  int ValidFlag = 1;
+  for (int i = 1; ValidFlag && (i < argc); i += 2)
+    {
+    if (i + 1 >= argc) ValidFlag = 0;
+    else if (!strcmp(argv[i], "--size")) Size = atoi(argv[i+1]);
+    else if (!strcmp(argv[i], "--shift")) Shift = atof(argv[i+1]);
+    else if (!strcmp(argv[i], "--iterations")) Iterations = atoi(argv[i+1]);
+    else ValidFlag = 0;
+    }
+  if (!ValidFlag || (Size < 16) || (Iterations < 1))
+    {
+    std::cerr << "Usage: vtkRegistrationPyramidCacheTest [--size N] [--shift S] [--iterations I]" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  double FixedCenter[3]  = {0.5*(Size-1), 0.5*(Size-1), 0.5*(Size-1)};
+  double MovingCenter[3] = {FixedCenter[0] + Shift, FixedCenter[1], FixedCenter[2]};
+  vtkImageData* FixedImage  = NewBlobImage(Size, FixedCenter);
+  vtkImageData* MovingImage = NewBlobImage(Size, MovingCenter);
+  vtkRegistrationPyramidCache* Cache = vtkRegistrationPyramidCache::New();
+
+  // Reference transforms without the cache
+  vtkTransform*     RigidReference   = RunRigidRegistration(FixedImage, MovingImage, NULL, NULL, Iterations);
+  vtkGridTransform* BSplineReference = RunBSplineRegistration(FixedImage, MovingImage, NULL, Iterations);
+  vtkTransform*     Rigid   = NULL;
+  vtkGridTransform* BSpline = NULL;
+  int Success = (RigidReference && BSplineReference);
+
+  // The rigid registration fills the cache, the B-spline registration has to use it
+  if (Success) Success = ((Rigid = RunRigidRegistration(FixedImage, MovingImage, NULL, Cache, Iterations)) != NULL);
+  if (Success)
+    {
+    std::cout << "Rigid registration: " << Cache->GetNumberOfHits() << " hits, " << Cache->GetNumberOfMisses() << " misses, "
+              << Cache->GetNumberOfLevels() << " cached levels" << std::endl;
+    if (Cache->GetNumberOfHits() || !Cache->GetNumberOfLevels())
+      {
+      std::cerr << "The first registration did not fill the empty cache" << std::endl;
+      Success = 0;
+      }
+    double Difference = TransformDifference(Rigid, RigidReference, Size);
+    if (Difference > 1e-4)
+      {
+      std::cerr << "The rigid transform differs by " << Difference << " from the one without the cache" << std::endl;
+      Success = 0;
+      }
+    }
+
+  if (Success)
+    {
+    int Hits = Cache->GetNumberOfHits();
+    Success = ((BSpline = RunBSplineRegistration(FixedImage, MovingImage, Cache, Iterations)) != NULL);
+    if (Success)
+      {
+      std::cout << "B-spline registration: " << Cache->GetNumberOfHits() - Hits << " hits" << std::endl;
+      if (Cache->GetNumberOfHits() <= Hits)
+        {
+        std::cerr << "The B-spline registration did not use the pyramid levels of the rigid registration" << std::endl;
+        Success = 0;
+        }
+      double Difference = TransformDifference(BSpline, BSplineReference, Size);
+      if (Difference > 1e-4)
+        {
+        std::cerr << "The B-spline transform differs by " << Difference << " from the one without the cache" << std::endl;
+        Success = 0;
+        }
+      }
+    }
+
+  // Changed images and matrices must not be served from the cache
+  if (Success)
+    {
+    vtkTransform* Transform = NULL;
+    MovingImage->Modified();
+    int Misses = Cache->GetNumberOfMisses();
+    Success = ((Transform = RunRigidRegistration(FixedImage, MovingImage, NULL, Cache, Iterations)) != NULL);
+    if (Transform) Transform->Delete();
+    if (Success && (Cache->GetNumberOfMisses() <= Misses))
+      {
+      std::cerr << "The levels of the modified moving image were taken from the cache" << std::endl;
+      Success = 0;
+      }
+    }
+
+  if (Success)
+    {
+    vtkTransform* Transform = NULL;
+    vtkMatrix4x4* FixedIJKToXYZ = vtkMatrix4x4::New();
+    FixedIJKToXYZ->Identity();
+    FixedIJKToXYZ->SetElement(0, 0, 1.5);
+    int Misses = Cache->GetNumberOfMisses();
+    Success = ((Transform = RunRigidRegistration(FixedImage, MovingImage, FixedIJKToXYZ, Cache, Iterations)) != NULL);
+    if (Transform) Transform->Delete();
+    FixedIJKToXYZ->Delete();
+    if (Success && (Cache->GetNumberOfMisses() <= Misses))
+      {
+      std::cerr << "The levels of the fixed image with a different IJKToXYZ matrix were taken from the cache" << std::endl;
+      Success = 0;
+      }
+    }
+
+  if (RigidReference) RigidReference->Delete();
+  if (BSplineReference) BSplineReference->Delete();
+  if (Rigid) Rigid->Delete();
+  if (BSpline) BSpline->Delete();
+  Cache->Delete();
+  FixedImage->Delete();
+  MovingImage->Delete();
+  return (Success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
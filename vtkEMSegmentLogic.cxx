@@ -8,13 +8,29 @@
 #include "vtkImageEMLocalSegmenter.h"
 #include "vtkImageEMLocalSuperClass.h"
 #include "vtkSlicerVolumesLogic.h"
-#include "vtkTransformToGrid.h"
-#include "vtkIdentityTransform.h"
+#include "vtkComposedGridTransform.h"
 #include "vtkMRMLEMSAtlasNode.h"
 #include "vtkMRMLEMSGlobalParametersNode.h"
 #include "vtkMRMLLabelMapVolumeDisplayNode.h"
 #include "vtkMRMLEMSTemplateNode.h"
 #include "vtkImageIslandFilter.h"
+#include "vtkMultiThreader.h"
+#include "vtkCollection.h"
+#include "vtkPointData.h"
+#include "vtkDataArray.h"
+
+#include <limits>
+#include <vtksys/SystemTools.hxx>
+#include <vtksys/MD5.h>
+#include <vtksys/Process.h>
+#include <sstream>
+#include <fstream>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#endif
 
 
 // A helper class to compare two maps
@@ -54,6 +70,25 @@ vtkEMSegmentLogic::vtkEMSegmentLogic()
   this->ProgressGlobalFractionCompleted = 0.0;
   this->ProgressCurrentFractionCompleted = 0.0;
 
+  this->Trace         = 0;
+  this->TraceFileName = NULL;
+  this->MetricsFileName = NULL;
+  this->NumberOfThreads = 0;
+  this->PostProcessingPeakMemory = 0;
+  this->RegistrationCacheFlag = 1;
+  this->RegistrationCacheDirectory = NULL;
+  this->PreprocessingConcurrencyLimit = 0;
+  this->PreprocessingCoreBudget = 0;
+  this->SharedMemoryFlag = 1;
+  this->SharedMemoryDirectory = NULL;
+  this->SharedMemoryCounter = 0;
+  this->ScratchCompressionFlag = 0;
+  this->ScratchDirectory = NULL;
+  this->BackgroundLevelSampleStride = 1;
+#ifdef __linux__
+  this->SetSharedMemoryDirectory("/dev/shm");
+#endif
+
   //this->DebugOn();
 
   this->MRMLManager = NULL; // NB: must be set before SetMRMLManager is called
@@ -68,6 +103,16 @@ vtkEMSegmentLogic::~vtkEMSegmentLogic()
   this->SetMRMLManager(NULL);
   this->SetProgressCurrentAction(NULL);
   this->SetModuleName(NULL);
+  this->SetTraceFileName(NULL);
+  this->SetMetricsFileName(NULL);
+  this->SetRegistrationCacheDirectory(NULL);
+  this->RemoveAllSharedMemoryVolumes();
+  this->SetSharedMemoryDirectory(NULL);
+  this->SetScratchDirectory(NULL);
+  for (unsigned int i = 0; i < this->PostProcessingStages.size(); i++)
+    {
+    delete this->PostProcessingStages[i];
+    }
 }
 
 //----------------------------------------------------------------------------
@@ -193,168 +238,155 @@ IsVolumeGeometryEqual(vtkMRMLVolumeNode* lhs,
   return equalExent && equalMatrix;
 }
 
-// loops through the faces of the image bounding box and counts all the different image values and stores them in a map
-// T represents the image data type
+// Voxel counts of the faces of the image bounding box (see GuessRegistrationBackgroundLevel). The border is 
+// made of six slabs, each a set of rows - the rows of all slabs are split evenly across the threads and every 
+// thread counts into its own map, so no locking is needed until the maps are merged
 template <class T>
-T
-vtkEMSegmentLogic::
-GuessRegistrationBackgroundLevel(vtkImageData* imageData)
+struct vtkEMSegmentLogicBackgroundLevelParameters
 {
-  int borderWidth = 5;
-  T inLevel;
   typedef std::map<T, unsigned int> MapType;
-  MapType m;
-  long totalVoxelsCounted = 0;
 
-  T* inData = static_cast<T*>(imageData->GetScalarPointer());
-  int dim[3];
-  imageData->GetDimensions(dim);
+  const T*   InData;
+  int        Dim[3];
+  vtkIdType  Inc[3];
+  int        SampleStride;
+  // per slab: axis of the slab, first and last+1 layer along it, axis of the rows and axis along the rows 
+  int        Slab[6][5];
+  vtkIdType  NumberOfRows[6];
+  vtkIdType  TotalNumberOfRows;
+  MapType*   Counts;
+  long*      NumberOfVoxels;
+};
+
+template <class T>
+static VTK_THREAD_RETURN_TYPE vtkEMSegmentLogic_BackgroundLevelThreaded(void *arg)
+{
+  int threadID = ((ThreadInfoStruct*)(arg))->ThreadID;
+  int numberOfThreads = ((ThreadInfoStruct*)(arg))->NumberOfThreads;
+  vtkEMSegmentLogicBackgroundLevelParameters<T>* para = 
+    (vtkEMSegmentLogicBackgroundLevelParameters<T>*) (((ThreadInfoStruct*)(arg))->UserData);
+
+  vtkIdType firstRow = (para->TotalNumberOfRows * threadID) / numberOfThreads;
+  vtkIdType lastRow  = (para->TotalNumberOfRows * (threadID + 1)) / numberOfThreads;
+  typename vtkEMSegmentLogicBackgroundLevelParameters<T>::MapType& m = para->Counts[threadID];
+  const int stride = para->SampleStride;
+  long totalVoxelsCounted = 0;
 
-  vtkIdType inc[3];
-  vtkIdType iInc, jInc, kInc;
-  imageData->GetIncrements(inc);
+  // the border is mostly background - runs of the same value are added to the map at once
+  T runLevel = T(0);
+  unsigned int runLength = 0;
 
-   // k first slice
-  for (int k = 0; k < borderWidth; ++k)
+  vtkIdType slabFirstRow = 0;
+  for (int s = 0; s < 6 && slabFirstRow < lastRow; slabFirstRow += para->NumberOfRows[s], ++s)
     {
-    kInc = k*inc[2];
-    for (int j = 0; j < dim[1]; ++j)
+    vtkIdType slabLastRow = slabFirstRow + para->NumberOfRows[s];
+    if (slabLastRow <= firstRow)
       {
-      jInc = j*inc[1];
-      for (int i = 0; i < dim[0]; ++i)
-        {
-        iInc = i*inc[0];
-        inLevel = inData[iInc+jInc+kInc];
-        if (m.count(inLevel))
-          {
-          ++m[inLevel];
-          }
-        else
-          {
-          m[inLevel] = 1;
-          }
-        ++totalVoxelsCounted;
-        }
+      continue;
       }
-    }
-
-  // k last slice
-  for (int k = dim[2]-borderWidth; k < dim[2]; ++k)
-    {
-    kInc = k*inc[2];
-    for (int j = 0; j < dim[1]; ++j)
+    const int* slab = para->Slab[s];
+    vtkIdType rowsPerLayer = (para->Dim[slab[3]] + stride - 1) / stride;
+    vtkIdType rowInc  = para->Inc[slab[3]] * stride;
+    vtkIdType stepInc = para->Inc[slab[4]] * stride;
+    int numSteps = (para->Dim[slab[4]] + stride - 1) / stride;
+
+    vtkIdType begin = (firstRow > slabFirstRow ? firstRow : slabFirstRow) - slabFirstRow;
+    vtkIdType end   = (lastRow < slabLastRow ? lastRow : slabLastRow) - slabFirstRow;
+    for (vtkIdType row = begin; row < end; ++row)
       {
-      jInc = j*inc[1];
-      for (int i = 0; i < dim[0]; ++i)
+      const T* inPtr = para->InData + (slab[1] + row / rowsPerLayer) * para->Inc[slab[0]] + (row % rowsPerLayer) * rowInc;
+      for (int i = 0; i < numSteps; ++i, inPtr += stepInc)
         {
-        iInc = i*inc[0];
-        inLevel = inData[iInc+jInc+kInc];
-        if (m.count(inLevel))
+        if (runLength && *inPtr == runLevel)
           {
-          ++m[inLevel];
+          ++runLength;
+          continue;
           }
-        else
+        if (runLength)
           {
-          m[inLevel] = 1;
+          m[runLevel] += runLength;
           }
-        ++totalVoxelsCounted;
+        runLevel  = *inPtr;
+        runLength = 1;
         }
+      totalVoxelsCounted += numSteps;
       }
     }
-
-  // j first slice
-  for (int j = 0; j < borderWidth; ++j)
+  if (runLength)
     {
-    jInc = j*inc[1];
-    for (int k = 0; k < dim[2]; ++k)
-      {
-      kInc = k*inc[2];
-      for (int i = 0; i < dim[0]; ++i)
-        {
-        iInc = i*inc[0];
-        inLevel = inData[iInc+jInc+kInc];
-        if (m.count(inLevel))
-          {
-          ++m[inLevel];
-          }
-        else
-          {
-          m[inLevel] = 1;
-          }
-        ++totalVoxelsCounted;
-        }
-      }
+    m[runLevel] += runLength;
     }
+  para->NumberOfVoxels[threadID] = totalVoxelsCounted;
 
-  // j last slice
-  for (int j = dim[1]-borderWidth; j < dim[1]; ++j)
-    {
-    jInc = j*inc[1];
-    for (int k = 0; k < dim[2]; ++k)
-      {
-      kInc = k*inc[2];
-      for (int i = 0; i < dim[0]; ++i)
-        {
-        iInc = i*inc[0];
-        inLevel = inData[iInc+jInc+kInc];
-        if (m.count(inLevel))
-          {
-          ++m[inLevel];
-          }
-        else
-          {
-          m[inLevel] = 1;
-          }
-        ++totalVoxelsCounted;
-        }
-      }
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// loops through the faces of the image bounding box and counts all the different image values and stores them in a map
+// T represents the image data type. Only every sampleStride-th voxel along the faces is looked at, 
+// numberOfThreads = 0 keeps the vtkMultiThreader global default
+template <class T>
+T
+vtkEMSegmentLogic::
+GuessRegistrationBackgroundLevel(vtkImageData* imageData, int numberOfThreads, int sampleStride)
+{
+  int borderWidth = 5;
+  typedef std::map<T, unsigned int> MapType;
+  MapType m;
+  long totalVoxelsCounted = 0;
+
+  vtkEMSegmentLogicBackgroundLevelParameters<T> para;
+  para.InData = static_cast<T*>(imageData->GetScalarPointer());
+  imageData->GetDimensions(para.Dim);
+  imageData->GetIncrements(para.Inc);
+  para.SampleStride = (sampleStride > 1 ? sampleStride : 1);
+
+  // k first and last slice (rows along j), j first and last slice (rows along k), i first and last slice (rows along k)
+  const int slabAxes[3][3] = {{2, 1, 0}, {1, 2, 0}, {0, 2, 1}};
+  para.TotalNumberOfRows = 0;
+  for (int s = 0; s < 6; ++s)
+    {
+    const int* axes = slabAxes[s / 2];
+    int dim   = para.Dim[axes[0]];
+    int width = (borderWidth < dim ? borderWidth : dim);
+    para.Slab[s][0] = axes[0];
+    para.Slab[s][1] = (s % 2 ? dim - width : 0);
+    para.Slab[s][2] = para.Slab[s][1] + width;
+    para.Slab[s][3] = axes[1];
+    para.Slab[s][4] = axes[2];
+    para.NumberOfRows[s] = (para.Dim[axes[2]] > 0 ? 
+                            vtkIdType(width) * ((para.Dim[axes[1]] + para.SampleStride - 1) / para.SampleStride) : 0);
+    para.TotalNumberOfRows += para.NumberOfRows[s];
     }
 
-  // i first slice
-  for (int i = 0; i < borderWidth; ++i)
+  if (para.TotalNumberOfRows)
     {
-    iInc = i*inc[0];
-    for (int k = 0; k < dim[2]; ++k)
+    vtkMultiThreader* threader = vtkMultiThreader::New();
+    if (numberOfThreads > 0)
       {
-      kInc = k*inc[2];
-      for (int j = 0; j < dim[1]; ++j)
-        {
-        jInc = j*inc[1];
-        inLevel = inData[iInc+jInc+kInc];
-        if (m.count(inLevel))
-          {
-          ++m[inLevel];
-          }
-        else
-          {
-          m[inLevel] = 1;
-          }
-        ++totalVoxelsCounted;
-        }
+      threader->SetNumberOfThreads(numberOfThreads);
       }
-    }
-
-  // i last slice
-  for (int i = dim[0]-borderWidth; i < dim[0]; ++i)
-    {
-    iInc = i*inc[0];
-    for (int k = 0; k < dim[2]; ++k)
+    if (threader->GetNumberOfThreads() > para.TotalNumberOfRows)
       {
-      kInc = k*inc[2];
-      for (int j = 0; j < dim[1]; ++j)
+      threader->SetNumberOfThreads(int(para.TotalNumberOfRows));
+      }
+    int threads = threader->GetNumberOfThreads();
+    std::vector<MapType> counts(threads);
+    std::vector<long>    numberOfVoxels(threads, 0);
+    para.Counts         = &counts[0];
+    para.NumberOfVoxels = &numberOfVoxels[0];
+    threader->SetSingleMethod(vtkEMSegmentLogic_BackgroundLevelThreaded<T>, &para);
+    threader->SingleMethodExecute();
+    threader->Delete();
+
+    m.swap(counts[0]);
+    totalVoxelsCounted = numberOfVoxels[0];
+    for (int t = 1; t < threads; ++t)
+      {
+      for (typename MapType::const_iterator it = counts[t].begin(); it != counts[t].end(); ++it)
         {
-        jInc = j*inc[1];
-        inLevel = inData[iInc+jInc+kInc];
-        if (m.count(inLevel))
-          {
-          ++m[inLevel];
-          }
-        else
-          {
-          m[inLevel] = 1;
-          }
-        ++totalVoxelsCounted;
+        m[it->first] += it->second;
         }
+      totalVoxelsCounted += numberOfVoxels[t];
       }
     }
 
@@ -566,48 +598,26 @@ SlicerImageResliceWithGrid(vtkMRMLVolumeNode* inputVolumeNode,
   // set inputs
   resliceFilter->SetInput(inputImageData);
 
-  //
-  // create total transform
-  vtkTransformToGrid* gridSource = vtkTransformToGrid::New();
-  vtkIdentityTransform* idTransform = vtkIdentityTransform::New();
-  gridSource->SetInput(idTransform);
-  //gridSource->SetGridScalarType(VTK_FLOAT);
-  idTransform->Delete();
-
   //
   // set geometry
   if (outputGeometryData != NULL)
     {
     resliceFilter->SetInformationInput(outputGeometryData);
     outputVolumeNode->CopyOrientation(outputVolumeGeometryNode);
-
-    gridSource->SetGridExtent(outputGeometryData->GetExtent());
-    gridSource->SetGridSpacing(outputGeometryData->GetSpacing());
-    gridSource->SetGridOrigin(outputGeometryData->GetOrigin());
-    }
-  else
-    {
-    gridSource->SetGridExtent(outputImageData->GetExtent());
-    gridSource->SetGridSpacing(outputImageData->GetSpacing());
-    gridSource->SetGridOrigin(outputImageData->GetOrigin());
     }
-  gridSource->Update();
-  vtkGridTransform* totalTransform = vtkGridTransform::New();
-  totalTransform->SetDisplacementGrid(gridSource->GetOutput());
-//  totalTransform->SetInterpolationModeToCubic();
-  gridSource->Delete();
-  
+
   //
-  // fill in total transform
+  // total transform, evaluated by vtkImageReslice where needed instead of 
+  // being sampled into a displacement grid of the size of the output 
   // ijk of output -> RAS -> XFORM -> RAS -> ijk of input
   vtkMatrix4x4* outputIJKToRAS  = vtkMatrix4x4::New();
   outputVolumeNode->GetIJKToRASMatrix(outputIJKToRAS);
   vtkMatrix4x4* inputRASToIJK = vtkMatrix4x4::New();
   inputVolumeNode->GetRASToIJKMatrix(inputRASToIJK);
-  vtkEMSegmentLogic::ComposeGridTransform(outputRASToInputRASTransform,
-                                          outputIJKToRAS,
-                                          inputRASToIJK,
-                                          totalTransform);
+  vtkComposedGridTransform* totalTransform = vtkComposedGridTransform::New();
+  totalTransform->SetPreMatrix(outputIJKToRAS);
+  totalTransform->SetGridTransform(outputRASToInputRASTransform);
+  totalTransform->SetPostMatrix(inputRASToIJK);
   resliceFilter->SetResliceTransform(totalTransform);
 
   //
@@ -615,94 +625,1015 @@ SlicerImageResliceWithGrid(vtkMRMLVolumeNode* inputVolumeNode,
   resliceFilter->SetBackgroundLevel(backgroundLevel);
   resliceFilter->OptimizationOn();
 
-  switch (interpolationType)
+  switch (interpolationType)
+    {
+    case vtkEMSegmentMRMLManager::InterpolationNearestNeighbor:
+      resliceFilter->SetInterpolationModeToNearestNeighbor();
+      break;
+    case vtkEMSegmentMRMLManager::InterpolationCubic:
+      resliceFilter->SetInterpolationModeToCubic();
+      break;
+    case vtkEMSegmentMRMLManager::InterpolationLinear:
+    default:
+      resliceFilter->SetInterpolationModeToLinear();
+    }
+
+  resliceFilter->Update();
+  outputImageData->ShallowCopy(resliceFilter->GetOutput());
+
+  //
+  // clean up
+  outputIJKToRAS->Delete();
+  inputRASToIJK->Delete();
+  resliceFilter->Delete();
+  totalTransform->Delete();
+}
+
+//----------------------------------------------------------------------------
+// Resampling of several volumes with one composed transform (see SlicerImageResliceVolumesWithGrid). 
+// For each output row the positions in the input volumes are computed once, turned into interpolation  
+// weights and these are then applied to every volume. Follows the conventions of vtkImageReslice: 
+// positions outside the input are set to the background level and integer types are rounded. 
+typedef struct {
+  // output data coordinates -> output RAS -> warp -> input RAS -> input structured coordinates
+  vtkComposedGridTransform* Transform;
+  int                       OutputExtent[6];
+  double                    OutputOrigin[3];
+  double                    OutputSpacing[3];
+  int                       InputDimensions[3];
+  int                       InterpolationType;
+  double                    BackgroundLevel;
+  int                       NumberOfVolumes;
+  void**                    InputPtr;
+  void**                    OutputPtr;
+  int*                      ScalarType;
+  int*                      NumberOfComponents;
+} vtkEMSegmentLogicResampleParameters;
+
+template <class T>
+static inline void vtkEMSegmentLogic_ResampleCast(double value, T& out)
+{
+  if (vtkstd::numeric_limits<T>::is_integer)
+    {
+    value = floor(value + 0.5);
+    if (value < double(vtkstd::numeric_limits<T>::min())) value = double(vtkstd::numeric_limits<T>::min());
+    if (value > double(vtkstd::numeric_limits<T>::max())) value = double(vtkstd::numeric_limits<T>::max());
+    }
+  out = T(value);
+}
+
+// Offset < 0 marks positions outside the input. For linear interpolation Step holds the increments to the 
+// next voxel along each axis (0 if the weight is 0) and Weight the fractions along each axis 
+template <class T>
+static void vtkEMSegmentLogic_ResampleRow(const T* inPtr, T* outPtr, int numComp, int numVoxels, const int* offset, 
+                                          const int* step, const float* weight, int interpolationType, double backgroundLevel)
+{
+  T background;
+  vtkEMSegmentLogic_ResampleCast(backgroundLevel, background);
+  for (int i = 0; i < numVoxels; i++)
+    {
+    if (offset[i] < 0)
+      {
+      for (int c = 0; c < numComp; c++) *outPtr++ = background;
+      continue;
+      }
+    const T* p = inPtr + vtkIdType(offset[i])*numComp;
+    if (interpolationType == vtkEMSegmentMRMLManager::InterpolationNearestNeighbor)
+      {
+      for (int c = 0; c < numComp; c++) *outPtr++ = p[c];
+      continue;
+      }
+    vtkIdType sx = vtkIdType(step[3*i])*numComp, sy = vtkIdType(step[3*i+1])*numComp, sz = vtkIdType(step[3*i+2])*numComp;
+    double fx = weight[3*i], fy = weight[3*i+1], fz = weight[3*i+2];
+    double rx = 1.0 - fx, ry = 1.0 - fy, rz = 1.0 - fz;
+    for (int c = 0; c < numComp; c++, p++)
+      {
+      double value = rz*(ry*(rx*p[0]    + fx*p[sx])    + fy*(rx*p[sy]    + fx*p[sy+sx]))
+                   + fz*(ry*(rx*p[sz]   + fx*p[sz+sx]) + fy*(rx*p[sz+sy] + fx*p[sz+sy+sx]));
+      vtkEMSegmentLogic_ResampleCast(value, *outPtr++);
+      }
+    }
+}
+
+static VTK_THREAD_RETURN_TYPE vtkEMSegmentLogic_ResampleThreaded(void *arg)
+{
+  int threadID = ((ThreadInfoStruct*)(arg))->ThreadID;
+  int numberOfThreads = ((ThreadInfoStruct*)(arg))->NumberOfThreads;
+  vtkEMSegmentLogicResampleParameters* para = (vtkEMSegmentLogicResampleParameters*) (((ThreadInfoStruct*)(arg))->UserData);
+
+  const int* ext = para->OutputExtent;
+  int numVoxels  = ext[1] - ext[0] + 1;
+  int numRowsY   = ext[3] - ext[2] + 1;
+  int numRows    = numRowsY * (ext[5] - ext[4] + 1);
+  int firstRow   = int((vtkIdType(numRows) * threadID) / numberOfThreads);
+  int lastRow    = int((vtkIdType(numRows) * (threadID + 1)) / numberOfThreads);
+  const int* dim = para->InputDimensions;
+  int inc[3] = {1, dim[0], dim[0]*dim[1]};
+
+  int*    offset   = new int[numVoxels];
+  int*    step     = new int[3*numVoxels];
+  float*  weight   = new float[3*numVoxels];
+  double* position = new double[3*numVoxels];
+  double  rowStep[3] = {para->OutputSpacing[0], 0.0, 0.0};
+
+  for (int row = firstRow; row < lastRow; row++)
+    {
+    int y = ext[2] + row % numRowsY;
+    int z = ext[4] + row / numRowsY;
+
+    // Update was called before the threads started - TransformRow steps along the row without locking 
+    double rowStart[3] = {para->OutputOrigin[0] + ext[0]*para->OutputSpacing[0], para->OutputOrigin[1] + y*para->OutputSpacing[1], 
+                          para->OutputOrigin[2] + z*para->OutputSpacing[2]};
+    para->Transform->TransformRow(rowStart, rowStep, numVoxels, position);
+
+    for (int i = 0; i < numVoxels; i++)
+      {
+      offset[i] = 0;
+      for (int r = 0; r < 3; r++)
+        {
+        float pos = float(position[3*i+r]);
+        // Snap positions within round off of the border
+        if ((pos < 0.0f) && (pos > -1e-3f)) pos = 0.0f;
+        if ((pos > float(dim[r] - 1)) && (pos < float(dim[r] - 1) + 1e-3f)) pos = float(dim[r] - 1);
+
+        if (para->InterpolationType == vtkEMSegmentMRMLManager::InterpolationNearestNeighbor)
+          {
+          int idx = int(floor(pos + 0.5f));
+          if ((idx < 0) || (idx > dim[r] - 1) || (offset[i] < 0)) offset[i] = -1;
+          else offset[i] += idx*inc[r];
+          continue;
+          }
+        int idx = int(floor(pos));
+        float f = pos - float(idx);
+        if ((idx < 0) || (idx + (f != 0.0f) > dim[r] - 1) || (offset[i] < 0)) 
+          {
+          offset[i] = -1;
+          continue;
+          }
+        offset[i] += idx*inc[r];
+        step[3*i+r]   = (f != 0.0f ? inc[r] : 0);
+        weight[3*i+r] = f;
+        }
+      }
+
+    vtkIdType outOffset = (vtkIdType(z - ext[4])*numRowsY + (y - ext[2]))*numVoxels;
+    for (int v = 0; v < para->NumberOfVolumes; v++)
+      {
+      int numComp = para->NumberOfComponents[v];
+      switch (para->ScalarType[v])
+        {
+        vtkTemplateMacro(vtkEMSegmentLogic_ResampleRow(static_cast<VTK_TT*>(para->InputPtr[v]), static_cast<VTK_TT*>(para->OutputPtr[v]) + outOffset*numComp, 
+                                                       numComp, numVoxels, offset, step, weight, para->InterpolationType, para->BackgroundLevel));
+        }
+      }
+    }
+
+  delete[] offset;
+  delete[] step;
+  delete[] weight;
+  delete[] position;
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+bool
+vtkEMSegmentLogic::
+SlicerImageResliceVolumesWithGrid(vtkCollection* inputVolumeNodes,
+                                  vtkCollection* outputVolumeNodes,
+                                  vtkMRMLVolumeNode* outputVolumeGeometryNode,
+                                  vtkGridTransform* outputRASToInputRASTransform,
+                                  int interpolationType,
+                                  double backgroundLevel,
+                                  int numberOfThreads)
+{
+  if (!inputVolumeNodes || !outputVolumeNodes || 
+      (inputVolumeNodes->GetNumberOfItems() != outputVolumeNodes->GetNumberOfItems()))
+    {
+    std::cerr << "SlicerImageResliceVolumesWithGrid: number of input and output volumes differ" << std::endl;
+    return false;
+    }
+  if (!outputVolumeGeometryNode || !outputVolumeGeometryNode->GetImageData())
+    {
+    std::cerr << "SlicerImageResliceVolumesWithGrid: output geometry is not defined" << std::endl;
+    return false;
+    }
+
+  // Volumes that share the geometry of the first volume are resampled together, all others on their own   
+  std::vector<vtkMRMLVolumeNode*> inputNodes;
+  std::vector<vtkMRMLVolumeNode*> outputNodes;
+  vtkMRMLVolumeNode* referenceInput = NULL;
+  for (int i = 0; i < inputVolumeNodes->GetNumberOfItems(); i++)
+    {
+    vtkMRMLVolumeNode* inputNode  = vtkMRMLVolumeNode::SafeDownCast(inputVolumeNodes->GetItemAsObject(i));
+    vtkMRMLVolumeNode* outputNode = vtkMRMLVolumeNode::SafeDownCast(outputVolumeNodes->GetItemAsObject(i));
+    if (!inputNode || !outputNode || !inputNode->GetImageData() || !outputNode->GetImageData())
+      {
+      std::cerr << "SlicerImageResliceVolumesWithGrid: volume " << i << " is not defined - skipped" << std::endl;
+      continue;
+      }
+    outputNode->CopyOrientation(outputVolumeGeometryNode);
+    if (!referenceInput)
+      {
+      referenceInput = inputNode;
+      }
+    if ((interpolationType == vtkEMSegmentMRMLManager::InterpolationCubic) || 
+        !vtkEMSegmentLogic::IsVolumeGeometryEqual(inputNode, referenceInput))
+      {
+      vtkEMSegmentLogic::SlicerImageResliceWithGrid(inputNode, outputNode, outputVolumeGeometryNode, outputRASToInputRASTransform, 
+                                                    interpolationType, backgroundLevel);
+      continue;
+      }
+    inputNodes.push_back(inputNode);
+    outputNodes.push_back(outputNode);
+    }
+  if (inputNodes.empty())
+    {
+    return true;
+    }
+
+  vtkImageData* geometryData = outputVolumeGeometryNode->GetImageData();
+  vtkImageData* referenceData = inputNodes[0]->GetImageData();
+
+  vtkEMSegmentLogicResampleParameters para;
+  geometryData->GetExtent(para.OutputExtent);
+  geometryData->GetOrigin(para.OutputOrigin);
+  geometryData->GetSpacing(para.OutputSpacing);
+  referenceData->GetDimensions(para.InputDimensions);
+  para.InterpolationType = interpolationType;
+  para.BackgroundLevel   = backgroundLevel;
+
+  // ijk of output -> RAS -> XFORM -> RAS -> ijk of input -> structured coordinates of input 
+  vtkMatrix4x4* outputIJKToRAS  = vtkMatrix4x4::New();
+  outputNodes[0]->GetIJKToRASMatrix(outputIJKToRAS);
+  vtkMatrix4x4* inputRASToIndex = vtkMatrix4x4::New();
+  inputNodes[0]->GetRASToIJKMatrix(inputRASToIndex);
+  double inputOrigin[3], inputSpacing[3];
+  int inputExtent[6];
+  referenceData->GetOrigin(inputOrigin);
+  referenceData->GetSpacing(inputSpacing);
+  referenceData->GetExtent(inputExtent);
+  for (int r = 0; r < 3; r++)
+    {
+    for (int c = 0; c < 4; c++)
+      {
+      inputRASToIndex->SetElement(r, c, inputRASToIndex->GetElement(r, c) / inputSpacing[r]);
+      }
+    inputRASToIndex->SetElement(r, 3, inputRASToIndex->GetElement(r, 3) - inputOrigin[r] / inputSpacing[r] - inputExtent[2*r]);
+    }
+  para.Transform = vtkComposedGridTransform::New();
+  para.Transform->SetPreMatrix(outputIJKToRAS);
+  para.Transform->SetGridTransform(outputRASToInputRASTransform);
+  para.Transform->SetPostMatrix(inputRASToIndex);
+  para.Transform->Update();
+  outputIJKToRAS->Delete();
+  inputRASToIndex->Delete();
+
+  para.NumberOfVolumes    = int(inputNodes.size());
+  para.InputPtr           = new void*[para.NumberOfVolumes];
+  para.OutputPtr          = new void*[para.NumberOfVolumes];
+  para.ScalarType         = new int[para.NumberOfVolumes];
+  para.NumberOfComponents = new int[para.NumberOfVolumes];
+  std::vector<vtkImageData*> outputData;
+  for (int v = 0; v < para.NumberOfVolumes; v++)
+    {
+    vtkImageData* inputData = inputNodes[v]->GetImageData();
+    vtkImageData* data = vtkImageData::New();
+    data->SetExtent(para.OutputExtent);
+    data->SetWholeExtent(para.OutputExtent);
+    data->SetOrigin(para.OutputOrigin);
+    data->SetSpacing(para.OutputSpacing);
+    data->SetScalarType(inputData->GetScalarType());
+    data->SetNumberOfScalarComponents(inputData->GetNumberOfScalarComponents());
+    data->AllocateScalars();
+    outputData.push_back(data);
+
+    para.InputPtr[v]           = inputData->GetScalarPointer();
+    para.OutputPtr[v]          = data->GetScalarPointer();
+    para.ScalarType[v]         = inputData->GetScalarType();
+    para.NumberOfComponents[v] = inputData->GetNumberOfScalarComponents();
+    }
+
+  int numRows = (para.OutputExtent[3] - para.OutputExtent[2] + 1) * (para.OutputExtent[5] - para.OutputExtent[4] + 1);
+  if ((numRows > 0) && (para.OutputExtent[1] >= para.OutputExtent[0]))
+    {
+    vtkMultiThreader* threader = vtkMultiThreader::New();
+    if (numberOfThreads > 0)
+      {
+      threader->SetNumberOfThreads(numberOfThreads);
+      }
+    if (threader->GetNumberOfThreads() > numRows)
+      {
+      threader->SetNumberOfThreads(numRows);
+      }
+    threader->SetSingleMethod(vtkEMSegmentLogic_ResampleThreaded, &para);
+    threader->SingleMethodExecute();
+    threader->Delete();
+    }
+
+  for (int v = 0; v < para.NumberOfVolumes; v++)
+    {
+    outputNodes[v]->GetImageData()->ShallowCopy(outputData[v]);
+    outputData[v]->Delete();
+    }
+  para.Transform->Delete();
+  delete[] para.InputPtr;
+  delete[] para.OutputPtr;
+  delete[] para.ScalarType;
+  delete[] para.NumberOfComponents;
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool
+vtkEMSegmentLogic::
+ResampleVolumesWithDeformationField(vtkCollection* inputVolumeNodes,
+                                    vtkCollection* outputVolumeNodes,
+                                    vtkMRMLVolumeNode* outputVolumeGeometryNode,
+                                    vtkMRMLVolumeNode* deformationFieldNode,
+                                    int interpolationType,
+                                    double backgroundLevel)
+{
+  vtkImageData* fieldData = (deformationFieldNode ? deformationFieldNode->GetImageData() : NULL);
+  if (!fieldData || (fieldData->GetNumberOfScalarComponents() != 3) || !fieldData->GetPointData()->GetScalars())
+    {
+    vtkErrorMacro("ResampleVolumesWithDeformationField: deformation field is not defined");
+    return false;
+    }
+
+  // vtkGridTransform has no direction - the voxel axes of the field have to be aligned with the RAS axes
+  vtkMatrix4x4* fieldIJKToRAS = vtkMatrix4x4::New();
+  deformationFieldNode->GetIJKToRASMatrix(fieldIJKToRAS);
+  double gridOrigin[3], gridSpacing[3];
+  bool alignedFlag = true;
+  for (int r = 0; r < 3; r++)
+    {
+    gridOrigin[r]  = fieldIJKToRAS->GetElement(r, 3);
+    gridSpacing[r] = fieldIJKToRAS->GetElement(r, r);
+    for (int c = 0; c < 3; c++)
+      {
+      if ((r != c) && (fabs(fieldIJKToRAS->GetElement(r, c)) > 1e-6 * fabs(gridSpacing[r])))
+        {
+        alignedFlag = false;
+        }
+      }
+    if (gridSpacing[r] == 0.0)
+      {
+      alignedFlag = false;
+      }
+    }
+  fieldIJKToRAS->Delete();
+  if (!alignedFlag)
+    {
+    vtkWarningMacro("ResampleVolumesWithDeformationField: deformation field is not aligned with the RAS axes");
+    return false;
+    }
+
+  // Displacement from output RAS to input RAS - the field holds it in LPS (see BRAINSResample --deformationVolume)
+  vtkImageData* grid = vtkImageData::New();
+  grid->SetExtent(fieldData->GetExtent());
+  grid->SetWholeExtent(fieldData->GetExtent());
+  grid->SetOrigin(gridOrigin);
+  grid->SetSpacing(gridSpacing);
+  grid->SetScalarTypeToDouble();
+  grid->SetNumberOfScalarComponents(3);
+  grid->AllocateScalars();
+  vtkDataArray* displacement = fieldData->GetPointData()->GetScalars();
+  double* gridPtr = static_cast<double*>(grid->GetScalarPointer());
+  vtkIdType numVoxels = fieldData->GetNumberOfPoints();
+  for (vtkIdType i = 0; i < numVoxels; i++, gridPtr += 3)
+    {
+    displacement->GetTuple(i, gridPtr);
+    gridPtr[0] = -gridPtr[0];
+    gridPtr[1] = -gridPtr[1];
+    }
+
+  vtkGridTransform* outputRASToInputRASTransform = vtkGridTransform::New();
+  outputRASToInputRASTransform->SetDisplacementGrid(grid);
+  outputRASToInputRASTransform->SetInterpolationModeToLinear();
+  grid->Delete();
+
+  bool result = vtkEMSegmentLogic::SlicerImageResliceVolumesWithGrid(inputVolumeNodes, outputVolumeNodes, outputVolumeGeometryNode, 
+                                                                     outputRASToInputRASTransform, interpolationType, backgroundLevel,
+                                                                     this->NumberOfThreads);
+  outputRASToInputRASTransform->Delete();
+  return result;
+}
+
+//----------------------------------------------------------------------------
+void vtkEMSegmentLogic::StartPreprocessingResampleAndCastToTarget(vtkMRMLVolumeNode* movingVolumeNode, vtkMRMLVolumeNode* fixedVolumeNode, vtkMRMLVolumeNode* outputVolumeNode)
+{
+  if (!vtkEMSegmentLogic::IsVolumeGeometryEqual(fixedVolumeNode, outputVolumeNode))
+    {
+
+      std::cout << "Warning: Target-to-target registration skipped but "
+                << "target images have differenent geometries. "
+                << std::endl
+                << "Suggestion: If you are not positive that your images are "
+                << "aligned, you should enable target-to-target registration."
+                << std::endl;
+
+      std::cout << "Fixed Volume Node: " << std::endl;
+      PrintImageInfo(fixedVolumeNode);
+      std::cout << "Output Volume Node: " << std::endl;
+      PrintImageInfo(outputVolumeNode);
+
+      // std::cout << "Resampling target image " << i << "...";
+      double backgroundLevel = this->GuessRegistrationBackgroundLevel(movingVolumeNode);
+
+      vtkEMSegmentLogic::SlicerImageReslice(movingVolumeNode, 
+                                            outputVolumeNode, 
+                                            fixedVolumeNode,
+                                            NULL,
+                                            vtkEMSegmentMRMLManager::InterpolationLinear,
+                                            backgroundLevel);
+    }
+
+  if (fixedVolumeNode->GetImageData()->GetScalarType() != movingVolumeNode->GetImageData()->GetScalarType())
+    {
+      //cast
+      vtkImageCast* cast = vtkImageCast::New();
+      cast->SetInput(outputVolumeNode->GetImageData());
+      cast->SetOutputScalarType(fixedVolumeNode->GetImageData()->GetScalarType());
+      cast->Update();
+      outputVolumeNode->GetImageData()->DeepCopy(cast->GetOutput());
+      cast->Delete();
+    }
+  std::cout << "Resampling and casting output volume \"" << outputVolumeNode->GetName() << "\" to reference target \"" << fixedVolumeNode->GetName() <<  "\" DONE" << std::endl;
+}
+
+//----------------------------------------------------------------------------
+double vtkEMSegmentLogic::GuessRegistrationBackgroundLevel(vtkMRMLVolumeNode* volumeNode)
+{
+  if (!volumeNode ||  !volumeNode->GetImageData())  
+    {
+      std::cerr << "double vtkEMSegmentLogic::GuessRegistrationBackgroundLevel(vtkMRMLVolumeNode* volumeNode) : volumeNode or volumeNode->GetImageData is null" << std::endl;
+      return -1;
+    }
+
+  // the voxels can be changed in place without touching the node  
+  vtkImageData* imageData = volumeNode->GetImageData();
+  unsigned long mtime = volumeNode->GetMTime();
+  if (imageData->GetMTime() > mtime)
+    {
+      mtime = imageData->GetMTime();
+    }
+  int sampleStride = (this->BackgroundLevelSampleStride > 1 ? this->BackgroundLevelSampleStride : 1);
+
+  std::map<vtkMRMLVolumeNode*, vtkEMSegmentBackgroundLevelCacheEntry>::iterator it = this->BackgroundLevelCache.find(volumeNode);
+  if (it != this->BackgroundLevelCache.end() && it->second.ImageData == imageData && it->second.MTime == mtime 
+      && it->second.SampleStride == sampleStride)
+    {
+      std::cout << "   Guessed background level: " << it->second.BackgroundLevel << " (unchanged volume)" << std::endl;
+      return it->second.BackgroundLevel;
+    }
+
+  // guess background level    
+  double backgroundLevel = 0;
+  switch (imageData->GetScalarType())
+      {  
+        vtkTemplateMacro(backgroundLevel = (GuessRegistrationBackgroundLevel<VTK_TT>(imageData, this->NumberOfThreads, sampleStride)););
+      }
+  std::cout << "   Guessed background level: " << backgroundLevel << std::endl;
+
+  vtkEMSegmentBackgroundLevelCacheEntry& entry = this->BackgroundLevelCache[volumeNode];
+  entry.ImageData       = imageData;
+  entry.MTime           = mtime;
+  entry.SampleStride    = sampleStride;
+  entry.BackgroundLevel = backgroundLevel;
+  return backgroundLevel;
+}
+
+//----------------------------------------------------------------------------
+// MD5 over the geometry and the voxels - vtksysMD5_Append takes int lengths, so large volumes are added in blocks
+static void vtkEMSegmentLogic_UpdateContentHash(vtksysMD5* md5, const void* data, size_t length)
+{
+  const unsigned char* ptr = static_cast<const unsigned char*>(data);
+  while (length > 0)
+    {
+    int block = int(length < size_t(1 << 30) ? length : size_t(1 << 30));
+    vtksysMD5_Append(md5, ptr, block);
+    ptr    += block;
+    length -= block;
+    }
+}
+
+static std::string vtkEMSegmentLogic_FinalizeContentHash(vtksysMD5* md5)
+{
+  char hash[33];
+  vtksysMD5_FinalizeHex(md5, hash);
+  hash[32] = '\0';
+  vtksysMD5_Delete(md5);
+  return std::string(hash);
+}
+
+//----------------------------------------------------------------------------
+std::string vtkEMSegmentLogic::ComputeVolumeContentHash(vtkMRMLVolumeNode* volumeNode)
+{
+  vtkImageData* imageData = (volumeNode ? volumeNode->GetImageData() : NULL);
+  if (!imageData || !imageData->GetScalarPointer())
+    {
+    return std::string();
+    }
+
+  vtksysMD5* md5 = vtksysMD5_New();
+  vtksysMD5_Initialize(md5);
+
+  int header[5];
+  imageData->GetDimensions(header);
+  header[3] = imageData->GetScalarType();
+  header[4] = imageData->GetNumberOfScalarComponents();
+  vtkEMSegmentLogic_UpdateContentHash(md5, header, sizeof(header));
+
+  vtkMatrix4x4* ijkToRAS = vtkMatrix4x4::New();
+  volumeNode->GetIJKToRASMatrix(ijkToRAS);
+  vtkEMSegmentLogic_UpdateContentHash(md5, ijkToRAS->Element, sizeof(ijkToRAS->Element));
+  ijkToRAS->Delete();
+
+  size_t numBytes = size_t(imageData->GetNumberOfPoints()) * size_t(header[4]) * size_t(imageData->GetScalarSize());
+  vtkEMSegmentLogic_UpdateContentHash(md5, imageData->GetScalarPointer(), numBytes);
+
+  return vtkEMSegmentLogic_FinalizeContentHash(md5);
+}
+
+//----------------------------------------------------------------------------
+const char* vtkEMSegmentLogic::GetRegistrationCacheKey(vtkMRMLVolumeNode* fixedVolumeNode, vtkMRMLVolumeNode* movingVolumeNode, 
+                                                       const char* parameters)
+{
+  std::string fixedHash  = vtkEMSegmentLogic::ComputeVolumeContentHash(fixedVolumeNode);
+  std::string movingHash = vtkEMSegmentLogic::ComputeVolumeContentHash(movingVolumeNode);
+  if (fixedHash.empty() || movingHash.empty())
+    {
+    vtkErrorMacro("GetRegistrationCacheKey: fixed or moving volume is not defined");
+    return NULL;
+    }
+
+  vtksysMD5* md5 = vtksysMD5_New();
+  vtksysMD5_Initialize(md5);
+  if (parameters)
+    {
+    vtkEMSegmentLogic_UpdateContentHash(md5, parameters, strlen(parameters));
+    }
+
+  this->RegistrationCacheKey = fixedHash + "_" + movingHash + "_" + vtkEMSegmentLogic_FinalizeContentHash(md5);
+  return this->RegistrationCacheKey.c_str();
+}
+
+//----------------------------------------------------------------------------
+// Preprocessing scheduler
+//----------------------------------------------------------------------------
+int vtkEMSegmentLogic::AddPreprocessingJob(const char* commandLine)
+{
+  vtkEMSegmentPreprocessingJob job;
+  job.ExitCode        = -1;
+  job.Done            = false;
+  job.NumberOfThreads = 0;
+  if (commandLine)
+    {
+    job.CommandLines.push_back(commandLine);
+    }
+  this->PreprocessingJobs.push_back(job);
+  return int(this->PreprocessingJobs.size()) - 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkEMSegmentLogic::AddPreprocessingJobCommand(int jobID, const char* commandLine)
+{
+  if ((jobID < 0) || (jobID >= int(this->PreprocessingJobs.size())) || this->PreprocessingJobs[jobID].Done || !commandLine)
+    {
+    vtkErrorMacro("AddPreprocessingJobCommand: job " << jobID << " is not pending or command is not defined");
+    return;
+    }
+  this->PreprocessingJobs[jobID].CommandLines.push_back(commandLine);
+}
+
+//----------------------------------------------------------------------------
+int vtkEMSegmentLogic::GetPreprocessingJobExitCode(int jobID)
+{
+  if ((jobID < 0) || (jobID >= int(this->PreprocessingJobs.size())))
+    {
+    vtkErrorMacro("GetPreprocessingJobExitCode: job " << jobID << " does not exist");
+    return -1;
+    }
+  return this->PreprocessingJobs[jobID].ExitCode;
+}
+
+//----------------------------------------------------------------------------
+const char* vtkEMSegmentLogic::GetPreprocessingJobOutput(int jobID)
+{
+  if ((jobID < 0) || (jobID >= int(this->PreprocessingJobs.size())))
+    {
+    vtkErrorMacro("GetPreprocessingJobOutput: job " << jobID << " does not exist");
+    return NULL;
+    }
+  return this->PreprocessingJobs[jobID].Output.c_str();
+}
+
+//----------------------------------------------------------------------------
+void vtkEMSegmentLogic::RemoveAllPreprocessingJobs()
+{
+  this->PreprocessingJobs.clear();
+}
+
+//----------------------------------------------------------------------------
+// NRRD type of a VTK scalar type, NULL if it has none
+static const char* vtkEMSegmentLogic_NrrdType(int scalarType)
+{
+  switch (scalarType)
+    {
+    case VTK_CHAR:
+    case VTK_SIGNED_CHAR:    return "int8";
+    case VTK_UNSIGNED_CHAR:  return "uint8";
+    case VTK_SHORT:          return "int16";
+    case VTK_UNSIGNED_SHORT: return "uint16";
+    case VTK_INT:            return "int32";
+    case VTK_UNSIGNED_INT:   return "uint32";
+    case VTK_FLOAT:          return "float";
+    case VTK_DOUBLE:         return "double";
+    }
+  return NULL;
+}
+
+//----------------------------------------------------------------------------
+const char* vtkEMSegmentLogic::GetSharedMemoryDirectoryForVolume(vtkMRMLVolumeNode* referenceNode)
+{
+#ifdef __linux__
+  if (!this->SharedMemoryFlag || !this->SharedMemoryDirectory || !vtksys::SystemTools::FileIsDirectory(this->SharedMemoryDirectory))
+    {
+    return "";
+    }
+  double requiredBytes = 0.0;
+  if (referenceNode && referenceNode->GetImageData())
+    {
+    int dims[3];
+    vtkImageData* image = referenceNode->GetImageData();
+    image->GetDimensions(dims);
+    requiredBytes = 2.0 * double(dims[0]) * double(dims[1]) * double(dims[2]) * image->GetScalarSize() * image->GetNumberOfScalarComponents();
+    }
+  struct statvfs fileSystem;
+  if (statvfs(this->SharedMemoryDirectory, &fileSystem) || (double(fileSystem.f_bavail) * double(fileSystem.f_frsize) < requiredBytes))
+    {
+    return "";
+    }
+  return this->SharedMemoryDirectory;
+#else
+  return "";
+#endif
+}
+
+//----------------------------------------------------------------------------
+const char* vtkEMSegmentLogic::WriteVolumeToSharedMemory(vtkMRMLVolumeNode* volumeNode)
+{
+  this->SharedMemoryFileName = "";
+  this->RemoveOrphanedSharedMemoryVolumes();
+#ifdef __linux__
+  vtkImageData* image = (volumeNode ? volumeNode->GetImageData() : NULL);
+  if (!image || (image->GetNumberOfScalarComponents() != 1) || !vtkEMSegmentLogic_NrrdType(image->GetScalarType()) || 
+      !image->GetScalarPointer() || !*this->GetSharedMemoryDirectoryForVolume(volumeNode))
+    {
+    return "";
+    }
+
+  int dims[3];
+  image->GetDimensions(dims);
+  size_t numberOfBytes = size_t(dims[0]) * size_t(dims[1]) * size_t(dims[2]) * image->GetScalarSize();
+  if (!numberOfBytes)
+    {
+    return "";
+    }
+
+  std::ostringstream baseName;
+  baseName << "EMSegment-" << getpid() << "-" << this->SharedMemoryCounter++;
+  std::string rawName    = std::string(this->SharedMemoryDirectory) + "/" + baseName.str() + ".raw";
+  std::string headerName = std::string(this->SharedMemoryDirectory) + "/" + baseName.str() + ".nhdr";
+
+  int fd = open(rawName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    {
+    return "";
+    }
+  // Reserve the pages first - writing to the mapping of a full tmpfs would crash instead of failing
+  void* data = MAP_FAILED;
+  if (posix_fallocate(fd, 0, numberOfBytes) == 0)
+    {
+    data = mmap(NULL, numberOfBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+  close(fd);
+  if (data == MAP_FAILED)
+    {
+    unlink(rawName.c_str());
+    return "";
+    }
+  memcpy(data, image->GetScalarPointer(), numberOfBytes);
+  munmap(data, numberOfBytes);
+
+  // The modules expect LPS coordinates 
+  vtkMatrix4x4* IJKToRAS = vtkMatrix4x4::New();
+  volumeNode->GetIJKToRASMatrix(IJKToRAS);
+  double IJKToLPS[3][4];
+  for (int c = 0; c < 4; c++)
+    {
+    IJKToLPS[0][c] = 0.0 - IJKToRAS->GetElement(0, c);
+    IJKToLPS[1][c] = 0.0 - IJKToRAS->GetElement(1, c);
+    IJKToLPS[2][c] = IJKToRAS->GetElement(2, c);
+    }
+  IJKToRAS->Delete();
+
+  std::ofstream header(headerName.c_str());
+  header.precision(17);
+  header << "NRRD0004\n"
+         << "# Complete NRRD file format specification at:\n"
+         << "# http://teem.sourceforge.net/nrrd/format.html\n"
+         << "type: " << vtkEMSegmentLogic_NrrdType(image->GetScalarType()) << "\n"
+         << "dimension: 3\n"
+         << "space: left-posterior-superior\n"
+         << "sizes: " << dims[0] << " " << dims[1] << " " << dims[2] << "\n"
+         << "space directions:";
+  for (int c = 0; c < 3; c++)
+    {
+    header << " (" << IJKToLPS[0][c] << "," << IJKToLPS[1][c] << "," << IJKToLPS[2][c] << ")";
+    }
+  header << "\n"
+         << "kinds: domain domain domain\n"
+#ifdef VTK_WORDS_BIGENDIAN
+         << "endian: big\n"
+#else
+         << "endian: little\n"
+#endif
+         << "encoding: raw\n"
+         << "space origin: (" << IJKToLPS[0][3] << "," << IJKToLPS[1][3] << "," << IJKToLPS[2][3] << ")\n"
+         << "data file: " << baseName.str() << ".raw\n";
+  header.close();
+  if (header.fail())
+    {
+    unlink(headerName.c_str());
+    unlink(rawName.c_str());
+    return "";
+    }
+
+  this->SharedMemoryVolumes.push_back(std::make_pair(headerName, rawName));
+  this->SharedMemoryFileName = headerName;
+#endif
+  return this->SharedMemoryFileName.c_str();
+}
+
+//----------------------------------------------------------------------------
+// The task scripts only delete the header they were given
+void vtkEMSegmentLogic::RemoveOrphanedSharedMemoryVolumes()
+{
+  for (unsigned int i = 0; i < this->SharedMemoryVolumes.size(); )
     {
-    case vtkEMSegmentMRMLManager::InterpolationNearestNeighbor:
-      resliceFilter->SetInterpolationModeToNearestNeighbor();
-      break;
-    case vtkEMSegmentMRMLManager::InterpolationCubic:
-      resliceFilter->SetInterpolationModeToCubic();
-      break;
-    case vtkEMSegmentMRMLManager::InterpolationLinear:
-    default:
-      resliceFilter->SetInterpolationModeToLinear();
+    if (vtksys::SystemTools::FileExists(this->SharedMemoryVolumes[i].first.c_str()))
+      {
+      i++;
+      continue;
+      }
+    vtksys::SystemTools::RemoveFile(this->SharedMemoryVolumes[i].second.c_str());
+    this->SharedMemoryVolumes.erase(this->SharedMemoryVolumes.begin() + i);
     }
+}
 
-  resliceFilter->Update();
-  outputImageData->ShallowCopy(resliceFilter->GetOutput());
+//----------------------------------------------------------------------------
+void vtkEMSegmentLogic::RemoveAllSharedMemoryVolumes()
+{
+  for (unsigned int i = 0; i < this->SharedMemoryVolumes.size(); i++)
+    {
+    vtksys::SystemTools::RemoveFile(this->SharedMemoryVolumes[i].first.c_str());
+    vtksys::SystemTools::RemoveFile(this->SharedMemoryVolumes[i].second.c_str());
+    }
+  this->SharedMemoryVolumes.clear();
+}
 
-  //
-  // clean up
-  outputIJKToRAS->Delete();
-  inputRASToIJK->Delete();
-  resliceFilter->Delete();
-  totalTransform->Delete();
+//----------------------------------------------------------------------------
+// Splits a command line as built by the task scripts into its arguments - arguments are separated by white 
+// space, double quotes group and backslashes escape characters (like Tcl's eval exec does for these strings)
+static void vtkEMSegmentLogic_SplitCommandLine(const std::string& commandLine, std::vector<std::string>& args)
+{
+  args.clear();
+  std::string arg;
+  bool inArg    = false;
+  bool inQuotes = false;
+  for (size_t i = 0; i < commandLine.size(); i++)
+    {
+    char c = commandLine[i];
+    if ((c == '\\') && (i + 1 < commandLine.size()))
+      {
+      arg += commandLine[++i];
+      inArg = true;
+      }
+    else if (c == '"')
+      {
+      inQuotes = !inQuotes;
+      inArg = true;
+      }
+    else if (!inQuotes && isspace(static_cast<unsigned char>(c)))
+      {
+      if (inArg)
+        {
+        args.push_back(arg);
+        arg.clear();
+        inArg = false;
+        }
+      }
+    else
+      {
+      arg += c;
+      inArg = true;
+      }
+    }
+  if (inArg)
+    {
+    args.push_back(arg);
+    }
 }
 
 //----------------------------------------------------------------------------
-void vtkEMSegmentLogic::StartPreprocessingResampleAndCastToTarget(vtkMRMLVolumeNode* movingVolumeNode, vtkMRMLVolumeNode* fixedVolumeNode, vtkMRMLVolumeNode* outputVolumeNode)
+// The child inherits the environment at the time it is started - so the thread settings are only changed 
+// around the start of the process
+static vtksysProcess* vtkEMSegmentLogic_StartProcess(const std::string& commandLine, int numberOfThreads)
 {
-  if (!vtkEMSegmentLogic::IsVolumeGeometryEqual(fixedVolumeNode, outputVolumeNode))
+  std::vector<std::string> args;
+  vtkEMSegmentLogic_SplitCommandLine(commandLine, args);
+  if (args.empty())
+    {
+    return NULL;
+    }
+  std::vector<const char*> argv;
+  for (unsigned int i = 0; i < args.size(); i++)
     {
+    argv.push_back(args[i].c_str());
+    }
+  argv.push_back(NULL);
 
-      std::cout << "Warning: Target-to-target registration skipped but "
-                << "target images have differenent geometries. "
-                << std::endl
-                << "Suggestion: If you are not positive that your images are "
-                << "aligned, you should enable target-to-target registration."
-                << std::endl;
+  vtksysProcess* process = vtksysProcess_New();
+  vtksysProcess_SetCommand(process, &argv[0]);
+  vtksysProcess_SetOption(process, vtksysProcess_Option_HideWindow, 1);
 
-      std::cout << "Fixed Volume Node: " << std::endl;
-      PrintImageInfo(fixedVolumeNode);
-      std::cout << "Output Volume Node: " << std::endl;
-      PrintImageInfo(outputVolumeNode);
+  const char* threadVariables[2] = {"ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS", "OMP_NUM_THREADS"};
+  std::string oldValue[2];
+  bool        oldValueFlag[2];
+  for (int i = 0; i < 2; i++)
+    {
+    oldValueFlag[i] = vtksys::SystemTools::GetEnv(threadVariables[i], oldValue[i]);
+    std::ostringstream value;
+    value << threadVariables[i] << "=" << numberOfThreads;
+    vtksys::SystemTools::PutEnv(value.str().c_str());
+    }
 
-      // std::cout << "Resampling target image " << i << "...";
-      double backgroundLevel = 0;
-      switch (movingVolumeNode->GetImageData()->GetScalarType())
-        {  
-          vtkTemplateMacro(backgroundLevel = (GuessRegistrationBackgroundLevel<VTK_TT>(movingVolumeNode->GetImageData())););
-        }
-      std::cout << "   Guessed background level: " << backgroundLevel << std::endl;
+  vtksysProcess_Execute(process);
 
-      vtkEMSegmentLogic::SlicerImageReslice(movingVolumeNode, 
-                                            outputVolumeNode, 
-                                            fixedVolumeNode,
-                                            NULL,
-                                            vtkEMSegmentMRMLManager::InterpolationLinear,
-                                            backgroundLevel);
+  for (int i = 0; i < 2; i++)
+    {
+    if (oldValueFlag[i])
+      {
+      vtksys::SystemTools::PutEnv((std::string(threadVariables[i]) + "=" + oldValue[i]).c_str());
+      }
+    else
+      {
+      vtksys::SystemTools::UnPutEnv(threadVariables[i]);
+      }
     }
 
-  if (fixedVolumeNode->GetImageData()->GetScalarType() != movingVolumeNode->GetImageData()->GetScalarType())
+  if (vtksysProcess_GetState(process) != vtksysProcess_State_Executing)
     {
-      //cast
-      vtkImageCast* cast = vtkImageCast::New();
-      cast->SetInput(outputVolumeNode->GetImageData());
-      cast->SetOutputScalarType(fixedVolumeNode->GetImageData()->GetScalarType());
-      cast->Update();
-      outputVolumeNode->GetImageData()->DeepCopy(cast->GetOutput());
-      cast->Delete();
+    vtksysProcess_Delete(process);
+    return NULL;
     }
-  std::cout << "Resampling and casting output volume \"" << outputVolumeNode->GetName() << "\" to reference target \"" << fixedVolumeNode->GetName() <<  "\" DONE" << std::endl;
+  return process;
 }
 
 //----------------------------------------------------------------------------
-double vtkEMSegmentLogic::GuessRegistrationBackgroundLevel(vtkMRMLVolumeNode* volumeNode)
+bool vtkEMSegmentLogic::RunPreprocessingJobs()
 {
-  if (!volumeNode ||  !volumeNode->GetImageData())  
+  std::vector<int> pending;
+  for (unsigned int i = 0; i < this->PreprocessingJobs.size(); i++)
     {
-      std::cerr << "double vtkEMSegmentLogic::GuessRegistrationBackgroundLevel(vtkMRMLVolumeNode* volumeNode) : volumeNode or volumeNode->GetImageData is null" << std::endl;
-      return -1;
+    if (!this->PreprocessingJobs[i].Done)
+      {
+      pending.push_back(int(i));
+      }
+    }
+  if (pending.empty())
+    {
+    return true;
     }
 
-  // guess background level    
-  double backgroundLevel = 0;
-  switch (volumeNode->GetImageData()->GetScalarType())
-      {  
-        vtkTemplateMacro(backgroundLevel = (GuessRegistrationBackgroundLevel<VTK_TT>(volumeNode->GetImageData())););
+  int numberOfCores = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int concurrencyLimit = (this->PreprocessingConcurrencyLimit > 0 ? this->PreprocessingConcurrencyLimit : numberOfCores);
+  int coreBudget       = (this->PreprocessingCoreBudget > 0 ? this->PreprocessingCoreBudget : numberOfCores);
+  int numberOfSlots = vtkstd::min(concurrencyLimit, int(pending.size()));
+  int threadsPerJob = vtkstd::max(1, coreBudget / numberOfSlots);
+
+  std::cout << "Preprocessing scheduler: " << pending.size() << " job(s), " << numberOfSlots << " at once with " 
+            << threadsPerJob << " thread(s) each" << std::endl;
+
+  // A slot holds the running process, its job and the index of its current command 
+  std::vector<vtksysProcess*> slotProcess(numberOfSlots, (vtksysProcess*) NULL);
+  std::vector<int>            slotJob(numberOfSlots, -1);
+  std::vector<unsigned int>   slotCommand(numberOfSlots, 0);
+  unsigned int nextPending = 0;
+  int numberOfRunning = 0;
+  bool success = true;
+
+  while ((nextPending < pending.size()) || numberOfRunning)
+    {
+    // Start the next command of each job in a free slot
+    for (int s = 0; s < numberOfSlots; s++)
+      {
+      while (!slotProcess[s])
+        {
+        if (slotJob[s] < 0)
+          {
+          if (nextPending == pending.size())
+            {
+            break;
+            }
+          slotJob[s]     = pending[nextPending++];
+          slotCommand[s] = 0;
+          this->PreprocessingJobs[slotJob[s]].NumberOfThreads = threadsPerJob;
+          }
+        vtkEMSegmentPreprocessingJob& job = this->PreprocessingJobs[slotJob[s]];
+        if (slotCommand[s] == job.CommandLines.size())
+          {
+          job.Done = true;
+          slotJob[s] = -1;
+          continue;
+          }
+        std::cout << "Preprocessing scheduler: job " << slotJob[s] << " executes " << job.CommandLines[slotCommand[s]] << std::endl;
+        slotProcess[s] = vtkEMSegmentLogic_StartProcess(job.CommandLines[slotCommand[s]], threadsPerJob);
+        if (!slotProcess[s])
+          {
+          job.Output   += "Could not execute " + job.CommandLines[slotCommand[s]] + "\n";
+          job.ExitCode = -1;
+          job.Done     = true;
+          slotJob[s]   = -1;
+          success      = false;
+          continue;
+          }
+        numberOfRunning++;
+        }
       }
-  std::cout << "   Guessed background level: " << backgroundLevel << std::endl;
-  return backgroundLevel;
+
+    // Collect output and detect commands that are done
+    for (int s = 0; s < numberOfSlots; s++)
+      {
+      if (!slotProcess[s])
+        {
+        continue;
+        }
+      vtkEMSegmentPreprocessingJob& job = this->PreprocessingJobs[slotJob[s]];
+      char*  data    = NULL;
+      int    length  = 0;
+      double timeout = 0.05 / numberOfRunning;
+      int pipe = vtksysProcess_WaitForData(slotProcess[s], &data, &length, &timeout);
+      if ((pipe == vtksysProcess_Pipe_STDOUT) || (pipe == vtksysProcess_Pipe_STDERR))
+        {
+        job.Output.append(data, length);
+        continue;
+        }
+      if (pipe != vtksysProcess_Pipe_None)
+        {
+        continue;
+        }
+
+      vtksysProcess_WaitForExit(slotProcess[s], NULL);
+      int state = vtksysProcess_GetState(slotProcess[s]);
+      if (state == vtksysProcess_State_Exited)
+        {
+        job.ExitCode = vtksysProcess_GetExitValue(slotProcess[s]);
+        }
+      else
+        {
+        job.ExitCode = -1;
+        if (state == vtksysProcess_State_Exception)
+          {
+          job.Output += std::string(vtksysProcess_GetExceptionString(slotProcess[s])) + "\n";
+          }
+        else if (state == vtksysProcess_State_Error)
+          {
+          job.Output += std::string(vtksysProcess_GetErrorString(slotProcess[s])) + "\n";
+          }
+        }
+      vtksysProcess_Delete(slotProcess[s]);
+      slotProcess[s] = NULL;
+      numberOfRunning--;
+      slotCommand[s]++;
+      if (job.ExitCode != 0)
+        {
+        // later commands of the job depend on this one 
+        std::cout << "Preprocessing scheduler: job " << slotJob[s] << " failed" << std::endl;
+        job.Done   = true;
+        slotJob[s] = -1;
+        success    = false;
+        }
+      else if (slotCommand[s] == job.CommandLines.size())
+        {
+        job.Done   = true;
+        slotJob[s] = -1;
+        }
+      }
+    }
+
+  return success;
 }
 
 //-----------------------------------------------------------------------------
@@ -1671,7 +2602,82 @@ WritePackagedScene(vtkMRMLScene* scene)
 }
 
 //-----------------------------------------------------------------------------
-void vtkEMSegmentLogic::SubParcelateSegmentation(vtkImageData* segmentation, vtkIdType nodeID)
+// Sub-parcellation in a single pass over the label map - the label of each voxel is looked up in a table 
+// of leaf labels and replaced with the value of the leaf's parcellation. The table is applied in order,
+// i.e. if the parcellation value is the label of a later leaf it is parcellated again.
+// This is the same result as applying threshold, cast, multiply, threshold and add for each leaf in turn.
+typedef struct {
+  void*     SegmentationPtr;
+  int       SegmentationType;
+  vtkIdType NumberOfVoxels;
+  int       NumberOfEntries;
+  void**    ParcellationPtr;
+  int*      ParcellationType;
+  // FirstEntry[label - MinLabel] is the first entry with that label, NextEntry links entries with the same label
+  int       MinLabel;
+  int       MaxLabel;
+  int*      FirstEntry;
+  int*      NextEntry;
+} vtkEMSegmentLogicSubParcellationTable;
+
+template <class T>
+static T vtkEMSegmentLogic_GetParcellationValue(void* ptr, int type, vtkIdType index)
+{
+  switch (type)
+    {
+    vtkTemplateMacro(return static_cast<T>(static_cast<VTK_TT*>(ptr)[index]));
+    }
+  return T(0);
+}
+
+// Returns the first entry after afterEntry with the label value, or -1 
+template <class T>
+static int vtkEMSegmentLogic_FindSubParcellationEntry(const vtkEMSegmentLogicSubParcellationTable* table, T value, int afterEntry)
+{
+  double label = double(value);
+  if ((label < table->MinLabel) || (label > table->MaxLabel) || (double(int(label)) != label))
+    {
+    return -1;
+    }
+  int entry = table->FirstEntry[int(label) - table->MinLabel];
+  while ((entry > -1) && (entry <= afterEntry))
+    {
+    entry = table->NextEntry[entry];
+    }
+  return entry;
+}
+
+template <class T>
+static void vtkEMSegmentLogic_SubParcelateRange(const vtkEMSegmentLogicSubParcellationTable* table, T* segPtr, vtkIdType start, vtkIdType end)
+{
+  for (vtkIdType i = start; i < end; i++)
+    {
+    int entry = vtkEMSegmentLogic_FindSubParcellationEntry(table, segPtr[i], -1);
+    while (entry > -1)
+      {
+      segPtr[i] = vtkEMSegmentLogic_GetParcellationValue<T>(table->ParcellationPtr[entry], table->ParcellationType[entry], i);
+      entry = vtkEMSegmentLogic_FindSubParcellationEntry(table, segPtr[i], entry);
+      }
+    }
+}
+
+static VTK_THREAD_RETURN_TYPE vtkEMSegmentLogic_SubParcelateThreaded(void *arg)
+{
+  int threadID = ((ThreadInfoStruct*)(arg))->ThreadID;
+  int numberOfThreads = ((ThreadInfoStruct*)(arg))->NumberOfThreads;
+  vtkEMSegmentLogicSubParcellationTable* table = (vtkEMSegmentLogicSubParcellationTable*) (((ThreadInfoStruct*)(arg))->UserData);
+
+  vtkIdType start = (table->NumberOfVoxels * threadID) / numberOfThreads;
+  vtkIdType end   = (table->NumberOfVoxels * (threadID + 1)) / numberOfThreads;
+  switch (table->SegmentationType)
+    {
+    vtkTemplateMacro(vtkEMSegmentLogic_SubParcelateRange(table, static_cast<VTK_TT*>(table->SegmentationPtr), start, end));
+    }
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//-----------------------------------------------------------------------------
+void vtkEMSegmentLogic::GetSubParcellationTable(vtkIdType nodeID, std::vector<int>& labels, std::vector<vtkImageData*>& parcellations)
 {
   unsigned int numChildren =  this->MRMLManager->GetTreeNodeNumberOfChildren(nodeID);
   for (unsigned int i = 0; i < numChildren; ++i)
@@ -1679,62 +2685,94 @@ void vtkEMSegmentLogic::SubParcelateSegmentation(vtkImageData* segmentation, vtk
     vtkIdType childID = this->MRMLManager->GetTreeNodeChildNodeID(nodeID, i);
     if (this->MRMLManager->GetTreeNodeIsLeaf(childID))
       {
-    vtkMRMLVolumeNode*  parcellationNode =  this->MRMLManager->GetAlignedSubParcellationFromTreeNodeID(childID);
-        if ( ! parcellationNode || !parcellationNode->GetImageData() ) 
+      vtkMRMLVolumeNode*  parcellationNode =  this->MRMLManager->GetAlignedSubParcellationFromTreeNodeID(childID);
+      if ( ! parcellationNode || !parcellationNode->GetImageData() ) 
+        {
+        continue;
+        }
+      labels.push_back(this->MRMLManager->GetTreeNodeIntensityLabel(childID));
+      parcellations.push_back(parcellationNode->GetImageData());
+      }
+    else
       {
-            continue;
+      this->GetSubParcellationTable(childID, labels, parcellations); 
       }
-        int childLabel =  this->MRMLManager->GetTreeNodeIntensityLabel(childID);
-        cout << "==> Subparcellate " <<  childLabel << endl;
-        vtkImageData* input = vtkImageData::New();
-    input->DeepCopy(segmentation);
- 
-    vtkImageThreshold* roiMap =     vtkImageThreshold::New();
-        roiMap->SetInput(input);
-        roiMap->ThresholdBetween( childLabel,  childLabel);
-        roiMap->ReplaceOutOn();
-        roiMap->SetInValue(1);
-        roiMap->SetOutValue(0);
-        roiMap->Update();
- 
-        vtkImageCast* castParcellation = vtkImageCast::New();
-        castParcellation->SetInput(parcellationNode->GetImageData());
-    castParcellation->SetOutputScalarType(roiMap->GetOutput()->GetScalarType());
-    castParcellation->Update();
-
-        vtkImageMathematics* roiParcellation = vtkImageMathematics::New();
-    roiParcellation->SetInput1(roiMap->GetOutput());
-    roiParcellation->SetInput2(castParcellation->GetOutput());
-        roiParcellation->SetOperationToMultiply();
-        roiParcellation->Update();
-
-    vtkImageThreshold* changedSeg =     vtkImageThreshold::New();
-        changedSeg->SetInput(input);
-        changedSeg->ThresholdBetween( childLabel,  childLabel);
-        changedSeg->ReplaceOutOff();
-        changedSeg->SetInValue(0);
-        changedSeg->Update();
-
-        vtkImageMathematics* parcellatedSeg = vtkImageMathematics::New();
-    parcellatedSeg->SetInput1(changedSeg->GetOutput());
-    parcellatedSeg->SetInput2(roiParcellation->GetOutput());
-        parcellatedSeg->SetOperationToAdd();
-        parcellatedSeg->Update();
-
-        segmentation->DeepCopy(parcellatedSeg->GetOutput());
-        parcellatedSeg->Delete();
-        changedSeg->Delete();
-        roiParcellation->Delete();
-        castParcellation->Delete();
-        roiMap->Delete();
-    input->Delete();
+    }
+}
+
+//-----------------------------------------------------------------------------
+void vtkEMSegmentLogic::SubParcelateSegmentation(vtkImageData* segmentation, vtkIdType nodeID)
+{
+  std::vector<int> labels;
+  std::vector<vtkImageData*> parcellations;
+  this->GetSubParcellationTable(nodeID, labels, parcellations);
+
+  if (segmentation->GetNumberOfScalarComponents() != 1)
+    {
+    vtkErrorMacro("SubParcelateSegmentation: segmentation has to have one scalar component");
+    return;
+    }
+
+  int segDim[3];
+  segmentation->GetDimensions(segDim);
+  vtkEMSegmentLogicSubParcellationTable table;
+  table.SegmentationPtr  = segmentation->GetScalarPointer();
+  table.SegmentationType = segmentation->GetScalarType();
+  table.NumberOfVoxels   = segmentation->GetNumberOfPoints();
+  table.NumberOfEntries  = 0;
+  table.ParcellationPtr  = new void*[labels.size() + 1];
+  table.ParcellationType = new int[labels.size() + 1];
+  table.NextEntry        = new int[labels.size() + 1];
+  table.FirstEntry       = NULL;
+  table.MinLabel = table.MaxLabel = 0;
+
+  std::vector<int> entryLabel;
+  for (unsigned int i = 0; i < labels.size(); i++)
+    {
+    int parcDim[3];
+    parcellations[i]->GetDimensions(parcDim);
+    if ((parcDim[0] != segDim[0]) || (parcDim[1] != segDim[1]) || (parcDim[2] != segDim[2]) || (parcellations[i]->GetNumberOfScalarComponents() != 1))
+      {
+      vtkWarningMacro("SubParcelateSegmentation: parcellation of label " << labels[i] << " does not match the segmentation - skipped");
+      continue;
       }
-    else
+    cout << "==> Subparcellate " << labels[i] << endl;
+    table.ParcellationPtr[table.NumberOfEntries]  = parcellations[i]->GetScalarPointer();
+    table.ParcellationType[table.NumberOfEntries] = parcellations[i]->GetScalarType();
+    table.NextEntry[table.NumberOfEntries]        = -1;
+    if (!table.NumberOfEntries || (labels[i] < table.MinLabel)) table.MinLabel = labels[i];
+    if (!table.NumberOfEntries || (labels[i] > table.MaxLabel)) table.MaxLabel = labels[i];
+    entryLabel.push_back(labels[i]);
+    table.NumberOfEntries++;
+    }
+
+  if (table.NumberOfEntries && table.NumberOfVoxels)
+    {
+    int numLabels = table.MaxLabel - table.MinLabel + 1;
+    table.FirstEntry = new int[numLabels];
+    for (int i = 0; i < numLabels; i++) table.FirstEntry[i] = -1;
+    for (int i = table.NumberOfEntries - 1; i >= 0; i--)
       {
-        this->SubParcelateSegmentation(segmentation, childID); 
+      int* first = &table.FirstEntry[entryLabel[i] - table.MinLabel];
+      table.NextEntry[i] = *first;
+      *first = i;
       }
 
+    vtkMultiThreader* threader = vtkMultiThreader::New();
+    if (this->NumberOfThreads > 0)
+      {
+      threader->SetNumberOfThreads(this->NumberOfThreads);
+      }
+    threader->SetSingleMethod(vtkEMSegmentLogic_SubParcelateThreaded, &table);
+    threader->SingleMethodExecute();
+    threader->Delete();
+    segmentation->Modified();
+    delete[] table.FirstEntry;
     }
+
+  delete[] table.ParcellationPtr;
+  delete[] table.ParcellationType;
+  delete[] table.NextEntry;
 }
 
 //-----------------------------------------------------------------------------
@@ -1870,6 +2908,115 @@ void vtkEMSegmentLogic::CreateOutputVolumeNode()
   this->MRMLManager->SetOutputVolumeMRMLID(outputNode->GetID());
 }
 
+//----------------------------------------------------------------------------
+// Post processing stages of the MRML manager settings
+class vtkEMSegmentSubParcellationStage : public vtkEMSegmentPostProcessingStage
+{
+public:
+  vtkEMSegmentSubParcellationStage(vtkEMSegmentLogic* logic) : Logic(logic) {}
+  virtual const char* GetName() {return "Sub-Parcellation";}
+  virtual bool Execute(vtkImageData* labelMap)
+    {
+    this->Logic->SubParcelateSegmentation(labelMap, this->Logic->GetMRMLManager()->GetTreeRootNodeID());
+    return true;
+    }
+  // Only the lookup table of the parcellations is allocated
+  virtual vtkIdType GetWorkingMemory() {return 0;}
+
+private:
+  vtkEMSegmentLogic* Logic;
+};
+
+class vtkEMSegmentIslandRemovalStage : public vtkEMSegmentPostProcessingStage
+{
+public:
+  vtkEMSegmentIslandRemovalStage(int minSize, int island2DFlag, int numberOfThreads)
+    : MinSize(minSize), Island2DFlag(island2DFlag), NumberOfThreads(numberOfThreads), WorkingMemory(0) {}
+  virtual const char* GetName() {return "Island removal";}
+  virtual bool Execute(vtkImageData* labelMap)
+    {
+    vtkImageIslandFilter* islandFilter = vtkImageIslandFilter::New();
+    islandFilter->SetIslandMinSize(this->MinSize);
+    if (this->Island2DFlag)
+      {
+      islandFilter->SetNeighborhoodDim2D();
+      vtkstd::cout << "2D Neighborhood Island activated" << vtkstd::endl;
+      }
+    else
+      {
+      islandFilter->SetNeighborhoodDim3D();
+      }
+    if (this->NumberOfThreads > 0)
+      {
+      islandFilter->SetNumberOfThreads(this->NumberOfThreads);
+      }
+    islandFilter->SetPrintInformation(1);
+    int success = islandFilter->RemoveIslandsInPlace(labelMap);
+    this->WorkingMemory = islandFilter->GetPeakMemory();
+    islandFilter->Delete();
+    return (success != 0);
+    }
+  virtual vtkIdType GetWorkingMemory() {return this->WorkingMemory;}
+
+private:
+  int MinSize;
+  int Island2DFlag;
+  int NumberOfThreads;
+  vtkIdType WorkingMemory;
+};
+
+//----------------------------------------------------------------------------
+void vtkEMSegmentLogic::AddPostProcessingStage(vtkEMSegmentPostProcessingStage* stage)
+{
+  if (stage)
+    {
+    this->PostProcessingStages.push_back(stage);
+    }
+}
+
+//----------------------------------------------------------------------------
+bool vtkEMSegmentLogic::PostProcessSegmentation(vtkImageData* labelMap)
+{
+  this->PostProcessingPeakMemory = 0;
+  if (labelMap == NULL)
+    {
+    vtkErrorMacro("PostProcessSegmentation: label map is null");
+    return false;
+    }
+
+  std::vector<vtkEMSegmentPostProcessingStage*> stages;
+  vtkEMSegmentSubParcellationStage subParcellation(this);
+  if (this->GetMRMLManager()->GetEnableSubParcellation())
+    {
+    stages.push_back(&subParcellation);
+    }
+  vtkEMSegmentIslandRemovalStage islandRemoval(this->GetMRMLManager()->GetMinimumIslandSize(), 
+                                               this->GetMRMLManager()->GetIsland2DFlag(), this->NumberOfThreads);
+  if (this->GetMRMLManager()->GetMinimumIslandSize() > 1)
+    {
+    stages.push_back(&islandRemoval);
+    }
+  stages.insert(stages.end(), this->PostProcessingStages.begin(), this->PostProcessingStages.end());
+
+  vtkIdType labelMapMemory = vtkIdType(labelMap->GetNumberOfPoints()) * labelMap->GetNumberOfScalarComponents() * labelMap->GetScalarSize();
+  vtkIdType maxWorkingMemory = 0;
+  for (unsigned int i = 0; i < stages.size(); i++)
+    {
+    vtkstd::cout << "=== " << stages[i]->GetName() << " === " << vtkstd::endl;
+    if (!stages[i]->Execute(labelMap))
+      {
+      vtkErrorMacro("PostProcessSegmentation: " << stages[i]->GetName() << " failed");
+      return false;
+      }
+    if (stages[i]->GetWorkingMemory() > maxWorkingMemory)
+      {
+      maxWorkingMemory = stages[i]->GetWorkingMemory();
+      }
+    }
+  this->PostProcessingPeakMemory = labelMapMemory + maxWorkingMemory;
+  return true;
+}
+
 //----------------------------------------------------------------------------
 int vtkEMSegmentLogic::StartSegmentationWithoutPreprocessingAndSaving()
 {
@@ -1938,6 +3085,14 @@ int vtkEMSegmentLogic::StartSegmentationWithoutPreprocessingAndSaving()
   //
   vtkstd::cout << "EMSEG: Copying data to algorithm class...";
   this->CopyDataToSegmenter(segmenter);
+  segmenter->SetTrace(this->Trace);
+  segmenter->SetTraceFileName(this->TraceFileName);
+  segmenter->SetMetricsFileName(this->MetricsFileName);
+  segmenter->SetPrintMetrics(this->Trace);
+  if (this->NumberOfThreads > 0)
+    {
+    segmenter->SetNumberOfThreads(this->NumberOfThreads);
+    }
   vtkstd::cout << "DONE" << vtkstd::endl;
 
   if (this->GetDebug())
@@ -1981,38 +3136,18 @@ int vtkEMSegmentLogic::StartSegmentationWithoutPreprocessingAndSaving()
 
   // POST PROCESSING 
   vtkstd::cout << "[Start] Postprocessing ..." << vtkstd::endl;
+  // The shallow copy shares the label map of the segmenter - all stages work in place on it 
   vtkImageData* postProcessing = vtkImageData::New(); 
   postProcessing->ShallowCopy(segmenter->GetOutput());
-
-  // Subparcellation
-  if (this->GetMRMLManager()->GetEnableSubParcellation()) {
-    vtkstd::cout << "=== Sub-Parcellation === " << vtkstd::endl;
-    this->SubParcelateSegmentation(postProcessing,this->GetMRMLManager()->GetTreeRootNodeID()); 
-  }
-
-  // Island Removal
-  if (this->GetMRMLManager()->GetMinimumIslandSize() > 1) {
-     vtkstd::cout << "=== Island removal === " << vtkstd::endl;
-     vtkImageData* input = vtkImageData::New();
-     input->DeepCopy(postProcessing);
-     vtkImageIslandFilter* islandFilter = vtkImageIslandFilter::New();
-     islandFilter->SetInput(input);
-     islandFilter->SetIslandMinSize(this->GetMRMLManager()->GetMinimumIslandSize());
-     if  ( this->GetMRMLManager()->GetIsland2DFlag() )
-       {
-            islandFilter->SetNeighborhoodDim2D();
-           vtkstd::cout << "2D Neighborhood Island activated" << vtkstd::endl;
-       }
-     else 
-       {
-           islandFilter->SetNeighborhoodDim3D();
-       }
-     islandFilter->SetPrintInformation(1);
-     islandFilter->Update();
-     postProcessing->DeepCopy(islandFilter->GetOutput());
-     islandFilter->Delete();
-     input->Delete();
-  }
+  if (!this->PostProcessSegmentation(postProcessing))
+    {
+    ErrorMsg = "Post processing of the segmentation failed";
+    vtkErrorMacro( << ErrorMsg );
+    postProcessing->Delete();
+    segmenter->Delete();
+    return EXIT_FAILURE;
+    }
+  vtkDebugMacro("Peak memory of post processing: " << this->PostProcessingPeakMemory << " bytes");
   vtkstd::cout << "[Done] Postprocessing" << vtkstd::endl;
   //
   // copy result to output volume
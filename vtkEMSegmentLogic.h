@@ -15,12 +15,49 @@
 #include <vtkMRMLScalarVolumeNode.h>
 #include <vtkMRMLVolumeNode.h>
 
+#include <map>
+
 class vtkImageEMLocalSegmenter;
 class vtkImageEMLocalGenericClass;
 class vtkImageEMLocalSuperClass;
 class vtkImageEMLocalClass;
 class vtkSlicerApplicationLogic;
 class vtkGridTransform;
+class vtkCollection;
+
+//BTX
+// A stage of the post processing of the segmentation (see vtkEMSegmentLogic::PostProcessSegmentation). 
+// Stages rewrite the label map in place and must not allocate a second label map.
+class VTK_EMSEGMENT_EXPORT vtkEMSegmentPostProcessingStage
+{
+public:
+  virtual ~vtkEMSegmentPostProcessingStage() {}
+  virtual const char* GetName() = 0;
+  // Returns false if the stage failed 
+  virtual bool Execute(vtkImageData* labelMap) = 0;
+  // Memory (in bytes) allocated by the last Execute in addition to the label map 
+  virtual vtkIdType GetWorkingMemory() = 0;
+};
+
+// A job of the preprocessing scheduler (see vtkEMSegmentLogic::AddPreprocessingJob). 
+// Its command lines are run one after the other, the output of all of them is collected in Output 
+typedef struct {
+  std::vector<std::string> CommandLines;
+  std::string              Output;
+  // -1 while pending or if a command could not be run, otherwise the exit code of the last command run 
+  int                      ExitCode;
+  bool                     Done;
+  int                      NumberOfThreads;
+} vtkEMSegmentPreprocessingJob;
+
+// Result of vtkEMSegmentLogic::GuessRegistrationBackgroundLevel for a volume node 
+typedef struct {
+  vtkImageData* ImageData;
+  unsigned long MTime;
+  int           SampleStride;
+  double        BackgroundLevel;
+} vtkEMSegmentBackgroundLevelCacheEntry;
+//ETX
 
 class VTK_EMSEGMENT_EXPORT vtkEMSegmentLogic : public vtkSlicerModuleLogic
 {
@@ -46,6 +83,27 @@ public:
   // purposes.
   virtual void      CopyDataToSegmenter(vtkImageEMLocalSegmenter* segmenter);
 
+  // Description:
+  // Timing of the phases of the EM algorithm - passed on to the segmenter 
+  // (see vtkImageEMLocalSegmenter::SetTrace and SetTraceFileName). If Trace is on the run metrics are printed as well 
+  vtkGetMacro(Trace, int);
+  vtkSetMacro(Trace, int);
+  vtkBooleanMacro(Trace, int);
+  vtkGetStringMacro(TraceFileName);
+  vtkSetStringMacro(TraceFileName);
+
+  // Description:
+  // Run metrics of the segmenter are written as JSON to this file 
+  // (see vtkImageEMLocalSegmenter::GetMetrics) 
+  vtkGetStringMacro(MetricsFileName);
+  vtkSetStringMacro(MetricsFileName);
+
+  // Description:
+  // Number of threads of the segmenter and the post processing - 0 keeps the vtkMultiThreader global default 
+  // (see vtkImageEMLocalSegmenter::SetNumberOfThreads) 
+  vtkGetMacro(NumberOfThreads, int);
+  vtkSetMacro(NumberOfThreads, int);
+
   //
   // progress bar related functions: not currently used, likely to
   // change
@@ -97,7 +155,89 @@ public:
   static void TransferRASToIJK(vtkMRMLVolumeNode* volumeNode, double ras[3], int ijk[3]);
 
 
-  static double GuessRegistrationBackgroundLevel(vtkMRMLVolumeNode* volumeNode);
+  // Description:
+  // Most frequent value on the faces of the image bounding box, computed with NumberOfThreads threads.
+  // The result is kept until the volume node or its image data is modified, as the task scripts ask
+  // repeatedly for the same fixed image. BackgroundLevelSampleStride > 1 only looks at every n-th voxel
+  // along the faces
+  double GuessRegistrationBackgroundLevel(vtkMRMLVolumeNode* volumeNode);
+  vtkGetMacro(BackgroundLevelSampleStride, int);
+  vtkSetMacro(BackgroundLevelSampleStride, int);
+
+  // Description:
+  // Registrations of the task scripts are cached on disk (see GenericTask.tcl) so that re-segmenting the same 
+  // subject with different parameters does not repeat them. RegistrationCacheDirectory NULL uses the default 
+  // directory of the task scripts 
+  vtkGetMacro(RegistrationCacheFlag, int);
+  vtkSetMacro(RegistrationCacheFlag, int);
+  vtkBooleanMacro(RegistrationCacheFlag, int);
+  vtkGetStringMacro(RegistrationCacheDirectory);
+  vtkSetStringMacro(RegistrationCacheDirectory);
+
+  // Description:
+  // Key of the registration cache entry for aligning movingVolumeNode to fixedVolumeNode - content hashes 
+  // of both volumes followed by a hash of parameters, which should list every setting of the registration 
+  // (package, metric, affine/deformable type, iterations, sampling, ...). Returns NULL if a volume is not defined 
+  const char* GetRegistrationCacheKey(vtkMRMLVolumeNode* fixedVolumeNode, vtkMRMLVolumeNode* movingVolumeNode, const char* parameters);
+  // Description:
+  // Scheduler for independent preprocessing steps such as the registrations of the task scripts (see 
+  // RegisterInputImages in GenericTask.tcl). AddPreprocessingJob queues a command line and returns the 
+  // ID of the job, AddPreprocessingJobCommand appends a command that has to run after the previous ones 
+  // of the same job. RunPreprocessingJobs runs all pending jobs - at most PreprocessingConcurrencyLimit 
+  // at once - and returns once all of them are done. The PreprocessingCoreBudget is split evenly among the 
+  // jobs running at once, which learn about their share through ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS and 
+  // OMP_NUM_THREADS. Both settings < 1 mean the number of cores. Returns false if a job failed 
+  vtkGetMacro(PreprocessingConcurrencyLimit, int);
+  vtkSetMacro(PreprocessingConcurrencyLimit, int);
+  vtkGetMacro(PreprocessingCoreBudget, int);
+  vtkSetMacro(PreprocessingCoreBudget, int);
+  int  AddPreprocessingJob(const char* commandLine);
+  void AddPreprocessingJobCommand(int jobID, const char* commandLine);
+  bool RunPreprocessingJobs();
+  // Description:
+  // Results of a job after RunPreprocessingJobs - the exit code is -1 if the job could not be run 
+  int         GetPreprocessingJobExitCode(int jobID);
+  const char* GetPreprocessingJobOutput(int jobID);
+  void        RemoveAllPreprocessingJobs();
+
+  // Description:
+  // In-memory hand-off of volumes to the command line modules of the preprocessing (see 
+  // WriteDataToTemporaryDir in GenericTask.tcl). WriteVolumeToSharedMemory copies the voxels into 
+  // a file mapped in SharedMemoryDirectory (POSIX shared memory, /dev/shm by default) and returns the 
+  // name of a detached NRRD header (.nhdr) pointing to it, so the modules read the volume like any other 
+  // file without it ever going to disk. It returns "" if the volume cannot be handed over that way 
+  // (SharedMemoryFlag off, not supported by the platform, not a scalar volume or not enough space) - 
+  // the caller then falls back to the temporary directory. GetSharedMemoryDirectoryForVolume returns the 
+  // directory for the results of the modules if it has room for two volumes of the size of 
+  // referenceNode, otherwise "". The raw data of a header deleted by the task scripts is removed with the 
+  // next call to WriteVolumeToSharedMemory, RemoveAllSharedMemoryVolumes removes all of them
+  vtkGetMacro(SharedMemoryFlag, int);
+  vtkSetMacro(SharedMemoryFlag, int);
+  vtkBooleanMacro(SharedMemoryFlag, int);
+  vtkGetStringMacro(SharedMemoryDirectory);
+  vtkSetStringMacro(SharedMemoryDirectory);
+  const char* WriteVolumeToSharedMemory(vtkMRMLVolumeNode* volumeNode);
+  const char* GetSharedMemoryDirectoryForVolume(vtkMRMLVolumeNode* referenceNode);
+  void        RemoveAllSharedMemoryVolumes();
+
+  // Description:
+  // Scratch-file policy of the preprocessing for the intermediate volumes that still go through files
+  // (see CreateTemporaryFileNameForNode and WriteDataToTemporaryDir in GenericTask.tcl). They only live
+  // for seconds, so they are written uncompressed by default (ScratchCompressionFlag off) - zlib would be
+  // paid once when writing and once when reading them. ScratchDirectory places them on a faster file
+  // system such as a tmpfs, NULL uses the temporary directory of Slicer. The packaged outputs
+  // (WritePackagedScene) do not follow this policy
+  vtkGetMacro(ScratchCompressionFlag, int);
+  vtkSetMacro(ScratchCompressionFlag, int);
+  vtkBooleanMacro(ScratchCompressionFlag, int);
+  vtkGetStringMacro(ScratchDirectory);
+  vtkSetStringMacro(ScratchDirectory);
+
+  //BTX
+  // Description:
+  // MD5 of the voxels, scalar type, dimensions and IJKToRAS matrix of a volume as hex string ("" if not defined)
+  static std::string ComputeVolumeContentHash(vtkMRMLVolumeNode* volumeNode);
+  //ETX
 
   static void 
   SlicerImageResliceWithGrid(vtkMRMLVolumeNode* inputVolumeNode,
@@ -107,6 +247,34 @@ public:
                              int iterpolationType,
                              double backgroundLevel);
 
+  // Description:
+  // Reslices each volume of inputVolumeNodes into the volume of outputVolumeNodes at the same position 
+  // (see SlicerImageResliceWithGrid). The transform from output to input voxels is composed once per row 
+  // and its interpolation weights are shared by all volumes, which are resampled with numberOfThreads 
+  // threads (0 = default of vtkMultiThreader) in one pass. Volumes whose geometry differs from the first 
+  // one and cubic interpolation fall back to SlicerImageResliceWithGrid. 
+  // Returns false if the output geometry is not defined.
+  static bool 
+  SlicerImageResliceVolumesWithGrid(vtkCollection* inputVolumeNodes,
+                                    vtkCollection* outputVolumeNodes,
+                                    vtkMRMLVolumeNode* outputVolumeGeometryNode,
+                                    vtkGridTransform* outputRASToInputRASTransform,
+                                    int iterpolationType,
+                                    double backgroundLevel,
+                                    int numberOfThreads = 0);
+
+  // Description:
+  // Resamples the atlas or parcellation volumes of inputVolumeNodes onto the geometry of outputVolumeGeometryNode 
+  // with the deformation field of a registration (as written by BSplineToDeformationField) in one pass 
+  // (see SlicerImageResliceVolumesWithGrid and NumberOfThreads). Returns false if the field is not defined 
+  // or not aligned with the RAS axes - the task scripts then fall back to BRAINSResample.
+  bool ResampleVolumesWithDeformationField(vtkCollection* inputVolumeNodes,
+                                           vtkCollection* outputVolumeNodes,
+                                           vtkMRMLVolumeNode* outputVolumeGeometryNode,
+                                           vtkMRMLVolumeNode* deformationFieldNode,
+                                           int interpolationType,
+                                           double backgroundLevel);
+
 
   // utility---should probably go to general slicer lib at some point
   static void SlicerImageReslice(vtkMRMLVolumeNode* inputVolumeNode,
@@ -132,7 +300,29 @@ public:
 
   virtual void                              CreateOutputVolumeNode();
 
+  // Description:
+  // Replaces the label of each leaf below nodeID that has a sub-parcellation with the values of the parcellation.
+  // The label map is rewritten in place in a single multithreaded pass (see NumberOfThreads)
   void SubParcelateSegmentation(vtkImageData* segmentation, vtkIdType nodeID);
+  //BTX
+  // Description:
+  // Labels and parcellations of the leaves below nodeID in the order they are applied
+  void GetSubParcellationTable(vtkIdType nodeID, std::vector<int>& labels, std::vector<vtkImageData*>& parcellations);
+  //ETX
+
+  // Description:
+  // Runs the post processing in place on labelMap - the sub-parcellation and the island removal defined by 
+  // the MRML manager followed by the stages added with AddPostProcessingStage. Returns false if a stage failed
+  bool PostProcessSegmentation(vtkImageData* labelMap);
+  //BTX
+  // Description:
+  // Adds a stage to the end of the post processing - the logic takes ownership of the stage
+  void AddPostProcessingStage(vtkEMSegmentPostProcessingStage* stage);
+  //ETX
+
+  // Description:
+  // Peak memory (in bytes) of the last post processing, i.e. the label map plus the largest working memory of a stage 
+  vtkGetMacro(PostProcessingPeakMemory, vtkIdType);
 
   // functions for packaging and writing intermediate results
   virtual void CreatePackageFilenames(vtkMRMLScene* scene, 
@@ -153,7 +343,7 @@ protected:
 
   //BTX
   template <class T>
-  static T GuessRegistrationBackgroundLevel(vtkImageData* imageData);
+  static T GuessRegistrationBackgroundLevel(vtkImageData* imageData, int numberOfThreads, int sampleStride);
   //ETX
 
   static void
@@ -212,8 +402,32 @@ protected:
   char*  ProgressCurrentAction;
   double ProgressGlobalFractionCompleted;
   double ProgressCurrentFractionCompleted;
+
+  int   Trace;
+  char* TraceFileName;
+  char* MetricsFileName;
+  int   NumberOfThreads;
+  vtkIdType PostProcessingPeakMemory;
+  int   RegistrationCacheFlag;
+  int   PreprocessingConcurrencyLimit;
+  int   PreprocessingCoreBudget;
+  char* RegistrationCacheDirectory;
+  int   SharedMemoryFlag;
+  char* SharedMemoryDirectory;
+  int   SharedMemoryCounter;
+  int   ScratchCompressionFlag;
+  char* ScratchDirectory;
+  int   BackgroundLevelSampleStride;
   //BTX
   std::string ErrorMsg; 
+  std::string RegistrationCacheKey;
+  std::vector<vtkEMSegmentPreprocessingJob> PreprocessingJobs;
+  // header and raw data file of the volumes written by WriteVolumeToSharedMemory
+  std::vector<std::pair<std::string, std::string> > SharedMemoryVolumes;
+  std::string SharedMemoryFileName;
+  void RemoveOrphanedSharedMemoryVolumes();
+  std::vector<vtkEMSegmentPostProcessingStage*> PostProcessingStages;
+  std::map<vtkMRMLVolumeNode*, vtkEMSegmentBackgroundLevelCacheEntry> BackgroundLevelCache;
   //ETX
   vtkEMSegmentLogic();
   ~vtkEMSegmentLogic();